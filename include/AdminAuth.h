@@ -0,0 +1,72 @@
+#ifndef ADMINAUTH_H
+#define ADMINAUTH_H
+
+#include <atomic>
+#include <string>
+#include "KeyStore.h"
+#include "OpenNonces.h"
+
+// Proof of the session key on admin messages that change the lock. The
+// message carries "nonce", the one the lock last pushed to this peer in
+// OpenNonce, and "auth": the hex AES-CMAC, under the key the sender
+// registered on this connection, of "<type>|<requestUUID>|<nonce>|<fields>",
+// where fields are the message's own values joined with '|'. The nonce is
+// spent by the check whatever its outcome, so a captured frame cannot be
+// sent again; the lock pushes the next one with the reply. Being on the
+// confirmed list alone is not enough; a peer that only claims a confirmed
+// address holds no session key for it.
+class AdminAuth {
+public:
+    struct Stats {
+        std::atomic<uint32_t> accepted{0};
+        std::atomic<uint32_t> noSession{0};
+        std::atomic<uint32_t> badNonce{0};   // unknown, expired or already spent
+        std::atomic<uint32_t> badMac{0};
+    };
+
+    static std::string text(int type, const std::string &requestUUID, const std::string &nonce, const std::string &fields)
+    {
+        return std::to_string(type) + "|" + requestUUID + "|" + nonce + "|" + fields;
+    }
+
+    static bool check(const std::string &address, int type, const std::string &requestUUID, const std::string &nonce,
+                      const std::string &fields, const std::string &auth, unsigned long nowMs)
+    {
+        auto cipher = KeyStore::instance().sessionCipher(address);
+        if (!cipher) {
+            stats().noSession++;
+            return false;
+        }
+        if (nonce.empty() || OpenNonces::instance().consume(address, nonce, nowMs) != OpenNonces::Result::Valid) {
+            stats().badNonce++;
+            return false;
+        }
+        if (auth.empty() || !SessionCipher::sameProof(auth, cipher->proof(text(type, requestUUID, nonce, fields)))) {
+            stats().badMac++;
+            return false;
+        }
+        stats().accepted++;
+        return true;
+    }
+
+    // A secret field of a checked request, sent as hex of its AES-CTR
+    // encryption under the session key with text(type, requestUUID, nonce,
+    // name) as the label. False when there is no session or it is not hex.
+    static bool reveal(const std::string &address, int type, const std::string &requestUUID, const std::string &nonce,
+                       const std::string &name, const std::string &hex, std::string &value)
+    {
+        auto cipher = KeyStore::instance().sessionCipher(address);
+        if (!cipher || !SessionCipher::fromHex(hex, value))
+            return false;
+        cipher->crypt(text(type, requestUUID, nonce, name), value);
+        return true;
+    }
+
+    static Stats &stats()
+    {
+        static Stats st;
+        return st;
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+enum class AdmissionCost {
+    Normal,
+    Expensive,  // RSA keygen/decrypt, key save, WiFi scan
+    Open        // OpenRequest
+};
+
+#define AdmissionBucketSize 3
+#define AdmissionRefillMs 10000
+#define AdmissionMaxSources 32
+// share of the window that expensive handlers may take
+#define AdmissionWindowMs 10000
+#define AdmissionCpuBudgetPercent 50
+#define AdmissionMaxExpensiveQueued 2
+
+// Decides on the BLE task whether a request may be queued. Expensive
+// requests pay from a per-source token bucket and are refused when the
+// expensive work of the last window, or the queue of it, is over budget.
+// Open requests from keyed devices are never throttled; from unknown
+// devices they pay from the same per-source bucket as expensive ones.
+// Time is passed in, so the policy can be driven by a synthetic clock.
+class AdmissionControl {
+public:
+    enum class Verdict {
+        Admit,
+        RejectSource,
+        RejectCpu,
+        RejectQueue
+    };
+
+    struct Stats {
+        uint32_t admitted = 0;
+        uint32_t rejectedSource = 0;
+        uint32_t rejectedCpu = 0;
+        uint32_t rejectedQueue = 0;
+        uint32_t reservedOpens = 0;
+    };
+
+    Verdict admit(const std::string &source, AdmissionCost cost, bool isKnownDevice,
+                  size_t expensiveQueued, uint32_t nowMs)
+    {
+        if (cost == AdmissionCost::Normal) {
+            counters.admitted++;
+            return Verdict::Admit;
+        }
+        if (cost == AdmissionCost::Open && isKnownDevice) {
+            counters.admitted++;
+            counters.reservedOpens++;
+            return Verdict::Admit;
+        }
+        if (cost == AdmissionCost::Expensive) {
+            if (expensiveQueued >= AdmissionMaxExpensiveQueued) {
+                counters.rejectedQueue++;
+                return Verdict::RejectQueue;
+            }
+            if (cpuUsedMs(nowMs) * 100 >= (uint32_t)AdmissionWindowMs * AdmissionCpuBudgetPercent) {
+                counters.rejectedCpu++;
+                return Verdict::RejectCpu;
+            }
+        }
+        if (!take(source, nowMs)) {
+            counters.rejectedSource++;
+            return Verdict::RejectSource;
+        }
+        counters.admitted++;
+        return Verdict::Admit;
+    }
+
+    // Time spent by an admitted expensive handler, charged to the window
+    void charge(uint32_t micros, uint32_t nowMs)
+    {
+        roll(nowMs);
+        currentMs += micros / 1000;
+    }
+
+    const Stats &stats() const { return counters; }
+
+    uint32_t cpuUsedMs(uint32_t nowMs)
+    {
+        roll(nowMs);
+        // previous window weighted by how much of it still overlaps
+        uint32_t elapsed = nowMs - windowStartMs;
+        uint64_t carried = (uint64_t)previousMs * (AdmissionWindowMs - elapsed) / AdmissionWindowMs;
+        return currentMs + (uint32_t)carried;
+    }
+
+private:
+    struct Bucket {
+        uint32_t tokens;
+        uint32_t refilledMs;
+        uint32_t lastUsedMs;
+    };
+
+    void roll(uint32_t nowMs)
+    {
+        if (nowMs - windowStartMs < AdmissionWindowMs)
+            return;
+        previousMs = nowMs - windowStartMs < 2 * AdmissionWindowMs ? currentMs : 0;
+        currentMs = 0;
+        windowStartMs = nowMs - (nowMs - windowStartMs) % AdmissionWindowMs;
+    }
+
+    bool take(const std::string &source, uint32_t nowMs)
+    {
+        auto it = buckets.find(source);
+        if (it == buckets.end()) {
+            if (buckets.size() >= AdmissionMaxSources)
+                evictIdlest();
+            it = buckets.emplace(source, Bucket{AdmissionBucketSize, nowMs, nowMs}).first;
+        }
+        auto &b = it->second;
+        uint32_t refill = (nowMs - b.refilledMs) / AdmissionRefillMs;
+        if (refill) {
+            b.tokens = b.tokens + refill > AdmissionBucketSize ? AdmissionBucketSize : b.tokens + refill;
+            b.refilledMs += refill * AdmissionRefillMs;
+        }
+        b.lastUsedMs = nowMs;
+        if (b.tokens == 0)
+            return false;
+        b.tokens--;
+        return true;
+    }
+
+    void evictIdlest()
+    {
+        auto idlest = buckets.begin();
+        for (auto it = buckets.begin(); it != buckets.end(); ++it) {
+            if ((int32_t)(it->second.lastUsedMs - idlest->second.lastUsedMs) < 0)
+                idlest = it;
+        }
+        buckets.erase(idlest);
+    }
+
+    std::map<std::string, Bucket> buckets;
+    uint32_t windowStartMs = 0;
+    uint32_t currentMs = 0;
+    uint32_t previousMs = 0;
+    Stats counters;
+};
+
+#endif
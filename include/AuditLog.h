@@ -0,0 +1,279 @@
+#ifndef AUDITLOG_H
+#define AUDITLOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <json.hpp>
+
+// records kept in RAM before one batched write
+#define AuditBufferRecords 16
+// a partly filled buffer is written after this long
+#define AuditFlushMs 5000
+#define AuditPageMax 20
+
+enum class AuditResult : uint8_t {
+    Denied,
+    Opened,
+    Replayed,
+    NoAnswer
+};
+
+// One 20 byte slot in flash
+struct AuditRecord {
+    uint32_t seq;
+    uint32_t time;          // unix seconds, or seconds since boot without AuditEpoch
+    uint8_t device[6];      // peer MAC
+    uint16_t latencyMs;
+    uint8_t result;
+    uint8_t flags;
+    uint16_t check;
+};
+
+#define AuditEpoch 0x01
+
+// Fixed-size region the log wraps around in; offsets are in bytes
+class AuditFlash {
+public:
+    virtual ~AuditFlash() = default;
+    virtual size_t size() = 0;
+    virtual bool read(size_t offset, void *buf, size_t len) = 0;
+    virtual bool write(size_t offset, const void *buf, size_t len) = 0;
+};
+
+// Append-only ring of AuditRecords. append() only copies into a RAM buffer;
+// tick() or flush() write the buffered records in one contiguous write
+// (two at the wrap point). Sequence numbers never repeat, so a reader
+// pages with "entries since cursor" and notices records lost to wraparound.
+// append() works before begin(): the records wait in RAM and are numbered
+// after the newest one in flash once begin() has found it.
+class AuditLog {
+public:
+    struct Stats {
+        uint32_t appended = 0;
+        uint32_t flushes = 0;
+        uint32_t bytesWritten = 0;
+        uint32_t dropped = 0;
+        uint32_t writeErrors = 0;
+    };
+
+    explicit AuditLog(AuditFlash &flash) : flash(flash) {}
+
+    // Finds the newest record so sequence numbers continue after a reboot
+    void begin()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        slots = flash.size() / sizeof(AuditRecord);
+        nextSeq = 1;
+        AuditRecord page[AuditBufferRecords];
+        for (size_t i = 0; i < slots; i += AuditBufferRecords) {
+            size_t n = slots - i < AuditBufferRecords ? slots - i : AuditBufferRecords;
+            if (!flash.read(i * sizeof(AuditRecord), page, n * sizeof(AuditRecord)))
+                continue;
+            for (size_t k = 0; k < n; k++) {
+                if (valid(page[k]) && page[k].seq >= nextSeq)
+                    nextSeq = page[k].seq + 1;
+            }
+        }
+        flushedSeq = nextSeq;
+        for (auto &rec : buffer) {
+            rec.seq = nextSeq++;
+            rec.check = checksum(rec);
+        }
+    }
+
+    uint32_t append(const std::string &address, AuditResult result, uint32_t latencyMs, uint32_t time, bool epoch, uint32_t nowMs)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (buffer.size() >= AuditBufferRecords * 2) {
+            // flash is not keeping up, keep the newest
+            buffer.erase(buffer.begin());
+            counters.dropped++;
+        }
+        AuditRecord rec = {};
+        rec.seq = nextSeq++;
+        rec.time = time;
+        parseMac(address, rec.device);
+        rec.latencyMs = latencyMs > 0xffff ? 0xffff : latencyMs;
+        rec.result = (uint8_t)result;
+        rec.flags = epoch ? AuditEpoch : 0;
+        rec.check = checksum(rec);
+        if (buffer.empty())
+            firstBufferedMs = nowMs;
+        buffer.push_back(rec);
+        counters.appended++;
+        return rec.seq;
+    }
+
+    void tick(uint32_t nowMs)
+    {
+        bool due;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            due = buffer.size() >= AuditBufferRecords || (!buffer.empty() && nowMs - firstBufferedMs >= AuditFlushMs);
+        }
+        if (due)
+            flush();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> flushGuard(flushMutex);
+        std::vector<AuditRecord> batch;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            // before begin() the records stay buffered for it to number
+            if (!slots)
+                return;
+            batch.swap(buffer);
+        }
+        if (batch.empty())
+            return;
+        size_t i = 0;
+        while (i < batch.size()) {
+            size_t slot = batch[i].seq % slots;
+            size_t run = slots - slot < batch.size() - i ? slots - slot : batch.size() - i;
+            size_t bytes = run * sizeof(AuditRecord);
+            bool ok = flash.write(slot * sizeof(AuditRecord), &batch[i], bytes);
+            std::lock_guard<std::mutex> guard(mutex);
+            counters.flushes++;
+            counters.bytesWritten += bytes;
+            if (!ok)
+                counters.writeErrors++;
+            i += run;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        flushedSeq = batch.back().seq + 1;
+    }
+
+    // up to `max` records with seq >= cursor, oldest first; `next` is the
+    // cursor for the following page
+    size_t read(uint32_t cursor, size_t max, std::vector<AuditRecord> &out, uint32_t &next)
+    {
+        // flushMutex keeps flash and flushedSeq consistent; appends (the
+        // open path) only wait for the short copy of the RAM buffer
+        std::lock_guard<std::mutex> flushGuard(flushMutex);
+        uint32_t flushed;
+        std::vector<AuditRecord> pending;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            flushed = flushedSeq;
+            pending = buffer;
+        }
+        out.clear();
+        uint32_t oldest = flushed > slots ? flushed - slots : 1;
+        if (cursor < oldest)
+            cursor = oldest;
+        // flushed records come back in at most two contiguous reads
+        size_t want = cursor < flushed ? flushed - cursor : 0;
+        if (want > max)
+            want = max;
+        std::vector<AuditRecord> page(want);
+        size_t got = 0;
+        while (got < want) {
+            size_t slot = (cursor + got) % slots;
+            size_t run = slots - slot < want - got ? slots - slot : want - got;
+            if (!flash.read(slot * sizeof(AuditRecord), &page[got], run * sizeof(AuditRecord)))
+                break;
+            got += run;
+        }
+        for (size_t i = 0; i < got; i++) {
+            if (valid(page[i]) && page[i].seq == cursor + i)
+                out.push_back(page[i]);
+        }
+        for (auto &rec : pending) {
+            if (out.size() >= max)
+                break;
+            if (rec.seq >= cursor)
+                out.push_back(rec);
+        }
+        next = out.empty() ? cursor : out.back().seq + 1;
+        return out.size();
+    }
+
+    // one page as sent over BLE and HTTP:
+    // {"entries": [[seq, time, device, result, latencyMs, epoch]...], "next": n}
+    void page(uint32_t cursor, size_t max, nlohmann::json &j)
+    {
+        std::vector<AuditRecord> records;
+        uint32_t next;
+        read(cursor, max < AuditPageMax ? max : AuditPageMax, records, next);
+        auto entries = nlohmann::json::array();
+        for (auto &rec : records)
+            entries.push_back({rec.seq, rec.time, deviceString(rec), rec.result, rec.latencyMs, (rec.flags & AuditEpoch) != 0});
+        j["entries"] = entries;
+        j["next"] = next;
+        j["last"] = lastSeq();
+    }
+
+    uint32_t lastSeq() const { return nextSeq - 1; }
+    size_t capacity() const { return slots; }
+    size_t buffered() const { return buffer.size(); }
+    const Stats &stats() const { return counters; }
+
+    static std::string deviceString(const AuditRecord &rec)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string mac;
+        for (int i = 0; i < 6; i++) {
+            if (i)
+                mac += ':';
+            mac += digits[rec.device[i] >> 4];
+            mac += digits[rec.device[i] & 0x0f];
+        }
+        return mac;
+    }
+
+private:
+    static uint16_t checksum(const AuditRecord &rec)
+    {
+        // Fletcher-16 over everything but the check field
+        auto p = reinterpret_cast<const uint8_t *>(&rec);
+        uint16_t a = 0, b = 0;
+        for (size_t i = 0; i < offsetof(AuditRecord, check); i++) {
+            a = (a + p[i]) % 255;
+            b = (b + a) % 255;
+        }
+        return (b << 8) | a;
+    }
+
+    static bool valid(const AuditRecord &rec)
+    {
+        return rec.seq != 0 && rec.seq != 0xffffffff && rec.check == checksum(rec);
+    }
+
+    static void parseMac(const std::string &address, uint8_t *mac)
+    {
+        int n = 0;
+        int nibbles = 0;
+        for (char c : address) {
+            int v;
+            if (c >= '0' && c <= '9')
+                v = c - '0';
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                v = (c | 0x20) - 'a' + 10;
+            else
+                continue;
+            if (n >= 6)
+                break;
+            mac[n] = (mac[n] << 4) | v;
+            if (++nibbles % 2 == 0)
+                n++;
+        }
+    }
+
+    AuditFlash &flash;
+    std::mutex mutex;
+    std::mutex flushMutex;
+    std::vector<AuditRecord> buffer;
+    size_t slots = 0;
+    uint32_t nextSeq = 1;
+    uint32_t flushedSeq = 1;
+    uint32_t firstBufferedMs = 0;
+    Stats counters;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// RFC 4648 base64, used for key blobs in text framing (4/3 of the raw size
+// instead of 2x for hex)
+namespace Base64 {
+
+inline std::string encode(const uint8_t *data, size_t len)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((len + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < len; i += 3) {
+        uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        out += table[(v >> 18) & 0x3f];
+        out += table[(v >> 12) & 0x3f];
+        out += table[(v >> 6) & 0x3f];
+        out += table[v & 0x3f];
+    }
+    if (i < len) {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < len)
+            v |= data[i + 1] << 8;
+        out += table[(v >> 18) & 0x3f];
+        out += table[(v >> 12) & 0x3f];
+        out += i + 1 < len ? table[(v >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+inline std::string encode(const std::vector<uint8_t> &data)
+{
+    return encode(data.data(), data.size());
+}
+
+inline bool decode(const std::string &text, std::vector<uint8_t> &out)
+{
+    auto value = [](char c) -> int {
+        if (c >= 'A' && c <= 'Z') return c - 'A';
+        if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+        if (c >= '0' && c <= '9') return c - '0' + 52;
+        if (c == '+') return 62;
+        if (c == '/') return 63;
+        return -1;
+    };
+    out.clear();
+    out.reserve(text.size() / 4 * 3);
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char c : text) {
+        if (c == '=')
+            break;
+        int v = value(c);
+        if (v < 0)
+            return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((acc >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+}
+
+#endif
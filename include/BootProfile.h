@@ -0,0 +1,69 @@
+#ifndef BOOTPROFILE_H
+#define BOOTPROFILE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <json.hpp>
+#include "BleLockAndKey.h"
+
+#define BootProfileStages 12
+
+// Startup timeline: each stage records when it finished (ms since power-on)
+// and how long it took. Stages may be marked from the background boot task.
+class BootProfile {
+public:
+    static void end(const char *stage, unsigned long startMs)
+    {
+        size_t i = count().fetch_add(1);
+        if (i >= BootProfileStages)
+            return;
+        auto &s = stages()[i];
+        s.name = stage;
+        s.endMs = millis();
+        s.durationMs = s.endMs - startMs;
+        logColor(LColor::Blue, F("Boot: %s %lu ms (at %lu ms)"), stage, s.durationMs, s.endMs);
+    }
+
+    static void toJson(nlohmann::json &j)
+    {
+        size_t n = count().load();
+        if (n > BootProfileStages)
+            n = BootProfileStages;
+        for (size_t i = 0; i < n; i++) {
+            auto &s = stages()[i];
+            j[s.name] = {{"ms", s.durationMs}, {"at", s.endMs}};
+        }
+    }
+
+    // RAII helper: BootProfile::Stage stage("lock");
+    class Stage {
+    public:
+        explicit Stage(const char *name) : name(name), startMs(millis()) {}
+        ~Stage() { BootProfile::end(name, startMs); }
+
+    private:
+        const char *name;
+        unsigned long startMs;
+    };
+
+private:
+    struct Entry {
+        const char *name = "";
+        unsigned long endMs = 0;
+        unsigned long durationMs = 0;
+    };
+
+    static Entry *stages()
+    {
+        static Entry list[BootProfileStages];
+        return list;
+    }
+
+    static std::atomic<size_t> &count()
+    {
+        static std::atomic<size_t> n{0};
+        return n;
+    }
+};
+
+#endif
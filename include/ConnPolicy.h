@@ -0,0 +1,282 @@
+#ifndef CONNPOLICY_H
+#define CONNPOLICY_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <strings.h>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// how long a link stays fast after the last message that asked for it
+#define ConnInteractiveHoldMs 3000
+#define ConnBulkHoldMs 2000
+// a new link keeps what the central picked for this long (handshake time)
+// before it is relaxed like any other
+#define ConnSettleMs 5000
+// how often the controller's connection list is compared with ours
+#define ConnLinkPollMs 250
+#define ConnPolicyTypeSlots 32
+
+// BLE connection parameters: intervals in 1.25 ms units, supervision
+// timeout in 10 ms units
+struct ConnParams {
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+
+// Ordered by how much speed they ask for
+enum class LinkProfile : uint8_t {
+    Idle,
+    Bulk,
+    Interactive
+};
+
+// One connection as the controller reports it
+struct LinkPeer {
+    uint16_t handle;
+    std::string address;
+};
+
+// Link layer the policy drives; the firmware wraps NimBLE, the host side can
+// record the updates instead
+class LinkDriver {
+public:
+    virtual ~LinkDriver() = default;
+    virtual void connected(std::vector<LinkPeer> &peers) = 0;
+    virtual bool update(uint16_t handle, const ConnParams &params) = 0;
+};
+
+// Picks connection parameters per connection from the messages its peer
+// sends: open and handshake flows get the shortest interval, bulk replies a
+// short one, and a link falls back to a long interval with slave latency
+// once the hold time of its last fast message has passed. Links are keyed
+// by connection handle; the address a message claims only selects among
+// the live connections whose controller address it names, so a message
+// cannot retune a link that is not its own peer's.
+//
+// tick() also follows the controller's connection list: a new link is
+// relaxed after ConnSettleMs even if it never asked for speed, and a link
+// that went away is forgotten and reported to the disconnect hook with
+// every spelling of the address its messages used.
+class ConnPolicy {
+public:
+    struct Stats {
+        uint32_t updates = 0;
+        uint32_t raised = 0;
+        uint32_t relaxed = 0;
+        uint32_t failed = 0;
+        uint32_t connects = 0;
+        uint32_t disconnects = 0;
+        uint32_t unresolved = 0;
+    };
+
+    using DisconnectHook = void (*)(const std::string &address);
+
+    explicit ConnPolicy(LinkDriver &driver) : driver(driver), mutex(xSemaphoreCreateMutex()) {}
+
+    static ConnParams paramsFor(LinkProfile profile)
+    {
+        switch (profile) {
+            case LinkProfile::Interactive: return ConnParams{6, 12, 0, 400};    // 7.5-15 ms
+            case LinkProfile::Bulk: return ConnParams{12, 24, 0, 400};          // 15-30 ms
+            default: return ConnParams{80, 160, 4, 600};                         // 100-200 ms, 4 skipped
+        }
+    }
+
+    void setProfile(int type, LinkProfile profile)
+    {
+        if (type >= 0 && type < ConnPolicyTypeSlots)
+            profiles[type] = profile;
+    }
+
+    void setDisconnectHook(DisconnectHook hook) { disconnectHook = hook; }
+
+    // a message of `type` from `address` was seen
+    void onMessage(const std::string &address, int type, uint32_t nowMs)
+    {
+        LinkProfile wanted = type >= 0 && type < ConnPolicyTypeSlots ? profiles[type] : LinkProfile::Idle;
+        raise(address, wanted, nowMs);
+    }
+
+    // a reply to `address` needs several frames
+    void onBulk(const std::string &address, uint32_t nowMs) { raise(address, LinkProfile::Bulk, nowMs); }
+
+    void tick(uint32_t nowMs)
+    {
+        if (nowMs - lastPollMs >= ConnLinkPollMs) {
+            lastPollMs = nowMs;
+            poll(nowMs);
+        }
+        std::vector<uint16_t> relax;
+        {
+            Guard guard(mutex);
+            for (auto &it : links) {
+                auto &link = it.second;
+                if ((int32_t)(nowMs - link.holdUntilMs) < 0 || (link.settled && link.profile == LinkProfile::Idle))
+                    continue;
+                link.profile = LinkProfile::Idle;
+                link.settled = true;
+                relax.push_back(it.first);
+            }
+            counters.relaxed += relax.size();
+        }
+        for (uint16_t handle : relax)
+            apply(handle, LinkProfile::Idle);
+    }
+
+    // connection `handle` is gone; returns the addresses its messages used
+    std::vector<std::string> forget(uint16_t handle)
+    {
+        Guard guard(mutex);
+        auto it = links.find(handle);
+        if (it == links.end())
+            return {};
+        auto names = std::move(it->second.names);
+        names.push_back(it->second.address);
+        links.erase(it);
+        counters.disconnects++;
+        return names;
+    }
+
+    LinkProfile profileOf(const std::string &address)
+    {
+        Guard guard(mutex);
+        auto it = find(address);
+        return it == links.end() ? LinkProfile::Idle : it->second.profile;
+    }
+
+    size_t fastLinks()
+    {
+        Guard guard(mutex);
+        size_t n = 0;
+        for (auto &it : links)
+            n += it.second.profile != LinkProfile::Idle;
+        return n;
+    }
+
+    size_t linkCount()
+    {
+        Guard guard(mutex);
+        return links.size();
+    }
+
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Link {
+        std::string address;                // as the controller reports it
+        std::vector<std::string> names;     // other spellings seen in messages
+        LinkProfile profile = LinkProfile::Idle;
+        bool settled = false;               // parameters were set by us at least once
+        uint32_t holdUntilMs = 0;
+    };
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    // mutex held
+    std::map<uint16_t, Link>::iterator find(const std::string &address)
+    {
+        for (auto it = links.begin(); it != links.end(); ++it) {
+            if (!strcasecmp(it->second.address.c_str(), address.c_str()))
+                return it;
+        }
+        return links.end();
+    }
+
+    void poll(uint32_t nowMs)
+    {
+        std::vector<LinkPeer> peers;
+        driver.connected(peers);
+        std::vector<uint16_t> gone;
+        {
+            Guard guard(mutex);
+            for (auto &it : links) {
+                bool live = false;
+                for (auto &peer : peers)
+                    live |= peer.handle == it.first && peer.address == it.second.address;
+                if (!live)
+                    gone.push_back(it.first);
+            }
+        }
+        for (uint16_t handle : gone) {
+            auto names = forget(handle);
+            if (!disconnectHook)
+                continue;
+            for (size_t i = 0; i < names.size(); i++) {
+                bool repeated = false;
+                for (size_t j = 0; j < i; j++)
+                    repeated |= names[j] == names[i];
+                if (!repeated)
+                    disconnectHook(names[i]);
+            }
+        }
+        Guard guard(mutex);
+        for (auto &peer : peers) {
+            if (links.count(peer.handle))
+                continue;
+            auto &link = links[peer.handle];
+            link.address = peer.address;
+            link.holdUntilMs = nowMs + ConnSettleMs;
+            counters.connects++;
+        }
+    }
+
+    void raise(const std::string &address, LinkProfile wanted, uint32_t nowMs)
+    {
+        uint16_t handle;
+        {
+            Guard guard(mutex);
+            auto it = find(address);
+            if (it == links.end()) {
+                counters.unresolved++;
+                return;
+            }
+            handle = it->first;
+            auto &link = it->second;
+            if (address != link.address) {
+                bool known = false;
+                for (auto &name : link.names)
+                    known |= name == address;
+                if (!known)
+                    link.names.push_back(address);
+            }
+            if (wanted == LinkProfile::Idle)
+                return;
+            uint32_t hold = wanted == LinkProfile::Interactive ? ConnInteractiveHoldMs : ConnBulkHoldMs;
+            if ((int32_t)(nowMs + hold - link.holdUntilMs) > 0 || link.profile == LinkProfile::Idle)
+                link.holdUntilMs = nowMs + hold;
+            if (wanted <= link.profile)
+                return;
+            link.profile = wanted;
+            link.settled = true;
+            counters.raised++;
+        }
+        apply(handle, wanted);
+    }
+
+    void apply(uint16_t handle, LinkProfile profile)
+    {
+        bool ok = driver.update(handle, paramsFor(profile));
+        Guard guard(mutex);
+        counters.updates++;
+        if (!ok)
+            counters.failed++;
+    }
+
+    LinkDriver &driver;
+    SemaphoreHandle_t mutex;
+    std::map<uint16_t, Link> links;
+    LinkProfile profiles[ConnPolicyTypeSlots] = {};
+    DisconnectHook disconnectHook = nullptr;
+    uint32_t lastPollMs = 0;
+    Stats counters;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef DEVICEACCESS_H
+#define DEVICEACCESS_H
+
+#include <Arduino.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "BleLockAndKey.h"
+
+// Access list shared by the BLE admin messages and the LAN admin API.
+// Reads and writes of BleLockServer::confirmedDevices go under the server
+// mutex; a batch of changes is written to flash with a single
+// saveConfirmedDevices(), and not at all when nothing changed.
+class DeviceAccess {
+public:
+    using Entry = std::pair<std::string, bool>;
+
+    struct Stats {
+        uint32_t batches = 0;
+        uint32_t changed = 0;
+        uint32_t unchanged = 0;
+        uint32_t unknown = 0;
+        uint32_t saves = 0;
+        uint32_t lastSaveUs = 0;
+        uint32_t maxSaveUs = 0;
+    };
+
+    static DeviceAccess &instance()
+    {
+        static DeviceAccess access;
+        return access;
+    }
+
+    void begin(BleLockServer *server) { this->server = server; }
+
+    std::vector<Entry> snapshot()
+    {
+        std::vector<Entry> list;
+        Guard guard(server);
+        list.reserve(BleLockServer::confirmedDevices.size());
+        for (auto &it : BleLockServer::confirmedDevices)
+            list.emplace_back(it.first, it.second);
+        return list;
+    }
+
+    bool isConfirmed(const std::string &mac)
+    {
+        Guard guard(server);
+        auto it = BleLockServer::confirmedDevices.find(mac);
+        return it != BleLockServer::confirmedDevices.end() && it->second;
+    }
+
+    // Entries may carry the "MAC hash" form GetDeviceList hands out. Only
+    // devices the lock already knows are switched; MACs it never paired
+    // with are counted in `unknown` and left out. The save runs under the
+    // server mutex, as saveConfirmedDevices() walks the map it guards.
+    // Returns how many entries changed.
+    size_t apply(const std::vector<Entry> &entries, size_t *unknown = nullptr)
+    {
+        size_t changed = 0;
+        size_t missing = 0;
+        Guard saveGuard(saveMutex);
+        Guard guard(server);
+        for (auto &e : entries) {
+            auto it = BleLockServer::confirmedDevices.find(macOf(e.first));
+            if (it == BleLockServer::confirmedDevices.end()) {
+                missing++;
+                continue;
+            }
+            if (it->second != e.second) {
+                it->second = e.second;
+                changed++;
+            }
+        }
+        counters.batches++;
+        counters.changed += changed;
+        counters.unchanged += entries.size() - changed - missing;
+        counters.unknown += missing;
+        if (unknown)
+            *unknown = missing;
+        if (changed) {
+            uint32_t start = micros();
+            BleLockServer::saveConfirmedDevices();
+            counters.lastSaveUs = micros() - start;
+            if (counters.lastSaveUs > counters.maxSaveUs)
+                counters.maxSaveUs = counters.lastSaveUs;
+            counters.saves++;
+        }
+        return changed;
+    }
+
+    static std::string macOf(const std::string &entry)
+    {
+        return entry.substr(0, entry.find(' '));
+    }
+
+    // 12 character public key fingerprint shown next to the MAC: the low
+    // 12 bits of the byte sum, wrapping at 16 bits as it always has
+    static std::string keyHash(const std::vector<uint8_t> &val)
+    {
+        //simple add hash
+        std::string res;
+        uint16_t sum = 0;
+        for (size_t i = 0; i < val.size(); i++)
+            sum += val[i];
+        uint16_t mask = 1;
+        for (int it = 0; it < 12; it++)
+        {
+            if (sum & mask)
+                res+= "1";
+            else
+                res+= "0";
+            mask <<= 1;
+        }
+        return res;
+    }
+
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        explicit Guard(BleLockServer *server) : m(server->mutex) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    DeviceAccess() : saveMutex(xSemaphoreCreateMutex()) {}
+
+    BleLockServer *server = nullptr;
+    SemaphoreHandle_t saveMutex;
+    Stats counters;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef DISPATCHREPLAY_H
+#define DISPATCHREPLAY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "Dispatcher.h"
+#include "TraceReplay.h"
+
+// Type of the reply a replayed request gets; never a captured type
+#define ReplayReplyType 0xffff
+
+// Replays a loaded trace through the firmware's own dispatch path on the
+// host: each record becomes a request that is serialized, parsed back
+// with MessageBase::createInstance and handed to processRequest on the
+// calling thread, the way the lock task does, at its captured arrival
+// time. Dispatcher::dispatch admits it, queues it for the worker pool of
+// its captured class and a worker runs it; the wait and handle times in
+// the report are the ones the Dispatcher's tracer measured.
+//
+// A replayed request takes as long as the handler installed for its type,
+// or spins for its captured handler time. Records carry no addresses, so
+// requests are spread over `peers` stand-in phones. The lock is the host
+// stand-in, replies go to a stand-in transport that only counts them, and
+// the run installs its own Dispatcher tracer, sender and sizer, clearing
+// them when it is done. The Dispatcher is started on first use.
+class DispatchReplay {
+public:
+    using Handler = TraceReplay::Handler;
+
+    explicit DispatchReplay(const TraceReplay &trace) : trace(trace) {}
+
+    void setHandler(uint8_t type, Handler handler) { handlers[type] = handler; }
+
+    void setPeers(size_t count)
+    {
+        if (count)
+            peers = count;
+    }
+
+    // >1 brings arrivals closer together, <1 spreads them out
+    void setSpeed(double factor)
+    {
+        if (factor > 0)
+            speed = factor;
+    }
+
+    // {"replayed": {<type>: summary}, "captured": {<type>: summary},
+    //  "records", "lost", "peers", "replies", "unfinished"}
+    void run(nlohmann::json &report, uint32_t drainMs = 30000)
+    {
+        static BleLockServer lock;
+        auto &dispatcher = Dispatcher::instance();
+        uint32_t base;
+        auto order = trace.arrivals(base);
+        for (auto rec : order) {
+            int cls = rec->flags & 0x03;
+            dispatcher.setClass(rec->type, (DispatchClass)(cls < (int)DispatchClass::Count ? cls : (int)DispatchClass::Admin));
+            MessageBase::registerConstructor(rec->type, []() -> MessageBase * { return new Request; });
+        }
+        if (!dispatcher.poolOf(DispatchClass::Open))
+            dispatcher.begin(&lock);
+
+        measured.clear();
+        replies = 0;
+        ran = 0;
+        active() = this;
+        Dispatcher::setTracer(onTrace);
+        Dispatcher::setSender(onReply);
+        Dispatcher::setSizer([](MessageBase *request) { return request->serialize().size(); });
+
+        std::map<uint8_t, MessageTrace::TypeSummary> replayed, captured;
+        auto start = std::chrono::steady_clock::now();
+        size_t sent = 0;
+        for (auto rec : order) {
+            MessageTrace::add(captured[rec->type], *rec);
+            std::this_thread::sleep_until(start + std::chrono::microseconds((uint64_t)((rec->enqueuedUs - base) / speed)));
+            Request req;
+            req.type = rec->type;
+            req.sourceAddress = peerAddress(sent % peers);
+            req.destinationAddress = "lock";
+            req.requestUUID = std::to_string(sent);
+            req.record = rec - trace.loaded().data();
+            req.pad.assign(padding(req, rec->bytes), 'x');
+
+            // what the lock task does with bytes off the air
+            MessageBase *msg = MessageBase::createInstance(req.serialize());
+            MessageBase *res = msg ? msg->processRequest(&lock) : nullptr;
+            delete msg;
+            if (res)
+                onReply(&lock, res);
+            sent++;
+        }
+
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            // a worker traces a request before its reply goes out
+            done.wait_for(guard, std::chrono::milliseconds(drainMs), [&]() { return measured.size() >= sent && replies >= ran; });
+            for (auto &rec : measured)
+                MessageTrace::add(replayed[rec.type], rec);
+            report = nlohmann::json::object();
+            report["unfinished"] = sent - measured.size();
+            report["replies"] = replies;
+        }
+        Dispatcher::setTracer(nullptr);
+        Dispatcher::setSender(nullptr);
+        Dispatcher::setSizer(nullptr);
+        active() = nullptr;
+
+        report["records"] = trace.loaded().size();
+        report["lost"] = trace.lost();
+        report["peers"] = peers;
+        report["replayed"] = TraceReplay::toJson(replayed);
+        report["captured"] = TraceReplay::toJson(captured);
+    }
+
+private:
+    // Stands in for every captured type; `pad` brings it to the captured size
+    class Request : public Detachable<Request> {
+    public:
+        size_t record = 0;
+        std::string pad;
+
+        MessageBase *handleRequest(void *) override
+        {
+            if (auto replay = active())
+                replay->serve(record);
+            auto res = new Reply;
+            res->destinationAddress = sourceAddress;
+            res->sourceAddress = destinationAddress;
+            res->requestUUID = requestUUID;
+            return res;
+        }
+
+    protected:
+        void serializeExtraFields(json &doc) override
+        {
+            doc["record"] = record;
+            doc["pad"] = pad;
+        }
+        void deserializeExtraFields(const json &doc) override
+        {
+            record = doc["record"];
+            pad = doc["pad"];
+        }
+    };
+
+    class Reply : public MessageBase {
+    public:
+        Reply() { type = ReplayReplyType; }
+
+    protected:
+        void serializeExtraFields(json &) override {}
+        void deserializeExtraFields(const json &) override {}
+    };
+
+    static DispatchReplay *&active()
+    {
+        static DispatchReplay *replay = nullptr;
+        return replay;
+    }
+
+    static void onTrace(const DispatchTrace &t)
+    {
+        auto replay = active();
+        if (!replay)
+            return;
+        TraceRecord rec;
+        rec.enqueuedUs = t.enqueuedUs;
+        rec.waitUs = t.startUs - t.enqueuedUs;
+        rec.handleUs = t.endUs - t.startUs;
+        rec.bytes = t.bytes > 0xffff ? 0xffff : t.bytes;
+        rec.type = t.type;
+        rec.flags = ((int)t.cls & 0x03) | ((int)t.outcome & 0x03) << 2;
+        std::lock_guard<std::mutex> guard(replay->mutex);
+        replay->measured.push_back(rec);
+        if (t.outcome == DispatchOutcome::Handled || t.outcome == DispatchOutcome::InPlace)
+            replay->ran++;
+        replay->done.notify_all();
+    }
+
+    // stand-in transport: the reply is written and gone
+    static void onReply(void *, MessageBase *response)
+    {
+        if (auto replay = active()) {
+            std::lock_guard<std::mutex> guard(replay->mutex);
+            replay->replies++;
+            replay->done.notify_all();
+        }
+        delete response;
+    }
+
+    void serve(size_t index)
+    {
+        auto &rec = trace.loaded()[index];
+        auto it = handlers.find(rec.type);
+        if (it != handlers.end()) {
+            it->second(rec);
+            return;
+        }
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(rec.handleUs);
+        while (std::chrono::steady_clock::now() < until) {
+        }
+    }
+
+    static size_t padding(Request &req, uint16_t bytes)
+    {
+        size_t bare = req.serialize().size();
+        return bytes > bare ? bytes - bare : 0;
+    }
+
+    static std::string peerAddress(size_t n)
+    {
+        char text[18];
+        snprintf(text, sizeof(text), "02:00:00:00:%02x:%02x", (unsigned)(n >> 8) & 0xff, (unsigned)n & 0xff);
+        return text;
+    }
+
+    const TraceReplay &trace;
+    std::map<uint8_t, Handler> handlers;
+    size_t peers = 4;
+    double speed = 1.0;
+    std::mutex mutex;
+    std::condition_variable done;
+    std::vector<TraceRecord> measured;
+    uint32_t replies = 0;
+    uint32_t ran = 0;
+};
+
+#endif
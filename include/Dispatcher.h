@@ -0,0 +1,441 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <map>
+#include "MessageBase.h"
+#include "BleLockAndKey.h"
+#include "ResponseCache.h"
+#include "Admission.h"
+#include "KeyStore.h"
+#include "MemoryBudget.h"
+
+#define DispatchQueueDepth 8
+#define DispatchMaxPool 3
+// how long the BLE task may wait for queue space before rejecting
+#define DispatchBackpressureMs 20
+
+// Priority classes, highest first
+enum class DispatchClass {
+    Open,       // OpenRequest and the security check flow
+    Handshake,  // HelloRequest, reqRegKey
+    Admin,      // device list, access changes, WiFi
+    Count
+};
+
+// Base for messages the lock serves. processRequest only hands the message
+// to the Dispatcher; the actual work is done in handleRequest on the worker
+// task of the message's class.
+class LockRequest : public MessageBase {
+public:
+    MessageBase *processRequest(void *context) override;
+
+    virtual MessageBase *handleRequest(void *context) = 0;
+
+    // Replies that may be replayed from ResponseCache on a retry
+    virtual bool isReplayable() const { return false; }
+
+    // What admission control charges this request as
+    virtual AdmissionCost cost() const { return AdmissionCost::Normal; }
+
+    // A new instance the fields of this one were moved into. The library
+    // deletes the message it handed to processRequest once that returns,
+    // so a queued request has to live in an instance of its own.
+    virtual LockRequest *detach() = 0;
+
+    MessageBase *execute(void *context)
+    {
+        MemScope scope(MemoryBudget::messageSite((int)type));
+        if (isReplayable())
+            return ResponseCache::instance().serve(this, [&]() { return handleRequest(context); });
+        return handleRequest(context);
+    }
+};
+
+// Base of the concrete requests: detach() moves T into a new T. `Base` is
+// LockRequest or an abstract request in between (e.g. AdminRequest).
+template <class T, class Base = LockRequest>
+class Detachable : public Base {
+public:
+    LockRequest *detach() override { return new T(std::move(static_cast<T &>(*this))); }
+};
+
+// How a request left the dispatcher
+enum class DispatchOutcome : uint8_t {
+    Handled,    // ran on a worker
+    InPlace,    // ran on the calling task (before begin(), or inside a Batch)
+    Refused,    // turned away by admission control
+    Dropped     // worker queue stayed full
+};
+
+// One request as the tracer sees it; times are micros(), bytes is the
+// queued request's size from the Sizer (0 without one, or when run in place)
+struct DispatchTrace {
+    MessageType type;
+    DispatchClass cls;
+    DispatchOutcome outcome;
+    uint32_t enqueuedUs;
+    uint32_t startUs;
+    uint32_t endUs;
+    size_t bytes;
+};
+
+struct DispatchStats {
+    uint32_t handled = 0;
+    uint32_t dropped = 0;
+    uint32_t lastWaitUs = 0;
+    uint32_t maxWaitUs = 0;
+    uint32_t lastHandleUs = 0;
+    uint32_t maxHandleUs = 0;
+    uint32_t lastDoneUs = 0;
+    uint64_t totalWaitUs = 0;
+    uint64_t totalHandleUs = 0;
+};
+
+class Dispatcher {
+public:
+    static Dispatcher &instance()
+    {
+        static Dispatcher dispatcher;
+        return dispatcher;
+    }
+
+    void setClass(MessageType type, DispatchClass cls) { classes[type] = cls; }
+
+    DispatchClass classOf(MessageType type) const
+    {
+        auto it = classes.find(type);
+        return it == classes.end() ? DispatchClass::Admin : it->second;
+    }
+
+    // Each class gets a small pool of workers. A connection is pinned to one
+    // worker of the pool (by address hash), so requests from one phone stay
+    // in order while different phones are served concurrently.
+    void begin(void *context)
+    {
+        static const struct {
+            const char *name;
+            UBaseType_t priority;
+            uint32_t stack;
+            uint8_t pool;
+        } config[(int)DispatchClass::Count] = {
+                {"dispOpen", 5, 6144, 3},
+                {"dispHandshake", 4, 8192, 2},
+                {"dispAdmin", 2, 8192, 1},
+        };
+        this->context = context;
+        for (int i = 0; i < (int)DispatchClass::Count; i++) {
+            poolSize[i] = config[i].pool;
+            for (int n = 0; n < poolSize[i]; n++) {
+                auto &worker = workers[i][n];
+                worker.owner = this;
+                worker.cls = (DispatchClass)i;
+                worker.queue = xQueueCreate(DispatchQueueDepth, sizeof(Job));
+                std::string name = std::string(config[i].name) + std::to_string(n);
+                xTaskCreate(workerTask, name.c_str(), config[i].stack, &worker, config[i].priority, &worker.task);
+                MemoryBudget::instance().watchTask(pcTaskGetName(worker.task), worker.task, config[i].stack);
+            }
+        }
+        started = true;
+    }
+
+    // Called on the BLE task: move the request into the queue of its class
+    MessageBase *dispatch(LockRequest *request, void *context)
+    {
+        uint32_t arrivedUs = micros();
+        if (observerHook())
+            observerHook()(request);
+        // a retry of something already answered is neither charged nor
+        // queued; ResponseCache counts it
+        if (request->isReplayable()) {
+            if (MessageBase *cached = ResponseCache::instance().replay(request))
+                return cached;
+        }
+        if (!started)
+            return runInPlace(request, AdmissionCost::Normal, context, arrivedUs);
+
+        AdmissionCost cost = request->cost();
+        if (!admit(request, cost)) {
+            trace(request->type, DispatchOutcome::Refused, arrivedUs, arrivedUs, micros(), 0);
+            return rejecterHook() ? rejecterHook()(request) : nullptr;
+        }
+
+        // already on a worker (e.g. inside a Batch): run in place, in order
+        if (onWorker())
+            return runInPlace(request, cost, context, arrivedUs);
+
+        int cls = (int)classOf(request->type);
+        auto &worker = workers[cls][std::hash<std::string>()(request->sourceAddress) % poolSize[cls]];
+        LockRequest *queued = request->detach();
+        size_t bytes = sizerHook() ? sizerHook()(queued) : 0;
+
+        Job job{queued, (uint32_t)micros(), cost, bytes};
+        if (cost == AdmissionCost::Expensive)
+            expensiveQueued++;
+        if (xQueueSend(worker.queue, &job, pdMS_TO_TICKS(DispatchBackpressureMs)) != pdTRUE) {
+            if (cost == AdmissionCost::Expensive)
+                expensiveQueued--;
+            worker.stats.dropped++;
+            logColor(LColor::Red, F("Dispatch queue full, type %d rejected"), (int)queued->type);
+            trace(queued->type, DispatchOutcome::Dropped, job.enqueuedUs, job.enqueuedUs, micros(), bytes);
+            MessageBase *rejected = rejecterHook() ? rejecterHook()(queued) : nullptr;
+            delete queued;
+            return rejected;
+        }
+        return nullptr;
+    }
+
+    DispatchStats stats(DispatchClass cls) const
+    {
+        DispatchStats sum;
+        for (int n = 0; n < poolSize[(int)cls]; n++) {
+            auto &st = workers[(int)cls][n].stats;
+            sum.handled += st.handled;
+            sum.dropped += st.dropped;
+            sum.totalWaitUs += st.totalWaitUs;
+            sum.totalHandleUs += st.totalHandleUs;
+            if (st.maxWaitUs > sum.maxWaitUs)
+                sum.maxWaitUs = st.maxWaitUs;
+            if (st.maxHandleUs > sum.maxHandleUs)
+                sum.maxHandleUs = st.maxHandleUs;
+            if (st.handled && (int32_t)(st.lastDoneUs - sum.lastDoneUs) >= 0) {
+                sum.lastDoneUs = st.lastDoneUs;
+                sum.lastWaitUs = st.lastWaitUs;
+                sum.lastHandleUs = st.lastHandleUs;
+            }
+        }
+        return sum;
+    }
+
+    size_t queued(DispatchClass cls) const
+    {
+        size_t total = 0;
+        for (int n = 0; started && n < poolSize[(int)cls]; n++)
+            total += uxQueueMessagesWaiting(workers[(int)cls][n].queue);
+        return total;
+    }
+
+    size_t poolOf(DispatchClass cls) const { return poolSize[(int)cls]; }
+
+    AdmissionControl::Stats admissionStats()
+    {
+        xSemaphoreTake(admissionMutex, portMAX_DELAY);
+        auto st = admission.stats();
+        xSemaphoreGive(admissionMutex);
+        return st;
+    }
+
+    uint32_t expensiveCpuMs()
+    {
+        xSemaphoreTake(admissionMutex, portMAX_DELAY);
+        uint32_t used = admission.cpuUsedMs(millis());
+        xSemaphoreGive(admissionMutex);
+        return used;
+    }
+
+    // Sees every incoming request before admission (e.g. link tuning)
+    using Observer = void (*)(const MessageBase *request);
+
+    static void setObserver(Observer observer) { observerHook() = observer; }
+
+    // Sees every request once it was handled, refused or dropped (e.g.
+    // trace capture). Called on the task that finished with the request.
+    using Tracer = void (*)(const DispatchTrace &trace);
+
+    static void setTracer(Tracer tracer) { tracerHook() = tracer; }
+
+    // Serialized size of a queued request for its trace, or 0 when nobody
+    // looks at it; requests are no longer serialized on the way to a worker
+    using Sizer = size_t (*)(MessageBase *request);
+
+    static void setSizer(Sizer sizer) { sizerHook() = sizer; }
+
+    // Builds the reply for a request rejected under backpressure
+    using Rejecter = MessageBase *(*)(MessageBase *request);
+
+    static void setRejecter(Rejecter rejecter) { rejecterHook() = rejecter; }
+
+    // Replies go through the installed sender (e.g. the fragmenting
+    // transport), or straight to the lock when none is set
+    using Sender = void (*)(void *context, MessageBase *response);
+
+    static void setSender(Sender sender) { senderHook() = sender; }
+
+    static void sendResponse(void *context, MessageBase *response)
+    {
+        if (senderHook())
+            senderHook()(context, response);
+        else
+            sendRaw(context, response);
+    }
+
+    // Hands `response` to the lock library, which takes it over; false when
+    // it could not be sent (no lock, nobody to send it to). With no timeout
+    // request() waits for nothing, so what it returns is an answer no one
+    // asked for.
+    static bool sendRaw(void *context, MessageBase *response)
+    {
+        auto lock = static_cast<BleLockServer *>(context);
+        if (!lock || response->destinationAddress.empty()) {
+            logColor(LColor::Red, F("Reply type %d has nowhere to go"), (int)response->type);
+            delete response;
+            return false;
+        }
+        std::string address = response->destinationAddress;
+        delete lock->request(response, address, 0);
+        return true;
+    }
+
+private:
+    struct Job {
+        LockRequest *request;
+        uint32_t enqueuedUs;
+        AdmissionCost cost;
+        size_t bytes;
+    };
+    struct Worker {
+        Dispatcher *owner = nullptr;
+        DispatchClass cls = DispatchClass::Admin;
+        QueueHandle_t queue = nullptr;
+        TaskHandle_t task = nullptr;
+        DispatchStats stats;
+    };
+
+    Dispatcher() : admissionMutex(xSemaphoreCreateMutex()) {}
+
+    bool admit(LockRequest *request, AdmissionCost cost)
+    {
+        bool known = cost == AdmissionCost::Open && KeyStore::instance().hasSession(request->sourceAddress);
+        xSemaphoreTake(admissionMutex, portMAX_DELAY);
+        auto verdict = admission.admit(request->sourceAddress, cost, known, expensiveQueued, millis());
+        xSemaphoreGive(admissionMutex);
+        if (verdict == AdmissionControl::Verdict::Admit)
+            return true;
+        logColor(LColor::Red, F("Admission: type %d from %s refused (%d)"), (int)request->type,
+                 request->sourceAddress.c_str(), (int)verdict);
+        return false;
+    }
+
+    MessageBase *runCharged(LockRequest *request, AdmissionCost cost, void *context)
+    {
+        uint32_t startUs = micros();
+        MessageBase *response = request->execute(context);
+        if (cost == AdmissionCost::Expensive) {
+            xSemaphoreTake(admissionMutex, portMAX_DELAY);
+            admission.charge(micros() - startUs, millis());
+            xSemaphoreGive(admissionMutex);
+        }
+        return response;
+    }
+
+    MessageBase *runInPlace(LockRequest *request, AdmissionCost cost, void *context, uint32_t arrivedUs)
+    {
+        uint32_t startUs = micros();
+        MessageBase *response = runCharged(request, cost, context);
+        trace(request->type, DispatchOutcome::InPlace, arrivedUs, startUs, micros(), 0);
+        return response;
+    }
+
+    void trace(MessageType type, DispatchOutcome outcome, uint32_t enqueuedUs, uint32_t startUs, uint32_t endUs, size_t bytes)
+    {
+        if (tracerHook())
+            tracerHook()(DispatchTrace{type, classOf(type), outcome, enqueuedUs, startUs, endUs, bytes});
+    }
+
+    static Tracer &tracerHook()
+    {
+        static Tracer tracer = nullptr;
+        return tracer;
+    }
+
+    static Sizer &sizerHook()
+    {
+        static Sizer sizer = nullptr;
+        return sizer;
+    }
+
+    static Sender &senderHook()
+    {
+        static Sender sender = nullptr;
+        return sender;
+    }
+
+    static Rejecter &rejecterHook()
+    {
+        static Rejecter rejecter = nullptr;
+        return rejecter;
+    }
+
+    static Observer &observerHook()
+    {
+        static Observer observer = nullptr;
+        return observer;
+    }
+
+    bool onWorker() const
+    {
+        TaskHandle_t current = xTaskGetCurrentTaskHandle();
+        for (int i = 0; i < (int)DispatchClass::Count; i++) {
+            for (int n = 0; n < poolSize[i]; n++) {
+                if (workers[i][n].task == current)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    static void workerTask(void *param)
+    {
+        auto worker = static_cast<Worker *>(param);
+        Job job;
+        for (;;) {
+            if (xQueueReceive(worker->queue, &job, portMAX_DELAY) != pdTRUE)
+                continue;
+            worker->owner->run(*worker, job);
+        }
+    }
+
+    void run(Worker &worker, Job &job)
+    {
+        uint32_t startUs = micros();
+        MessageBase *response = runCharged(job.request, job.cost, context);
+        uint32_t endUs = micros();
+        trace(job.request->type, DispatchOutcome::Handled, job.enqueuedUs, startUs, endUs, job.bytes);
+        delete job.request;
+        if (job.cost == AdmissionCost::Expensive)
+            expensiveQueued--;
+
+        // counted before the reply goes out, so whoever got it sees it counted
+        auto &st = worker.stats;
+        st.handled++;
+        st.lastWaitUs = startUs - job.enqueuedUs;
+        st.lastHandleUs = endUs - startUs;
+        st.lastDoneUs = endUs;
+        st.totalWaitUs += st.lastWaitUs;
+        st.totalHandleUs += st.lastHandleUs;
+        if (st.lastWaitUs > st.maxWaitUs)
+            st.maxWaitUs = st.lastWaitUs;
+        if (st.lastHandleUs > st.maxHandleUs)
+            st.maxHandleUs = st.lastHandleUs;
+
+        if (response)
+            sendResponse(context, response);
+    }
+
+    std::map<MessageType, DispatchClass> classes;
+    Worker workers[(int)DispatchClass::Count][DispatchMaxPool];
+    uint8_t poolSize[(int)DispatchClass::Count] = {};
+    void *context = nullptr;
+    bool started = false;
+    AdmissionControl admission;
+    SemaphoreHandle_t admissionMutex;
+    std::atomic<size_t> expensiveQueued{0};
+};
+
+inline MessageBase *LockRequest::processRequest(void *context)
+{
+    return Dispatcher::instance().dispatch(this, context);
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef ESPOTAPARTITION_H
+#define ESPOTAPARTITION_H
+
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+#include "OtaUpdate.h"
+
+// OtaPartition on the next OTA app slot. Writes go through the partition
+// API rather than esp_ota_begin/write, which erase the slot up front and
+// cannot pick up a transfer in the middle.
+class EspOtaPartition : public OtaPartition {
+public:
+    bool open() override
+    {
+        if (!partition)
+            partition = esp_ota_get_next_update_partition(nullptr);
+        return partition != nullptr;
+    }
+
+    size_t size() override { return partition ? partition->size : 0; }
+
+    bool erase(size_t offset, size_t len) override
+    {
+        return esp_partition_erase_range(partition, offset, len) == ESP_OK;
+    }
+
+    bool write(size_t offset, const uint8_t *data, size_t len) override
+    {
+        return esp_partition_write(partition, offset, data, len) == ESP_OK;
+    }
+
+    bool read(size_t offset, uint8_t *data, size_t len) override
+    {
+        return esp_partition_read(partition, offset, data, len) == ESP_OK;
+    }
+
+    // verifies the app image and flips otadata in one step
+    bool activate() override
+    {
+        return esp_ota_set_boot_partition(partition) == ESP_OK;
+    }
+
+private:
+    const esp_partition_t *partition = nullptr;
+};
+
+class MbedOtaHash : public OtaHash {
+public:
+    MbedOtaHash() { mbedtls_sha256_init(&ctx); }
+    ~MbedOtaHash() override { mbedtls_sha256_free(&ctx); }
+
+    void reset() override { mbedtls_sha256_starts(&ctx, 0); }
+
+    void update(const uint8_t *data, size_t len) override { mbedtls_sha256_update(&ctx, data, len); }
+
+    std::string hex() override
+    {
+        static const char digits[] = "0123456789abcdef";
+        uint8_t sum[32];
+        mbedtls_sha256_finish(&ctx, sum);
+        std::string out(64, '0');
+        for (int i = 0; i < 32; i++) {
+            out[2 * i] = digits[sum[i] >> 4];
+            out[2 * i + 1] = digits[sum[i] & 0x0f];
+        }
+        return out;
+    }
+
+private:
+    mbedtls_sha256_context ctx;
+};
+
+// OtaSignature with the publisher's public key (PEM, RSA or EC); the
+// signature is the usual sign-the-SHA-256 one, as `openssl dgst -sha256
+// -sign` makes it
+class MbedOtaSignature : public OtaSignature {
+public:
+    explicit MbedOtaSignature(const char *pem)
+    {
+        mbedtls_pk_init(&key);
+        loaded = mbedtls_pk_parse_public_key(&key, (const unsigned char *)pem, strlen(pem) + 1) == 0;
+    }
+    ~MbedOtaSignature() override { mbedtls_pk_free(&key); }
+
+    bool valid() const { return loaded; }
+
+    bool verify(const uint8_t digest[32], const std::vector<uint8_t> &signature) override
+    {
+        return loaded && !signature.empty() &&
+               mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, 32, signature.data(), signature.size()) == 0;
+    }
+
+private:
+    mbedtls_pk_context key;
+    bool loaded = false;
+};
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#define FrameDefaultWindow 4
+#define FrameMaxWindow 8
+// smallest data budget per fragment worth framing for; the envelope of a
+// Fragment is around 160 bytes, so an MTU of 185 (iOS) leaves about 25
+#define FrameMinPayload 16
+#define FrameMaxRetries 3
+#define FrameMaxReassemblyBytes 8192
+// no transfer within FrameMaxReassemblyBytes needs more parts than this
+#define FrameMaxFragments (FrameMaxReassemblyBytes / FrameMinPayload)
+#define FrameMaxTransfersPerPeer 2
+
+// The parts of the fragmenting transport that do not touch messages or the
+// radio: cutting a serialized message into fragment payloads, the sender's
+// window and the receiver's reassembly buffers.
+namespace FrameCodec {
+
+// bytes `c` takes inside a json string as nlohmann::json dumps it
+inline size_t escapedSize(unsigned char c)
+{
+    switch (c) {
+        case '"': case '\\': case '\b': case '\f': case '\n': case '\r': case '\t':
+            return 2;
+        default:
+            return c < 0x20 ? 6 : 1;
+    }
+}
+
+// How many bytes of `bytes`, starting at `from`, fit in `budget` once
+// escaped. Never ends inside a UTF-8 sequence: a fragment holding half a
+// character would not serialize.
+inline size_t fragmentLength(const std::string &bytes, size_t from, size_t budget)
+{
+    size_t used = 0;
+    size_t end = from;
+    while (end < bytes.size()) {
+        unsigned char c = bytes[end];
+        size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+        if (end + len > bytes.size())
+            len = bytes.size() - end;
+        size_t cost = len == 1 ? escapedSize(c) : len;
+        if (used + cost > budget)
+            break;
+        used += cost;
+        end += len;
+    }
+    return end - from;
+}
+
+// Fragment boundaries of `bytes` for a per-fragment data budget: part i is
+// [offsets[i], offsets[i + 1]). False when the budget is too small to make
+// progress or the message needs more than FrameMaxFragments parts.
+inline bool plan(const std::string &bytes, size_t budget, std::vector<uint32_t> &offsets)
+{
+    offsets.clear();
+    offsets.push_back(0);
+    size_t at = 0;
+    while (at < bytes.size()) {
+        size_t len = fragmentLength(bytes, at, budget);
+        if (len == 0 || offsets.size() > FrameMaxFragments)
+            return false;
+        at += len;
+        offsets.push_back(at);
+    }
+    return offsets.size() > 1;
+}
+
+} // namespace FrameCodec
+
+// Sender side of one transfer: which fragments go out next, cumulative acks
+// and go-back-N on timeout
+class FrameWindow {
+public:
+    bool plan(const std::string &bytes, size_t budget, uint8_t window)
+    {
+        this->window = window ? window : 1;
+        acked = sent = 0;
+        retries = 0;
+        return FrameCodec::plan(bytes, budget, offsets);
+    }
+
+    uint16_t total() const { return offsets.size() - 1; }
+    uint16_t ackedCount() const { return acked; }
+    bool done() const { return acked >= total(); }
+
+    // next fragment the window allows; false when it is full or all are out
+    bool next(uint16_t &seq, size_t &offset, size_t &length)
+    {
+        if (sent >= total() || sent >= acked + window)
+            return false;
+        seq = sent++;
+        offset = offsets[seq];
+        length = offsets[seq + 1] - offsets[seq];
+        return true;
+    }
+
+    // true when the ack moved the window
+    bool ack(uint16_t value)
+    {
+        if (value <= acked || value > total())
+            return false;
+        acked = value;
+        if (sent < acked)
+            sent = acked;
+        retries = 0;
+        return true;
+    }
+
+    // go back to the first unacked fragment; false once retries ran out.
+    // `resent` is how many fragments will go out again.
+    bool timeout(uint16_t &resent)
+    {
+        resent = sent - acked;
+        if (++retries > FrameMaxRetries)
+            return false;
+        sent = acked;
+        return true;
+    }
+
+private:
+    std::vector<uint32_t> offsets;
+    uint16_t acked = 0;
+    uint16_t sent = 0;
+    uint8_t window = FrameDefaultWindow;
+    uint8_t retries = 0;
+};
+
+// Receiver side: bounded per-peer reassembly of incoming fragments. Not
+// locked; the owner serializes calls.
+class FrameReassembler {
+public:
+    struct Stats {
+        uint32_t reassembled = 0;
+        uint32_t drops = 0;
+    };
+
+    // Takes fragment `seq` of `total` of transfer `id` from `address`. False
+    // when the fragment was dropped. `ack` and `sendAck` say whether and
+    // what to acknowledge; `joined` is filled once the last part arrived.
+    bool accept(const std::string &address, uint16_t id, uint16_t seq, uint16_t total, const std::string &data,
+                uint8_t window, std::string &joined, uint16_t &ack, bool &sendAck)
+    {
+        sendAck = false;
+        auto done = lastCompleted.find(address);
+        if (done != lastCompleted.end() && done->second == id) {
+            // retransmit of a finished transfer: our final ack was lost
+            ack = total;
+            sendAck = true;
+            return true;
+        }
+
+        auto &transfers = incoming[address];
+        auto it = transfers.find(id);
+        if (it == transfers.end()) {
+            // checked before anything is sized after it
+            if (total == 0 || total > FrameMaxFragments || seq >= total) {
+                counters.drops++;
+                if (transfers.empty())
+                    incoming.erase(address);
+                return false;
+            }
+            if (transfers.size() >= FrameMaxTransfersPerPeer) {
+                // oldest unfinished transfer is abandoned
+                counters.drops++;
+                transfers.erase(transfers.begin());
+            }
+            Incoming in;
+            in.total = total;
+            in.window = window ? window : 1;
+            in.parts.resize(total);
+            in.present.resize(total, false);
+            it = transfers.emplace(id, std::move(in)).first;
+        }
+
+        auto &in = it->second;
+        if (seq >= in.total || total != in.total) {
+            counters.drops++;
+            return false;
+        }
+        if (!in.present[seq]) {
+            in.bytes += data.size();
+            if (in.bytes > FrameMaxReassemblyBytes) {
+                counters.drops++;
+                transfers.erase(it);
+                return false;
+            }
+            in.parts[seq] = data;
+            in.present[seq] = true;
+            in.received++;
+        }
+
+        uint16_t contiguous = 0;
+        while (contiguous < in.total && in.present[contiguous])
+            contiguous++;
+        ack = contiguous;
+        // also right after a retransmit closed a gap, so the sender does not
+        // wait out another timeout to learn about it
+        sendAck = contiguous == in.total || (seq + 1) % in.window == 0 || contiguous > seq + 1;
+
+        if (in.received == in.total) {
+            joined.reserve(in.bytes);
+            for (auto &part : in.parts)
+                joined += part;
+            transfers.erase(it);
+            lastCompleted[address] = id;
+            counters.reassembled++;
+        }
+        return true;
+    }
+
+    void forget(const std::string &address)
+    {
+        incoming.erase(address);
+        lastCompleted.erase(address);
+    }
+
+    size_t pending(const std::string &address) const
+    {
+        auto it = incoming.find(address);
+        return it == incoming.end() ? 0 : it->second.size();
+    }
+
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Incoming {
+        uint16_t total = 0;
+        uint16_t received = 0;
+        size_t bytes = 0;
+        uint8_t window = FrameDefaultWindow;
+        std::vector<std::string> parts;
+        std::vector<bool> present;
+    };
+
+    std::map<std::string, std::map<uint16_t, Incoming>> incoming;
+    std::map<std::string, uint16_t> lastCompleted;
+    Stats counters;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "BleLockAndKey.h"
+#include "Base64.h"
+#include "SessionCipher.h"
+
+// Wire capabilities announced by the client in HelloRequest
+#define CapKeyBase64 0x01
+// a registered session key is raw AES key bytes, as decryptMessageRSA
+// returns them
+#define SessionKeyBytes AES_KEYLEN
+
+// Per-device key material as seen by message handlers. The wire encodings
+// of the public key are built once when it is published.
+struct KeyEntry
+{
+    std::vector<uint8_t> publicKey;
+    std::string publicKeyHex;
+    std::string publicKeyB64;
+    uint8_t caps = 0;
+    std::string sessionKey;
+    // expanded once per session key, shared by all handlers
+    std::shared_ptr<const SessionCipher> cipher;
+    bool hasPublicKey = false;
+    bool hasSession = false;
+};
+
+using KeyTable = std::map<std::string, KeyEntry>;
+
+// Read-mostly key table. Readers take an immutable snapshot without locking,
+// writers copy the current table, modify the copy and publish it with a
+// compare-and-swap. Expensive crypto (RSA keygen/decrypt) must be done by
+// the caller before publishing, never inside update().
+class KeyStore {
+public:
+    using Snapshot = std::shared_ptr<const KeyTable>;
+
+    static KeyStore &instance()
+    {
+        static KeyStore store;
+        return store;
+    }
+
+    Snapshot snapshot() const
+    {
+        return std::atomic_load(&table);
+    }
+
+    uint32_t version() const { return tableVersion.load(); }
+
+    bool findPublicKey(const std::string &address, std::vector<uint8_t> &key) const
+    {
+        auto snap = snapshot();
+        auto it = snap->find(address);
+        if (it == snap->end() || !it->second.hasPublicKey)
+            return false;
+        key = it->second.publicKey;
+        return true;
+    }
+
+    // public key as it goes on the wire for this peer's capabilities
+    bool encodedPublicKey(const std::string &address, std::string &key, bool &isBase64) const
+    {
+        auto snap = snapshot();
+        auto it = snap->find(address);
+        if (it == snap->end() || !it->second.hasPublicKey)
+            return false;
+        isBase64 = it->second.caps & CapKeyBase64;
+        key = isBase64 ? it->second.publicKeyB64 : it->second.publicKeyHex;
+        return true;
+    }
+
+    uint8_t caps(const std::string &address) const
+    {
+        auto snap = snapshot();
+        auto it = snap->find(address);
+        return it == snap->end() ? 0 : it->second.caps;
+    }
+
+    void setCaps(const std::string &address, uint8_t caps)
+    {
+        if (this->caps(address) == caps && snapshot()->count(address))
+            return;
+        update([&](KeyTable &t) { t[address].caps = caps; });
+    }
+
+    bool hasPublicKey(const std::string &address) const
+    {
+        auto snap = snapshot();
+        auto it = snap->find(address);
+        return it != snap->end() && it->second.hasPublicKey;
+    }
+
+    bool hasSession(const std::string &address) const
+    {
+        auto snap = snapshot();
+        auto it = snap->find(address);
+        return it != snap->end() && it->second.hasSession;
+    }
+
+    void publishPublicKey(const std::string &address, const std::vector<uint8_t> &key)
+    {
+        std::string hex = SecureConnection::vector2hex(key);
+        std::string b64 = Base64::encode(key);
+        update([&](KeyTable &t) {
+            auto &entry = t[address];
+            entry.publicKey = key;
+            entry.publicKeyHex = hex;
+            entry.publicKeyB64 = b64;
+            entry.hasPublicKey = true;
+        });
+    }
+
+    void publishSessionKey(const std::string &address, const std::string &key)
+    {
+        auto cipher = std::make_shared<const SessionCipher>(key);
+        update([&](KeyTable &t) {
+            auto &entry = t[address];
+            entry.sessionKey = key;
+            entry.cipher = cipher->valid() ? cipher : nullptr;
+            entry.hasSession = true;
+        });
+    }
+
+    std::shared_ptr<const SessionCipher> sessionCipher(const std::string &address) const
+    {
+        auto snap = snapshot();
+        auto it = snap->find(address);
+        return it == snap->end() ? nullptr : it->second.cipher;
+    }
+
+    void dropSession(const std::string &address)
+    {
+        update([&](KeyTable &t) {
+            auto it = t.find(address);
+            if (it != t.end()) {
+                it->second.sessionKey.clear();
+                it->second.cipher.reset();
+                it->second.hasSession = false;
+            }
+        });
+    }
+
+    // SecureConnection keeps its own std::maps and is not thread-safe. Calls
+    // that can insert into them or do RSA work on them (generateRSAKeys,
+    // SaveRSAKeys, decryptMessageRSA) are serialized with this mutex now that
+    // several dispatcher workers run handlers. Key readers use snapshots and
+    // never take it.
+    class CryptoGuard {
+    public:
+        CryptoGuard() { xSemaphoreTake(instance().cryptoMutex, portMAX_DELAY); }
+        ~CryptoGuard() { xSemaphoreGive(instance().cryptoMutex); }
+    };
+
+    // Swap statistics: time spent in the publishing critical section.
+    uint32_t writes() const { return writeCount.load(); }
+    uint32_t retries() const { return retryCount.load(); }
+    uint32_t maxSwapMicros() const { return maxSwapUs.load(); }
+
+private:
+    KeyStore() : table(std::make_shared<const KeyTable>()), cryptoMutex(xSemaphoreCreateMutex()) {}
+
+    template<typename Mutator>
+    void update(Mutator mutate)
+    {
+        Snapshot expected = snapshot();
+        for (;;) {
+            auto next = std::make_shared<KeyTable>(*expected);
+            mutate(*next);
+            Snapshot desired(std::move(next));
+
+            uint32_t start = micros();
+            bool swapped = std::atomic_compare_exchange_strong(&table, &expected, desired);
+            uint32_t held = micros() - start;
+            if (held > maxSwapUs.load())
+                maxSwapUs.store(held);
+
+            if (swapped)
+                break;
+            retryCount++;
+        }
+        tableVersion++;
+        writeCount++;
+    }
+
+    Snapshot table;
+    SemaphoreHandle_t cryptoMutex;
+    std::atomic<uint32_t> tableVersion{0};
+    std::atomic<uint32_t> writeCount{0};
+    std::atomic<uint32_t> retryCount{0};
+    std::atomic<uint32_t> maxSwapUs{0};
+};
+
+#endif
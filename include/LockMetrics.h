@@ -0,0 +1,37 @@
+#ifndef LOCKMETRICS_H
+#define LOCKMETRICS_H
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <json.hpp>
+
+// Registry of metric sections. Each subsystem registers a provider that
+// fills its own json object; the HTTP /metrics handler collects them all.
+class LockMetrics {
+public:
+    using Provider = std::function<void(nlohmann::json &)>;
+
+    static void add(const char *section, Provider provider)
+    {
+        providers().emplace_back(section, std::move(provider));
+    }
+
+    static std::string toJson()
+    {
+        nlohmann::json doc = nlohmann::json::object();
+        for (auto &it : providers())
+            it.second(doc[it.first]);
+        return doc.dump();
+    }
+
+private:
+    static std::vector<std::pair<std::string, Provider>> &providers()
+    {
+        static std::vector<std::pair<std::string, Provider>> list;
+        return list;
+    }
+};
+
+#endif
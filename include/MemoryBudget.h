@@ -0,0 +1,349 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <json.hpp>
+#include <esp_heap_caps.h>
+#include "BleLockAndKey.h"
+
+// Attribute operator new/delete to allocation sites. Off by default: it
+// replaces the global allocator for every component linked in (NimBLE and
+// the Arduino core too, not only the app's MemScopes) and adds an 8 byte
+// header to each C++ allocation. Turn it on for a profiling build with
+// -DMemSiteTracking=1 (see platformio.ini); without it the site list of
+// the report stays empty and MemScope does nothing.
+#ifndef MemSiteTracking
+#define MemSiteTracking 0
+#endif
+
+// 1 makes a budget breach fatal: tick() prints the report and aborts, so a
+// soak test or host run fails instead of logging a line
+#ifndef MemBudgetFatal
+#define MemBudgetFatal 0
+#endif
+
+// site 0 collects allocations outside any MemScope, message type n is site
+// 1 + n, named sites follow
+#define MemMessageSites 32
+#define MemSiteSlots 40
+// tasks that can be inside a MemScope at the same time
+#define MemScopeTasks 8
+#define MemWatchedTasks 12
+#define MemSampleMs 1000
+
+// Budgets: a task is over budget once less than MemStackReserveBytes of its
+// stack was never touched, the heap once its largest free block drops under
+// MemHeapBlockBudget, a site once its live bytes peaked above MemSiteBudgetBytes.
+#define MemStackReserveBytes 512
+#define MemHeapBlockBudget 16384
+#define MemSiteBudgetBytes 32768
+
+// Memory accounting: stack high-water marks of the watched tasks, heap
+// headroom including the largest free block (what a big json reply really
+// needs), and per-site allocation counters. A MemScope marks the code
+// running on the current task as one site; every operator new in it is
+// counted against that site until the matching delete, wherever that runs.
+class MemoryBudget {
+public:
+    struct Site {
+        const char *name = nullptr;
+        std::atomic<uint32_t> allocs{0};
+        std::atomic<uint32_t> frees{0};
+        std::atomic<uint32_t> bytes{0};
+        std::atomic<int32_t> live{0};
+        std::atomic<int32_t> peak{0};
+    };
+
+    static MemoryBudget &instance()
+    {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    // stackBytes as passed to xTaskCreate, 0 when unknown
+    void watchTask(const char *name, TaskHandle_t handle, uint32_t stackBytes)
+    {
+        if (!handle)
+            return;
+        Guard guard(mutex);
+        for (size_t i = 0; i < taskCount; i++) {
+            if (tasks[i].handle == handle)
+                return;
+        }
+        if (taskCount < MemWatchedTasks)
+            tasks[taskCount++] = Task{name, handle, stackBytes, UINT32_MAX};
+    }
+
+    // named site, registered on first use; `name` must outlive the program
+    uint8_t site(const char *name)
+    {
+        Guard guard(mutex);
+        size_t i = 1 + MemMessageSites;
+        for (; i < MemSiteSlots && sites[i].name; i++) {
+            if (!strcmp(sites[i].name, name))
+                return i;
+        }
+        if (i == MemSiteSlots)
+            return 0;
+        sites[i].name = name;
+        return i;
+    }
+
+    static uint8_t messageSite(int type)
+    {
+        return type >= 0 && type < MemMessageSites ? 1 + type : 0;
+    }
+
+    void tick(uint32_t nowMs)
+    {
+        if (nowMs - lastSampleMs < MemSampleMs)
+            return;
+        lastSampleMs = nowMs;
+        sample();
+        bool ok = withinBudget();
+        if (!ok && !breachLogged)
+            logColor(LColor::Red, F("Memory budget exceeded, see /memory"));
+        breachLogged = !ok;
+#if MemBudgetFatal
+        if (!ok) {
+            nlohmann::json j;
+            report(j);
+            Serial.println(j.dump(2).c_str());
+            abort();
+        }
+#endif
+    }
+
+    // every watched stack, the heap's largest block and every app site
+    // within its budget
+    bool withinBudget()
+    {
+        if (minLargestBlock < MemHeapBlockBudget || worstStackFree() < MemStackReserveBytes)
+            return false;
+        for (size_t i = 1; i < MemSiteSlots; i++) {
+            if (sites[i].peak > MemSiteBudgetBytes)
+                return false;
+        }
+        return true;
+    }
+
+    // {"ok", "heap": {...}, "tasks": [...], "sites": [...], "budgets": {...}}
+    void report(nlohmann::json &j)
+    {
+        sample();
+        j["ok"] = withinBudget();
+        auto &heap = j["heap"];
+        heap["size"] = heap_caps_get_total_size(MALLOC_CAP_8BIT);
+        heap["free"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        heap["minFree"] = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+        heap["largestBlock"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        heap["minLargestBlock"] = minLargestBlock;
+        heap["ok"] = minLargestBlock >= MemHeapBlockBudget;
+
+        auto list = nlohmann::json::array();
+        {
+            Guard guard(mutex);
+            for (size_t i = 0; i < taskCount; i++) {
+                auto &t = tasks[i];
+                list.push_back({{"name", t.name}, {"stack", t.stackBytes}, {"minFree", t.minFree},
+                                {"ok", t.minFree >= MemStackReserveBytes}});
+            }
+        }
+        j["tasks"] = list;
+
+        list = nlohmann::json::array();
+        for (size_t i = 0; i < MemSiteSlots; i++) {
+            auto &s = sites[i];
+            if (!s.allocs)
+                continue;
+            std::string name = s.name ? s.name : i == 0 ? "other" : "msg" + std::to_string(i - 1);
+            list.push_back({{"name", name}, {"allocs", s.allocs.load()}, {"frees", s.frees.load()},
+                            {"bytes", s.bytes.load()}, {"live", s.live.load()}, {"peak", s.peak.load()},
+                            {"ok", i == 0 || s.peak <= MemSiteBudgetBytes}});
+        }
+        j["sites"] = list;
+        j["siteTracking"] = MemSiteTracking != 0;
+        j["budgets"] = {{"stackReserve", MemStackReserveBytes}, {"heapBlock", MemHeapBlockBudget},
+                        {"sitePeak", MemSiteBudgetBytes}};
+    }
+
+    // serial console: a line reading "mem" prints the report
+    void pollSerial()
+    {
+        while (Serial.available() > 0) {
+            int c = Serial.read();
+            if (c < 0)
+                break;
+            if (c != '\n' && c != '\r') {
+                if (lineLen < sizeof(line) - 1)
+                    line[lineLen++] = (char)c;
+                continue;
+            }
+            line[lineLen] = 0;
+            if (!strcmp(line, "mem")) {
+                nlohmann::json j;
+                report(j);
+                Serial.println(j.dump(2).c_str());
+            }
+            lineLen = 0;
+        }
+    }
+
+    size_t worstStackFree()
+    {
+        Guard guard(mutex);
+        uint32_t worst = UINT32_MAX;
+        for (size_t i = 0; i < taskCount; i++)
+            worst = std::min(worst, tasks[i].minFree);
+        return worst;
+    }
+
+    size_t lowestLargestBlock() const { return minLargestBlock; }
+
+    // operator new/delete go through these when MemSiteTracking is on
+    static void *allocate(size_t size)
+    {
+        auto h = static_cast<Header *>(malloc(sizeof(Header) + size));
+        if (!h)
+            return nullptr;
+        h->size = size;
+        h->site = instance().currentSite();
+        auto &s = instance().sites[h->site];
+        s.allocs++;
+        s.bytes += size;
+        int32_t live = s.live += size;
+        int32_t peak = s.peak;
+        while (live > peak && !s.peak.compare_exchange_weak(peak, live)) {
+        }
+        return h + 1;
+    }
+
+    static void release(void *p)
+    {
+        if (!p)
+            return;
+        auto h = static_cast<Header *>(p) - 1;
+        auto &s = instance().sites[h->site];
+        s.frees++;
+        s.live -= h->size;
+        free(h);
+    }
+
+private:
+    friend class MemScope;
+
+    struct Task {
+        const char *name;
+        TaskHandle_t handle;
+        uint32_t stackBytes;
+        uint32_t minFree;
+    };
+    // keeps the 8 byte alignment malloc gives
+    struct Header {
+        uint32_t size;
+        uint8_t site;
+        uint8_t pad[3];
+    };
+    struct Scope {
+        std::atomic<TaskHandle_t> task{nullptr};
+        uint8_t site = 0;
+    };
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    MemoryBudget() : mutex(xSemaphoreCreateMutex()) {}
+
+    void sample()
+    {
+        size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        if (largest < minLargestBlock)
+            minLargestBlock = largest;
+        Guard guard(mutex);
+        for (size_t i = 0; i < taskCount; i++) {
+            // ESP-IDF counts stack in bytes
+            uint32_t free = uxTaskGetStackHighWaterMark(tasks[i].handle);
+            if (free < tasks[i].minFree)
+                tasks[i].minFree = free;
+        }
+    }
+
+    uint8_t currentSite()
+    {
+        TaskHandle_t current = xTaskGetCurrentTaskHandle();
+        if (!current)
+            return 0;
+        for (auto &scope : scopes) {
+            if (scope.task.load(std::memory_order_relaxed) == current)
+                return scope.site;
+        }
+        return 0;
+    }
+
+    SemaphoreHandle_t mutex;
+    Task tasks[MemWatchedTasks];
+    size_t taskCount = 0;
+    Site sites[MemSiteSlots];
+    Scope scopes[MemScopeTasks];
+    size_t minLargestBlock = SIZE_MAX;
+    uint32_t lastSampleMs = 0;
+    bool breachLogged = false;
+    char line[16];
+    size_t lineLen = 0;
+};
+
+// Counts allocations made by the current task against `site` while alive.
+// Scopes nest; the inner one wins.
+class MemScope {
+public:
+    explicit MemScope(uint8_t site)
+    {
+        if (!MemSiteTracking)
+            return;
+        TaskHandle_t current = xTaskGetCurrentTaskHandle();
+        for (auto &s : MemoryBudget::instance().scopes) {
+            if (s.task.load() == current) {
+                scope = &s;
+                previous = s.site;
+                s.site = site;
+                return;
+            }
+        }
+        for (auto &s : MemoryBudget::instance().scopes) {
+            // only the owning task reads its slot, so the site can follow the claim
+            TaskHandle_t none = nullptr;
+            if (s.task.compare_exchange_strong(none, current)) {
+                s.site = site;
+                scope = &s;
+                return;
+            }
+        }
+    }
+
+    ~MemScope()
+    {
+        if (!scope)
+            return;
+        if (previous == NoSite)
+            scope->task.store(nullptr);
+        else
+            scope->site = previous;
+    }
+
+    MemScope(const MemScope &) = delete;
+    MemScope &operator=(const MemScope &) = delete;
+
+private:
+    static const uint16_t NoSite = 0xffff;
+
+    MemoryBudget::Scope *scope = nullptr;
+    uint16_t previous = NoSite;
+};
+
+#endif
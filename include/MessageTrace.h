@@ -0,0 +1,235 @@
+#ifndef MESSAGETRACE_H
+#define MESSAGETRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <json.hpp>
+
+#define TraceDefaultRecords 1024
+#define TraceMaxRecords 4096
+// records copied out per lock while a trace is read
+#define TraceReadChunk 64
+#define TraceMagic 0x4352544d   // "MTRC"
+#define TraceVersion 2
+// flags of a record that was overwritten, or cleared by a restart, while
+// the download was on its way; the other fields are zero
+#define TraceFlagLost 0x80
+
+// One dispatched message, 16 bytes. Times are the low 32 bits of micros();
+// flags hold the dispatch class in bits 0-1 and the outcome in bits 2-3,
+// or are TraceFlagLost.
+struct TraceRecord {
+    uint32_t enqueuedUs;
+    uint32_t waitUs;
+    uint32_t handleUs;
+    uint16_t bytes;     // serialized request size, 0 when unknown, 0xffff and up saturated
+    uint8_t type;
+    uint8_t flags;
+};
+
+// Download header, followed by exactly `count` TraceRecords oldest first.
+// All fields little-endian.
+struct TraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t count;
+    uint32_t firstSeq;  // sequence number of the first record sent
+    uint32_t lost;      // records overwritten before this download
+    uint32_t capacity;
+};
+
+// Capture ring for dispatched messages. Off by default: record() is a
+// single relaxed load until start() allocates the ring. stop() keeps the
+// records for download, clear() frees them. When full the oldest record is
+// overwritten and counted as lost.
+class MessageTrace {
+public:
+    struct TypeSummary {
+        uint32_t count = 0;
+        uint32_t refused = 0;
+        uint32_t dropped = 0;
+        uint64_t totalWaitUs = 0;
+        uint64_t totalHandleUs = 0;
+        uint32_t maxWaitUs = 0;
+        uint32_t maxHandleUs = 0;
+        uint64_t totalBytes = 0;
+        std::vector<uint32_t> handleUs;
+    };
+
+    void start(size_t records)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        records = records ? std::min<size_t>(records, TraceMaxRecords) : TraceDefaultRecords;
+        ring.clear();
+        ring.shrink_to_fit();
+        ring.resize(records);
+        nextSeq = 0;
+        epoch++;
+        active.store(true, std::memory_order_relaxed);
+    }
+
+    void stop()
+    {
+        active.store(false, std::memory_order_relaxed);
+    }
+
+    // drops a stopped capture's memory
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        active.store(false, std::memory_order_relaxed);
+        std::vector<TraceRecord>().swap(ring);
+        nextSeq = 0;
+        epoch++;
+    }
+
+    void record(uint8_t type, uint8_t cls, uint8_t outcome, uint32_t enqueuedUs, uint32_t startUs, uint32_t endUs, size_t bytes)
+    {
+        if (!active.load(std::memory_order_relaxed))
+            return;
+        TraceRecord rec;
+        rec.enqueuedUs = enqueuedUs;
+        rec.waitUs = startUs - enqueuedUs;
+        rec.handleUs = endUs - startUs;
+        rec.bytes = bytes > 0xffff ? 0xffff : bytes;
+        rec.type = type;
+        rec.flags = (cls & 0x03) | (outcome & 0x03) << 2;
+        std::lock_guard<std::mutex> guard(mutex);
+        if (ring.empty())
+            return;
+        ring[nextSeq % ring.size()] = rec;
+        nextSeq++;
+    }
+
+    // up to `max` records from sequence `seq` on; seq is moved up to the
+    // oldest record still held
+    size_t read(uint32_t &seq, TraceRecord *out, size_t max)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        uint32_t oldest = nextSeq > ring.size() ? nextSeq - ring.size() : 0;
+        if (seq < oldest)
+            seq = oldest;
+        size_t n = 0;
+        for (; n < max && seq + n < nextSeq; n++)
+            out[n] = ring[(seq + n) % ring.size()];
+        return n;
+    }
+
+    // Exactly `n` records from sequence `seq` of the capture `captureEpoch`
+    // (from header()). Records no longer held come back as TraceFlagLost
+    // fillers, so a download announced with header().count never runs
+    // short however far capture gets meanwhile. Returns the fillers.
+    size_t readExact(uint32_t captureEpoch, uint32_t seq, TraceRecord *out, size_t n)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        uint32_t oldest = nextSeq > ring.size() ? nextSeq - ring.size() : 0;
+        size_t lost = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t s = seq + i;
+            if (captureEpoch != epoch || s < oldest || s >= nextSeq) {
+                out[i] = TraceRecord{};
+                out[i].flags = TraceFlagLost;
+                lost++;
+            } else {
+                out[i] = ring[s % ring.size()];
+            }
+        }
+        return lost;
+    }
+
+    TraceHeader header(uint32_t *captureEpoch = nullptr)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (captureEpoch)
+            *captureEpoch = epoch;
+        TraceHeader h;
+        h.magic = TraceMagic;
+        h.version = TraceVersion;
+        h.recordSize = sizeof(TraceRecord);
+        h.capacity = ring.size();
+        h.count = std::min<uint32_t>(nextSeq, ring.size());
+        h.firstSeq = nextSeq - h.count;
+        h.lost = h.firstSeq;
+        return h;
+    }
+
+    // Per-type latency over everything held:
+    // {"<type>": {"count", "refused", "dropped", "avgWaitUs", "maxWaitUs",
+    //             "avgHandleUs", "p95HandleUs", "maxHandleUs", "avgBytes"}}
+    void summary(nlohmann::json &j)
+    {
+        std::map<uint8_t, TypeSummary> types;
+        TraceRecord chunk[TraceReadChunk];
+        uint32_t seq = 0;
+        size_t n;
+        while ((n = read(seq, chunk, TraceReadChunk)) > 0) {
+            for (size_t i = 0; i < n; i++)
+                add(types[chunk[i].type], chunk[i]);
+            seq += n;
+        }
+        j = nlohmann::json::object();
+        for (auto &it : types)
+            j[std::to_string(it.first)] = toJson(it.second);
+    }
+
+    bool isActive() const { return active.load(std::memory_order_relaxed); }
+    size_t capacity() const { return ring.size(); }
+    uint32_t recorded() const { return nextSeq; }
+
+    static void add(TypeSummary &sum, const TraceRecord &rec)
+    {
+        if (rec.flags & TraceFlagLost)
+            return;
+        uint8_t outcome = (rec.flags >> 2) & 0x03;
+        // 2 and 3: refused by admission, dropped on a full queue
+        if (outcome == 2) {
+            sum.refused++;
+            return;
+        }
+        if (outcome == 3) {
+            sum.dropped++;
+            return;
+        }
+        sum.count++;
+        sum.totalWaitUs += rec.waitUs;
+        sum.totalHandleUs += rec.handleUs;
+        sum.totalBytes += rec.bytes;
+        sum.maxWaitUs = std::max(sum.maxWaitUs, rec.waitUs);
+        sum.maxHandleUs = std::max(sum.maxHandleUs, rec.handleUs);
+        sum.handleUs.push_back(rec.handleUs);
+    }
+
+    static nlohmann::json toJson(TypeSummary &sum)
+    {
+        nlohmann::json j;
+        j["count"] = sum.count;
+        j["refused"] = sum.refused;
+        j["dropped"] = sum.dropped;
+        if (!sum.count)
+            return j;
+        auto p95 = sum.handleUs.begin() + (sum.handleUs.size() - 1) * 95 / 100;
+        std::nth_element(sum.handleUs.begin(), p95, sum.handleUs.end());
+        j["avgWaitUs"] = sum.totalWaitUs / sum.count;
+        j["maxWaitUs"] = sum.maxWaitUs;
+        j["avgHandleUs"] = sum.totalHandleUs / sum.count;
+        j["p95HandleUs"] = *p95;
+        j["maxHandleUs"] = sum.maxHandleUs;
+        j["avgBytes"] = sum.totalBytes / sum.count;
+        return j;
+    }
+
+private:
+    std::mutex mutex;
+    std::atomic<bool> active{false};
+    std::vector<TraceRecord> ring;
+    uint32_t nextSeq = 0;
+    // bumped by start() and clear(), whose sequence numbers start over
+    uint32_t epoch = 0;
+};
+
+#endif
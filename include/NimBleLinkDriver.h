@@ -0,0 +1,31 @@
+#ifndef NIMBLELINKDRIVER_H
+#define NIMBLELINKDRIVER_H
+
+#include <NimBLEDevice.h>
+#include "ConnPolicy.h"
+
+// LinkDriver on the NimBLE server: lists the server's connections and asks
+// the central for new parameters on one of them
+class NimBleLinkDriver : public LinkDriver {
+public:
+    void connected(std::vector<LinkPeer> &peers) override
+    {
+        peers.clear();
+        NimBLEServer *server = NimBLEDevice::getServer();
+        if (!server)
+            return;
+        for (uint16_t handle : server->getPeerDevices())
+            peers.push_back(LinkPeer{handle, server->getPeerIDInfo(handle).getAddress().toString()});
+    }
+
+    bool update(uint16_t handle, const ConnParams &params) override
+    {
+        NimBLEServer *server = NimBLEDevice::getServer();
+        if (!server)
+            return false;
+        server->updateConnParams(handle, params.minInterval, params.maxInterval, params.latency, params.timeout);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef NVSSETTINGSBACKEND_H
+#define NVSSETTINGSBACKEND_H
+
+#include <nvs.h>
+#include <nvs_flash.h>
+#include "SettingsStore.h"
+
+// SettingsBackend on the raw NVS API. Every nvs_set_* writes the entry to
+// flash right away (nvs_commit adds little), so what saves flash wear is
+// how rarely write() is called: SettingsStore batches puts in RAM and only
+// writes a changed key at flush(), where Preferences sets on every put.
+// Types match what Preferences uses, so existing keys still read.
+class NvsSettingsBackend : public SettingsBackend {
+public:
+    ~NvsSettingsBackend() override
+    {
+        if (opened)
+            nvs_close(handle);
+    }
+
+    bool open(const char *ns) override
+    {
+        if (opened)
+            return true;
+        if (nvs_open(ns, NVS_READWRITE, &handle) != ESP_OK) {
+            nvs_flash_init();
+            if (nvs_open(ns, NVS_READWRITE, &handle) != ESP_OK)
+                return false;
+        }
+        opened = true;
+        return true;
+    }
+
+    bool read(const std::string &key, SettingType type, std::string &value) override
+    {
+        if (!opened)
+            return false;
+        switch (type) {
+            case SettingType::Str: {
+                size_t len = 0;
+                if (nvs_get_str(handle, key.c_str(), nullptr, &len) != ESP_OK || len == 0)
+                    return false;
+                value.resize(len);
+                if (nvs_get_str(handle, key.c_str(), &value[0], &len) != ESP_OK)
+                    return false;
+                value.resize(len - 1);
+                return true;
+            }
+            case SettingType::Blob: {
+                size_t len = 0;
+                if (nvs_get_blob(handle, key.c_str(), nullptr, &len) != ESP_OK)
+                    return false;
+                value.resize(len);
+                return nvs_get_blob(handle, key.c_str(), &value[0], &len) == ESP_OK;
+            }
+            case SettingType::I32: {
+                int32_t v;
+                if (nvs_get_i32(handle, key.c_str(), &v) != ESP_OK)
+                    return false;
+                value.assign((const char *)&v, sizeof(v));
+                return true;
+            }
+            case SettingType::U32: {
+                uint32_t v;
+                if (nvs_get_u32(handle, key.c_str(), &v) != ESP_OK)
+                    return false;
+                value.assign((const char *)&v, sizeof(v));
+                return true;
+            }
+            case SettingType::U8: {
+                uint8_t v;
+                if (nvs_get_u8(handle, key.c_str(), &v) != ESP_OK)
+                    return false;
+                value.assign((const char *)&v, sizeof(v));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool write(const std::string &key, SettingType type, const std::string &value) override
+    {
+        if (!opened)
+            return false;
+        switch (type) {
+            case SettingType::Str:
+                return nvs_set_str(handle, key.c_str(), value.c_str()) == ESP_OK;
+            case SettingType::Blob:
+                return nvs_set_blob(handle, key.c_str(), value.data(), value.size()) == ESP_OK;
+            case SettingType::I32: {
+                int32_t v;
+                memcpy(&v, value.data(), sizeof(v));
+                return nvs_set_i32(handle, key.c_str(), v) == ESP_OK;
+            }
+            case SettingType::U32: {
+                uint32_t v;
+                memcpy(&v, value.data(), sizeof(v));
+                return nvs_set_u32(handle, key.c_str(), v) == ESP_OK;
+            }
+            case SettingType::U8:
+                return nvs_set_u8(handle, key.c_str(), (uint8_t)value[0]) == ESP_OK;
+        }
+        return false;
+    }
+
+    bool erase(const std::string &key) override
+    {
+        return opened && nvs_erase_key(handle, key.c_str()) == ESP_OK;
+    }
+
+    bool commit() override
+    {
+        return opened && nvs_commit(handle) == ESP_OK;
+    }
+
+private:
+    nvs_handle_t handle = 0;
+    bool opened = false;
+};
+
+#endif
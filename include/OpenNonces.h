@@ -0,0 +1,129 @@
+#ifndef OPENNONCES_H
+#define OPENNONCES_H
+
+#include <Arduino.h>
+#include <string>
+#include <unordered_map>
+
+#define OpenNonceTtlMs 30000
+#define OpenNonceEntries 16
+// recently consumed nonces kept to tell a replay from an unknown nonce
+#define OpenNonceSpent 32
+
+// Single-use open challenges handed to a phone ahead of time. The phone
+// answers one with its AES proof inside OpenRequest, which saves the
+// SecurityCheck/OpenCommand round trip. One live nonce per address.
+class OpenNonces {
+public:
+    enum class Result {
+        Valid,
+        Unknown,
+        Expired,
+        Replayed
+    };
+
+    struct Stats {
+        uint32_t issued = 0;
+        uint32_t used = 0;
+        uint32_t expired = 0;
+        uint32_t unknown = 0;
+        uint32_t replayed = 0;
+        uint32_t evicted = 0;
+    };
+
+    static OpenNonces &instance()
+    {
+        static OpenNonces nonces;
+        return nonces;
+    }
+
+    // `proof` is the expected answer when it could be computed up front
+    void issue(const std::string &address, const std::string &nonce, const std::string &proof, unsigned long nowMs)
+    {
+        Guard guard(mutex);
+        if (live.find(address) == live.end() && live.size() >= OpenNonceEntries)
+            evictOldest();
+        live[address] = Entry{nonce, proof, nowMs};
+        counters.issued++;
+    }
+
+    // The nonce is gone after this call whatever the outcome
+    Result consume(const std::string &address, const std::string &nonce, unsigned long nowMs, std::string *proof = nullptr)
+    {
+        Guard guard(mutex);
+        auto it = live.find(address);
+        if (it == live.end() || it->second.nonce != nonce) {
+            if (isSpent(nonce)) {
+                counters.replayed++;
+                return Result::Replayed;
+            }
+            counters.unknown++;
+            return Result::Unknown;
+        }
+        bool stale = nowMs - it->second.issuedMs > OpenNonceTtlMs;
+        if (proof)
+            *proof = it->second.proof;
+        live.erase(it);
+        spent[spentHead] = nonce;
+        spentHead = (spentHead + 1) % OpenNonceSpent;
+        if (stale) {
+            counters.expired++;
+            return Result::Expired;
+        }
+        counters.used++;
+        return Result::Valid;
+    }
+
+    void drop(const std::string &address)
+    {
+        Guard guard(mutex);
+        live.erase(address);
+    }
+
+    size_t size() const { return live.size(); }
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Entry {
+        std::string nonce;
+        std::string proof;
+        unsigned long issuedMs;
+    };
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    OpenNonces() : mutex(xSemaphoreCreateMutex()) {}
+
+    bool isSpent(const std::string &nonce) const
+    {
+        for (auto &s : spent) {
+            if (!s.empty() && s == nonce)
+                return true;
+        }
+        return false;
+    }
+
+    void evictOldest()
+    {
+        auto oldest = live.begin();
+        for (auto it = live.begin(); it != live.end(); ++it) {
+            if (it->second.issuedMs < oldest->second.issuedMs)
+                oldest = it;
+        }
+        if (oldest != live.end()) {
+            live.erase(oldest);
+            counters.evicted++;
+        }
+    }
+
+    SemaphoreHandle_t mutex;
+    std::unordered_map<std::string, Entry> live;
+    std::string spent[OpenNonceSpent];
+    size_t spentHead = 0;
+    Stats counters;
+};
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef OTAUPDATE_H
+#define OTAUPDATE_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <json.hpp>
+#include "SettingsStore.h"
+
+#define OtaSectorBytes 4096
+// progress is persisted every this many bytes (a multiple of the sector)
+#define OtaCheckpointBytes 65536
+// time left for the last reply to go out before rebooting into the image
+#define OtaRebootDelayMs 2000
+
+// The inactive app slot. Offsets are relative to the partition; erase works
+// on whole sectors.
+class OtaPartition {
+public:
+    virtual ~OtaPartition() = default;
+    virtual bool open() = 0;
+    virtual size_t size() = 0;
+    virtual bool erase(size_t offset, size_t len) = 0;
+    virtual bool write(size_t offset, const uint8_t *data, size_t len) = 0;
+    virtual bool read(size_t offset, uint8_t *data, size_t len) = 0;
+    // make the written image the one to boot next
+    virtual bool activate() = 0;
+};
+
+// Incremental SHA-256
+class OtaHash {
+public:
+    virtual ~OtaHash() = default;
+    virtual void reset() = 0;
+    virtual void update(const uint8_t *data, size_t len) = 0;
+    virtual std::string hex() = 0;
+};
+
+// Checks the publisher's signature over an image's SHA-256 digest
+class OtaSignature {
+public:
+    virtual ~OtaSignature() = default;
+    virtual bool verify(const uint8_t digest[32], const std::vector<uint8_t> &signature) = 0;
+};
+
+// Streams an image into the inactive partition in order, without holding
+// more than one chunk. The next expected offset is the acknowledgement: a
+// client that lost its link asks for it (begin() again with the same hash)
+// and carries on from there. Resent chunks below it are ignored. Progress
+// is checkpointed on sector boundaries, so after a reboot the written part
+// is re-hashed from flash and the transfer resumes from the checkpoint.
+// The last chunk triggers the hash check and the boot partition switch.
+//
+// With a verifier installed, begin() only accepts a digest the publisher
+// signed; the hash check at the end then binds the whole image to it.
+class OtaUpdater {
+public:
+    enum class State : uint8_t {
+        Idle,
+        Receiving,
+        Done,
+        Failed
+    };
+
+    enum class Result : uint8_t {
+        Ok,
+        NotStarted,
+        BadRequest,
+        TooLarge,
+        BadOffset,
+        WriteError,
+        HashMismatch,
+        ActivateError,
+        BadSignature
+    };
+
+    struct Stats {
+        uint32_t sessions = 0;
+        uint32_t resumed = 0;
+        uint32_t chunks = 0;
+        uint32_t duplicates = 0;
+        uint32_t bytes = 0;
+        uint32_t rehashedBytes = 0;
+        uint32_t erases = 0;
+        uint32_t checkpoints = 0;
+        uint32_t failures = 0;
+        uint32_t badSignatures = 0;
+    };
+
+    OtaUpdater(OtaPartition &partition, OtaHash &hash, SettingsStore &settings)
+        : partition(partition), hash(hash), settings(settings), mutex(xSemaphoreCreateMutex()) {}
+
+    // From now on only signed images are taken
+    void requireSignature(OtaSignature &verifier) { signature = &verifier; }
+    bool signatureRequired() const { return signature != nullptr; }
+
+    // `sha256` is the hex digest of the whole image, `sig` the publisher's
+    // signature over it (ignored without a verifier). offset is where the
+    // client has to continue from.
+    Result begin(uint32_t total, const std::string &sha256, const std::vector<uint8_t> &sig, uint32_t &offset)
+    {
+        Guard guard(mutex);
+        std::string image = lower(sha256);
+        offset = 0;
+        uint8_t digest[32];
+        if (!fromHex(image, digest))
+            return Result::BadRequest;
+        if (signature && !signature->verify(digest, sig)) {
+            counters.badSignatures++;
+            return Result::BadSignature;
+        }
+        if (!partition.open())
+            return fail(Result::WriteError);
+        if (!total || total > partition.size())
+            return Result::TooLarge;
+
+        if (image == expected && total == size) {
+            if (state == State::Done) {
+                offset = size;
+                return Result::Ok;
+            }
+            if (state == State::Receiving) {
+                offset = acked;
+                counters.resumed++;
+                return Result::Ok;
+            }
+        }
+
+        expected = image;
+        size = total;
+        acked = 0;
+        erasedTo = 0;
+        hash.reset();
+        counters.sessions++;
+        if (settings.getString("image") == image && settings.getUInt("total") == total) {
+            uint32_t checkpoint = settings.getUInt("acked");
+            if (checkpoint && checkpoint < total && rehash(checkpoint)) {
+                acked = checkpoint;
+                // sectors from here on may hold bytes written after the checkpoint
+                erasedTo = checkpoint;
+                counters.resumed++;
+            } else {
+                hash.reset();
+            }
+        }
+        settings.putString("image", expected);
+        settings.putUInt("total", size);
+        settings.putUInt("acked", acked);
+        settings.flush();
+        state = State::Receiving;
+        offset = acked;
+        return Result::Ok;
+    }
+
+    // `next` is the next expected offset after this call, whatever the result
+    Result write(uint32_t offset, const uint8_t *data, size_t len, uint32_t nowMs, uint32_t &next)
+    {
+        Guard guard(mutex);
+        next = acked;
+        if (state != State::Receiving)
+            return Result::NotStarted;
+        if (offset > acked)
+            return Result::BadOffset;
+        if (offset + len <= acked) {
+            counters.duplicates++;
+            return Result::Ok;
+        }
+        // a resend that overlaps the acknowledged part
+        size_t skip = acked - offset;
+        data += skip;
+        len -= skip;
+        if (acked + len > size)
+            return Result::TooLarge;
+
+        while (erasedTo < acked + len) {
+            if (!partition.erase(erasedTo, OtaSectorBytes))
+                return error = Result::WriteError;
+            erasedTo += OtaSectorBytes;
+            counters.erases++;
+        }
+        // the client may retry the same chunk after a write error
+        if (!partition.write(acked, data, len))
+            return error = Result::WriteError;
+        hash.update(data, len);
+        uint32_t before = acked;
+        acked += len;
+        next = acked;
+        counters.chunks++;
+        counters.bytes += len;
+
+        if (acked == size)
+            return finish(nowMs);
+        if (acked / OtaCheckpointBytes != before / OtaCheckpointBytes) {
+            settings.putUInt("acked", acked - acked % OtaCheckpointBytes);
+            settings.flush();
+            counters.checkpoints++;
+        }
+        return Result::Ok;
+    }
+
+    void abort()
+    {
+        Guard guard(mutex);
+        state = State::Idle;
+        clearCheckpoint();
+    }
+
+    // the new image is active and the reply announcing it had time to go out
+    bool rebootDue(uint32_t nowMs)
+    {
+        Guard guard(mutex);
+        return state == State::Done && nowMs - doneMs >= OtaRebootDelayMs;
+    }
+
+    // {"state", "offset", "total", "result"}: what both the HTTP and BLE
+    // replies carry, `result` being the outcome of the call answered
+    void toJson(nlohmann::json &j, Result result)
+    {
+        Guard guard(mutex);
+        j["state"] = name(state);
+        j["offset"] = acked;
+        j["total"] = size;
+        j["result"] = name(result);
+    }
+
+    State getState() const { return state; }
+    uint32_t offset() const { return acked; }
+    uint32_t total() const { return size; }
+    Result lastError() const { return error; }
+    const Stats &stats() const { return counters; }
+
+    static const char *name(Result result)
+    {
+        static const char *names[] = {"ok", "notStarted", "badRequest", "tooLarge", "badOffset",
+                                      "writeError", "hashMismatch", "activateError", "badSignature"};
+        return names[(int)result];
+    }
+
+    static const char *name(State st)
+    {
+        static const char *names[] = {"idle", "receiving", "done", "failed"};
+        return names[(int)st];
+    }
+
+private:
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    Result finish(uint32_t nowMs)
+    {
+        clearCheckpoint();
+        if (hash.hex() != expected)
+            return fail(Result::HashMismatch);
+        if (!partition.activate())
+            return fail(Result::ActivateError);
+        state = State::Done;
+        doneMs = nowMs;
+        return Result::Ok;
+    }
+
+    Result fail(Result result)
+    {
+        state = State::Failed;
+        error = result;
+        counters.failures++;
+        return result;
+    }
+
+    bool rehash(uint32_t len)
+    {
+        uint8_t buf[256];
+        for (uint32_t pos = 0; pos < len;) {
+            size_t n = len - pos < sizeof(buf) ? len - pos : sizeof(buf);
+            if (!partition.read(pos, buf, n))
+                return false;
+            hash.update(buf, n);
+            pos += n;
+        }
+        counters.rehashedBytes += len;
+        return true;
+    }
+
+    void clearCheckpoint()
+    {
+        settings.remove("image");
+        settings.remove("total");
+        settings.remove("acked");
+        settings.flush();
+    }
+
+    static bool fromHex(const std::string &hex, uint8_t out[32])
+    {
+        if (hex.size() != 64)
+            return false;
+        for (size_t i = 0; i < 64; i++) {
+            char c = hex[i];
+            uint8_t v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : 0xff;
+            if (v == 0xff)
+                return false;
+            out[i / 2] = i % 2 ? out[i / 2] | v : v << 4;
+        }
+        return true;
+    }
+
+    static std::string lower(std::string s)
+    {
+        for (auto &c : s)
+            c = (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+        return s;
+    }
+
+    OtaPartition &partition;
+    OtaHash &hash;
+    SettingsStore &settings;
+    SemaphoreHandle_t mutex;
+    OtaSignature *signature = nullptr;
+    State state = State::Idle;
+    Result error = Result::Ok;
+    std::string expected;
+    uint32_t size = 0;
+    uint32_t acked = 0;
+    uint32_t erasedTo = 0;
+    uint32_t doneMs = 0;
+    Stats counters;
+};
+
+#endif
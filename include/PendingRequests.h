@@ -0,0 +1,213 @@
+#ifndef PENDINGREQUESTS_H
+#define PENDINGREQUESTS_H
+
+#include <Arduino.h>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "MessageBase.h"
+
+#define PendingTickMs 100
+#define PendingWheelSlots 64
+#define PendingDefaultTimeoutMs 10000
+
+// Outstanding server-initiated requests, keyed by requestUUID.
+// Entries live in a hashed timer wheel: insert, complete and expire are O(1),
+// tick() advances one slot per PendingTickMs. An expired entry hands its
+// payload to the optional expire handler; a cancelled one (the peer is gone)
+// just releases it.
+class PendingRequests {
+public:
+    using ExpireHandler = std::function<void(const std::string &uuid, std::unique_ptr<MessageBase> payload)>;
+
+    static PendingRequests &instance()
+    {
+        static PendingRequests table;
+        return table;
+    }
+
+    void setTimeout(MessageType type, uint32_t ms) { timeouts[type] = ms; }
+
+    uint32_t timeoutFor(MessageType type) const
+    {
+        auto it = timeouts.find(type);
+        return it == timeouts.end() ? PendingDefaultTimeoutMs : it->second;
+    }
+
+    bool add(const std::string &uuid, const std::string &address, MessageType type,
+             std::unique_ptr<MessageBase> payload = nullptr, ExpireHandler onExpire = nullptr)
+    {
+        uint32_t ticks = (timeoutFor(type) + PendingTickMs - 1) / PendingTickMs;
+        if (ticks == 0)
+            ticks = 1;
+
+        Guard guard(mutex);
+        if (index.count(uuid))
+            return false;
+        size_t slot = (cursor + ticks) % PendingWheelSlots;
+        auto &bucket = wheel[slot];
+        bucket.push_front(Entry{uuid, address, type, (ticks - 1) / PendingWheelSlots,
+                                std::move(payload), std::move(onExpire)});
+        index[uuid] = Location{slot, bucket.begin()};
+        return true;
+    }
+
+    // Request answered: drop the entry and hand its payload back to the caller
+    std::unique_ptr<MessageBase> complete(const std::string &uuid)
+    {
+        Guard guard(mutex);
+        auto it = index.find(uuid);
+        if (it == index.end())
+            return nullptr;
+        auto payload = std::move(it->second.entry->payload);
+        wheel[it->second.slot].erase(it->second.entry);
+        index.erase(it);
+        completedCount++;
+        return payload;
+    }
+
+    // Same, for an answer that claims to come from `address`: only the peer
+    // the request went to can complete it
+    std::unique_ptr<MessageBase> complete(const std::string &uuid, const std::string &address)
+    {
+        Guard guard(mutex);
+        auto it = index.find(uuid);
+        if (it == index.end())
+            return nullptr;
+        if (it->second.entry->address != address) {
+            mismatchCount++;
+            return nullptr;
+        }
+        auto payload = std::move(it->second.entry->payload);
+        wheel[it->second.slot].erase(it->second.entry);
+        index.erase(it);
+        completedCount++;
+        return payload;
+    }
+
+    // Caller observed the timeout itself (e.g. lock->request returned nullptr)
+    bool expire(const std::string &uuid)
+    {
+        Entry entry;
+        {
+            Guard guard(mutex);
+            auto it = index.find(uuid);
+            if (it == index.end())
+                return false;
+            entry = std::move(*it->second.entry);
+            wheel[it->second.slot].erase(it->second.entry);
+            index.erase(it);
+            timeoutCount++;
+        }
+        if (entry.onExpire)
+            entry.onExpire(entry.uuid, std::move(entry.payload));
+        return true;
+    }
+
+    // Connection to address is gone: release everything it was waiting on
+    size_t cancelAddress(const std::string &address)
+    {
+        std::list<Entry> dropped;
+        {
+            Guard guard(mutex);
+            for (auto &bucket : wheel) {
+                for (auto it = bucket.begin(); it != bucket.end();) {
+                    auto next = std::next(it);
+                    if (it->address == address) {
+                        index.erase(it->uuid);
+                        dropped.splice(dropped.end(), bucket, it);
+                    }
+                    it = next;
+                }
+            }
+            cancelledCount += dropped.size();
+        }
+        return dropped.size();
+    }
+
+    void tick(unsigned long nowMs)
+    {
+        if (lastTickMs == 0)
+            lastTickMs = nowMs;
+        while (nowMs - lastTickMs >= PendingTickMs) {
+            lastTickMs += PendingTickMs;
+            advance();
+        }
+    }
+
+    size_t outstanding()
+    {
+        Guard guard(mutex);
+        return index.size();
+    }
+
+    uint32_t timeoutsTotal() const { return timeoutCount; }
+    uint32_t completedTotal() const { return completedCount; }
+    uint32_t cancelledTotal() const { return cancelledCount; }
+    uint32_t mismatchedTotal() const { return mismatchCount; }
+
+private:
+    struct Entry {
+        std::string uuid;
+        std::string address;
+        MessageType type{};
+        uint32_t rounds = 0;
+        std::unique_ptr<MessageBase> payload;
+        ExpireHandler onExpire;
+    };
+    struct Location {
+        size_t slot;
+        std::list<Entry>::iterator entry;
+    };
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    PendingRequests() : mutex(xSemaphoreCreateMutex()) {}
+
+    void advance()
+    {
+        std::list<Entry> expired;
+        {
+            Guard guard(mutex);
+            cursor = (cursor + 1) % PendingWheelSlots;
+            auto &bucket = wheel[cursor];
+            for (auto it = bucket.begin(); it != bucket.end();) {
+                auto next = std::next(it);
+                if (it->rounds == 0) {
+                    index.erase(it->uuid);
+                    expired.splice(expired.end(), bucket, it);
+                } else {
+                    it->rounds--;
+                }
+                it = next;
+            }
+            timeoutCount += expired.size();
+        }
+        // handlers and payload destructors run outside the mutex
+        for (auto &entry : expired) {
+            if (entry.onExpire)
+                entry.onExpire(entry.uuid, std::move(entry.payload));
+        }
+    }
+
+    SemaphoreHandle_t mutex;
+    std::array<std::list<Entry>, PendingWheelSlots> wheel;
+    std::unordered_map<std::string, Location> index;
+    std::map<MessageType, uint32_t> timeouts;
+    size_t cursor = 0;
+    unsigned long lastTickMs = 0;
+    std::atomic<uint32_t> timeoutCount{0};
+    std::atomic<uint32_t> completedCount{0};
+    std::atomic<uint32_t> cancelledCount{0};
+    std::atomic<uint32_t> mismatchCount{0};
+};
+
+#endif
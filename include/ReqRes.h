@@ -1,11 +1,25 @@
 #ifndef REGRES_H
 #define REGRES_H
 
+#include <algorithm>
+#include <atomic>
 #include <json.hpp>
 #include "MessageBase.h"
 #include "BleLockAndKey.h"
+#include "AdminAuth.h"
+#include "KeyStore.h"
+#include "PendingRequests.h"
+#include "Dispatcher.h"
+#include "ResponseTemplate.h"
+#include "ThermalMonitor.h"
+#include "OpenNonces.h"
+#include "SerialBuffers.h"
+#include "AuditLog.h"
+#include "DeviceAccess.h"
+#include "OtaUpdate.h"
+#include "Base64.h"
+#include "FrameCodec.h"
 
-#define MessageMaxDelay 0xefffffff
 enum class MessageTypeReg {
     resOk,
     reqRegKey,
@@ -24,7 +38,28 @@ enum class MessageTypeReg {
     ScanWiFi,
     ScanWiFiResult,
     LoginWWiFi,
-    GetWiFiStatus
+    GetWiFiStatus,
+
+    TransportHello,
+    Fragment,
+    FragmentAck,
+
+    Batch,
+    BatchResult,
+
+    GetThermal,
+    ThermalStatus,
+
+    OpenNonce,
+
+    GetAuditLog,
+    AuditLogPage,
+
+    SetApiToken,
+
+    OtaBegin,
+    OtaChunk,
+    OtaStatus
 };
 
 
@@ -43,12 +78,162 @@ public:
 protected:
     void serializeExtraFields(json &doc) override {
         doc["status"] = status;
-        Serial.printf("Serialized status: %d\n", status);
+        Log.verbose("Serialized status: %d\n", status);
     }
 
     void deserializeExtraFields(const json &doc) override {
         status = doc["status"];
-        Serial.printf("Deserialized status: %d\n", status);
+        Log.verbose("Deserialized status: %d\n", status);
+    }
+};
+
+#define ReplyTypeSlots 32
+// sizes seen before a type's estimate is trusted
+#define ReplyEstimateSamples 4
+#define ReplyEstimateSlack 32
+
+// Serializes replies on the paths this firmware owns (response cache, batch
+// results, fragmenting transport). ResOk, by far the most frequent reply,
+// is rendered from two prebuilt templates instead of a json DOM.
+class ReplySerializer {
+public:
+    // bumped from the workers and the BLE task at once
+    struct Stats {
+        std::atomic<uint32_t> templated{0};
+        std::atomic<uint32_t> generic{0};
+        std::atomic<uint32_t> jsonUs{0};       // per ResOk, measured by benchmark()
+        std::atomic<uint32_t> templateUs{0};
+        std::atomic<uint32_t> templateReallocs{0};
+    };
+
+    static void begin()
+    {
+        ResOk no(false);
+        okTemplate(false).build(no);
+        ResOk yes(true);
+        okTemplate(true).build(yes);
+    }
+
+    static void serialize(MessageBase *msg, std::string &out)
+    {
+        if (msg->type == (MessageType)MessageTypeReg::resOk && okTemplate(true).isBuilt())
+        {
+            okTemplate(static_cast<ResOk *>(msg)->status).render(msg->sourceAddress, msg->destinationAddress, msg->requestUUID, out);
+            stats().templated++;
+            return;
+        }
+        // keeps the capacity of a pooled buffer
+        out.clear();
+        out.append(msg->serialize());
+        stats().generic++;
+    }
+
+    // Serialize into a caller-owned buffer; false when the result is over
+    // `limit` bytes and could not be delivered anyway
+    static bool serializeInto(MessageBase *msg, std::string &out, size_t limit)
+    {
+        size_t capacity = out.capacity();
+        serialize(msg, out);
+        SerialBuffers::instance().countSerialized(out.size(), capacity, out.capacity());
+        observe(msg->type, out.size());
+        if (out.size() > limit) {
+            SerialBuffers::instance().countTruncated();
+            return false;
+        }
+        return true;
+    }
+
+    // Expected serialized size: exact for templated replies, otherwise the
+    // largest size seen for this type so far (0 when unknown)
+    static size_t estimate(const MessageBase *msg)
+    {
+        if (msg->type == (MessageType)MessageTypeReg::resOk && okTemplate(true).isBuilt())
+            return okTemplate(true).size(msg->sourceAddress, msg->destinationAddress, msg->requestUUID);
+        int slot = (int)msg->type;
+        if (slot < 0 || slot >= ReplyTypeSlots || samples()[slot] < ReplyEstimateSamples)
+            return 0;
+        return maxSeen()[slot];
+    }
+
+    // replies that always fit in one MTU and never need a size check
+    static bool isSmall(const MessageBase *msg)
+    {
+        return msg->type == (MessageType)MessageTypeReg::resOk;
+    }
+
+    // whether the reply can go out whole without serializing it first to
+    // measure it
+    static bool fits(const MessageBase *msg, size_t mtu)
+    {
+        if (isSmall(msg))
+            return true;
+        size_t expected = estimate(msg);
+        return expected && expected + ReplyEstimateSlack <= mtu;
+    }
+
+    // Times `iterations` ResOk replies through json and through the
+    // template; on device it runs off the door path, after boot
+    static void benchmark(int iterations)
+    {
+        ResOk sample(true);
+        sample.sourceAddress = "aa:bb:cc:dd:ee:ff";
+        sample.destinationAddress = "11:22:33:44:55:66";
+        sample.requestUUID = "3f2b8c1e-7d4a-4e9b-a1c6-5d8e2f7b9a04";
+
+        uint32_t start = micros();
+        for (int i = 0; i < iterations; i++)
+            sample.serialize();
+        stats().jsonUs = (micros() - start) / iterations;
+
+        std::string buffer;
+        size_t capacity = buffer.capacity();
+        start = micros();
+        for (int i = 0; i < iterations; i++)
+        {
+            okTemplate(true).render(sample.sourceAddress, sample.destinationAddress, sample.requestUUID, buffer);
+            if (buffer.capacity() != capacity)
+            {
+                capacity = buffer.capacity();
+                stats().templateReallocs++;
+            }
+        }
+        stats().templateUs = (micros() - start) / iterations;
+    }
+
+    static Stats &stats()
+    {
+        static Stats st;
+        return st;
+    }
+
+private:
+    static void observe(MessageType type, size_t bytes)
+    {
+        int slot = (int)type;
+        if (slot < 0 || slot >= ReplyTypeSlots)
+            return;
+        if (bytes > maxSeen()[slot])
+            maxSeen()[slot] = bytes;
+        if (samples()[slot] < ReplyEstimateSamples)
+            samples()[slot]++;
+    }
+
+    static std::atomic<uint32_t> *maxSeen()
+    {
+        static std::atomic<uint32_t> sizes[ReplyTypeSlots];
+        return sizes;
+    }
+
+    static std::atomic<uint8_t> *samples()
+    {
+        static std::atomic<uint8_t> counts[ReplyTypeSlots];
+        return counts;
+    }
+
+    static ResponseTemplate &okTemplate(bool status)
+    {
+        static ResponseTemplate templates[2];
+        return templates[status ? 1 : 0];
     }
 };
 
@@ -84,44 +269,72 @@ protected:
 };
 
 
-class ReqRegKey : public MessageBase {
+class ReqRegKey : public Detachable<ReqRegKey> {
 public:
     std::string key;
+    bool isBase64 = false;
 
     ReqRegKey() {
         type = (MessageType)MessageTypeReg::reqRegKey;
     }
 
-    MessageBase *processRequest(void *context) override {
+    AdmissionCost cost() const override { return AdmissionCost::Expensive; }
+
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
-        if (xSemaphoreTake(lock->mutex, portMAX_DELAY) == pdTRUE) {
-            //lock->secureConnection.generateAESKey (sourceAddress);
-            //key = lock->secureConnection.GetAESKey (sourceAddress);
-            auto newKey = lock->secureConnection.decryptMessageRSA (key,sourceAddress );
-            lock->secureConnection.aesKeys[sourceAddress] = newKey;
-            xSemaphoreGive(lock->mutex);
-        }
-        /*
-        auto res = new ResOk();
-        res->destinationAddress = key;
-        res->sourceAddress = key;
-        */
+        //lock->secureConnection.generateAESKey (sourceAddress);
+        //key = lock->secureConnection.GetAESKey (sourceAddress);
         auto res = new ResKey();
         res->destinationAddress = sourceAddress;
         res->sourceAddress = destinationAddress;
-        res->status = true;
+        res->status = false;
         res->key = "";
+        // RSA decrypt is done outside the mutex, only the map store is locked
+        if (isBase64)
+        {
+            // SecureConnection takes the ciphertext as hex text
+            std::vector<uint8_t> raw;
+            if (!Base64::decode(key, raw) || raw.empty()) {
+                logColor(LColor::Red, F("Key from %s is not base64"), sourceAddress.c_str());
+                return res;
+            }
+            key = SecureConnection::vector2hex(raw);
+        }
+        decltype(lock->secureConnection.decryptMessageRSA (key,sourceAddress )) newKey;
+        {
+            KeyStore::CryptoGuard guard;
+            newKey = lock->secureConnection.decryptMessageRSA (key,sourceAddress );
+        }
+        // nothing is stored unless the key decrypted to a usable AES key
+        if (newKey.size() != SessionKeyBytes) {
+            logColor(LColor::Red, F("Key from %s decrypted to %u bytes, expected %u"), sourceAddress.c_str(),
+                     (unsigned)newKey.size(), (unsigned)SessionKeyBytes);
+            return res;
+        }
+        if (xSemaphoreTake(lock->mutex, portMAX_DELAY) != pdTRUE)
+            return res;
+        lock->secureConnection.aesKeys[sourceAddress] = newKey;
+        xSemaphoreGive(lock->mutex);
+        // whatever was issued under the previous key goes with it
+        KeyStore::instance().dropSession(sourceAddress);
+        OpenNonces::instance().drop(sourceAddress);
+        ResponseCache::instance().invalidate(sourceAddress);
+        KeyStore::instance().publishSessionKey(sourceAddress, std::string(newKey.begin(), newKey.end()));
+        res->status = true;
         return res;
     }
 
 protected:
     void serializeExtraFields(json &doc) override {
         doc["key"] = key;
+        if (isBase64)
+            doc["enc"] = "b64";
         Serial.printf("Serialized key: %s\n", key.c_str());
     }
 
     void deserializeExtraFields(const json &doc) override {
         key = doc["key"];
+        isBase64 = doc.value("enc", "") == "b64";
         Serial.printf("Deserialized key: %s\n", key.c_str());
     }
 };
@@ -130,7 +343,9 @@ protected:
 
 
 
-class OpenCommand : public MessageBase {
+// The phone's answer to a SecurityCheckRequestest. It completes the open
+// waiting for it in PendingRequests, on the Open worker like the request.
+class OpenCommand : public Detachable<OpenCommand> {
 public:
     std::string randomField;
 
@@ -143,19 +358,8 @@ public:
     {
         randomField = randomFieldVal;
     }
-    /*
-    MessageBase *processRequest(void *context) override {
-        auto lock = static_cast<BleLock *>(context);
-        if (xSemaphoreTake(lock->bleMutex, portMAX_DELAY) == pdTRUE) {
-            //lock->awaitingKeys.insert(key);
-            xSemaphoreGive(lock->bleMutex);
-        }
-        auto res = new ResOk();
-        res->destinationAddress = sourceAddress;
-        res->sourceAddress = destinationAddress;
-        res->status = true;
-        return res;
-    }*/
+
+    MessageBase *handleRequest(void *context) override;
 
     std::string getEncryptedCommand ()
     {
@@ -222,21 +426,235 @@ protected:
 
 
 
-class OpenRequest : public MessageBase {
+// RSA key pair for `address`, generated in a scratch SecureConnection so
+// the seconds of keygen hold no lock; only the insert into the lock's map
+// and the publish go under CryptoGuard. A pair another worker put there
+// meanwhile wins. Returns the public key now on file.
+inline std::vector<uint8_t> generateKeyPair(BleLockServer *lock, const std::string &address)
+{
+    SecureConnection scratch;
+    scratch.generateRSAKeys(address);
+    auto pair = scratch.keys[address];
+
+    KeyStore::CryptoGuard guard;
+    auto &keys = lock->secureConnection.keys;
+    auto it = keys.find(address);
+    if (it == keys.end())
+        it = keys.emplace(address, std::move(pair)).first;
+    KeyStore::instance().publishPublicKey(address, it->second.first);
+    return it->second.first;
+}
+
+// who opened when; appends only touch RAM, main loop writes flash
+extern AuditLog auditLog;
+
+inline void auditOpen(const std::string &address, AuditResult result, uint32_t startUs)
+{
+    time_t now = time(nullptr);
+    bool epoch = now > 1700000000;
+    auditLog.append(address, result, (micros() - startUs) / 1000, epoch ? (uint32_t)now : millis() / 1000, epoch, millis());
+}
+
+// Pre-issued open challenge, pushed after a successful hello and after
+// every open. The phone proves it inside its next OpenRequest, either as
+// the hex AES-CMAC of the nonce under its session key (SessionCipher::proof,
+// computed here at issue time) or, from older apps, as
+// encryptMessageAES(nonce), which the lock library checks.
+class OpenNonceMessage : public MessageBase {
+public:
+    std::string nonce;
+    uint32_t ttlMs = OpenNonceTtlMs;
+
+    OpenNonceMessage() {
+        type = (MessageType)MessageTypeReg::OpenNonce;
+    }
+
+    static void offer(void *context, const std::string &address, const std::string &lockAddress)
+    {
+        auto lock = static_cast<BleLockServer *>(context);
+        auto res = new OpenNonceMessage;
+        res->nonce = lock->secureConnection.generateRandomField();
+        res->destinationAddress = address;
+        res->sourceAddress = lockAddress;
+        auto cipher = KeyStore::instance().sessionCipher(address);
+        OpenNonces::instance().issue(address, res->nonce, cipher ? cipher->proof(res->nonce) : std::string(), millis());
+        Dispatcher::sendResponse(context, res);
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["nonce"] = nonce;
+        doc["ttl"] = ttlMs;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        nonce = doc.value("nonce", "");
+        ttlMs = doc.value("ttl", OpenNonceTtlMs);
+    }
+
+    MessageBase *processRequest(void *context) override {
+        logColor(LColor::Yellow, F("OpenNonce processRequest"));
+            return nullptr;
+    }
+};
+
+// A two-step open waiting for the phone's OpenCommand: the addressing of
+// the OpenRequest to answer and the field the command must decrypt to
+class PendingOpen : public MessageBase {
+public:
+    void *context = nullptr;
+    std::string expected;
+    uint32_t startUs = 0;
+
+protected:
+    void serializeExtraFields(json &doc) override {}
+    void deserializeExtraFields(const json &doc) override {}
+};
+
+class OpenRequest : public Detachable<OpenRequest> {
 public:
     std::string key;
     std::string randomField;
+    // one-round-trip open: a nonce from OpenNonce and its AES encryption
+    std::string nonce;
+    std::string proof;
+
+    struct OpenTiming {
+        uint32_t count = 0;
+        uint64_t totalUs = 0;
+        uint32_t maxUs = 0;
+        uint32_t avgUs() const { return count ? totalUs / count : 0; }
+    };
+    struct OpenStats {
+        OpenTiming fast;
+        OpenTiming twoStep;
+        uint32_t precomputed = 0;
+        uint32_t fallbacks = 0;
+        uint32_t denied = 0;
+    };
+
+    static OpenStats &openStats()
+    {
+        static OpenStats st;
+        return st;
+    }
 
     OpenRequest() {
         type = (MessageType)MessageTypeReg::OpenRequest;
     }
 
+    AdmissionCost cost() const override { return AdmissionCost::Open; }
+
     void setRandomField(std::string randomFieldVal)
     {
         randomField = randomFieldVal;
     }
 
-    MessageBase *processRequest(void *context) override {
+    MessageBase *handleRequest(void *context) override {
+        auto lock = static_cast<BleLockServer *>(context);
+        uint32_t start = micros();
+
+        if (!proof.empty())
+        {
+            std::string expected;
+            auto result = OpenNonces::instance().consume(sourceAddress, nonce, millis(), &expected);
+            if (result == OpenNonces::Result::Valid)
+            {
+                // no AES at all when the proof matches the one computed at issue time
+                bool opened = !expected.empty() && SessionCipher::sameProof(proof, expected);
+                if (opened)
+                    openStats().precomputed++;
+                else
+                    opened = decrypt(lock, proof) == nonce;
+                MessageBase *res = reply(context, opened);
+                record(openStats().fast, start);
+                auditOpen(sourceAddress, opened ? AuditResult::Opened : AuditResult::Denied, start);
+                return res;
+            }
+            if (result == OpenNonces::Result::Replayed)
+            {
+                Log.error(F("Повторно использованный nonce"));
+                auditOpen(sourceAddress, AuditResult::Replayed, start);
+                return reply(context, false);
+            }
+            // stale or unknown nonce: the phone is still owed an answer, check it the long way
+            openStats().fallbacks++;
+        }
+
+        // answered later, by the phone's OpenCommand or the check timing out
+        twoStepOpen(context, start);
+        return nullptr;
+    }
+
+    // The phone's OpenCommand for a pending two-step open arrived
+    static MessageBase *finishTwoStep(void *context, PendingOpen &open, const std::string &command)
+    {
+        auto lock = static_cast<BleLockServer *>(context);
+        std::string decryptedCommand = decrypt(lock, open.sourceAddress, command);
+        logColor (LColor::Yellow, F("decryptedCommand = <%s>   etalonField = <%s>"),decryptedCommand.c_str(),open.expected.c_str());
+        bool opened = !decryptedCommand.empty() && decryptedCommand == open.expected;
+        MessageBase *res = answer(context, open, opened);
+        record(openStats().twoStep, open.startUs);
+        auditOpen(open.sourceAddress, opened ? AuditResult::Opened : AuditResult::Denied, open.startUs);
+        return res;
+    }
+
+protected:
+    std::string decrypt(BleLockServer *lock, const std::string &encrypted)
+    {
+        return decrypt(lock, sourceAddress, encrypted);
+    }
+
+    static std::string decrypt(BleLockServer *lock, const std::string &address, const std::string &encrypted)
+    {
+        std::string decrypted;
+        uint32_t start = micros();
+        if (xSemaphoreTake(lock->mutex, portMAX_DELAY) == pdTRUE) {
+            decrypted = lock->secureConnection.decryptMessageAES(encrypted, address);
+            xSemaphoreGive(lock->mutex);
+        }
+        auto &st = SessionCipher::stats();
+        st.legacyOps++;
+        st.legacyUs += micros() - start;
+        return decrypted;
+    }
+
+    static void record(OpenTiming &timing, uint32_t start)
+    {
+        uint32_t elapsed = micros() - start;
+        timing.count++;
+        timing.totalUs += elapsed;
+        if (elapsed > timing.maxUs)
+            timing.maxUs = elapsed;
+    }
+
+    // answer the open and hand out the nonce for the next one
+    MessageBase *reply(void *context, bool opened)
+    {
+        return answer(context, *this, opened);
+    }
+
+    // `request` carries the addressing of the OpenRequest being answered
+    static MessageBase *answer(void *context, const MessageBase &request, bool opened)
+    {
+        ResOk* res = new ResOk();
+        res->sourceAddress = request.destinationAddress;
+        res->destinationAddress = request.sourceAddress;
+        res->requestUUID = request.requestUUID;
+        res->status = opened;
+        if (opened) {
+            Log.verbose(F("Замок открыт успешно"));
+            OpenNonceMessage::offer(context, request.sourceAddress, request.destinationAddress);
+        } else {
+            openStats().denied++;
+            Log.error(F("Ошибка проверки безопасности"));
+        }
+        return res;
+    }
+
+    // Sends the security check and parks the open in PendingRequests with
+    // everything its answer needs; the worker does not wait for the phone
+    void twoStepOpen(void *context, uint32_t start) {
         auto lock = static_cast<BleLockServer *>(context);
 
         std::string randomField = lock->secureConnection.generateRandomField();
@@ -245,69 +663,77 @@ public:
         SecurityCheckRequestest* securityCheckRequest = new SecurityCheckRequestest();
         securityCheckRequest->sourceAddress = destinationAddress;
         securityCheckRequest->destinationAddress = sourceAddress;
-        //securityCheckRequest->type = MessageType::SecurityCheck;
         securityCheckRequest->setRandomField(randomField);
 
-        // Отправляем запрос на проверку безопасности и ждем ответ
-        MessageBase* securityCheckResponse = lock->request(securityCheckRequest, sourceAddress, MessageMaxDelay);
-        //logColor(LColor::Green, F("delete CHECK_Request"));
-        //delete securityCheckRequest;
-
-        logColor(LColor::Green, F("CHECK_ANSWER: %s"), securityCheckResponse->serialize().c_str());
-        if (securityCheckResponse && securityCheckResponse->type == (MessageType)MessageTypeReg::OpenCommand) 
-        {
-            // Расшифровываем команду открытия и проверяем рандомное поле
-            std::string decryptedCommand = lock->secureConnection.decryptMessageAES(((OpenCommand*)securityCheckResponse)->getEncryptedCommand(), sourceAddress);
-            logColor (LColor::Yellow, F("decryptedCommand = <%s>   etalonField = <%s>"),decryptedCommand.c_str(),randomField.c_str());
-            if (decryptedCommand == randomField) {
-                // Отправляем ответ об успешном открытии
-                ResOk* successResponse = new ResOk();
-                successResponse->sourceAddress = destinationAddress;
-                successResponse->destinationAddress = sourceAddress;
-                successResponse->status = true;
-                //successResponse->type = MessageType::ResOk;
-
-                //lock->request(successResponse, sourceAddress, MessageMaxDelay/* таймаут */);
-                //delete successResponse;
-                //delete securityCheckResponse;
-                
-                //delete request;
-
-                Log.verbose(F("Замок открыт успешно"));
-                return successResponse; // Успешное завершение
-            } else {
-                
-                ResOk* successResponse = new ResOk();
-                successResponse->sourceAddress = destinationAddress;
-                successResponse->destinationAddress = sourceAddress;
-                successResponse->status = false;
-                Log.error(F("Ошибка проверки безопасности"));
-                return successResponse; // Успешное завершение
-            }
-        } else {
-            Log.error(F("Не удалось получить ответ на проверку безопасности"));
+        std::unique_ptr<PendingOpen> open(new PendingOpen);
+        open->sourceAddress = sourceAddress;
+        open->destinationAddress = destinationAddress;
+        open->requestUUID = requestUUID;
+        open->context = context;
+        open->expected = randomField;
+        open->startUs = start;
+
+        // parked before sending, so even an immediate answer finds it
+        auto &pending = PendingRequests::instance();
+        if (!pending.add(securityCheckRequest->requestUUID, sourceAddress, securityCheckRequest->type,
+                         std::move(open), onCheckTimeout)) {
+            delete securityCheckRequest;
+            Dispatcher::sendResponse(context, reply(context, false));
+            return;
         }
+        std::string checkUUID = securityCheckRequest->requestUUID;
+        if (!Dispatcher::sendRaw(context, securityCheckRequest)) {
+            // the phone never gets the check: refuse now instead of at the timeout
+            if (auto parked = pending.complete(checkUUID))
+                onCheckTimeout(checkUUID, std::move(parked));
+        }
+    }
 
-        if (securityCheckResponse) delete securityCheckResponse;
-
-        return nullptr;
+    // No OpenCommand in time: the phone gets a refusal rather than silence
+    static void onCheckTimeout(const std::string &, std::unique_ptr<MessageBase> payload)
+    {
+        auto &open = static_cast<PendingOpen &>(*payload);
+        Log.error(F("Не удалось получить ответ на проверку безопасности"));
+        record(openStats().twoStep, open.startUs);
+        auditOpen(open.sourceAddress, AuditResult::NoAnswer, open.startUs);
+        ResOk *res = new ResOk(false);
+        res->sourceAddress = open.destinationAddress;
+        res->destinationAddress = open.sourceAddress;
+        res->requestUUID = open.requestUUID;
+        Dispatcher::sendResponse(open.context, res);
     }
 
-protected:
     void serializeExtraFields(json &doc) override {
         doc["key"] = key;
         doc["randomField"] = randomField;
+        if (!proof.empty()) {
+            doc["nonce"] = nonce;
+            doc["proof"] = proof;
+        }
         Log.notice("Serialized OpenRequest: %s\n", randomField.c_str());
     }
 
     void deserializeExtraFields(const json &doc) override {
         key = doc["key"];
         randomField = doc["randomField"];
+        nonce = doc.value("nonce", "");
+        proof = doc.value("proof", "");
         Log.notice("Deserialized OpenRequest: %s\n", randomField.c_str());
     }
 };
 
 
+inline MessageBase *OpenCommand::handleRequest(void *context)
+{
+    auto waiting = PendingRequests::instance().complete(requestUUID, sourceAddress);
+    if (!waiting) {
+        // late, unsolicited, or from a peer the check did not go to
+        Log.error(F("OpenCommand without a pending open"));
+        return nullptr;
+    }
+    return OpenRequest::finishTwoStep(context, static_cast<PendingOpen &>(*waiting), getEncryptedCommand());
+}
+
 ////////////////////////
 ///////////////////////
 ////////////////////////
@@ -316,6 +742,7 @@ protected:
 class ReceivePublic : public MessageBase {
 public:
     std::string key;
+    bool isBase64 = false;
 
     ReceivePublic() {
         type = (MessageType)MessageTypeReg::ReceivePublic;
@@ -328,11 +755,14 @@ protected:
 
     void serializeExtraFields(json &doc) override {
         doc["key"] = key;
+        if (isBase64)
+            doc["enc"] = "b64";
         Serial.printf("Serialized key:lem=%d\n", key.length());
     }
 
     void deserializeExtraFields(const json &doc) override {
         key = doc["key"];
+        isBase64 = doc.value("enc", "") == "b64";
         Serial.printf("Deserialized key:len=%d\n", key.length());
     }
     MessageBase *processRequest(void *context) override {
@@ -342,10 +772,18 @@ protected:
 
 };
 // cliewnt handshake request
-class HelloRequest : public MessageBase {
+class HelloRequest : public Detachable<HelloRequest> {
 public:
     bool status{};
     std::string key;
+    uint8_t caps = 0;
+
+    // public key bytes sent in ReceivePublic, and what hex would have cost
+    static uint32_t keysSent() { return keyStats().count; }
+    static uint32_t keyBytesSent() { return keyStats().sent; }
+    static uint32_t keyBytesAsHex() { return keyStats().asHex; }
+    static uint32_t lastKeyBytes() { return keyStats().last; }
+    static uint32_t lastKeyBytesAsHex() { return keyStats().lastAsHex; }
 
     HelloRequest() {
         type = (MessageType)MessageTypeReg::HelloRequest;
@@ -358,15 +796,38 @@ protected:
     void serializeExtraFields(json &doc) override {
         doc["status"] = status;
         doc["key"] = key;
+        if (caps)
+            doc["caps"] = caps;
         Serial.printf("Serialized status: %d  key:%s\n", status, key.c_str()?key.c_str():"");
     }
 
     void deserializeExtraFields(const json &doc) override {
         status = doc["status"];
         key = doc["key"];
+        caps = doc.value("caps", 0);
         Serial.printf("Deserialized status: %d  key:%s\n", status, key.c_str()?key.c_str():"");
     }
-    MessageBase *processRequest(void *context) override {
+
+    struct KeyStats {
+        uint32_t count = 0;
+        uint32_t sent = 0;
+        uint32_t asHex = 0;
+        uint32_t last = 0;
+        uint32_t lastAsHex = 0;
+    };
+
+    static KeyStats &keyStats()
+    {
+        static KeyStats st;
+        return st;
+    }
+
+    bool isReplayable() const override { return true; }
+
+    // the key-sending branch may generate and always saves RSA keys
+    AdmissionCost cost() const override { return status ? AdmissionCost::Normal : AdmissionCost::Expensive; }
+
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
         logColor(LColor::Yellow, F("HelloRequest processRequest status = %d"), status);
 
@@ -374,16 +835,13 @@ protected:
         {
                 logColor (LColor::Green, F("check hash!"));
             bool bChkResult = false;
-            auto keyPair = lock->secureConnection.keys.find(sourceAddress);
-            if (keyPair!=lock->secureConnection.keys.end())
+            std::vector<uint8_t> pubKey;
+            if (KeyStore::instance().findPublicKey(sourceAddress, pubKey))
             {
                 logColor (LColor::Green, F("Found keyPair!"));
-                //keyPair->second.first;
-                //keyPair->second.second;
                 auto rawMessage = key;
                 //int size = rawMessage.size();
 
-                auto pubKey =  keyPair->second.first;
                 auto hash = lock->secureConnection.generatePublicKeyHash (pubKey, 16);
                 bool isSiteConfirmed = lock->confirm (sourceAddress);
                 logColor(LColor::Yellow, F("%s <--> %s"), hash.c_str(), rawMessage.c_str());
@@ -394,6 +852,9 @@ protected:
                 //std::vector<uint8_t> encryptAESKey = lock->secureConnection.decryptMessageRSA (encMessage,sourceAddress);
                 //lock->secureConnection.SetAESKey(sourceAddress, SecureConnection::vector2hex(encryptAESKey));
             }
+            // first challenge goes out at connect time, so the first open is one round trip
+            if (bChkResult)
+                OpenNonceMessage::offer(context, sourceAddress, destinationAddress);
             ResOk* res = new ResOk();
             res->destinationAddress = sourceAddress;
             res->sourceAddress = destinationAddress;
@@ -403,21 +864,37 @@ protected:
         }
         else // sdend publick key
         {
-            if (lock->secureConnection.keys.find(sourceAddress) == lock->secureConnection.keys.end())
+            // new handshake from this address: whatever it was waiting for is stale
+            PendingRequests::instance().cancelAddress(sourceAddress);
+            OpenNonces::instance().drop(sourceAddress);
+            auto &keyStore = KeyStore::instance();
+            keyStore.setCaps(sourceAddress, caps);
+            if (!keyStore.hasPublicKey(sourceAddress))
             {
                 logColor (LColor::Green, F("Gen key!"));
-                lock->secureConnection.generateRSAKeys (sourceAddress);
+                generateKeyPair(lock, sourceAddress);
                 logColor (LColor::Green, F("Gen key - finished"));
             }
-            logColor (LColor::Green, F("Save keys!"));
-            lock->secureConnection.SaveRSAKeys();
-            logColor (LColor::Green, F("Keys saved!"));
+            {
+                KeyStore::CryptoGuard guard;
+                logColor (LColor::Green, F("Save keys!"));
+                lock->secureConnection.SaveRSAKeys();
+                logColor (LColor::Green, F("Keys saved!"));
+            }
 
             ReceivePublic* res = new ReceivePublic;
 
             res->destinationAddress = sourceAddress;
             res->sourceAddress = destinationAddress;            
-            res->key = SecureConnection::vector2hex(lock->secureConnection.keys[sourceAddress].first);
+            // encoded once when the key was published
+            keyStore.encodedPublicKey(sourceAddress, res->key, res->isBase64);
+            auto &st = keyStats();
+            size_t padding = std::count(res->key.end() - std::min<size_t>(2, res->key.size()), res->key.end(), '=');
+            st.count++;
+            st.last = res->key.size();
+            st.lastAsHex = res->isBase64 ? (res->key.size() / 4 * 3 - padding) * 2 : res->key.size();
+            st.sent += st.last;
+            st.asHex += st.lastAsHex;
             res->requestUUID = requestUUID;
             return res;
         }
@@ -505,45 +982,21 @@ protected:
     }
 };
 
-#define HASH_TOP 0xffff
-
-class GetDeviceList : public MessageBase {
+class GetDeviceList : public Detachable<GetDeviceList> {
 public:
     GetDeviceList() {
         type = (MessageType)MessageTypeReg::GetDeviceList;
     }
 
 protected:
-
-    std::string hashf (std::vector<uint8_t>& val)
-    {
-        //simple add hash
-        std::string res;
-        uint16_t sum = 0;
-        for (int i = 0; i < val.size(); i++)
-        {
-            sum+= val[i];
-            if (sum>HASH_TOP)
-                sum -= HASH_TOP;
-        }
-        uint16_t mask = 1;
-        for (int it = 0; it < 12; it++)
-        {
-            if (sum & mask)
-                res+= "1";
-            else
-                res+= "0";
-            mask <<= 1;
-        }  
-        return res;      
-    }
-
     void serializeExtraFields(json &doc) override {
     }
 
     void deserializeExtraFields(const json &doc) override {
     }
-    MessageBase *processRequest(void *context) override {
+    bool isReplayable() const override { return true; }
+
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
         logColor(LColor::Yellow, F("GetDeviceList processRequest"));
             
@@ -553,17 +1006,20 @@ protected:
             res->sourceAddress = destinationAddress;            
             res->requestUUID = requestUUID;
 
-            for (auto it: BleLockServer::confirmedDevices)
+            auto keys = KeyStore::instance().snapshot();
+            for (auto it: DeviceAccess::instance().snapshot())
             {
-                if (lock->secureConnection.keys.find(it.first) == lock->secureConnection.keys.end())
-                {// key not found
-                    lock->secureConnection.generateRSAKeys (it.first);
-                }
+                std::vector<uint8_t> pubKey;
+                auto entry = keys->find(it.first);
+                if (entry != keys->end() && entry->second.hasPublicKey)
+                    pubKey = entry->second.publicKey;
+                else
+                    pubKey = generateKeyPair(lock, it.first);
                 // generate 12 byte hash
                 std::string localHash = "000000000000";
-                if (lock->secureConnection.keys.find(it.first) != lock->secureConnection.keys.end())
+                if (!pubKey.empty())
                 {
-                    localHash =  hashf(lock->secureConnection.keys.find(it.first)->second.first);
+                    localHash =  DeviceAccess::keyHash(pubKey);
                 }
 
                 Serial.printf ("MAC:%s  HASH:%s CONFIRMED:%d\n", it.first.c_str(), localHash.c_str(), it.second);
@@ -577,7 +1033,7 @@ protected:
 };
 
 
-class AccessOnOFFSingle : public MessageBase {
+class AccessOnOFFSingle : public Detachable<AccessOnOFFSingle> {
 public:
     deciceConfirmedStruct option;
  
@@ -599,28 +1055,24 @@ protected:
         option.isConfirmed = it.value();
     }
 
-    MessageBase *processRequest(void *context) override {
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
         logColor(LColor::Yellow, F("GetDeviceList processRequest"));
-            std::string confMac;
-            int npos = option.mac.find(" ");
-            confMac = option.mac.substr(0,npos);
-
-            BleLockServer::confirmedDevices[confMac /*option.mac*/] = option.isConfirmed;
-            BleLockServer::saveConfirmedDevices();
+            size_t unknown = 0;
+            DeviceAccess::instance().apply({{option.mac, option.isConfirmed}}, &unknown);
 
             ResOk *res = new ResOk;
             res->destinationAddress = sourceAddress;
             res->sourceAddress = destinationAddress;            
             res->requestUUID = requestUUID;
-            res->status = true;
+            res->status = unknown == 0;
 
             return res;
     }
 };
 
 
-class AccessOnOFFMulty : public MessageBase {
+class AccessOnOFFMulty : public Detachable<AccessOnOFFMulty> {
 public:
     std::vector<deciceConfirmedStruct> devices;
  
@@ -646,24 +1098,27 @@ protected:
         {
             deciceConfirmedStruct tmp;
             tmp.mac = it.key();
-            tmp.mac = it.value();
+            tmp.isConfirmed = it.value();
             devices.push_back(tmp);
         }
     }
 
-    MessageBase *processRequest(void *context) override {
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
         logColor(LColor::Yellow, F("GetDeviceList processRequest"));
             
+            std::vector<DeviceAccess::Entry> entries;
             for (int i=0; i < devices.size(); i++)
-               BleLockServer::confirmedDevices[devices[i].mac] = devices[i].isConfirmed;
-            BleLockServer::saveConfirmedDevices();
+               entries.emplace_back(devices[i].mac, devices[i].isConfirmed);
+            size_t unknown = 0;
+            DeviceAccess::instance().apply(entries, &unknown);
 
             ResOk *res = new ResOk;
             res->destinationAddress = sourceAddress;
             res->sourceAddress = destinationAddress;            
             res->requestUUID = requestUUID;
-            res->status = true;
+            // known devices are still switched when some MACs are unknown
+            res->status = unknown == 0;
 
             return res;
     }
@@ -683,46 +1138,80 @@ struct netListItem
     bool isProtected;
 };
 
-bool ListWiFiStart();
-bool ListWiFiNext(String &ssid, int32_t &rssi, int &chanel, bool &isProtected);
-void scanWiFi ();
+// Blocks until a scan is done; `progress` gets each channel's networks
+void scanWiFi (const std::function<void(const std::vector<netListItem> &found)> &progress);
+// largest single write the link to `address` takes
+size_t replyWriteLimit (const std::string &address);
 void SetWiFiPass (String ssid, String pass);
 bool isWiFiConnected ();
+bool setApiToken (const std::string &token);
 
 
+// json around one network: its ssid key in "list" and in "info", the
+// protection flag and [rssi, channel]
+#define ScanItemOverhead 24
+
 class ScanWiFiResultMessage : public MessageBase {
 public:
 
     std::vector<netListItem> list;
+    int part = 0;
+    bool last = true;
 
 
     ScanWiFiResultMessage() {
         type = (MessageType)MessageTypeReg::ScanWiFiResult;
     }
 
+    // serialized size of one list entry, used to cut MTU-sized parts; the
+    // ssid is a key twice and pays its json escaping both times
+    static size_t itemSize(const netListItem &item)
+    {
+        size_t ssid = 0;
+        for (size_t i = 0; i < item.ssid.length(); i++)
+            ssid += FrameCodec::escapedSize(item.ssid[i]);
+        return 2 * ssid + ScanItemOverhead;
+    }
+
 protected:
 
     void serializeExtraFields(json &doc) override 
     {
         nlohmann::json j;
+        nlohmann::json info;
 
         for (int i=0; i < list.size(); i++)
         {
             j[list[i].ssid.c_str()] = list[i].isProtected;
+            info[list[i].ssid.c_str()] = {list[i].rssi, list[i].chanel};
         }
         doc["list"] = j;
+        doc["info"] = info;
+        doc["part"] = part;
+        doc["last"] = last;
     }
 
     void deserializeExtraFields(const json &doc) override {
         list.clear();
         nlohmann::json j = doc["list"];
+        nlohmann::json info = doc.value("info", nlohmann::json::object());
        for (auto it = j.begin(); it!=j.end(); it++)
         {
             netListItem tmp;
             tmp.ssid = it.key().c_str();
             tmp.isProtected = it.value();
+            tmp.rssi = 0;
+            tmp.chanel = 0;
+            auto extra = info.find(it.key());
+            if (extra != info.end() && extra->size() == 2)
+            {
+                tmp.rssi = (*extra)[0];
+                tmp.chanel = (*extra)[1];
+            }
             list.push_back(tmp);
         }
+        part = doc.value("part", 0);
+        last = doc.value("last", true);
     }
 
     MessageBase *processRequest(void *context) override {
@@ -732,8 +1221,145 @@ protected:
     }
 };
 
+// Runs WiFi scans on its own task and streams the results to every
+// requester while the scan moves across channels: networks are sent as soon
+// as a ScanWiFiResult part sized for that peer's link is full, the rest
+// with `last` set once the scan is over. Requests arriving while a scan is
+// running join the next one.
+class ScanWiFiWorker {
+public:
+    static ScanWiFiWorker &instance()
+    {
+        static ScanWiFiWorker worker;
+        return worker;
+    }
+
+    void request(void *context, const std::string &address, const std::string &lockAddress, const std::string &uuid)
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        waiting.push_back(Requester{context, address, lockAddress, uuid});
+        if (!task) {
+            xTaskCreate(scanTask, "wifiScan", 6144, this, 1, &task);
+            MemoryBudget::instance().watchTask("wifiScan", task, 6144);
+        } else
+            xTaskNotifyGive(task);
+        xSemaphoreGive(mutex);
+    }
+
+    bool isScanning() const { return scanning; }
+    uint32_t scans() const { return scanCount; }
+    uint32_t lastScanMs() const { return lastDurationMs; }
+    // time from the scan starting to the first part going out
+    uint32_t lastFirstPartMs() const { return firstPartMs; }
+    uint32_t parts() const { return partCount; }
+
+private:
+    struct Requester {
+        void *context;
+        std::string address;
+        std::string lockAddress;
+        std::string uuid;
+        int part = 0;
+        size_t budget = 0;
+        size_t heldBytes = 0;
+        std::vector<netListItem> held;
+    };
+
+    ScanWiFiWorker() : mutex(xSemaphoreCreateMutex()) {}
+
+    static void scanTask(void *param)
+    {
+        auto self = static_cast<ScanWiFiWorker *>(param);
+        for (;;) {
+            self->runOnce();
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
 
-class ScanWiFiMessage : public MessageBase {
+    void runOnce()
+    {
+        std::vector<Requester> batch;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        batch.swap(waiting);
+        xSemaphoreGive(mutex);
+        if (batch.empty())
+            return;
+        for (auto &req : batch)
+            req.budget = chunkBudget(req);
+
+        // a scan heats the radio up further, wait for the chip to cool first
+        ThermalMonitor::instance().waitUntilCool();
+        scanning = true;
+        start = millis();
+        firstPartMs = 0;
+        scanWiFi([&](const std::vector<netListItem> &found) {
+            for (auto &req : batch)
+                stream(req, found);
+        });
+        lastDurationMs = millis() - start;
+        scanCount++;
+        scanning = false;
+
+        for (auto &req : batch)
+            send(req, true);
+    }
+
+    // Room for list entries in one part to this peer: its write limit less
+    // what the message around the list takes
+    static size_t chunkBudget(const Requester &req)
+    {
+        ScanWiFiResultMessage probe;
+        probe.destinationAddress = req.address;
+        probe.sourceAddress = req.lockAddress;
+        probe.requestUUID = req.uuid;
+        probe.part = 9999;
+        probe.last = false;
+        size_t envelope = probe.serialize().size();
+        size_t limit = replyWriteLimit(req.address);
+        return limit > envelope ? limit - envelope : 0;
+    }
+
+    void stream(Requester &req, const std::vector<netListItem> &found)
+    {
+        for (auto &item : found) {
+            size_t size = ScanWiFiResultMessage::itemSize(item);
+            // a part holds at least one network, even one over the budget
+            if (!req.held.empty() && req.heldBytes + size > req.budget)
+                send(req, false);
+            req.held.push_back(item);
+            req.heldBytes += size;
+        }
+    }
+
+    void send(Requester &req, bool last)
+    {
+        auto res = new ScanWiFiResultMessage;
+        res->destinationAddress = req.address;
+        res->sourceAddress = req.lockAddress;
+        res->requestUUID = req.uuid;
+        res->part = req.part++;
+        res->last = last;
+        res->list.swap(req.held);
+        req.heldBytes = 0;
+        if (!firstPartMs)
+            firstPartMs = millis() - start;
+        partCount++;
+        Dispatcher::sendResponse(req.context, res);
+    }
+
+    SemaphoreHandle_t mutex;
+    std::vector<Requester> waiting;
+    TaskHandle_t task = nullptr;
+    volatile bool scanning = false;
+    uint32_t start = 0;
+    uint32_t scanCount = 0;
+    uint32_t partCount = 0;
+    uint32_t lastDurationMs = 0;
+    uint32_t firstPartMs = 0;
+};
+
+
+class ScanWiFiMessage : public Detachable<ScanWiFiMessage> {
 public:
     ScanWiFiMessage() {
         type = (MessageType)MessageTypeReg::ScanWiFi;
@@ -746,31 +1372,26 @@ protected:
     void deserializeExtraFields(const json &doc) override {
     }
 
-    MessageBase *processRequest(void *context) override {
-        auto lock = static_cast<BleLockServer *>(context);
+    AdmissionCost cost() const override { return AdmissionCost::Expensive; }
+
+    // acknowledge at once, ScanWiFiResult parts follow from ScanWiFiWorker
+    MessageBase *handleRequest(void *context) override {
         logColor(LColor::Yellow, F("ScanWiFiMessage processRequest"));
-            
 
-            ScanWiFiResultMessage *res = new ScanWiFiResultMessage;
-            scanWiFi();
-            bool isNoFinish = ListWiFiStart();
-            while (isNoFinish)
-            {
-                netListItem it;
-                isNoFinish = ListWiFiNext(it.ssid,it.rssi,it.chanel,it.isProtected);
-                res->list.push_back (it);
-            }
+            ScanWiFiWorker::instance().request(context, sourceAddress, destinationAddress, requestUUID);
 
+            ResOk *res = new ResOk;
             res->destinationAddress = sourceAddress;
             res->sourceAddress = destinationAddress;            
             res->requestUUID = requestUUID;
+            res->status = true;
 
             return res;
     }
 };
 
 
-class LoginWWiFiMessage : public MessageBase {
+class LoginWWiFiMessage : public Detachable<LoginWWiFiMessage> {
 public:
     std::string ssid;
     std::string pass;
@@ -790,7 +1411,7 @@ protected:
         pass = doc["pass"];
     }
 
-    MessageBase *processRequest(void *context) override {
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
         logColor(LColor::Yellow, F("LoginWWiFiMessage processRequest"));
             
@@ -805,7 +1426,7 @@ protected:
     }
 };
 
-class GetWiFiStatusMessage : public MessageBase {
+class GetWiFiStatusMessage : public Detachable<GetWiFiStatusMessage> {
 public:
     std::string ssid;
     std::string pass;
@@ -821,7 +1442,7 @@ protected:
     void deserializeExtraFields(const json &doc) override {
     }
 
-    MessageBase *processRequest(void *context) override {
+    MessageBase *handleRequest(void *context) override {
         auto lock = static_cast<BleLockServer *>(context);
         logColor(LColor::Yellow, F("GetWiFiStatusMessage processRequest"));
             
@@ -836,5 +1457,456 @@ protected:
     }
 };
 
+/**********
+    Batch,
+    BatchResult
+**********/
+#define BatchMaxItems 16
+
+// Several requests in one frame; items run in order and every item gets a
+// slot in BatchResult (the serialized reply, or null when it had none).
+// A batch of more than BatchMaxItems is refused whole with ResOk(false),
+// none of its items run.
+class BatchResultMessage : public MessageBase {
+public:
+    std::vector<std::string> results;
+
+    BatchResultMessage() {
+        type = (MessageType)MessageTypeReg::BatchResult;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        nlohmann::json j = nlohmann::json::array();
+        for (auto &r : results)
+        {
+            if (r.empty())
+                j.push_back(nullptr);
+            else
+                j.push_back(nlohmann::json::parse(r, nullptr, false));
+        }
+        doc["results"] = j;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        results.clear();
+        for (auto &it : doc["results"])
+            results.push_back(it.is_null() ? std::string() : it.dump());
+    }
+};
+
+class BatchMessage : public Detachable<BatchMessage> {
+public:
+    std::vector<std::string> items;
+
+    BatchMessage() {
+        type = (MessageType)MessageTypeReg::Batch;
+    }
+
+    static uint32_t batches() { return stats().batches; }
+    static uint32_t itemsTotal() { return stats().items; }
+    static uint32_t roundTripsSaved() { return stats().items - stats().batches; }
+    static uint64_t handleMicros() { return stats().micros; }
+    static uint32_t oversized() { return stats().oversized; }
+
+protected:
+    struct Stats {
+        uint32_t batches = 0;
+        uint32_t items = 0;
+        uint64_t micros = 0;
+        uint32_t oversized = 0;
+    };
+
+    static Stats &stats()
+    {
+        static Stats st;
+        return st;
+    }
+
+    void serializeExtraFields(json &doc) override {
+        nlohmann::json j = nlohmann::json::array();
+        for (auto &item : items)
+            j.push_back(nlohmann::json::parse(item, nullptr, false));
+        doc["items"] = j;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        items.clear();
+        for (auto &it : doc["items"])
+            items.push_back(it.dump());
+    }
+
+    MessageBase *handleRequest(void *context) override {
+        logColor(LColor::Yellow, F("Batch processRequest items = %d"), (int)items.size());
+        if (items.size() > BatchMaxItems)
+        {
+            logColor(LColor::Red, F("Batch of %d items refused, at most %d"), (int)items.size(), BatchMaxItems);
+            stats().oversized++;
+            ResOk *res = new ResOk(false);
+            res->destinationAddress = sourceAddress;
+            res->sourceAddress = destinationAddress;
+            res->requestUUID = requestUUID;
+            return res;
+        }
+        uint32_t start = micros();
+
+        auto res = new BatchResultMessage;
+        res->destinationAddress = sourceAddress;
+        res->sourceAddress = destinationAddress;
+        res->requestUUID = requestUUID;
+
+        size_t count = items.size();
+        for (size_t i = 0; i < count; i++)
+        {
+            std::string result;
+            MessageBase *item = MessageBase::createInstance(items[i]);
+            if (item && item->type != (MessageType)MessageTypeReg::Batch)
+            {
+                item->sourceAddress = sourceAddress;
+                item->destinationAddress = destinationAddress;
+                // we are on a dispatcher worker, so LockRequest items run inline
+                MessageBase *itemRes = item->processRequest(context);
+                if (itemRes)
+                {
+                    ReplySerializer::serialize(itemRes, result);
+                    delete itemRes;
+                }
+            }
+            delete item;
+            res->results.push_back(result);
+        }
+
+        auto &st = stats();
+        st.batches++;
+        st.items += count;
+        st.micros += micros() - start;
+        return res;
+    }
+};
+
+/**********
+    GetThermal,
+    ThermalStatus
+**********/
+#define ThermalStatusBuckets 10
+
+class ThermalStatusMessage : public MessageBase {
+public:
+    nlohmann::json data;
+
+    ThermalStatusMessage() {
+        type = (MessageType)MessageTypeReg::ThermalStatus;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["thermal"] = data;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        data = doc.value("thermal", nlohmann::json::object());
+    }
+
+    MessageBase *processRequest(void *context) override {
+        logColor(LColor::Yellow, F("ThermalStatusMessage processRequest"));
+            return nullptr;
+    }
+};
+
+class GetThermalMessage : public Detachable<GetThermalMessage> {
+public:
+    int buckets = ThermalStatusBuckets;
+
+    GetThermalMessage() {
+        type = (MessageType)MessageTypeReg::GetThermal;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["buckets"] = buckets;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        buckets = doc.value("buckets", ThermalStatusBuckets);
+    }
+
+    MessageBase *handleRequest(void *context) override {
+        logColor(LColor::Yellow, F("GetThermal processRequest"));
+
+            auto res = new ThermalStatusMessage;
+            res->destinationAddress = sourceAddress;
+            res->sourceAddress = destinationAddress;
+            res->requestUUID = requestUUID;
+            ThermalMonitor::instance().toJson(res->data, buckets < 0 ? 0 : std::min(buckets, ThermalBuckets));
+
+            return res;
+    }
+};
+
+// Admin message (changes the lock or reads who used it): the sender must
+// be confirmed and prove its session key with AdminAuth over signedFields()
+// and the open nonce it holds
+class AdminRequest : public LockRequest {
+public:
+    std::string nonce;
+    std::string auth;
+
+protected:
+    virtual std::string signedFields() const = 0;
+
+    // spends `nonce`; a confirmed peer gets the next one pushed either way
+    bool authorized(void *context) const
+    {
+        if (!DeviceAccess::instance().isConfirmed(sourceAddress))
+            return false;
+        bool ok = AdminAuth::check(sourceAddress, (int)type, requestUUID, nonce, signedFields(), auth, millis());
+        OpenNonceMessage::offer(context, sourceAddress, destinationAddress);
+        return ok;
+    }
+};
+
+/**********
+    GetAuditLog,
+    AuditLogPage
+**********/
+class AuditLogPageMessage : public MessageBase {
+public:
+    nlohmann::json page;
+
+    AuditLogPageMessage() {
+        type = (MessageType)MessageTypeReg::AuditLogPage;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["page"] = page;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        page = doc.value("page", nlohmann::json::object());
+    }
+
+    MessageBase *processRequest(void *context) override {
+        logColor(LColor::Yellow, F("AuditLogPage processRequest"));
+            return nullptr;
+    }
+};
+
+// entries with seq >= since; page on with the returned "next". Admin
+// messages only, like the /audit page.
+class GetAuditLogMessage : public Detachable<GetAuditLogMessage, AdminRequest> {
+public:
+    uint32_t since = 0;
+    int count = AuditPageMax;
+
+    GetAuditLogMessage() {
+        type = (MessageType)MessageTypeReg::GetAuditLog;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["since"] = since;
+        doc["count"] = count;
+        doc["nonce"] = nonce;
+        doc["auth"] = auth;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        since = doc.value("since", 0u);
+        count = doc.value("count", AuditPageMax);
+        nonce = doc.value("nonce", "");
+        auth = doc.value("auth", "");
+    }
+
+    std::string signedFields() const override { return std::to_string(since) + "|" + std::to_string(count); }
+
+    MessageBase *handleRequest(void *context) override {
+        logColor(LColor::Yellow, F("GetAuditLog processRequest since = %u"), since);
+
+            auto res = new AuditLogPageMessage;
+            res->destinationAddress = sourceAddress;
+            res->sourceAddress = destinationAddress;
+            res->requestUUID = requestUUID;
+            if (!authorized(context)) {
+                res->page = {{"error", "unauthorized"}};
+                return res;
+            }
+            auditLog.page(since, count < 0 ? 0 : count, res->page);
+
+            return res;
+    }
+};
+
+/**********
+    SetApiToken
+**********/
+// Bearer token of the LAN admin API (/api/devices). Only a confirmed device
+// holding its session key may set it; an empty token switches the API off.
+// "token" is encrypted as AdminAuth::reveal expects, under the name "token".
+class SetApiTokenMessage : public Detachable<SetApiTokenMessage, AdminRequest> {
+public:
+    std::string token;
+
+    SetApiTokenMessage() {
+        type = (MessageType)MessageTypeReg::SetApiToken;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["token"] = token;
+        doc["nonce"] = nonce;
+        doc["auth"] = auth;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        token = doc.value("token", "");
+        nonce = doc.value("nonce", "");
+        auth = doc.value("auth", "");
+    }
+
+    std::string signedFields() const override { return token; }
+
+    MessageBase *handleRequest(void *context) override {
+        logColor(LColor::Yellow, F("SetApiToken processRequest"));
+
+            ResOk *res = new ResOk;
+            res->destinationAddress = sourceAddress;
+            res->sourceAddress = destinationAddress;
+            res->requestUUID = requestUUID;
+            std::string plain;
+            res->status = authorized(context) &&
+                          AdminAuth::reveal(sourceAddress, (int)type, requestUUID, nonce, "token", token, plain) &&
+                          setApiToken(plain);
+
+            return res;
+    }
+};
+
+/**********
+    OtaBegin,
+    OtaChunk,
+    OtaStatus
+**********/
+// largest decoded chunk accepted over BLE
+#define OtaBleChunkMax 4096
+
+extern OtaUpdater ota;
+
+class OtaStatusMessage : public MessageBase {
+public:
+    nlohmann::json status;
+
+    OtaStatusMessage() {
+        type = (MessageType)MessageTypeReg::OtaStatus;
+    }
+
+    static OtaStatusMessage *replyTo(const MessageBase *request, OtaUpdater::Result result) {
+        auto res = new OtaStatusMessage;
+        res->destinationAddress = request->sourceAddress;
+        res->sourceAddress = request->destinationAddress;
+        res->requestUUID = request->requestUUID;
+        ota.toJson(res->status, result);
+        return res;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["ota"] = status;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        status = doc.value("ota", nlohmann::json::object());
+    }
+
+    MessageBase *processRequest(void *context) override {
+        logColor(LColor::Yellow, F("OtaStatus processRequest"));
+            return nullptr;
+    }
+};
+
+// Starts an update, or asks where an interrupted one continues: the reply's
+// offset is the first byte still wanted. Confirmed devices holding their
+// session key only; "signature" (base64) is the publisher's signature over
+// the digest, required when the firmware was built with a signing key.
+class OtaBeginMessage : public Detachable<OtaBeginMessage, AdminRequest> {
+public:
+    uint32_t size = 0;
+    std::string sha256;
+    std::string signature;
+
+    OtaBeginMessage() {
+        type = (MessageType)MessageTypeReg::OtaBegin;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["size"] = size;
+        doc["sha256"] = sha256;
+        doc["signature"] = signature;
+        doc["nonce"] = nonce;
+        doc["auth"] = auth;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        size = doc.value("size", 0u);
+        sha256 = doc.value("sha256", "");
+        signature = doc.value("signature", "");
+        nonce = doc.value("nonce", "");
+        auth = doc.value("auth", "");
+    }
+
+    std::string signedFields() const override { return std::to_string(size) + "|" + sha256 + "|" + signature; }
+
+    MessageBase *handleRequest(void *context) override {
+        logColor(LColor::Yellow, F("OtaBegin processRequest size = %u"), size);
+
+            if (!authorized(context))
+                return OtaStatusMessage::replyTo(this, OtaUpdater::Result::NotStarted);
+            std::vector<uint8_t> sig;
+            if (!signature.empty() && !Base64::decode(signature, sig))
+                return OtaStatusMessage::replyTo(this, OtaUpdater::Result::BadRequest);
+            uint32_t offset;
+            return OtaStatusMessage::replyTo(this, ota.begin(size, sha256, sig, offset));
+    }
+};
+
+// One piece of the image, base64 in "data", starting at "offset"
+class OtaChunkMessage : public Detachable<OtaChunkMessage, AdminRequest> {
+public:
+    uint32_t offset = 0;
+    std::string data;
+
+    OtaChunkMessage() {
+        type = (MessageType)MessageTypeReg::OtaChunk;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["offset"] = offset;
+        doc["data"] = data;
+        doc["nonce"] = nonce;
+        doc["auth"] = auth;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        offset = doc.value("offset", 0u);
+        data = doc.value("data", "");
+        nonce = doc.value("nonce", "");
+        auth = doc.value("auth", "");
+    }
+
+    std::string signedFields() const override { return std::to_string(offset) + "|" + data; }
+
+    MessageBase *handleRequest(void *context) override {
+            if (!authorized(context))
+                return OtaStatusMessage::replyTo(this, OtaUpdater::Result::NotStarted);
+            std::vector<uint8_t> raw;
+            if (!Base64::decode(data, raw) || raw.size() > OtaBleChunkMax)
+                return OtaStatusMessage::replyTo(this, OtaUpdater::Result::BadRequest);
+            uint32_t next;
+            return OtaStatusMessage::replyTo(this, ota.write(offset, raw.data(), raw.size(), millis(), next));
+    }
+};
+
 #endif
 
@@ -0,0 +1,146 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <Arduino.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "MessageBase.h"
+
+#define ResponseCacheEntries 8
+#define ResponseCacheBytes 8192
+
+// Bounded LRU of recent (source address, requestUUID) -> serialized response.
+// A retried request is answered by rebuilding the reply from the cached
+// bytes instead of running its handler again. Entries of a peer go when its
+// link drops or it registers a new key: replies made for the old session
+// must not be replayed into the new one.
+class ResponseCache {
+public:
+    static ResponseCache &instance()
+    {
+        static ResponseCache cache;
+        return cache;
+    }
+
+    // The cached reply to a retry of `request`, or nullptr. Checked before
+    // admission control and queueing, so a retry costs neither.
+    MessageBase *replay(const MessageBase *request)
+    {
+        if (request->requestUUID.empty())
+            return nullptr;
+        std::string bytes;
+        if (!lookup(keyOf(request), bytes))
+            return nullptr;
+        return MessageBase::createInstance(bytes);
+    }
+
+    // Runs the handler and keeps its reply for replay()
+    template<typename Handler>
+    MessageBase *serve(MessageBase *request, Handler handler)
+    {
+        uint32_t start = micros();
+        MessageBase *res = handler();
+        uint32_t elapsed = micros() - start;
+        if (res && !request->requestUUID.empty()) {
+            std::string bytes;
+            if (serializer)
+                serializer(res, bytes);
+            else
+                bytes = res->serialize();
+            store(keyOf(request), std::move(bytes), elapsed);
+        }
+        return res;
+    }
+
+    using Serializer = void (*)(MessageBase *message, std::string &out);
+
+    void setSerializer(Serializer fn) { serializer = fn; }
+
+    void invalidate(const std::string &address)
+    {
+        Guard guard(mutex);
+        std::string prefix = address + "|";
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->key.compare(0, prefix.size(), prefix) == 0) {
+                totalBytes -= it->bytes.size();
+                index.erase(it->key);
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    uint32_t lookups() const { return lookupCount; }
+    uint32_t hits() const { return hitCount; }
+    float hitRate() const { return lookupCount ? (float)hitCount / lookupCount : 0.0f; }
+    uint64_t savedMicros() const { return savedUs; }
+    size_t size() const { return entries.size(); }
+    size_t bytes() const { return totalBytes; }
+
+private:
+    struct Entry {
+        std::string key;
+        std::string bytes;
+        uint32_t handlerMicros;
+    };
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    ResponseCache() : mutex(xSemaphoreCreateMutex()) {}
+
+    static std::string keyOf(const MessageBase *request)
+    {
+        return request->sourceAddress + "|" + request->requestUUID;
+    }
+
+    bool lookup(const std::string &key, std::string &bytes)
+    {
+        Guard guard(mutex);
+        lookupCount++;
+        auto it = index.find(key);
+        if (it == index.end())
+            return false;
+        entries.splice(entries.begin(), entries, it->second);
+        hitCount++;
+        savedUs += it->second->handlerMicros;
+        bytes = it->second->bytes;
+        return true;
+    }
+
+    void store(const std::string &key, std::string bytes, uint32_t handlerMicros)
+    {
+        if (bytes.size() > ResponseCacheBytes)
+            return;
+        Guard guard(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            totalBytes -= it->second->bytes.size();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        totalBytes += bytes.size();
+        entries.push_front(Entry{key, std::move(bytes), handlerMicros});
+        index[key] = entries.begin();
+        while (entries.size() > ResponseCacheEntries || totalBytes > ResponseCacheBytes) {
+            totalBytes -= entries.back().bytes.size();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    SemaphoreHandle_t mutex;
+    Serializer serializer = nullptr;
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t totalBytes = 0;
+    uint32_t lookupCount = 0;
+    uint32_t hitCount = 0;
+    uint64_t savedUs = 0;
+};
+
+#endif
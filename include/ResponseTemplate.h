@@ -0,0 +1,115 @@
+#ifndef RESPONSETEMPLATE_H
+#define RESPONSETEMPLATE_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include "MessageBase.h"
+
+// A constant-shape reply serialized once. The prototype is serialized with
+// marker values in the addressing fields; render() then only splices the
+// real addresses and requestUUID between the fixed pieces, into a buffer
+// the caller keeps around.
+class ResponseTemplate {
+public:
+    enum Field {
+        Literal = -1,
+        Source,
+        Destination,
+        RequestUUID
+    };
+
+    void build(MessageBase &prototype)
+    {
+        static const char *markers[] = {"@@src@@", "@@dst@@", "@@uuid@@"};
+        prototype.sourceAddress = markers[Source];
+        prototype.destinationAddress = markers[Destination];
+        prototype.requestUUID = markers[RequestUUID];
+        std::string text = prototype.serialize();
+
+        pieces.clear();
+        fixedBytes = 0;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t next = std::string::npos;
+            int field = Literal;
+            for (int f = Source; f <= RequestUUID; f++) {
+                size_t at = text.find(markers[f], pos);
+                if (at < next) {
+                    next = at;
+                    field = f;
+                }
+            }
+            if (next == std::string::npos) {
+                addLiteral(text.substr(pos));
+                break;
+            }
+            if (next > pos)
+                addLiteral(text.substr(pos, next - pos));
+            pieces.push_back(Piece{std::string(), field});
+            pos = next + strlen(markers[field]);
+        }
+    }
+
+    bool isBuilt() const { return !pieces.empty(); }
+
+    // rendered length before any escaping of the spliced fields
+    size_t size(const std::string &source, const std::string &destination, const std::string &uuid) const
+    {
+        return fixedBytes + source.size() + destination.size() + uuid.size();
+    }
+
+    void render(const std::string &source, const std::string &destination, const std::string &uuid,
+                std::string &out) const
+    {
+        out.clear();
+        out.reserve(fixedBytes + source.size() + destination.size() + uuid.size() + 8);
+        for (auto &piece : pieces) {
+            switch (piece.field) {
+                case Source: appendEscaped(out, source); break;
+                case Destination: appendEscaped(out, destination); break;
+                case RequestUUID: appendEscaped(out, uuid); break;
+                default: out += piece.text; break;
+            }
+        }
+    }
+
+private:
+    struct Piece {
+        std::string text;
+        int field;
+    };
+
+    void addLiteral(std::string text)
+    {
+        fixedBytes += text.size();
+        pieces.push_back(Piece{std::move(text), Literal});
+    }
+
+    // the same escapes nlohmann::json::dump writes, so a rendered reply is
+    // byte for byte what serialize() would have made
+    static void appendEscaped(std::string &out, const std::string &value)
+    {
+        static const char hex[] = "0123456789abcdef";
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t') {
+                out += '\\';
+                out += c == '\b' ? 'b' : c == '\f' ? 'f' : c == '\n' ? 'n' : c == '\r' ? 'r' : 't';
+            } else if ((unsigned char)c < 0x20) {
+                out += "\\u00";
+                out += hex[(c >> 4) & 0xf];
+                out += hex[c & 0xf];
+            } else {
+                out += c;
+            }
+        }
+    }
+
+    std::vector<Piece> pieces;
+    size_t fixedBytes = 0;
+};
+
+#endif
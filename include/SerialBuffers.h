@@ -0,0 +1,115 @@
+#ifndef SERIALBUFFERS_H
+#define SERIALBUFFERS_H
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+#define SerialBufferReserve 512
+#define SerialBufferPool 4
+// buffers that grew beyond this are freed instead of pooled
+#define SerialBufferKeepBytes 8192
+
+// Pool of serialization buffers. A reply is serialized into a buffer taken
+// from here, a fragmented transfer keeps that buffer until the last ack and
+// then hands it back, so steady-state replies reuse capacity instead of
+// allocating a fresh string (and chunk copies) per message.
+class SerialBuffers {
+public:
+    struct Stats {
+        uint32_t taken = 0;
+        uint32_t reused = 0;
+        uint32_t allocated = 0;
+        uint32_t grown = 0;
+        uint32_t truncated = 0;
+        uint32_t serialized = 0;
+        uint32_t skipped = 0;
+        uint64_t bytesSerialized = 0;
+        uint64_t bytesCopied = 0;
+    };
+
+    static SerialBuffers &instance()
+    {
+        static SerialBuffers buffers;
+        return buffers;
+    }
+
+    // a buffer with at least `expected` bytes of capacity
+    std::string take(size_t expected)
+    {
+        std::string buf;
+        {
+            Guard guard(mutex);
+            counters.taken++;
+            if (!pool.empty()) {
+                buf.swap(pool.back());
+                pool.pop_back();
+                counters.reused++;
+            } else {
+                counters.allocated++;
+            }
+        }
+        size_t want = expected > SerialBufferReserve ? expected : SerialBufferReserve;
+        if (buf.capacity() < want) {
+            if (buf.capacity())
+                counters.grown++;
+            buf.reserve(want);
+        }
+        return buf;
+    }
+
+    void give(std::string &&buf)
+    {
+        if (buf.capacity() > SerialBufferKeepBytes)
+            return;
+        buf.clear();
+        Guard guard(mutex);
+        if (pool.size() < SerialBufferPool)
+            pool.push_back(std::move(buf));
+    }
+
+    void countSerialized(size_t bytes, size_t capacityBefore, size_t capacityAfter)
+    {
+        Guard guard(mutex);
+        counters.serialized++;
+        counters.bytesSerialized += bytes;
+        if (capacityAfter != capacityBefore)
+            counters.grown++;
+    }
+
+    void countCopied(size_t bytes)
+    {
+        Guard guard(mutex);
+        counters.bytesCopied += bytes;
+    }
+
+    void countSkipped()
+    {
+        Guard guard(mutex);
+        counters.skipped++;
+    }
+
+    void countTruncated()
+    {
+        Guard guard(mutex);
+        counters.truncated++;
+    }
+
+    size_t pooled() const { return pool.size(); }
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    SerialBuffers() : mutex(xSemaphoreCreateMutex()) {}
+
+    SemaphoreHandle_t mutex;
+    std::vector<std::string> pool;
+    Stats counters;
+};
+
+#endif
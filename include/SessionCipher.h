@@ -0,0 +1,177 @@
+#ifndef SESSIONCIPHER_H
+#define SESSIONCIPHER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <aes.hpp>
+
+// AES-CMAC (RFC 4493) under one session key. The key schedule and the two
+// CMAC subkeys are computed once when the session key is installed and
+// shared read-only by every handler afterwards; AES_ECB_encrypt takes a
+// const context, so concurrent workers need no lock.
+//
+// This is the firmware's own use of the session key: open nonce proofs, the
+// MAC on admin requests and the secrets those requests carry. The two-step open and the encryptMessageAES
+// proofs of older apps stay with SecureConnection: their mode, padding and
+// encoding are the library's wire format, which phones in the field
+// already speak, and that code is not in this tree. Those calls still
+// expand the key each time; stats() counts them as `legacy`.
+class SessionCipher {
+public:
+    struct Stats {
+        std::atomic<uint32_t> contexts{0};
+        std::atomic<uint32_t> expandUs{0};
+        std::atomic<uint32_t> ops{0};
+        std::atomic<uint32_t> opBytes{0};
+        std::atomic<uint32_t> opUs{0};
+        std::atomic<uint32_t> legacyOps{0};    // decryptMessageAES in the library
+        std::atomic<uint32_t> legacyUs{0};
+    };
+
+    // `key` is the session key as registered: AES_KEYLEN raw bytes. Any
+    // other length leaves the cipher invalid.
+    explicit SessionCipher(const std::string &key)
+    {
+        if (key.size() != AES_KEYLEN)
+            return;
+        uint32_t start = micros();
+        AES_init_ctx(&ctx, reinterpret_cast<const uint8_t *>(key.data()));
+        uint8_t l[AES_BLOCKLEN] = {};
+        AES_ECB_encrypt(&ctx, l);
+        doubleBlock(l, k1);
+        doubleBlock(k1, k2);
+        memset(l, 0, sizeof(l));
+        stats().expandUs += micros() - start;
+        stats().contexts++;
+        ok = true;
+    }
+
+    bool valid() const { return ok; }
+
+    void mac(const std::string &message, uint8_t tag[AES_BLOCKLEN]) const
+    {
+        uint32_t start = micros();
+        auto data = reinterpret_cast<const uint8_t *>(message.data());
+        size_t blocks = message.empty() ? 1 : (message.size() + AES_BLOCKLEN - 1) / AES_BLOCKLEN;
+        bool whole = !message.empty() && message.size() % AES_BLOCKLEN == 0;
+
+        memset(tag, 0, AES_BLOCKLEN);
+        for (size_t i = 0; i + 1 < blocks; i++) {
+            for (size_t j = 0; j < AES_BLOCKLEN; j++)
+                tag[j] ^= data[i * AES_BLOCKLEN + j];
+            AES_ECB_encrypt(&ctx, tag);
+        }
+        size_t offset = (blocks - 1) * AES_BLOCKLEN;
+        size_t rest = message.size() - offset;
+        for (size_t j = 0; j < AES_BLOCKLEN; j++) {
+            uint8_t b = j < rest ? data[offset + j] : j == rest ? 0x80 : 0;
+            tag[j] ^= b ^ (whole ? k1[j] : k2[j]);
+        }
+        AES_ECB_encrypt(&ctx, tag);
+        count(message.size(), start);
+    }
+
+    // hex(mac(text)), the proof format of a pre-issued open nonce
+    std::string proof(const std::string &text) const
+    {
+        uint8_t tag[AES_BLOCKLEN];
+        mac(text, tag);
+        return toHex(std::string(reinterpret_cast<const char *>(tag), AES_BLOCKLEN));
+    }
+
+    // AES-CTR in place, encrypting and decrypting alike. The counter starts
+    // at mac(label), so a label must never be used twice under one key.
+    void crypt(const std::string &label, std::string &data) const
+    {
+        uint32_t start = micros();
+        uint8_t counter[AES_BLOCKLEN], stream[AES_BLOCKLEN];
+        mac(label, counter);
+        for (size_t offset = 0; offset < data.size(); offset += AES_BLOCKLEN) {
+            memcpy(stream, counter, AES_BLOCKLEN);
+            AES_ECB_encrypt(&ctx, stream);
+            for (size_t j = 0; j < AES_BLOCKLEN && offset + j < data.size(); j++)
+                data[offset + j] ^= stream[j];
+            for (int j = AES_BLOCKLEN - 1; j >= 0 && ++counter[j] == 0; j--) {
+            }
+        }
+        count(data.size(), start);
+    }
+
+    static std::string toHex(const std::string &bytes)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(bytes.size() * 2, '0');
+        for (size_t i = 0; i < bytes.size(); i++) {
+            hex[2 * i] = digits[(uint8_t)bytes[i] >> 4];
+            hex[2 * i + 1] = digits[(uint8_t)bytes[i] & 0x0f];
+        }
+        return hex;
+    }
+
+    // false when `hex` is not whole bytes of hex digits
+    static bool fromHex(const std::string &hex, std::string &bytes)
+    {
+        if (hex.size() % 2)
+            return false;
+        bytes.resize(hex.size() / 2);
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int hi = nibble(hex[i]), lo = nibble(hex[i + 1]);
+            if (hi < 0 || lo < 0)
+                return false;
+            bytes[i / 2] = (char)(hi << 4 | lo);
+        }
+        return true;
+    }
+
+    static bool sameProof(const std::string &a, const std::string &b)
+    {
+        if (a.size() != b.size())
+            return false;
+        uint8_t diff = 0;
+        for (size_t i = 0; i < a.size(); i++)
+            diff |= (uint8_t)(tolower(a[i]) ^ tolower(b[i]));
+        return diff == 0;
+    }
+
+    static Stats &stats()
+    {
+        static Stats st;
+        return st;
+    }
+
+private:
+    static int nibble(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        c = tolower(c);
+        return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    }
+
+    // multiply by x in GF(2^128), RFC 4493 subkey generation
+    static void doubleBlock(const uint8_t in[AES_BLOCKLEN], uint8_t out[AES_BLOCKLEN])
+    {
+        uint8_t carry = in[0] & 0x80;
+        for (size_t i = 0; i < AES_BLOCKLEN - 1; i++)
+            out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+        out[AES_BLOCKLEN - 1] = (in[AES_BLOCKLEN - 1] << 1) ^ (carry ? 0x87 : 0);
+    }
+
+    static void count(size_t bytes, uint32_t start)
+    {
+        auto &st = stats();
+        st.ops++;
+        st.opBytes += bytes;
+        st.opUs += micros() - start;
+    }
+
+    AES_ctx ctx;
+    uint8_t k1[AES_BLOCKLEN] = {};
+    uint8_t k2[AES_BLOCKLEN] = {};
+    bool ok = false;
+};
+
+#endif
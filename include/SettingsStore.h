@@ -0,0 +1,206 @@
+#ifndef SETTINGSSTORE_H
+#define SETTINGSSTORE_H
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+enum class SettingType : uint8_t {
+    Str,
+    Blob,
+    I32,
+    U32,
+    U8
+};
+
+// Persistent key/value storage for one namespace. Numbers travel as their
+// raw little-endian bytes in `value`.
+class SettingsBackend {
+public:
+    virtual ~SettingsBackend() = default;
+    virtual bool open(const char *ns) = 0;
+    virtual bool read(const std::string &key, SettingType type, std::string &value) = 0;
+    virtual bool write(const std::string &key, SettingType type, const std::string &value) = 0;
+    virtual bool erase(const std::string &key) = 0;
+    virtual bool commit() = 0;
+};
+
+// Write-back cache over a SettingsBackend. Reads go to flash once per key,
+// writes of an unchanged value are dropped, and puts only touch RAM: the
+// backend sees changed keys at flush(), each written once however often it
+// was put, followed by a single commit.
+class SettingsStore {
+public:
+    struct Stats {
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+        uint32_t commits = 0;
+        uint32_t keysWritten = 0;
+        uint32_t bytesWritten = 0;
+        uint32_t skippedWrites = 0;
+    };
+
+    explicit SettingsStore(SettingsBackend &backend) : backend(backend), mutex(xSemaphoreCreateMutex()) {}
+
+    bool begin(const char *ns) { return backend.open(ns); }
+
+    std::string getString(const char *key, const std::string &def = "")
+    {
+        std::string value;
+        return get(key, SettingType::Str, value) ? value : def;
+    }
+
+    void putString(const char *key, const std::string &value) { put(key, SettingType::Str, value); }
+
+    size_t getBytes(const char *key, void *buf, size_t len)
+    {
+        std::string value;
+        if (!get(key, SettingType::Blob, value) || value.size() > len)
+            return 0;
+        memcpy(buf, value.data(), value.size());
+        return value.size();
+    }
+
+    void putBytes(const char *key, const void *buf, size_t len)
+    {
+        put(key, SettingType::Blob, std::string((const char *)buf, len));
+    }
+
+    int32_t getInt(const char *key, int32_t def = 0) { return getNumber(key, SettingType::I32, def); }
+    void putInt(const char *key, int32_t value) { putNumber(key, SettingType::I32, value); }
+    uint32_t getUInt(const char *key, uint32_t def = 0) { return getNumber(key, SettingType::U32, def); }
+    void putUInt(const char *key, uint32_t value) { putNumber(key, SettingType::U32, value); }
+    bool getBool(const char *key, bool def = false) { return getNumber<uint8_t>(key, SettingType::U8, def); }
+    void putBool(const char *key, bool value) { putNumber<uint8_t>(key, SettingType::U8, value); }
+
+    void remove(const char *key)
+    {
+        Guard guard(mutex);
+        auto &e = cache[key];
+        if (e.loaded && !e.present)
+            return;
+        e.loaded = true;
+        e.present = false;
+        e.value.clear();
+        e.dirty = true;
+    }
+
+    // Write every dirty key and commit once
+    bool flush()
+    {
+        Guard guard(mutex);
+        bool any = false;
+        bool ok = true;
+        for (auto &it : cache) {
+            auto &e = it.second;
+            if (!e.dirty)
+                continue;
+            if (e.present) {
+                ok &= backend.write(it.first, e.type, e.value);
+                counters.bytesWritten += it.first.size() + e.value.size();
+            } else {
+                backend.erase(it.first);
+            }
+            counters.keysWritten++;
+            e.dirty = false;
+            any = true;
+        }
+        if (any) {
+            ok &= backend.commit();
+            counters.commits++;
+        }
+        return ok;
+    }
+
+    bool isDirty()
+    {
+        Guard guard(mutex);
+        for (auto &it : cache) {
+            if (it.second.dirty)
+                return true;
+        }
+        return false;
+    }
+
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    struct Entry {
+        SettingType type = SettingType::Str;
+        std::string value;
+        bool loaded = false;
+        bool present = false;
+        bool dirty = false;
+    };
+
+    bool get(const char *key, SettingType type, std::string &value)
+    {
+        Guard guard(mutex);
+        auto &e = cache[key];
+        if (e.loaded) {
+            counters.hits++;
+        } else {
+            counters.misses++;
+            e.type = type;
+            e.present = backend.read(key, type, e.value);
+            e.loaded = true;
+        }
+        if (!e.present || e.type != type)
+            return false;
+        value = e.value;
+        return true;
+    }
+
+    void put(const char *key, SettingType type, const std::string &value)
+    {
+        Guard guard(mutex);
+        auto &e = cache[key];
+        if (!e.loaded) {
+            counters.misses++;
+            e.type = type;
+            e.present = backend.read(key, type, e.value);
+            e.loaded = true;
+        }
+        if (e.present && e.type == type && e.value == value) {
+            counters.skippedWrites++;
+            return;
+        }
+        e.type = type;
+        e.value = value;
+        e.present = true;
+        e.dirty = true;
+    }
+
+    template<typename T>
+    T getNumber(const char *key, SettingType type, T def)
+    {
+        std::string value;
+        if (!get(key, type, value) || value.size() != sizeof(T))
+            return def;
+        T number;
+        memcpy(&number, value.data(), sizeof(T));
+        return number;
+    }
+
+    template<typename T>
+    void putNumber(const char *key, SettingType type, T number)
+    {
+        put(key, type, std::string((const char *)&number, sizeof(T)));
+    }
+
+    SettingsBackend &backend;
+    SemaphoreHandle_t mutex;
+    std::map<std::string, Entry> cache;
+    Stats counters;
+};
+
+#endif
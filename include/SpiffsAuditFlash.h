@@ -0,0 +1,61 @@
+#ifndef SPIFFSAUDITFLASH_H
+#define SPIFFSAUDITFLASH_H
+
+#include <SPIFFS.h>
+#include "AuditLog.h"
+
+#define AuditFileBytes (512 * sizeof(AuditRecord))
+
+// AuditFlash on a preallocated SPIFFS file, so the log never grows and
+// writes land in place
+class SpiffsAuditFlash : public AuditFlash {
+public:
+    explicit SpiffsAuditFlash(const char *path) : path(path) {}
+
+    bool begin()
+    {
+        if (SPIFFS.exists(path)) {
+            File f = SPIFFS.open(path, "r");
+            bool sized = f && f.size() == AuditFileBytes;
+            f.close();
+            if (sized)
+                return true;
+        }
+        File f = SPIFFS.open(path, "w");
+        if (!f)
+            return false;
+        uint8_t blank[64];
+        memset(blank, 0xff, sizeof(blank));
+        for (size_t done = 0; done < AuditFileBytes; done += sizeof(blank))
+            f.write(blank, AuditFileBytes - done < sizeof(blank) ? AuditFileBytes - done : sizeof(blank));
+        f.close();
+        return true;
+    }
+
+    size_t size() override { return AuditFileBytes; }
+
+    bool read(size_t offset, void *buf, size_t len) override
+    {
+        File f = SPIFFS.open(path, "r");
+        if (!f || !f.seek(offset))
+            return false;
+        bool ok = f.read((uint8_t *)buf, len) == len;
+        f.close();
+        return ok;
+    }
+
+    bool write(size_t offset, const void *buf, size_t len) override
+    {
+        File f = SPIFFS.open(path, "r+");
+        if (!f || !f.seek(offset))
+            return false;
+        bool ok = f.write((const uint8_t *)buf, len) == len;
+        f.close();
+        return ok;
+    }
+
+private:
+    const char *path;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef STATUSEVENTS_H
+#define STATUSEVENTS_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <string>
+#include <json.hpp>
+
+#define StatusEventClients 3
+#define StatusEventKeepAliveMs 15000
+
+// Server-Sent Events on top of the synchronous WebServer: the /events
+// handler hands over its client, which stays open, and every publish()
+// writes one "event:/data:" frame to all attached pages.
+class StatusEvents {
+public:
+    struct Stats {
+        uint32_t attached = 0;
+        uint32_t events = 0;
+        uint32_t bytes = 0;
+        uint32_t dropped = 0;
+    };
+
+    StatusEvents() : mutex(xSemaphoreCreateMutex()) {}
+
+    void attach(WiFiClient client)
+    {
+        static const char header[] =
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: keep-alive\r\n"
+            "Access-Control-Allow-Origin: *\r\n\r\n"
+            "retry: 3000\n\n";
+        Guard guard(mutex);
+        int slot = -1;
+        for (int i = 0; i < StatusEventClients; i++) {
+            if (!clients[i] || !clients[i].connected()) {
+                slot = i;
+                break;
+            }
+        }
+        // the oldest page gives way to the newest one
+        if (slot < 0) {
+            clients[0].stop();
+            counters.dropped++;
+            slot = 0;
+        }
+        clients[slot] = client;
+        clients[slot].write((const uint8_t *)header, sizeof(header) - 1);
+        counters.attached++;
+    }
+
+    bool hasClients()
+    {
+        Guard guard(mutex);
+        for (auto &c : clients) {
+            if (c && c.connected())
+                return true;
+        }
+        return false;
+    }
+
+    void publish(const char *event, const nlohmann::json &data)
+    {
+        std::string frame = "event: ";
+        frame += event;
+        frame += "\ndata: ";
+        frame += data.dump();
+        frame += "\n\n";
+        send(frame);
+        counters.events++;
+    }
+
+    // comment line so proxies and the browser keep idle streams open
+    void keepAlive(unsigned long nowMs)
+    {
+        if (nowMs - lastSendMs < StatusEventKeepAliveMs)
+            return;
+        send(": ping\n\n");
+    }
+
+    const Stats &stats() const { return counters; }
+
+private:
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    void send(const std::string &frame)
+    {
+        Guard guard(mutex);
+        for (auto &c : clients) {
+            if (!c)
+                continue;
+            if (!c.connected() || c.write((const uint8_t *)frame.data(), frame.size()) != frame.size()) {
+                c.stop();
+                c = WiFiClient();
+                counters.dropped++;
+                continue;
+            }
+            counters.bytes += frame.size();
+        }
+        lastSendMs = millis();
+    }
+
+    SemaphoreHandle_t mutex;
+    WiFiClient clients[StatusEventClients];
+    unsigned long lastSendMs = 0;
+    Stats counters;
+};
+
+#endif
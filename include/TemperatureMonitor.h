@@ -1,3 +1,6 @@
+#ifndef TEMPERATUREMONITOR_H
+#define TEMPERATUREMONITOR_H
+
 #include <driver/temp_sensor.h>
 #include <esp_adc_cal.h>
 
@@ -13,3 +16,5 @@ public:
         return celsius;
     }
 };
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef THERMALMONITOR_H
+#define THERMALMONITOR_H
+
+#include <Arduino.h>
+#include <json.hpp>
+#include "BleLockAndKey.h"
+#include "TemperatureMonitor.h"
+#include "ThermalPolicy.h"
+#include "MemoryBudget.h"
+
+// longest a background job waits for the chip to cool before running anyway
+#define ThermalMaxDeferMs 30000
+#define ThermalDeferPollMs 500
+
+// Samples the die temperature on its own task into a ThermalHistory and
+// tells background jobs (WiFi scans, RSA key generation that is not on a
+// phone's critical path) to hold off while the chip is hot.
+class ThermalMonitor {
+public:
+    static ThermalMonitor &instance()
+    {
+        static ThermalMonitor monitor;
+        return monitor;
+    }
+
+    void begin()
+    {
+        if (!task) {
+            xTaskCreate(sampleTask, "thermal", 3072, this, 1, &task);
+            MemoryBudget::instance().watchTask("thermal", task, 3072);
+        }
+    }
+
+    void setSource(TemperatureSource fn)
+    {
+        Guard guard(mutex);
+        sampler.setSource(fn);
+    }
+
+    bool isHot() const { return hot; }
+
+    // Block a background job while hot; returns how long it waited
+    uint32_t waitUntilCool(uint32_t maxMs = ThermalMaxDeferMs)
+    {
+        if (!hot)
+            return 0;
+        deferrals++;
+        unsigned long start = millis();
+        while (hot && millis() - start < maxMs)
+            delay(ThermalDeferPollMs);
+        uint32_t waited = millis() - start;
+        if (hot)
+            forced++;
+        deferredMs += waited;
+        return waited;
+    }
+
+    // summary plus the newest `buckets` history buckets, oldest first
+    void toJson(nlohmann::json &j, size_t buckets = ThermalBuckets)
+    {
+        Guard guard(mutex);
+        auto &history = sampler.samples();
+        j["celsius"] = history.last();
+        j["hot"] = sampler.isHot();
+        j["changes"] = sampler.changes();
+        j["deferrals"] = deferrals;
+        j["forced"] = forced;
+        j["deferredMs"] = deferredMs;
+        j["bucketSeconds"] = ThermalBucketSamples * ThermalSampleMs / 1000;
+        size_t n = history.size() < buckets ? history.size() : buckets;
+        auto list = nlohmann::json::array();
+        for (size_t i = history.size() - n; i < history.size(); i++) {
+            auto &b = history.at(i);
+            list.push_back({b.min, b.max, b.avg});
+        }
+        auto &open = history.current();
+        if (open.count)
+            list.push_back({open.min, open.max, open.avg});
+        j["history"] = list;
+    }
+
+private:
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    ThermalMonitor() : mutex(xSemaphoreCreateMutex()), sampler(TemperatureMonitor::getTemperature) {}
+
+    static void sampleTask(void *param)
+    {
+        auto self = static_cast<ThermalMonitor *>(param);
+        for (;;) {
+            self->sampleOnce();
+            vTaskDelay(pdMS_TO_TICKS(ThermalSampleMs));
+        }
+    }
+
+    void sampleOnce()
+    {
+        bool wasHot = hot;
+        ThermalBucket closed;
+        bool rolled;
+        {
+            Guard guard(mutex);
+            size_t before = sampler.samples().current().count;
+            hot = sampler.sample();
+            rolled = sampler.samples().current().count < before;
+            if (rolled)
+                closed = sampler.samples().at(sampler.samples().size() - 1);
+        }
+        if (hot != wasHot)
+            logColor(hot ? LColor::Red : LColor::Green, F("CPU %s: %.1f °C"), hot ? "hot, deferring background work" : "cooled down",
+                     sampler.samples().last());
+        if (rolled)
+            logColor(LColor::Green, F("CPU Temperature: min %.1f max %.1f avg %.1f °C"), closed.min, closed.max, closed.avg);
+    }
+
+    SemaphoreHandle_t mutex;
+    ThermalSampler sampler;
+    TaskHandle_t task = nullptr;
+    volatile bool hot = false;
+    uint32_t deferrals = 0;
+    uint32_t forced = 0;
+    uint32_t deferredMs = 0;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef THERMALPOLICY_H
+#define THERMALPOLICY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define ThermalSampleMs 2000
+// raw samples folded into one history bucket (1 min at ThermalSampleMs)
+#define ThermalBucketSamples 30
+// buckets kept, oldest dropped first (1 h)
+#define ThermalBuckets 60
+#define ThermalHotC 70.0f
+#define ThermalCoolC 62.0f
+
+struct ThermalBucket {
+    float min = 0;
+    float max = 0;
+    float avg = 0;
+    uint16_t count = 0;
+};
+
+// Fixed ring of min/max/avg buckets plus the bucket being filled
+class ThermalHistory {
+public:
+    void add(float celsius)
+    {
+        latest = celsius;
+        if (open.count == 0) {
+            open.min = open.max = celsius;
+            sum = 0;
+        }
+        if (celsius < open.min)
+            open.min = celsius;
+        if (celsius > open.max)
+            open.max = celsius;
+        sum += celsius;
+        open.count++;
+        open.avg = sum / open.count;
+        if (open.count >= ThermalBucketSamples) {
+            ring[head] = open;
+            head = (head + 1) % ThermalBuckets;
+            if (filled < ThermalBuckets)
+                filled++;
+            open = ThermalBucket();
+        }
+    }
+
+    float last() const { return latest; }
+    const ThermalBucket &current() const { return open; }
+    size_t size() const { return filled; }
+
+    // 0 is the oldest closed bucket
+    const ThermalBucket &at(size_t i) const
+    {
+        return ring[(head + ThermalBuckets - filled + i) % ThermalBuckets];
+    }
+
+private:
+    ThermalBucket ring[ThermalBuckets];
+    ThermalBucket open;
+    size_t head = 0;
+    size_t filled = 0;
+    float sum = 0;
+    float latest = 0;
+};
+
+// Hot/cool decision with hysteresis so work is not toggled around one value
+class ThermalPolicy {
+public:
+    ThermalPolicy(float hotC = ThermalHotC, float coolC = ThermalCoolC) : hotC(hotC), coolC(coolC) {}
+
+    bool update(float celsius)
+    {
+        if (!hot && celsius >= hotC) {
+            hot = true;
+            transitions++;
+        } else if (hot && celsius <= coolC) {
+            hot = false;
+            transitions++;
+        }
+        return hot;
+    }
+
+    bool isHot() const { return hot; }
+    uint32_t changes() const { return transitions; }
+
+private:
+    float hotC;
+    float coolC;
+    bool hot = false;
+    uint32_t transitions = 0;
+};
+
+using TemperatureSource = float (*)();
+
+// One sample = read the source, record it, re-evaluate the policy. No RTOS
+// or sensor dependency, so a synthetic source can drive it off-target.
+class ThermalSampler {
+public:
+    explicit ThermalSampler(TemperatureSource source, ThermalPolicy policy = ThermalPolicy())
+        : source(source), policy(policy) {}
+
+    bool sample()
+    {
+        float celsius = source();
+        history.add(celsius);
+        return policy.update(celsius);
+    }
+
+    void setSource(TemperatureSource fn) { source = fn; }
+    bool isHot() const { return policy.isHot(); }
+    uint32_t changes() const { return policy.changes(); }
+    const ThermalHistory &samples() const { return history; }
+
+private:
+    TemperatureSource source;
+    ThermalPolicy policy;
+    ThermalHistory history;
+};
+
+#endif
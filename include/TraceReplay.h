@@ -0,0 +1,170 @@
+#ifndef TRACEREPLAY_H
+#define TRACEREPLAY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "MessageTrace.h"
+
+// Dispatcher workers per class (Open, Handshake, Admin), as in Dispatcher::begin
+#define ReplayClasses 3
+#define ReplayDefaultPools {3, 2, 1}
+
+// Replays a GET /trace download on the host. Requests arrive at their
+// captured enqueue times (spread out or squeezed by `speed`) and queue for
+// the worker pool of their dispatch class; a worker serves a request for
+// the time a handler installed for its type takes, or for the captured
+// handler time when there is none. The report is the /trace/summary of
+// the replay next to that of the capture, so a field trace becomes a
+// benchmark that reruns the same message mix against changed handlers.
+//
+// The replay has no addresses: a request takes whichever worker of its
+// class frees up first instead of the one its peer is pinned to.
+// DispatchReplay runs the same records through the Dispatcher itself.
+class TraceReplay {
+public:
+    using Handler = std::function<void(const TraceRecord &rec)>;
+
+    // False with `error` set when `bytes` is not a whole trace download
+    bool load(const uint8_t *bytes, size_t size, std::string &error)
+    {
+        records.clear();
+        if (size < sizeof(TraceHeader)) {
+            error = "shorter than the header";
+            return false;
+        }
+        memcpy(&head, bytes, sizeof(head));
+        if (head.magic != TraceMagic) {
+            error = "not a trace";
+            return false;
+        }
+        if (head.version != TraceVersion || head.recordSize != sizeof(TraceRecord)) {
+            error = "trace version " + std::to_string(head.version) + " not supported";
+            return false;
+        }
+        if (size != sizeof(head) + (size_t)head.count * sizeof(TraceRecord)) {
+            error = "body does not hold the header's " + std::to_string(head.count) + " records";
+            return false;
+        }
+        records.resize(head.count);
+        if (head.count)
+            memcpy(records.data(), bytes + sizeof(head), head.count * sizeof(TraceRecord));
+        return true;
+    }
+
+    const TraceHeader &header() const { return head; }
+
+    // every record of the download, lost ones included
+    const std::vector<TraceRecord> &loaded() const { return records; }
+
+    // records overwritten during the download
+    size_t lost() const
+    {
+        return std::count_if(records.begin(), records.end(), [](const TraceRecord &r) { return r.flags & TraceFlagLost; });
+    }
+
+    void setHandler(uint8_t type, Handler handler) { handlers[type] = handler; }
+
+    void setPool(int cls, uint8_t workers)
+    {
+        if (cls >= 0 && cls < ReplayClasses && workers)
+            pools[cls] = workers;
+    }
+
+    // >1 brings arrivals closer together, <1 spreads them out
+    void setSpeed(double factor)
+    {
+        if (factor > 0)
+            speed = factor;
+    }
+
+    // {"replayed": {<type>: summary}, "captured": {<type>: summary},
+    //  "records", "lost"}; summaries as in MessageTrace::summary
+    void run(nlohmann::json &report)
+    {
+        uint32_t base;
+        auto order = arrivals(base);
+
+        std::vector<uint64_t> freeAt[ReplayClasses];
+        for (int c = 0; c < ReplayClasses; c++)
+            freeAt[c].assign(pools[c], 0);
+
+        std::map<uint8_t, MessageTrace::TypeSummary> replayed, captured;
+        for (auto rec : order) {
+            MessageTrace::add(captured[rec->type], *rec);
+            TraceRecord out = *rec;
+            uint8_t outcome = (rec->flags >> 2) & 0x03;
+            // 0 ran on a worker, 1 in place; refused and dropped never ran
+            if (outcome <= 1) {
+                uint64_t arrival = (uint64_t)((rec->enqueuedUs - base) / speed);
+                uint32_t service = serve(*rec);
+                uint64_t start = arrival;
+                if (outcome == 0) {
+                    auto &workers = freeAt[(rec->flags & 0x03) % ReplayClasses];
+                    auto worker = std::min_element(workers.begin(), workers.end());
+                    start = std::max(arrival, *worker);
+                    *worker = start + service;
+                }
+                out.waitUs = start - arrival;
+                out.handleUs = service;
+            }
+            MessageTrace::add(replayed[rec->type], out);
+        }
+
+        report = nlohmann::json::object();
+        report["records"] = records.size();
+        report["lost"] = lost();
+        report["replayed"] = toJson(replayed);
+        report["captured"] = toJson(captured);
+    }
+
+    // Records that survived the download in the order they arrived; `base`
+    // is the enqueue time of the first
+    std::vector<const TraceRecord *> arrivals(uint32_t &base) const
+    {
+        std::vector<const TraceRecord *> order;
+        for (auto &rec : records)
+            if (!(rec.flags & TraceFlagLost))
+                order.push_back(&rec);
+        // the ring holds requests in the order they finished
+        base = order.empty() ? 0 : order.front()->enqueuedUs;
+        for (auto rec : order)
+            if ((int32_t)(rec->enqueuedUs - base) < 0)
+                base = rec->enqueuedUs;
+        std::stable_sort(order.begin(), order.end(), [&](const TraceRecord *a, const TraceRecord *b) {
+            return a->enqueuedUs - base < b->enqueuedUs - base;
+        });
+        return order;
+    }
+
+    static nlohmann::json toJson(std::map<uint8_t, MessageTrace::TypeSummary> &types)
+    {
+        nlohmann::json j = nlohmann::json::object();
+        for (auto &it : types)
+            j[std::to_string(it.first)] = MessageTrace::toJson(it.second);
+        return j;
+    }
+
+private:
+    uint32_t serve(const TraceRecord &rec)
+    {
+        auto it = handlers.find(rec.type);
+        if (it == handlers.end())
+            return rec.handleUs;
+        auto start = std::chrono::steady_clock::now();
+        it->second(rec);
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    TraceHeader head{};
+    std::vector<TraceRecord> records;
+    std::map<uint8_t, Handler> handlers;
+    uint8_t pools[ReplayClasses] = ReplayDefaultPools;
+    double speed = 1.0;
+};
+
+#endif
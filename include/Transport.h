@@ -0,0 +1,491 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "FrameCodec.h"
+#include "ReqRes.h"
+#include "PendingRequests.h"
+#include "SerialBuffers.h"
+
+#define FrameDefaultMtu 185
+#define FrameMaxMtu 512
+// ATT write/notify header inside the MTU
+#define FrameAttOverhead 3
+
+// Framing layer for MessageBase traffic. Peers that announced their MTU with
+// TransportHello get replies larger than one MTU split into sequence-numbered
+// Fragment messages; up to `window` fragments are in flight before a
+// cumulative FragmentAck. Incoming fragments are reassembled in bounded
+// per-connection buffers and the rebuilt message is processed as usual.
+// Peers that never negotiated keep receiving monolithic messages.
+//
+// The data budget of a fragment is what is left of the MTU after the
+// envelope, measured per peer at negotiation by serializing a Fragment with
+// that peer's addresses and the widest header values; fragments are then
+// cut so that their data fits the budget after json escaping.
+class FrameTransport {
+public:
+    struct Stats {
+        uint32_t transfers = 0;
+        uint32_t fragmentsSent = 0;
+        uint32_t fragmentsReceived = 0;
+        uint32_t retransmits = 0;
+        uint32_t abortedTransfers = 0;
+        uint32_t reassembled = 0;
+        uint32_t reassemblyDrops = 0;
+        uint64_t bytesFramed = 0;
+        uint32_t refused = 0;
+        uint32_t malformed = 0;
+    };
+
+    static FrameTransport &instance()
+    {
+        static FrameTransport transport;
+        return transport;
+    }
+
+    // Dispatcher::Sender
+    static void send(void *context, MessageBase *message) { instance().sendMessage(context, message); }
+
+    // agreedWindow 0: the MTU leaves no room for framing, the peer keeps
+    // getting monolithic messages
+    void negotiate(const std::string &address, const std::string &lockAddress, uint16_t mtu, uint8_t window,
+                   uint16_t &agreedMtu, uint8_t &agreedWindow);
+
+    // fragment data budget for `address`, 0 when it does not take fragments
+    size_t payloadFor(const std::string &address)
+    {
+        Guard guard(mutex);
+        auto it = peers.find(address);
+        return it == peers.end() ? 0 : it->second.payload;
+    }
+
+    // largest single write `address` takes
+    size_t writeLimit(const std::string &address)
+    {
+        Guard guard(mutex);
+        auto it = peers.find(address);
+        return (it == peers.end() ? FrameDefaultMtu : it->second.mtu) - FrameAttOverhead;
+    }
+
+    size_t lastPayload() const { return lastNegotiatedPayload; }
+
+    // the peer disconnected
+    void forget(const std::string &address)
+    {
+        Guard guard(mutex);
+        peers.erase(address);
+        reassembly.forget(address);
+        for (auto it = outgoing.begin(); it != outgoing.end();) {
+            if (it->second.address == address)
+                it = finish(it);
+            else
+                ++it;
+        }
+    }
+
+    // told about every reply that goes out in fragments
+    using TransferHook = void (*)(const std::string &address);
+
+    void setTransferHook(TransferHook hook) { transferHook = hook; }
+
+    void sendMessage(void *context, MessageBase *message);
+    void onAck(void *context, const std::string &address, uint16_t id, uint16_t acked);
+    void onFragment(void *context, const std::string &address, const std::string &lockAddress,
+                    uint16_t id, uint16_t seq, uint16_t total, const std::string &data);
+
+    Stats stats()
+    {
+        Guard guard(mutex);
+        Stats st = counters;
+        st.reassembled = reassembly.stats().reassembled;
+        st.reassemblyDrops = reassembly.stats().drops;
+        return st;
+    }
+
+private:
+    struct Peer {
+        uint16_t mtu = FrameDefaultMtu;
+        uint8_t window = FrameDefaultWindow;
+        size_t payload = 0;
+    };
+    struct Transfer {
+        void *context = nullptr;
+        std::string address;
+        std::string lockAddress;
+        // serialized reply, fragments are cut from it by offset
+        std::string bytes;
+        FrameWindow window;
+    };
+    struct Guard {
+        explicit Guard(SemaphoreHandle_t m) : m(m) { xSemaphoreTake(m, portMAX_DELAY); }
+        ~Guard() { xSemaphoreGive(m); }
+        SemaphoreHandle_t m;
+    };
+
+    FrameTransport() : mutex(xSemaphoreCreateMutex()) {}
+
+    static size_t envelopeBytes(const std::string &address, const std::string &lockAddress);
+
+    static std::string transferKey(const std::string &address, uint16_t id)
+    {
+        return "frag:" + address + ":" + std::to_string(id);
+    }
+
+    // requestUUID of a fragment: short, it is paid for in every one
+    static std::string fragmentUUID(uint16_t id) { return "f" + std::to_string(id); }
+
+    static uint64_t outgoingKey(const std::string &address, uint16_t id)
+    {
+        return ((uint64_t)std::hash<std::string>()(address) << 16) | id;
+    }
+
+    // drop a transfer and return its buffer to the pool; mutex held
+    std::map<uint64_t, Transfer>::iterator finish(std::map<uint64_t, Transfer>::iterator it)
+    {
+        SerialBuffers::instance().give(std::move(it->second.bytes));
+        return outgoing.erase(it);
+    }
+
+    void pump(uint64_t key, bool resend);
+    void armTimer(uint64_t key, const Transfer &transfer);
+    void sendAck(void *context, const std::string &address, const std::string &lockAddress, uint16_t id, uint16_t acked);
+
+    SemaphoreHandle_t mutex;
+    std::map<std::string, Peer> peers;
+    std::map<uint64_t, Transfer> outgoing;
+    FrameReassembler reassembly;
+    uint16_t nextId = 1;
+    size_t lastNegotiatedPayload = 0;
+    TransferHook transferHook = nullptr;
+    Stats counters;
+};
+
+// client -> lock: announce ATT MTU and receive window; the lock answers
+// with the values it will use for this connection
+class TransportHello : public MessageBase {
+public:
+    uint16_t mtu = FrameDefaultMtu;
+    uint8_t window = FrameDefaultWindow;
+
+    TransportHello() {
+        type = (MessageType)MessageTypeReg::TransportHello;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["mtu"] = mtu;
+        doc["window"] = window;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        mtu = doc.value("mtu", FrameDefaultMtu);
+        window = doc.value("window", FrameDefaultWindow);
+    }
+
+    MessageBase *processRequest(void *context) override {
+        auto res = new TransportHello;
+        FrameTransport::instance().negotiate(sourceAddress, destinationAddress, mtu, window, res->mtu, res->window);
+        res->destinationAddress = sourceAddress;
+        res->sourceAddress = destinationAddress;
+        res->requestUUID = requestUUID;
+        return res;
+    }
+};
+
+class Fragment : public MessageBase {
+public:
+    uint16_t id = 0;
+    uint16_t seq = 0;
+    uint16_t total = 0;
+    std::string data;
+
+    Fragment() {
+        type = (MessageType)MessageTypeReg::Fragment;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["id"] = id;
+        doc["seq"] = seq;
+        doc["total"] = total;
+        doc["data"] = data;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        id = doc["id"];
+        seq = doc["seq"];
+        total = doc["total"];
+        data = doc["data"];
+    }
+
+    MessageBase *processRequest(void *context) override {
+        FrameTransport::instance().onFragment(context, sourceAddress, destinationAddress, id, seq, total, data);
+        return nullptr;
+    }
+};
+
+// cumulative: every fragment below `acked` has arrived
+class FragmentAck : public MessageBase {
+public:
+    uint16_t id = 0;
+    uint16_t acked = 0;
+
+    FragmentAck() {
+        type = (MessageType)MessageTypeReg::FragmentAck;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override {
+        doc["id"] = id;
+        doc["acked"] = acked;
+    }
+
+    void deserializeExtraFields(const json &doc) override {
+        id = doc["id"];
+        acked = doc["acked"];
+    }
+
+    MessageBase *processRequest(void *context) override {
+        FrameTransport::instance().onAck(context, sourceAddress, id, acked);
+        return nullptr;
+    }
+};
+
+inline size_t FrameTransport::envelopeBytes(const std::string &address, const std::string &lockAddress)
+{
+    Fragment frag;
+    frag.destinationAddress = address;
+    frag.sourceAddress = lockAddress;
+    frag.requestUUID = fragmentUUID(0xffff);
+    frag.id = 0xffff;
+    frag.seq = 0xffff;
+    frag.total = 0xffff;
+    return frag.serialize().size();
+}
+
+inline void FrameTransport::negotiate(const std::string &address, const std::string &lockAddress, uint16_t mtu,
+                                      uint8_t window, uint16_t &agreedMtu, uint8_t &agreedWindow)
+{
+    agreedMtu = mtu < FrameMaxMtu ? mtu : FrameMaxMtu;
+    agreedWindow = window == 0 ? 1 : (window < FrameMaxWindow ? window : FrameMaxWindow);
+    size_t envelope = envelopeBytes(address, lockAddress);
+    size_t room = agreedMtu > FrameAttOverhead + envelope ? agreedMtu - FrameAttOverhead - envelope : 0;
+    Guard guard(mutex);
+    if (room < FrameMinPayload) {
+        logColor(LColor::Yellow, F("MTU %u of %s leaves %u bytes per fragment, not framing"),
+                 (unsigned)agreedMtu, address.c_str(), (unsigned)room);
+        peers.erase(address);
+        counters.refused++;
+        agreedWindow = 0;
+        return;
+    }
+    peers[address] = Peer{agreedMtu, agreedWindow, room};
+    lastNegotiatedPayload = room;
+}
+
+inline void FrameTransport::sendMessage(void *context, MessageBase *message)
+{
+    std::string address = message->destinationAddress;
+    Peer peer;
+    {
+        Guard guard(mutex);
+        auto it = peers.find(address);
+        if (it == peers.end()) {
+            Dispatcher::sendRaw(context, message);
+            return;
+        }
+        peer = it->second;
+    }
+    size_t limit = peer.mtu - FrameAttOverhead;
+    // known to fit: no need to serialize it just to measure it
+    if (ReplySerializer::fits(message, limit)) {
+        SerialBuffers::instance().countSkipped();
+        Dispatcher::sendRaw(context, message);
+        return;
+    }
+
+    auto &buffers = SerialBuffers::instance();
+    std::string bytes = buffers.take(ReplySerializer::estimate(message));
+    if (!ReplySerializer::serializeInto(message, bytes, FrameMaxReassemblyBytes)) {
+        logColor(LColor::Red, F("Reply type %d is %u bytes, over the reassembly limit"), (int)message->type, (unsigned)bytes.size());
+        buffers.give(std::move(bytes));
+        delete message;
+        return;
+    }
+    if (bytes.size() <= limit) {
+        buffers.give(std::move(bytes));
+        Dispatcher::sendRaw(context, message);
+        return;
+    }
+
+    Transfer transfer;
+    if (!transfer.window.plan(bytes, peer.payload, peer.window)) {
+        logColor(LColor::Red, F("Reply type %d needs more than %u fragments"), (int)message->type, (unsigned)FrameMaxFragments);
+        buffers.give(std::move(bytes));
+        delete message;
+        return;
+    }
+    transfer.context = context;
+    transfer.address = address;
+    transfer.lockAddress = message->sourceAddress;
+    size_t size = bytes.size();
+    transfer.bytes = std::move(bytes);
+    delete message;
+
+    uint64_t key;
+    {
+        Guard guard(mutex);
+        uint16_t id = nextId++;
+        key = outgoingKey(address, id);
+        outgoing[key] = std::move(transfer);
+        counters.transfers++;
+        counters.bytesFramed += size;
+    }
+    if (transferHook)
+        transferHook(address);
+    pump(key, false);
+}
+
+inline void FrameTransport::pump(uint64_t key, bool resend)
+{
+    std::vector<Fragment *> batch;
+    Transfer snapshot;
+    {
+        Guard guard(mutex);
+        auto it = outgoing.find(key);
+        if (it == outgoing.end())
+            return;
+        auto &t = it->second;
+        if (resend) {
+            uint16_t resent = 0;
+            if (!t.window.timeout(resent)) {
+                counters.abortedTransfers++;
+                finish(it);
+                return;
+            }
+            counters.retransmits += resent;
+        }
+        size_t copied = 0;
+        uint16_t seq;
+        size_t offset, length;
+        while (t.window.next(seq, offset, length)) {
+            auto frag = new Fragment;
+            frag->destinationAddress = t.address;
+            frag->sourceAddress = t.lockAddress;
+            frag->requestUUID = fragmentUUID(key & 0xffff);
+            frag->id = key & 0xffff;
+            frag->seq = seq;
+            frag->total = t.window.total();
+            frag->data.assign(t.bytes, offset, length);
+            copied += length;
+            batch.push_back(frag);
+        }
+        SerialBuffers::instance().countCopied(copied);
+        counters.fragmentsSent += batch.size();
+        snapshot.context = t.context;
+        snapshot.address = t.address;
+    }
+    bool sent = true;
+    for (auto frag : batch) {
+        if (sent)
+            sent = Dispatcher::sendRaw(snapshot.context, frag);
+        else
+            delete frag;
+    }
+    if (!sent) {
+        // no retransmit can get further than this send did
+        Guard guard(mutex);
+        auto it = outgoing.find(key);
+        if (it != outgoing.end()) {
+            counters.abortedTransfers++;
+            finish(it);
+        }
+        return;
+    }
+    armTimer(key, snapshot);
+}
+
+inline void FrameTransport::armTimer(uint64_t key, const Transfer &transfer)
+{
+    std::string uuid = transferKey(transfer.address, key & 0xffff);
+    auto &pending = PendingRequests::instance();
+    pending.complete(uuid);
+    pending.add(uuid, transfer.address, (MessageType)MessageTypeReg::Fragment, nullptr,
+                [key](const std::string &, std::unique_ptr<MessageBase>) { FrameTransport::instance().pump(key, true); });
+}
+
+inline void FrameTransport::onAck(void *context, const std::string &address, uint16_t id, uint16_t acked)
+{
+    uint64_t key = outgoingKey(address, id);
+    {
+        Guard guard(mutex);
+        auto it = outgoing.find(key);
+        if (it == outgoing.end())
+            return;
+        auto &t = it->second;
+        t.window.ack(acked);
+        if (t.window.done()) {
+            finish(it);
+            PendingRequests::instance().complete(transferKey(address, id));
+            return;
+        }
+    }
+    pump(key, false);
+}
+
+inline void FrameTransport::sendAck(void *context, const std::string &address, const std::string &lockAddress, uint16_t id, uint16_t acked)
+{
+    auto ack = new FragmentAck;
+    ack->destinationAddress = address;
+    ack->sourceAddress = lockAddress;
+    ack->id = id;
+    ack->acked = acked;
+    Dispatcher::sendRaw(context, ack);
+}
+
+inline void FrameTransport::onFragment(void *context, const std::string &address, const std::string &lockAddress,
+                                       uint16_t id, uint16_t seq, uint16_t total, const std::string &data)
+{
+    std::string joined;
+    uint16_t ackValue = 0;
+    bool sendAckNow = false;
+    {
+        Guard guard(mutex);
+        counters.fragmentsReceived++;
+        auto peer = peers.find(address);
+        uint8_t window = peer == peers.end() ? FrameDefaultWindow : peer->second.window;
+        if (!reassembly.accept(address, id, seq, total, data, window, joined, ackValue, sendAckNow))
+            return;
+    }
+    if (sendAckNow)
+        sendAck(context, address, lockAddress, id, ackValue);
+    if (joined.empty())
+        return;
+
+    MessageBase *inner = MessageBase::createInstance(joined);
+    // transport messages are never framed themselves; one inside a
+    // transfer would only nest another reassembly
+    if (inner && (inner->type == (MessageType)MessageTypeReg::Fragment ||
+                  inner->type == (MessageType)MessageTypeReg::FragmentAck ||
+                  inner->type == (MessageType)MessageTypeReg::TransportHello)) {
+        delete inner;
+        inner = nullptr;
+    }
+    if (!inner) {
+        Guard guard(mutex);
+        counters.malformed++;
+        return;
+    }
+    // the link the fragments came over names the peer, not the payload
+    inner->sourceAddress = address;
+    inner->destinationAddress = lockAddress;
+    MessageBase *res = inner->processRequest(context);
+    delete inner;
+    if (res)
+        sendMessage(context, res);
+}
+
+#endif
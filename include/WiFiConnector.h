@@ -0,0 +1,142 @@
+#ifndef WIFICONNECTOR_H
+#define WIFICONNECTOR_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define WiFiFastConnectTimeoutMs 3000
+#define WiFiFullConnectTimeoutMs 10000
+
+// What is remembered about the last successful association
+struct WiFiLink {
+    std::string ssid;
+    std::string password;
+    uint8_t bssid[6] = {};
+    int32_t channel = 0;
+    bool hasBssid = false;
+    // optional static addressing, host byte order as IPAddress uses it
+    bool useStaticIp = false;
+    uint32_t ip = 0;
+    uint32_t gateway = 0;
+    uint32_t mask = 0;
+    uint32_t dns = 0;
+};
+
+// Radio operations the connector needs; the firmware wraps WiFi, the host
+// side can plug in a fake
+class WiFiDriver {
+public:
+    virtual ~WiFiDriver() = default;
+    virtual void begin(const WiFiLink &link, bool targeted) = 0;
+    virtual void disconnect() = 0;
+    virtual bool isConnected() = 0;
+    // fill bssid/channel/addressing of the current association
+    virtual void current(WiFiLink &link) = 0;
+};
+
+// Non-blocking connect: targeted (BSSID + channel, no scan) attempt first
+// when a previous association is known, then a plain full connect.
+class WiFiConnector {
+public:
+    enum class State {
+        Idle,
+        Fast,
+        Full,
+        Connected,
+        Failed
+    };
+
+    struct Timings {
+        uint32_t fastMs = 0;
+        uint32_t fullMs = 0;
+        uint32_t totalMs = 0;
+        bool usedFast = false;
+        bool fastFailed = false;
+    };
+
+    explicit WiFiConnector(WiFiDriver &driver) : driver(driver) {}
+
+    void start(const WiFiLink &saved, uint32_t nowMs)
+    {
+        link = saved;
+        timings = Timings();
+        startedMs = nowMs;
+        if (link.ssid.empty()) {
+            state = State::Failed;
+            return;
+        }
+        if (link.hasBssid && link.channel > 0) {
+            timings.usedFast = true;
+            enter(State::Fast, nowMs);
+        } else {
+            enter(State::Full, nowMs);
+        }
+    }
+
+    // returns true once a final state (Connected/Failed) is reached
+    bool poll(uint32_t nowMs)
+    {
+        switch (state) {
+            case State::Fast:
+                if (driver.isConnected())
+                    return succeed(nowMs);
+                if (nowMs - stateMs >= WiFiFastConnectTimeoutMs) {
+                    timings.fastMs = nowMs - stateMs;
+                    timings.fastFailed = true;
+                    driver.disconnect();
+                    enter(State::Full, nowMs);
+                }
+                return false;
+            case State::Full:
+                if (driver.isConnected())
+                    return succeed(nowMs);
+                if (nowMs - stateMs >= WiFiFullConnectTimeoutMs) {
+                    timings.fullMs = nowMs - stateMs;
+                    timings.totalMs = nowMs - startedMs;
+                    state = State::Failed;
+                    return true;
+                }
+                return false;
+            case State::Idle:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    State getState() const { return state; }
+    const Timings &getTimings() const { return timings; }
+    // association details to persist after State::Connected
+    const WiFiLink &result() const { return link; }
+
+private:
+    void enter(State next, uint32_t nowMs)
+    {
+        state = next;
+        stateMs = nowMs;
+        driver.begin(link, next == State::Fast);
+    }
+
+    bool succeed(uint32_t nowMs)
+    {
+        if (state == State::Fast)
+            timings.fastMs = nowMs - stateMs;
+        else
+            timings.fullMs = nowMs - stateMs;
+        timings.totalMs = nowMs - startedMs;
+        driver.current(link);
+        link.hasBssid = true;
+        state = State::Connected;
+        return true;
+    }
+
+    WiFiDriver &driver;
+    WiFiLink link;
+    Timings timings;
+    State state = State::Idle;
+    uint32_t startedMs = 0;
+    uint32_t stateMs = 0;
+};
+
+#endif
@@ -5,25 +5,69 @@
 #include <WebServer.h>
 #include <DNSServer.h>
 #include <ESPmDNS.h>
-#include <Preferences.h>
 #include <SPIFFS.h>
+#include <functional>
+#include <vector>
+#include "WiFiConnector.h"
+#include "NvsSettingsBackend.h"
+#include "StatusEvents.h"
+#include "OtaUpdate.h"
+
+#define StatusPollMs 1000
+// RSSI change (dBm) worth telling the portal about
+#define StatusRssiStep 3
+// admin API: shortest accepted token, bytes gathered per streamed chunk
+#define ApiTokenMinLength 16
+#define ApiStreamChunk 1024
+// channels scanned one after the other, and the dwell on each
+#define WiFiScanChannels 13
+#define WiFiScanChannelMs 120
+// how long the portal's /scan waits for a scan already running
+#define WiFiScanWaitMs 5000
 
 class WiFiManager {
 public:
+    struct ScanHit {
+        String ssid;
+        int32_t rssi;
+        int channel;
+        bool isProtected;
+    };
+    using ScanProgress = std::function<void(const std::vector<ScanHit> &found)>;
+
     WiFiManager();
     void begin();
     void loop();
     String loadFile(const char* path);
 
-    void scanWiFi ();
+    // Scans channel by channel, handing each channel's networks to
+    // `progress` as soon as they are in. The station link stays up; an AP
+    // only mode gets the station interface added for the scan and back off
+    // after. False when another scan held the radio for waitMs.
+    bool scanWiFi (const ScanProgress &progress, uint32_t waitMs = portMAX_DELAY);
     void setProperties (String ssid, String pass);
+    bool setApiToken (const std::string &token);
     bool getIsConnected ()
     {
         return WiFi.status() == WL_CONNECTED;
     }
 
 private:
+    struct ApiStats {
+        uint32_t lists = 0;
+        uint32_t updates = 0;
+        uint32_t entries = 0;
+        uint32_t unauthorized = 0;
+        uint32_t badRequests = 0;
+        uint32_t bytesStreamed = 0;
+        uint32_t lastListUs = 0;
+        uint32_t lastUpdateUs = 0;
+    };
+
     void connectToSavedNetwork();
+    bool connect(const WiFiLink &link);
+    WiFiLink loadLink();
+    void saveLink(const WiFiLink &link);
     void startAPMode();
     void handleRoot();
     void handleScan();
@@ -31,11 +75,46 @@ private:
     void handleStyle();
     void handleStatus();
     void handleToggleAP();
+    void handleMetrics();
+    void handleThermal();
+    void handleEvents();
+    void handleAudit();
+    void handleApiDevices();
+    void handleApiAccess();
+    void handleOtaStatus();
+    void handleOtaBegin();
+    void handleOtaUpload();
+    void handleOtaDone();
+    void sendOta(OtaUpdater::Result result);
+    void handleTraceStart();
+    void handleTraceStop();
+    void handleTrace();
+    void handleTraceSummary();
+    void handleMemory();
+    int apiAccess();
+    bool authorized();
+    void pollStatus();
+    void publishStatus();
 
     WebServer server;
     DNSServer dnsServer;
-    Preferences preferences;
+    NvsSettingsBackend settingsBackend;
+    SettingsStore settings;
     bool apMode = false;
+    WiFiConnector::Timings lastConnect;
+    // one scan at a time, whether BLE or the portal asked
+    SemaphoreHandle_t scanMutex;
+    StatusEvents events;
+    bool lastConnected = false;
+    int32_t lastRssi = 0;
+    unsigned long lastStatusPollMs = 0;
+    ApiStats apiStats;
+    // the multipart upload in progress on /ota
+    struct {
+        bool allowed = false;
+        uint32_t position = 0;
+        OtaUpdater::Result result = OtaUpdater::Result::Ok;
+    } otaUpload;
 };
 
 #endif
@@ -1,10 +1,55 @@
 #include "WiFiManager.h"
+#include "LockMetrics.h"
+#include "ThermalMonitor.h"
+#include "AuditLog.h"
+#include "DeviceAccess.h"
+#include "KeyStore.h"
+#include "MessageTrace.h"
+#include "MemoryBudget.h"
+
+extern AuditLog auditLog;
+extern OtaUpdater ota;
+extern MessageTrace messageTrace;
+
+// WiFiDriver on top of the Arduino WiFi object
+class ArduinoWiFiDriver : public WiFiDriver {
+public:
+    void begin(const WiFiLink &link, bool targeted) override {
+        if (link.useStaticIp && link.ip)
+            WiFi.config(IPAddress(link.ip), IPAddress(link.gateway), IPAddress(link.mask), IPAddress(link.dns));
+        if (targeted)
+            WiFi.begin(link.ssid.c_str(), link.password.c_str(), link.channel, link.bssid);
+        else
+            WiFi.begin(link.ssid.c_str(), link.password.c_str());
+    }
+
+    void disconnect() override {
+        WiFi.disconnect();
+    }
 
-WiFiManager::WiFiManager() : server(80) {}
+    bool isConnected() override {
+        return WiFi.status() == WL_CONNECTED;
+    }
+
+    void current(WiFiLink &link) override {
+        uint8_t *bssid = WiFi.BSSID();
+        if (bssid)
+            memcpy(link.bssid, bssid, sizeof(link.bssid));
+        link.channel = WiFi.channel();
+        link.ip = WiFi.localIP();
+        link.gateway = WiFi.gatewayIP();
+        link.mask = WiFi.subnetMask();
+        link.dns = WiFi.dnsIP();
+    }
+};
+
+static ArduinoWiFiDriver wifiDriver;
+
+WiFiManager::WiFiManager() : server(80), settings(settingsBackend), scanMutex(xSemaphoreCreateMutex()) {}
 
 void WiFiManager::begin() {
 
-    preferences.begin("WiFiManager", false);
+    settings.begin("WiFiManager");
     connectToSavedNetwork();
 
     if (WiFi.status() != WL_CONNECTED) {
@@ -20,35 +65,160 @@ void WiFiManager::begin() {
     server.on("/connect", HTTP_POST, std::bind(&WiFiManager::handleConnect, this));
     server.on("/style.css", HTTP_GET, std::bind(&WiFiManager::handleStyle, this));
     server.on("/status", HTTP_GET, std::bind(&WiFiManager::handleStatus, this));
+    server.on("/metrics", HTTP_GET, std::bind(&WiFiManager::handleMetrics, this));
+    server.on("/thermal", HTTP_GET, std::bind(&WiFiManager::handleThermal, this));
+    server.on("/events", HTTP_GET, std::bind(&WiFiManager::handleEvents, this));
+    server.on("/audit", HTTP_GET, std::bind(&WiFiManager::handleAudit, this));
+    server.on("/api/devices", HTTP_GET, std::bind(&WiFiManager::handleApiDevices, this));
+    server.on("/api/devices", HTTP_POST, std::bind(&WiFiManager::handleApiAccess, this));
+    server.on("/ota", HTTP_GET, std::bind(&WiFiManager::handleOtaStatus, this));
+    server.on("/ota/begin", HTTP_POST, std::bind(&WiFiManager::handleOtaBegin, this));
+    server.on("/ota", HTTP_POST, std::bind(&WiFiManager::handleOtaDone, this), std::bind(&WiFiManager::handleOtaUpload, this));
+    server.on("/memory", HTTP_GET, std::bind(&WiFiManager::handleMemory, this));
+    server.on("/trace/start", HTTP_POST, std::bind(&WiFiManager::handleTraceStart, this));
+    server.on("/trace/stop", HTTP_POST, std::bind(&WiFiManager::handleTraceStop, this));
+    server.on("/trace", HTTP_GET, std::bind(&WiFiManager::handleTrace, this));
+    server.on("/trace/summary", HTTP_GET, std::bind(&WiFiManager::handleTraceSummary, this));
+    static const char *apiHeaders[] = {"Authorization"};
+    server.collectHeaders(apiHeaders, 1);
     server.begin();
+
+    LockMetrics::add("wifi", [this](nlohmann::json &j) {
+        j["connected"] = getIsConnected();
+        j["usedFast"] = lastConnect.usedFast;
+        j["fastFailed"] = lastConnect.fastFailed;
+        j["fastMs"] = lastConnect.fastMs;
+        j["fullMs"] = lastConnect.fullMs;
+        j["totalMs"] = lastConnect.totalMs;
+    });
+    LockMetrics::add("settings", [this](nlohmann::json &j) {
+        auto &st = settings.stats();
+        j["hits"] = st.hits;
+        j["misses"] = st.misses;
+        j["commits"] = st.commits;
+        j["keysWritten"] = st.keysWritten;
+        j["bytesWritten"] = st.bytesWritten;
+        j["skippedWrites"] = st.skippedWrites;
+    });
+    LockMetrics::add("portalEvents", [this](nlohmann::json &j) {
+        auto &st = events.stats();
+        j["attached"] = st.attached;
+        j["events"] = st.events;
+        j["bytes"] = st.bytes;
+        j["dropped"] = st.dropped;
+    });
+    LockMetrics::add("adminApi", [this](nlohmann::json &j) {
+        j["enabled"] = !settings.getString("apiToken").empty();
+        j["lists"] = apiStats.lists;
+        j["updates"] = apiStats.updates;
+        j["entries"] = apiStats.entries;
+        j["unauthorized"] = apiStats.unauthorized;
+        j["badRequests"] = apiStats.badRequests;
+        j["bytesStreamed"] = apiStats.bytesStreamed;
+        j["lastListUs"] = apiStats.lastListUs;
+        j["lastUpdateUs"] = apiStats.lastUpdateUs;
+    });
 }
 
 void WiFiManager::loop() {
+    static uint8_t httpSite = MemoryBudget::instance().site("http");
+    MemScope scope(httpSite);
     server.handleClient();
+    pollStatus();
 }
 
-void WiFiManager::connectToSavedNetwork() {
-    String ssid = preferences.getString("ssid", "");
-    String password = preferences.getString("password", "");
+// Local WiFi state is cheap to read; pages only hear about it on a change
+void WiFiManager::pollStatus() {
+    unsigned long now = millis();
+    if (now - lastStatusPollMs < StatusPollMs)
+        return;
+    lastStatusPollMs = now;
+    if (!events.hasClients())
+        return;
+    bool connected = getIsConnected();
+    int32_t rssi = connected ? WiFi.RSSI() : 0;
+    if (connected != lastConnected || abs(rssi - lastRssi) >= StatusRssiStep)
+        publishStatus();
+    events.keepAlive(now);
+}
 
-    if (ssid != "") {
-        WiFi.begin(ssid.c_str(), password.c_str());
+void WiFiManager::publishStatus() {
+    lastConnected = getIsConnected();
+    lastRssi = lastConnected ? WiFi.RSSI() : 0;
+    nlohmann::json j;
+    j["connected"] = lastConnected;
+    j["rssi"] = lastRssi;
+    j["ip"] = lastConnected ? WiFi.localIP().toString().c_str() : "";
+    events.publish("status", j);
+}
 
-        unsigned long startTime = millis();
-        while (WiFi.status() != WL_CONNECTED && millis() - startTime < 10000) {
-            delay(500);
-            Serial.print(".");
-        }
+void WiFiManager::connectToSavedNetwork() {
+    WiFiLink link = loadLink();
 
-        if (WiFi.status() == WL_CONNECTED) {
-            Serial.println("Connected to saved network");
-            return;
-        }
+    if (!link.ssid.empty() && connect(link)) {
+        Serial.println("Connected to saved network");
+        return;
     }
 
     Serial.println("No saved network found or failed to connect");
 }
 
+// Blocks until the connector finishes: targeted reconnect to the saved
+// BSSID/channel first, full connect as fallback. Saves the association.
+bool WiFiManager::connect(const WiFiLink &link) {
+    events.publish("connect", {{"status", "connecting"}, {"ssid", link.ssid}});
+    WiFiConnector connector(wifiDriver);
+    connector.start(link, millis());
+    while (!connector.poll(millis())) {
+        delay(50);
+    }
+    lastConnect = connector.getTimings();
+    Serial.printf("WiFi connect: fast=%d (%s) %u ms, full %u ms, total %u ms\n", lastConnect.usedFast,
+                  lastConnect.fastFailed ? "failed" : "ok", lastConnect.fastMs, lastConnect.fullMs, lastConnect.totalMs);
+
+    if (connector.getState() != WiFiConnector::State::Connected) {
+        events.publish("connect", {{"status", "failed"}, {"ssid", link.ssid}, {"ms", lastConnect.totalMs}});
+        publishStatus();
+        return false;
+    }
+    saveLink(connector.result());
+    events.publish("connect", {{"status", "connected"}, {"ssid", link.ssid}, {"ms", lastConnect.totalMs},
+                               {"ip", WiFi.localIP().toString().c_str()}});
+    publishStatus();
+    return true;
+}
+
+WiFiLink WiFiManager::loadLink() {
+    WiFiLink link;
+    link.ssid = settings.getString("ssid");
+    link.password = settings.getString("password");
+    link.hasBssid = settings.getBytes("bssid", link.bssid, sizeof(link.bssid)) == sizeof(link.bssid);
+    link.channel = settings.getInt("channel", 0);
+    link.useStaticIp = settings.getBool("staticIp", false);
+    if (link.useStaticIp) {
+        link.ip = settings.getUInt("ip", 0);
+        link.gateway = settings.getUInt("gw", 0);
+        link.mask = settings.getUInt("mask", 0);
+        link.dns = settings.getUInt("dns", 0);
+    }
+    return link;
+}
+
+void WiFiManager::saveLink(const WiFiLink &link) {
+    // unchanged values are dropped by the store, the rest go out in one commit
+    settings.putString("ssid", link.ssid);
+    settings.putString("password", link.password);
+    settings.putBytes("bssid", link.bssid, sizeof(link.bssid));
+    settings.putInt("channel", link.channel);
+    if (link.useStaticIp) {
+        settings.putUInt("ip", link.ip);
+        settings.putUInt("gw", link.gateway);
+        settings.putUInt("mask", link.mask);
+        settings.putUInt("dns", link.dns);
+    }
+    settings.flush();
+}
+
 void WiFiManager::startAPMode() {
     WiFi.softAP("ESP32-Setup", "password");
     Serial.println("Started AP mode");
@@ -60,39 +230,31 @@ void WiFiManager::handleRoot() {
 }
 
 void WiFiManager::handleScan() {
-    int n = WiFi.scanNetworks();
-    String networks = "{ \"networks\": [";
-
-    for (int i = 0; i < n; ++i) {
-        if (i > 0) {
-            networks += ",";
-        }
-        networks += "{";
-        networks += "\"ssid\": \"" + WiFi.SSID(i) + "\",";
-        networks += "\"rssi\": " + String(WiFi.RSSI(i));
-        networks += "}";
+    events.publish("scan", {{"state", "scanning"}});
+    nlohmann::json list = nlohmann::json::array();
+    bool scanned = scanWiFi([&](const std::vector<ScanHit> &found) {
+        for (auto &hit : found)
+            list.push_back({{"ssid", hit.ssid.c_str()}, {"rssi", hit.rssi}});
+    }, WiFiScanWaitMs);
+    if (!scanned) {
+        events.publish("scan", {{"state", "busy"}});
+        server.send(503, "application/json", "{\"error\":\"scan in progress\"}");
+        return;
     }
-
-    networks += "] }";
-    server.send(200, "application/json", networks);
+    events.publish("scan", {{"state", "done"}, {"count", list.size()}});
+    nlohmann::json j;
+    j["networks"] = std::move(list);
+    server.send(200, "application/json", j.dump().c_str());
 }
 
 void WiFiManager::handleConnect() {
     if (server.hasArg("ssid") && server.hasArg("password")) {
-        String ssid = server.arg("ssid");
-        String password = server.arg("password");
-
-        WiFi.begin(ssid.c_str(), password.c_str());
-
-        unsigned long startTime = millis();
-        while (WiFi.status() != WL_CONNECTED && millis() - startTime < 10000) {
-            delay(500);
-            Serial.print(".");
-        }
+        WiFiLink link;
+        link.ssid = server.arg("ssid").c_str();
+        link.password = server.arg("password").c_str();
+        link.useStaticIp = settings.getBool("staticIp", false);
 
-        if (WiFi.status() == WL_CONNECTED) {
-            preferences.putString("ssid", ssid);
-            preferences.putString("password", password);
+        if (connect(link)) {
             String response = "{\"status\":\"connected\"               ,\"ip\":\"" + WiFi.localIP().toString() + "\"}";
             server.send(200, "application/json", response);
         } else {
@@ -114,112 +276,337 @@ void WiFiManager::handleStatus() {
     server.send(200, "application/json", status);
 }
 
-String WiFiManager::loadFile(const char* path) {
-    File file = SPIFFS.open(path, "r");
-    if (!file) {
-        return String("File not found");
+// the metrics, memory and thermal reports describe the lock's internals
+// (peers, keys in use, heap layout) and need the admin token like /api
+void WiFiManager::handleMetrics() {
+    if (!authorized())
+        return;
+    server.send(200, "application/json", LockMetrics::toJson().c_str());
+}
+
+void WiFiManager::handleEvents() {
+    events.attach(server.client());
+    publishStatus();
+}
+
+// /audit?since=<seq>&count=<n>, admin token required: the log says who
+// opened the door when
+void WiFiManager::handleAudit() {
+    if (!authorized())
+        return;
+    uint32_t since = server.hasArg("since") ? server.arg("since").toInt() : 0;
+    int count = server.hasArg("count") ? server.arg("count").toInt() : AuditPageMax;
+    nlohmann::json j;
+    auditLog.page(since, count < 0 ? 0 : count, j);
+    server.send(200, "application/json", j.dump().c_str());
+}
+
+// Requests carry "Authorization: Bearer <token>"; the token is set over BLE
+// by a confirmed device (SetApiToken) and the API stays off until then.
+// 0 when the request may go on, else the HTTP status to refuse it with.
+int WiFiManager::apiAccess() {
+    std::string token = settings.getString("apiToken");
+    if (token.empty())
+        return 403;
+    String header = server.header("Authorization");
+    std::string given = header.startsWith("Bearer ") ? header.substring(7).c_str() : "";
+    // compare the whole token whatever the first mismatch
+    uint8_t diff = given.size() != token.size();
+    for (size_t i = 0; i < token.size(); i++)
+        diff |= (uint8_t)(token[i] ^ (i < given.size() ? given[i] : 0));
+    return diff ? 401 : 0;
+}
+
+bool WiFiManager::authorized() {
+    int refused = apiAccess();
+    if (!refused)
+        return true;
+    apiStats.unauthorized++;
+    if (refused == 403) {
+        server.send(403, "application/json", "{\"error\":\"admin api disabled\"}");
+    } else {
+        server.sendHeader("WWW-Authenticate", "Bearer");
+        server.send(401, "application/json", "{\"error\":\"unauthorized\"}");
     }
+    return false;
+}
 
-    String content = file.readString();
-    file.close();
-    return content;
+bool WiFiManager::setApiToken(const std::string &token) {
+    if (!token.empty() && token.size() < ApiTokenMinLength)
+        return false;
+    if (token.empty())
+        settings.remove("apiToken");
+    else
+        settings.putString("apiToken", token);
+    return settings.flush();
 }
 
-///
-struct netList
-{
-    String ssid;
-    int32_t rssi;
-    int chanel;
-    bool isProtected;
-    netList *next;
-};
+// GET /api/devices: {"devices": [{"mac", "confirmed", "hash"}...], "count": n}
+// Streamed in ApiStreamChunk pieces so a long list never sits in RAM as one
+// string. Devices without a public key yet come without "hash"; keys are not
+// generated on this path.
+void WiFiManager::handleApiDevices() {
+    if (!authorized())
+        return;
+    uint32_t start = micros();
+    auto keys = KeyStore::instance().snapshot();
+    auto list = DeviceAccess::instance().snapshot();
+
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+    std::string chunk = "{\"devices\":[";
+    chunk.reserve(ApiStreamChunk + 128);
+    for (size_t i = 0; i < list.size(); i++) {
+        nlohmann::json dev = {{"mac", list[i].first}, {"confirmed", list[i].second}};
+        auto entry = keys->find(list[i].first);
+        if (entry != keys->end() && entry->second.hasPublicKey && !entry->second.publicKey.empty())
+            dev["hash"] = DeviceAccess::keyHash(entry->second.publicKey);
+        if (i)
+            chunk += ',';
+        chunk += dev.dump();
+        if (chunk.size() >= ApiStreamChunk) {
+            server.sendContent(chunk.c_str(), chunk.size());
+            apiStats.bytesStreamed += chunk.size();
+            chunk.clear();
+        }
+    }
+    chunk += "],\"count\":" + std::to_string(list.size()) + "}";
+    server.sendContent(chunk.c_str(), chunk.size());
+    apiStats.bytesStreamed += chunk.size();
+    server.sendContent("");
+    apiStats.lists++;
+    apiStats.lastListUs = micros() - start;
+}
 
-static netList *scanRes = nullptr;
+// POST /api/devices with {"devices": {"<mac>": true, ...}} (the
+// AccessOnOFFMulty list) or {"devices": [{"mac": ..., "confirmed": ...}]}.
+// The whole body is applied as one batch and saved once.
+void WiFiManager::handleApiAccess() {
+    if (!authorized())
+        return;
+    uint32_t start = micros();
+    auto doc = nlohmann::json::parse(server.arg("plain").c_str(), nullptr, false);
+    if (doc.is_discarded() || !doc.is_object() || !doc.contains("devices")) {
+        apiStats.badRequests++;
+        server.send(400, "application/json", "{\"error\":\"expected a devices object or array\"}");
+        return;
+    }
+    std::vector<DeviceAccess::Entry> entries;
+    auto &devices = doc["devices"];
+    if (devices.is_object()) {
+        entries.reserve(devices.size());
+        for (auto it = devices.begin(); it != devices.end(); ++it) {
+            if (it.value().is_boolean())
+                entries.emplace_back(it.key(), it.value().get<bool>());
+        }
+    } else if (devices.is_array()) {
+        entries.reserve(devices.size());
+        for (auto &d : devices) {
+            if (d.is_object() && d.contains("mac") && d["mac"].is_string() && d.contains("confirmed") && d["confirmed"].is_boolean())
+                entries.emplace_back(d["mac"].get<std::string>(), d["confirmed"].get<bool>());
+        }
+    }
+    if (entries.size() != devices.size()) {
+        apiStats.badRequests++;
+        server.send(400, "application/json", "{\"error\":\"malformed device entry\"}");
+        return;
+    }
 
-void cleanScanList ()
-{
-    while (scanRes)
-    {
-        netList *tmp =scanRes->next;
-        delete scanRes;
-        scanRes = tmp;      
+    size_t unknown = 0;
+    size_t changed = DeviceAccess::instance().apply(entries, &unknown);
+    apiStats.updates++;
+    apiStats.entries += entries.size();
+    apiStats.lastUpdateUs = micros() - start;
+    nlohmann::json j;
+    j["received"] = entries.size();
+    j["changed"] = changed;
+    j["unknown"] = unknown;
+    j["saved"] = changed > 0;
+    j["us"] = apiStats.lastUpdateUs;
+    server.send(200, "application/json", j.dump().c_str());
+}
+
+// Firmware update, with the admin API token:
+//   POST /ota/begin?size=<bytes>&sha256=<hex>[&signature=<base64>]
+//                                              start, or learn where to resume
+//   POST /ota?offset=<n>                       multipart upload of the image from n
+//   GET  /ota                                  progress
+// Every reply is the OtaUpdater status; "offset" is the next byte wanted.
+void WiFiManager::sendOta(OtaUpdater::Result result) {
+    static const int codes[] = {200, 409, 400, 413, 409, 500, 422, 500, 403};
+    nlohmann::json j;
+    ota.toJson(j, result);
+    server.send(codes[(int)result], "application/json", j.dump().c_str());
+}
+
+void WiFiManager::handleOtaStatus() {
+    if (!authorized())
+        return;
+    sendOta(OtaUpdater::Result::Ok);
+}
+
+void WiFiManager::handleOtaBegin() {
+    if (!authorized())
+        return;
+    std::vector<uint8_t> signature;
+    if (server.hasArg("signature") && !Base64::decode(server.arg("signature").c_str(), signature)) {
+        sendOta(OtaUpdater::Result::BadRequest);
+        return;
     }
+    uint32_t offset;
+    sendOta(ota.begin(server.arg("size").toInt(), server.arg("sha256").c_str(), signature, offset));
 }
 
-void appendToScanList (    String ssid, int32_t rssi, int chanel, bool isProtected)
-{
-    netList * tmp = new netList;
-    tmp->ssid = ssid;
-    tmp->rssi = rssi;
-    tmp->chanel = chanel;
-    tmp->isProtected = isProtected;
-    tmp->next = nullptr;
-    if (scanRes)
-    {
-        netList * it = scanRes;
-        while (it->next)
-            it=it->next; 
-        it->next = tmp;
+// Runs per upload buffer (HTTP_UPLOAD_BUFLEN bytes); each goes straight to
+// flash, nothing of the image is kept in RAM
+void WiFiManager::handleOtaUpload() {
+    HTTPUpload &upload = server.upload();
+    if (upload.status == UPLOAD_FILE_START) {
+        otaUpload.allowed = apiAccess() == 0;
+        otaUpload.position = server.arg("offset").toInt();
+        otaUpload.result = OtaUpdater::Result::Ok;
+        return;
     }
+    if (upload.status != UPLOAD_FILE_WRITE || !otaUpload.allowed || otaUpload.result != OtaUpdater::Result::Ok)
+        return;
+    uint32_t next;
+    otaUpload.result = ota.write(otaUpload.position, upload.buf, upload.currentSize, millis(), next);
+    otaUpload.position += upload.currentSize;
+}
+
+void WiFiManager::handleOtaDone() {
+    if (!authorized())
+        return;
+    sendOta(otaUpload.result);
+    otaUpload.allowed = false;
+}
+
+// Message trace capture, with the admin API token:
+//   POST /trace/start?records=<n>   (re)start capturing into a fresh ring
+//   POST /trace/stop[?clear=1]      stop; clear also frees the ring
+//   GET  /trace                     TraceHeader + TraceRecords, binary
+//   GET  /trace/summary             per message type latency, JSON
+void WiFiManager::handleTraceStart() {
+    if (!authorized())
+        return;
+    messageTrace.start(server.hasArg("records") ? server.arg("records").toInt() : 0);
+    server.send(200, "application/json", ("{\"capacity\":" + std::to_string(messageTrace.capacity()) + "}").c_str());
+}
+
+void WiFiManager::handleTraceStop() {
+    if (!authorized())
+        return;
+    if (server.arg("clear") == "1")
+        messageTrace.clear();
     else
-        scanRes = tmp;
+        messageTrace.stop();
+    server.send(200, "application/json", ("{\"recorded\":" + std::to_string(messageTrace.recorded()) + "}").c_str());
 }
 
-void WiFiManager::scanWiFi ()
-{
-//  Wireless::scanner = true;
-  //Wireless::
-  auto mode =  WiFi.getMode();
-  WiFi.mode(WIFI_STA);
-  WiFi.disconnect();
-  delay(100);
-  cleanScanList();
-  int num  = WiFi.scanNetworks ();
-  Serial.println ("WIFi - ssid num - %d"), num;;
-  if (num>0)
-  {
-    for (int i= 0; i < num; i++)
-    {
-      Serial.println (WiFi.SSID(i));
-      appendToScanList (WiFi.SSID(i),WiFi.RSSI(i),WiFi.channel(i),WiFi.encryptionType(i) != WIFI_AUTH_OPEN);
-      /****
-      Serial.print(WiFi.SSID(i)); // Имя сети (SSID)
-      Serial.print(" (");
-      Serial.print(WiFi.RSSI(i)); // Уровень сигнала (RSSI)
-      Serial.print(" dBm) ");
-      Serial.print(" Канал: ");
-      Serial.print(WiFi.channel(i)); // Канал сети
-      Serial.print(" Шифрование: ");
-      Serial.println((WiFi.encryptionType(i) == WIFI_AUTH_OPEN) ? "Открытая" : "Защищённая");    }
-      **/
-    }
-  }
+// Streamed TraceReadChunk records at a time, capture may go on meanwhile.
+// The body is always the header's count of records, the ones overwritten
+// during the download sent as TraceFlagLost fillers, so it matches the
+// Content-Length announced up front.
+void WiFiManager::handleTrace() {
+    if (!authorized())
+        return;
+    uint32_t epoch;
+    TraceHeader header = messageTrace.header(&epoch);
+    server.setContentLength(sizeof(header) + (size_t)header.count * sizeof(TraceRecord));
+    server.send(200, "application/octet-stream", "");
+    server.sendContent(reinterpret_cast<const char *>(&header), sizeof(header));
+    TraceRecord chunk[TraceReadChunk];
+    uint32_t seq = header.firstSeq;
+    uint32_t left = header.count;
+    size_t lost = 0;
+    while (left) {
+        size_t n = left < TraceReadChunk ? left : TraceReadChunk;
+        lost += messageTrace.readExact(epoch, seq, chunk, n);
+        server.sendContent(reinterpret_cast<const char *>(chunk), n * sizeof(TraceRecord));
+        seq += n;
+        left -= n;
+    }
+    if (lost)
+        Serial.printf("Trace download: %u records overwritten on the way\n", (unsigned)lost);
 }
 
-void WiFiManager::setProperties (String ssid, String pass)
-{
-    preferences.putString("ssid", ssid);
-    preferences.putString("password", pass);
+void WiFiManager::handleTraceSummary() {
+    if (!authorized())
+        return;
+    nlohmann::json j;
+    messageTrace.summary(j);
+    server.send(200, "application/json", j.dump().c_str());
+}
+
+// stack, heap and allocation site report; the serial command "mem" prints the same
+void WiFiManager::handleMemory() {
+    if (!authorized())
+        return;
+    nlohmann::json j;
+    MemoryBudget::instance().report(j);
+    server.send(200, "application/json", j.dump().c_str());
+}
 
-    connectToSavedNetwork ();
+void WiFiManager::handleThermal() {
+    if (!authorized())
+        return;
+    nlohmann::json j;
+    ThermalMonitor::instance().toJson(j);
+    server.send(200, "application/json", j.dump().c_str());
 }
 
-/*********/
-static netList * iterator = nullptr;;
+String WiFiManager::loadFile(const char* path) {
+    File file = SPIFFS.open(path, "r");
+    if (!file) {
+        return String("File not found");
+    }
+
+    String content = file.readString();
+    file.close();
+    return content;
+}
 
-bool ListWiFiStart()
+bool WiFiManager::scanWiFi (const ScanProgress &progress, uint32_t waitMs)
 {
-    iterator = scanRes;
-    return scanRes != nullptr;
+    if (xSemaphoreTake(scanMutex, waitMs == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(waitMs)) != pdTRUE)
+        return false;
+    wifi_mode_t mode = WiFi.getMode();
+    if (mode == WIFI_OFF)
+        WiFi.mode(WIFI_STA);
+    else if (mode == WIFI_AP)
+        WiFi.mode(WIFI_AP_STA);
+
+    std::vector<ScanHit> found;
+    for (uint8_t channel = 1; channel <= WiFiScanChannels; channel++)
+    {
+        int num = WiFi.scanNetworks(false, false, false, WiFiScanChannelMs, channel);
+        found.clear();
+        for (int i = 0; i < num; i++)
+            found.push_back(ScanHit{WiFi.SSID(i), WiFi.RSSI(i), (int)WiFi.channel(i), WiFi.encryptionType(i) != WIFI_AUTH_OPEN});
+        WiFi.scanDelete();
+        if (!found.empty() && progress)
+            progress(found);
+    }
+
+    if (WiFi.getMode() != mode)
+        WiFi.mode(mode);
+    xSemaphoreGive(scanMutex);
+    return true;
 }
 
-bool ListWiFiNext(String &ssid, int32_t &rssi, int &chanel, bool &isProtected)
+void WiFiManager::setProperties (String ssid, String pass)
 {
-    ssid = iterator->ssid;
-    rssi = iterator->rssi;
-    chanel = iterator->chanel;
-    isProtected = iterator->isProtected;
-    iterator=iterator->next;
-    return iterator != nullptr;
+    WiFiLink link;
+    link.ssid = ssid.c_str();
+    link.password = pass.c_str();
+    link.useStaticIp = settings.getBool("staticIp", false);
+    // a new network must not be tried on the old BSSID/channel
+    settings.remove("bssid");
+    settings.remove("channel");
+    settings.putString("ssid", link.ssid);
+    settings.putString("password", link.password);
+    settings.flush();
+
+    connect (link);
 }
+
@@ -1,18 +1,165 @@
 #include <Arduino.h>
+#include <new>
 #include "WiFiManager.h"
 #include "TemperatureMonitor.h"
 #include "BleLockAndKey.h"
 #include "ReqRes.h"
+#include "KeyStore.h"
+#include "PendingRequests.h"
+#include "LockMetrics.h"
+#include "ResponseCache.h"
+#include "Dispatcher.h"
+#include "Transport.h"
+#include "BootProfile.h"
+#include "ThermalMonitor.h"
+#include "NimBleLinkDriver.h"
+#include "SpiffsAuditFlash.h"
+#include "EspOtaPartition.h"
+#include "MessageTrace.h"
+#include "MemoryBudget.h"
 //#include "esp_bt.h"
 
 WiFiManager wifiManager;
 BleLockBase * lock;
 std::string LocName = "BleLock";
+NimBleLinkDriver linkDriver;
+SpiffsAuditFlash auditFlash("/audit.bin");
+AuditLog auditLog(auditFlash);
+ConnPolicy connPolicy(linkDriver);
+EspOtaPartition otaPartition;
+MbedOtaHash otaHash;
+NvsSettingsBackend otaSettingsBackend;
+SettingsStore otaSettings(otaSettingsBackend);
+OtaUpdater ota(otaPartition, otaHash, otaSettings);
+#ifdef OtaSigningKey
+MbedOtaSignature otaSignature(OtaSigningKey);
+#endif
+MessageTrace messageTrace;
 
+#ifndef CONFIG_ARDUINO_LOOP_STACK_SIZE
+#define CONFIG_ARDUINO_LOOP_STACK_SIZE 8192
+#endif
 
+#if MemSiteTracking
+// every C++ allocation (json trees, messages, std containers) is counted
+// against the MemScope active on the allocating task
+void *operator new(size_t size)
+{
+    void *p = MemoryBudget::allocate(size);
+    if (!p)
+        std::__throw_bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return MemoryBudget::allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return MemoryBudget::allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    MemoryBudget::release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    MemoryBudget::release(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    MemoryBudget::release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    MemoryBudget::release(p);
+}
+#endif
 
 
+
+
+// Mirror keys loaded by the lock library into the read-mostly KeyStore
+static void seedKeyStore(BleLockServer *server)
+{
+    if (xSemaphoreTake(server->mutex, portMAX_DELAY) != pdTRUE)
+        return;
+    auto publicKeys = server->secureConnection.keys;
+    auto sessionKeys = server->secureConnection.aesKeys;
+    xSemaphoreGive(server->mutex);
+
+    for (auto &it : publicKeys)
+        KeyStore::instance().publishPublicKey(it.first, it.second.first);
+    for (auto &it : sessionKeys)
+        KeyStore::instance().publishSessionKey(it.first, std::string(it.second.begin(), it.second.end()));
+}
+
+// ConnPolicy saw the link to `address` go away: drop what was kept for it
+static void onPeerGone(const std::string &address)
+{
+    FrameTransport::instance().forget(address);
+    PendingRequests::instance().cancelAddress(address);
+    // the library's copy of the session key goes with the KeyStore's, or a
+    // reconnect would decrypt with a key the KeyStore no longer knows
+    if (auto server = static_cast<BleLockServer *>(lock)) {
+        xSemaphoreTake(server->mutex, portMAX_DELAY);
+        server->secureConnection.aesKeys.erase(address);
+        xSemaphoreGive(server->mutex);
+    }
+    KeyStore::instance().dropSession(address);
+    OpenNonces::instance().drop(address);
+    ResponseCache::instance().invalidate(address);
+}
+
+static volatile bool backgroundReady = false;
+
+// SPIFFS as setup() found it: mounted without formatting, or not
+static bool spiffsMounted = false;
+
+static void backgroundBoot(void *)
+{
+    // Formatting a SPIFFS that would not mount and preallocating the audit
+    // file take seconds on a fresh chip; opens meanwhile are audited from RAM
+    bool mounted = spiffsMounted;
+    if (!mounted) {
+        BootProfile::Stage stage("spiffsFormat");
+        mounted = SPIFFS.begin(true);
+        if (!mounted)
+            logColor(LColor::Red, F("An error has occurred while mounting SPIFFS"));
+    }
+    {
+        BootProfile::Stage stage("audit");
+        if (mounted && auditFlash.begin())
+            auditLog.begin();
+    }
+    {
+        BootProfile::Stage stage("wifi");
+        wifiManager.begin();
+    }
+    {
+        BootProfile::Stage stage("temperature");
+        TemperatureMonitor::begin();
+        ThermalMonitor::instance().begin();
+    }
+    ReplySerializer::benchmark(50);
+    BootProfile::end("allReady", 0);
+    backgroundReady = true;
+    vTaskDelete(nullptr);
+}
+
 void setup() {
+    MemoryBudget::instance().watchTask("loopTask", xTaskGetCurrentTaskHandle(), CONFIG_ARDUINO_LOOP_STACK_SIZE);
 
     IntSAtringMap::insert ((MessageType)MessageTypeReg::resOk, "resOk");
     IntSAtringMap::insert ((MessageType)MessageTypeReg::reqRegKey, "reqRegKey");
@@ -33,6 +180,27 @@ void setup() {
     IntSAtringMap::insert ((MessageType)MessageTypeReg::LoginWWiFi, "LoginWWiFi");
     IntSAtringMap::insert ((MessageType)MessageTypeReg::GetWiFiStatus, "GetWiFiStatus");
 
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::TransportHello, "TransportHello");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::Fragment, "Fragment");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::FragmentAck, "FragmentAck");
+
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::Batch, "Batch");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::BatchResult, "BatchResult");
+
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::GetThermal, "GetThermal");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::ThermalStatus, "ThermalStatus");
+
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::OpenNonce, "OpenNonce");
+
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::GetAuditLog, "GetAuditLog");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::AuditLogPage, "AuditLogPage");
+
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::SetApiToken, "SetApiToken");
+
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::OtaBegin, "OtaBegin");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::OtaChunk, "OtaChunk");
+    IntSAtringMap::insert ((MessageType)MessageTypeReg::OtaStatus, "OtaStatus");
+
 
     bool registerResOk = []() {
         MessageBase::registerConstructor((MessageType)MessageTypeReg::resOk, []() -> MessageBase * { return new ResOk(); });
@@ -110,33 +278,401 @@ void setup() {
 
 
 
-    if (!SPIFFS.begin(true)) {
-        logColor(LColor::Red, F("An error has occurred while mounting SPIFFS"));
-        return;
+    bool registerTransportHello = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::TransportHello, []() -> MessageBase * { return new TransportHello(); });
+        return true;
+    }();
+    bool registerFragment = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::Fragment, []() -> MessageBase * { return new Fragment(); });
+        return true;
+    }();
+    bool registerFragmentAck = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::FragmentAck, []() -> MessageBase * { return new FragmentAck(); });
+        return true;
+    }();
+
+
+
+    bool registerBatch = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::Batch, []() -> MessageBase * { return new BatchMessage(); });
+        return true;
+    }();
+    bool registerBatchResult = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::BatchResult, []() -> MessageBase * { return new BatchResultMessage(); });
+        return true;
+    }();
+
+
+
+    bool registerGetThermal = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::GetThermal, []() -> MessageBase * { return new GetThermalMessage(); });
+        return true;
+    }();
+    bool registerThermalStatus = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::ThermalStatus, []() -> MessageBase * { return new ThermalStatusMessage(); });
+        return true;
+    }();
+
+
+
+    bool registerOpenNonce = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::OpenNonce, []() -> MessageBase * { return new OpenNonceMessage(); });
+        return true;
+    }();
+
+
+
+    bool registerGetAuditLog = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::GetAuditLog, []() -> MessageBase * { return new GetAuditLogMessage(); });
+        return true;
+    }();
+    bool registerAuditLogPage = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::AuditLogPage, []() -> MessageBase * { return new AuditLogPageMessage(); });
+        return true;
+    }();
+
+
+
+    bool registerSetApiToken = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::SetApiToken, []() -> MessageBase * { return new SetApiTokenMessage(); });
+        return true;
+    }();
+
+
+
+    bool registerOtaBegin = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::OtaBegin, []() -> MessageBase * { return new OtaBeginMessage(); });
+        return true;
+    }();
+    bool registerOtaChunk = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::OtaChunk, []() -> MessageBase * { return new OtaChunkMessage(); });
+        return true;
+    }();
+    bool registerOtaStatus = []() {
+        MessageBase::registerConstructor((MessageType)MessageTypeReg::OtaStatus, []() -> MessageBase * { return new OtaStatusMessage(); });
+        return true;
+    }();
+
+
+
+    auto &dispatcher = Dispatcher::instance();
+    dispatcher.setClass((MessageType)MessageTypeReg::OpenRequest, DispatchClass::Open);
+    dispatcher.setClass((MessageType)MessageTypeReg::OpenCommand, DispatchClass::Open);
+    dispatcher.setClass((MessageType)MessageTypeReg::SecurityCheckRequestest, DispatchClass::Open);
+    dispatcher.setClass((MessageType)MessageTypeReg::HelloRequest, DispatchClass::Handshake);
+    dispatcher.setClass((MessageType)MessageTypeReg::reqRegKey, DispatchClass::Handshake);
+    // everything else (device list, access, WiFi) defaults to DispatchClass::Admin
+
+    PendingRequests::instance().setTimeout((MessageType)MessageTypeReg::SecurityCheckRequestest, 5000);
+    PendingRequests::instance().setTimeout((MessageType)MessageTypeReg::HelloRequest, 15000);
+    PendingRequests::instance().setTimeout((MessageType)MessageTypeReg::Fragment, 1000);
+    Dispatcher::setSender(FrameTransport::send);
+    ResponseCache::instance().setSerializer(ReplySerializer::serialize);
+    ReplySerializer::begin();
+    Dispatcher::setRejecter([](MessageBase *request) -> MessageBase * {
+        ResOk *res = new ResOk(false);
+        res->destinationAddress = request->sourceAddress;
+        res->sourceAddress = request->destinationAddress;
+        res->requestUUID = request->requestUUID;
+        return res;
+    });
+
+    // fast links while a phone opens or pairs, or pulls a long reply
+    connPolicy.setProfile((int)MessageTypeReg::HelloRequest, LinkProfile::Interactive);
+    connPolicy.setProfile((int)MessageTypeReg::reqRegKey, LinkProfile::Interactive);
+    connPolicy.setProfile((int)MessageTypeReg::OpenRequest, LinkProfile::Interactive);
+    connPolicy.setProfile((int)MessageTypeReg::GetDeviceList, LinkProfile::Bulk);
+    connPolicy.setProfile((int)MessageTypeReg::ScanWiFi, LinkProfile::Bulk);
+    connPolicy.setProfile((int)MessageTypeReg::Batch, LinkProfile::Bulk);
+    connPolicy.setProfile((int)MessageTypeReg::OtaChunk, LinkProfile::Bulk);
+    connPolicy.setDisconnectHook(onPeerGone);
+    Dispatcher::setObserver([](const MessageBase *request) {
+        connPolicy.onMessage(request->sourceAddress, (int)request->type, millis());
+    });
+    Dispatcher::setTracer([](const DispatchTrace &t) {
+        messageTrace.record((uint8_t)t.type, (uint8_t)t.cls, (uint8_t)t.outcome, t.enqueuedUs, t.startUs, t.endUs, t.bytes);
+    });
+    // request sizes cost a serialize, paid only while a trace is captured
+    Dispatcher::setSizer([](MessageBase *request) -> size_t {
+        return messageTrace.isActive() ? request->serialize().size() : 0;
+    });
+    FrameTransport::instance().setTransferHook([](const std::string &address) {
+        connPolicy.onBulk(address, millis());
+    });
+
+    LockMetrics::add("keys", [](nlohmann::json &j) {
+        auto &keys = KeyStore::instance();
+        j["version"] = keys.version();
+        j["writes"] = keys.writes();
+        j["retries"] = keys.retries();
+        j["maxSwapUs"] = keys.maxSwapMicros();
+    });
+    LockMetrics::add("handshake", [](nlohmann::json &j) {
+        size_t payload = FrameTransport::instance().lastPayload();
+        if (!payload)
+            payload = FrameMinPayload;
+        j["keysSent"] = HelloRequest::keysSent();
+        j["keyBytesSent"] = HelloRequest::keyBytesSent();
+        j["keyBytesAsHex"] = HelloRequest::keyBytesAsHex();
+        j["lastKeyBytes"] = HelloRequest::lastKeyBytes();
+        j["lastKeyBytesAsHex"] = HelloRequest::lastKeyBytesAsHex();
+        j["lastKeyFragments"] = (HelloRequest::lastKeyBytes() + payload - 1) / payload;
+        j["lastKeyFragmentsAsHex"] = (HelloRequest::lastKeyBytesAsHex() + payload - 1) / payload;
+    });
+    LockMetrics::add("pending", [](nlohmann::json &j) {
+        auto &pending = PendingRequests::instance();
+        j["outstanding"] = pending.outstanding();
+        j["timeouts"] = pending.timeoutsTotal();
+        j["completed"] = pending.completedTotal();
+        j["cancelled"] = pending.cancelledTotal();
+        j["mismatched"] = pending.mismatchedTotal();
+    });
+    LockMetrics::add("dispatch", [](nlohmann::json &j) {
+        static const char *names[] = {"open", "handshake", "admin"};
+        for (int i = 0; i < (int)DispatchClass::Count; i++) {
+            auto st = Dispatcher::instance().stats((DispatchClass)i);
+            auto &cls = j[names[i]];
+            cls["workers"] = Dispatcher::instance().poolOf((DispatchClass)i);
+            cls["handled"] = st.handled;
+            cls["dropped"] = st.dropped;
+            cls["queued"] = Dispatcher::instance().queued((DispatchClass)i);
+            cls["lastWaitUs"] = st.lastWaitUs;
+            cls["maxWaitUs"] = st.maxWaitUs;
+            cls["avgWaitUs"] = st.handled ? st.totalWaitUs / st.handled : 0;
+            cls["lastHandleUs"] = st.lastHandleUs;
+            cls["maxHandleUs"] = st.maxHandleUs;
+            cls["avgHandleUs"] = st.handled ? st.totalHandleUs / st.handled : 0;
+        }
+    });
+    LockMetrics::add("wifiScan", [](nlohmann::json &j) {
+        auto &scan = ScanWiFiWorker::instance();
+        j["scanning"] = scan.isScanning();
+        j["scans"] = scan.scans();
+        j["lastScanMs"] = scan.lastScanMs();
+        j["lastFirstPartMs"] = scan.lastFirstPartMs();
+        j["parts"] = scan.parts();
+    });
+    LockMetrics::add("transport", [](nlohmann::json &j) {
+        auto st = FrameTransport::instance().stats();
+        j["transfers"] = st.transfers;
+        j["fragmentsSent"] = st.fragmentsSent;
+        j["fragmentsReceived"] = st.fragmentsReceived;
+        j["retransmits"] = st.retransmits;
+        j["aborted"] = st.abortedTransfers;
+        j["reassembled"] = st.reassembled;
+        j["reassemblyDrops"] = st.reassemblyDrops;
+        j["bytesFramed"] = st.bytesFramed;
+        j["refused"] = st.refused;
+        j["malformed"] = st.malformed;
+    });
+    LockMetrics::add("admission", [](nlohmann::json &j) {
+        auto st = Dispatcher::instance().admissionStats();
+        j["admitted"] = st.admitted;
+        j["reservedOpens"] = st.reservedOpens;
+        j["rejectedSource"] = st.rejectedSource;
+        j["rejectedCpu"] = st.rejectedCpu;
+        j["rejectedQueue"] = st.rejectedQueue;
+        j["expensiveCpuMs"] = Dispatcher::instance().expensiveCpuMs();
+    });
+    LockMetrics::add("replies", [](nlohmann::json &j) {
+        auto &st = ReplySerializer::stats();
+        j["templated"] = st.templated.load();
+        j["generic"] = st.generic.load();
+        j["resOkJsonUs"] = st.jsonUs.load();
+        j["resOkTemplateUs"] = st.templateUs.load();
+        j["templateReallocs"] = st.templateReallocs.load();
+    });
+    LockMetrics::add("serialization", [](nlohmann::json &j) {
+        auto &buffers = SerialBuffers::instance();
+        auto &st = buffers.stats();
+        j["buffersTaken"] = st.taken;
+        j["buffersReused"] = st.reused;
+        j["buffersAllocated"] = st.allocated;
+        j["buffersGrown"] = st.grown;
+        j["pooled"] = buffers.pooled();
+        j["serialized"] = st.serialized;
+        j["skipped"] = st.skipped;
+        j["truncated"] = st.truncated;
+        j["bytesSerialized"] = st.bytesSerialized;
+        j["bytesCopied"] = st.bytesCopied;
+    });
+    LockMetrics::add("batch", [](nlohmann::json &j) {
+        j["batches"] = BatchMessage::batches();
+        j["items"] = BatchMessage::itemsTotal();
+        j["roundTripsSaved"] = BatchMessage::roundTripsSaved();
+        j["oversized"] = BatchMessage::oversized();
+        j["avgBatchUs"] = BatchMessage::batches() ? BatchMessage::handleMicros() / BatchMessage::batches() : 0;
+    });
+    LockMetrics::add("responseCache", [](nlohmann::json &j) {
+        auto &cache = ResponseCache::instance();
+        j["lookups"] = cache.lookups();
+        j["hits"] = cache.hits();
+        j["hitRate"] = cache.hitRate();
+        j["savedUs"] = cache.savedMicros();
+        j["entries"] = cache.size();
+        j["bytes"] = cache.bytes();
+    });
+
+    LockMetrics::add("open", [](nlohmann::json &j) {
+        auto &st = OpenRequest::openStats();
+        j["fast"] = {{"count", st.fast.count}, {"avgUs", st.fast.avgUs()}, {"maxUs", st.fast.maxUs}};
+        j["twoStep"] = {{"count", st.twoStep.count}, {"avgUs", st.twoStep.avgUs()}, {"maxUs", st.twoStep.maxUs}};
+        j["precomputed"] = st.precomputed;
+        j["fallbacks"] = st.fallbacks;
+        j["denied"] = st.denied;
+        auto &nonces = OpenNonces::instance().stats();
+        j["nonces"] = {{"live", OpenNonces::instance().size()}, {"issued", nonces.issued}, {"used", nonces.used},
+                       {"expired", nonces.expired}, {"unknown", nonces.unknown}, {"replayed", nonces.replayed},
+                       {"evicted", nonces.evicted}};
+    });
+    LockMetrics::add("sessionCipher", [](nlohmann::json &j) {
+        auto &st = SessionCipher::stats();
+        j["contexts"] = st.contexts.load();
+        j["avgExpandUs"] = st.contexts ? st.expandUs / st.contexts : 0;
+        j["ops"] = st.ops.load();
+        j["bytes"] = st.opBytes.load();
+        j["avgOpUs"] = st.ops ? st.opUs / st.ops : 0;
+        j["legacyOps"] = st.legacyOps.load();
+        j["avgLegacyUs"] = st.legacyOps ? st.legacyUs / st.legacyOps : 0;
+    });
+    LockMetrics::add("connPolicy", [](nlohmann::json &j) {
+        auto &st = connPolicy.stats();
+        j["fastLinks"] = connPolicy.fastLinks();
+        j["updates"] = st.updates;
+        j["raised"] = st.raised;
+        j["relaxed"] = st.relaxed;
+        j["failed"] = st.failed;
+        j["links"] = connPolicy.linkCount();
+        j["connects"] = st.connects;
+        j["disconnects"] = st.disconnects;
+        j["unresolved"] = st.unresolved;
+    });
+    LockMetrics::add("audit", [](nlohmann::json &j) {
+        auto &st = auditLog.stats();
+        j["lastSeq"] = auditLog.lastSeq();
+        j["capacity"] = auditLog.capacity();
+        j["buffered"] = auditLog.buffered();
+        j["appended"] = st.appended;
+        j["flushes"] = st.flushes;
+        j["bytesWritten"] = st.bytesWritten;
+        j["dropped"] = st.dropped;
+        j["writeErrors"] = st.writeErrors;
+    });
+    LockMetrics::add("deviceAccess", [](nlohmann::json &j) {
+        auto &st = DeviceAccess::instance().stats();
+        j["batches"] = st.batches;
+        j["changed"] = st.changed;
+        j["unchanged"] = st.unchanged;
+        j["unknown"] = st.unknown;
+        j["saves"] = st.saves;
+        j["lastSaveUs"] = st.lastSaveUs;
+        j["maxSaveUs"] = st.maxSaveUs;
+    });
+    LockMetrics::add("adminAuth", [](nlohmann::json &j) {
+        auto &st = AdminAuth::stats();
+        j["accepted"] = st.accepted.load();
+        j["noSession"] = st.noSession.load();
+        j["badNonce"] = st.badNonce.load();
+        j["badMac"] = st.badMac.load();
+    });
+    LockMetrics::add("ota", [](nlohmann::json &j) {
+        auto &st = ota.stats();
+        j["state"] = OtaUpdater::name(ota.getState());
+        j["offset"] = ota.offset();
+        j["total"] = ota.total();
+        j["lastError"] = OtaUpdater::name(ota.lastError());
+        j["sessions"] = st.sessions;
+        j["resumed"] = st.resumed;
+        j["chunks"] = st.chunks;
+        j["duplicates"] = st.duplicates;
+        j["bytes"] = st.bytes;
+        j["rehashedBytes"] = st.rehashedBytes;
+        j["erases"] = st.erases;
+        j["checkpoints"] = st.checkpoints;
+        j["failures"] = st.failures;
+        j["signed"] = ota.signatureRequired();
+        j["badSignatures"] = st.badSignatures;
+    });
+    LockMetrics::add("trace", [](nlohmann::json &j) {
+        j["active"] = messageTrace.isActive();
+        j["capacity"] = messageTrace.capacity();
+        j["recorded"] = messageTrace.recorded();
+    });
+    LockMetrics::add("memory", [](nlohmann::json &j) {
+        auto &mem = MemoryBudget::instance();
+        j["freeHeap"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        j["largestBlock"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        j["minLargestBlock"] = mem.lowestLargestBlock();
+        j["worstStackFree"] = mem.worstStackFree();
+    });
+    LockMetrics::add("thermal", [](nlohmann::json &j) {
+        ThermalMonitor::instance().toJson(j, 0);
+    });
+
+    LockMetrics::add("boot", [](nlohmann::json &j) {
+        BootProfile::toJson(j);
+    });
+
+    // Door path first: SPIFFS, lock/BLE and dispatch. The lock library loads
+    // its keys and confirmed devices from SPIFFS, so it is mounted before the
+    // lock, but never formatted here. The format fallback, the audit file,
+    // WiFi, the portal and telemetry come up in a background task so neither
+    // a format nor a slow or absent network delays opening after a power cut.
+    {
+        BootProfile::Stage stage("spiffs");
+        spiffsMounted = SPIFFS.begin(false);
+        if (!spiffsMounted)
+            logColor(LColor::Yellow, F("SPIFFS did not mount, formatting it in the background"));
     }
-    lock = createAndInitLock(true, LocName);
-    wifiManager.begin();
-    TemperatureMonitor::begin();
+    otaSettings.begin("ota");
+#ifdef OtaSigningKey
+    // a key that does not parse verifies nothing, so every update is refused
+    ota.requireSignature(otaSignature);
+    if (!otaSignature.valid())
+        logColor(LColor::Red, F("OtaSigningKey does not parse, OTA updates refused"));
+#endif
+    {
+        BootProfile::Stage stage("lock");
+        lock = createAndInitLock(true, LocName);
+        seedKeyStore(static_cast<BleLockServer *>(lock));
+        DeviceAccess::instance().begin(static_cast<BleLockServer *>(lock));
+        dispatcher.begin(static_cast<BleLockServer *>(lock));
+        MemoryBudget::instance().watchTask("nimble_host", xTaskGetHandle("nimble_host"), 0);
+    }
+    BootProfile::end("doorReady", 0);
+
+    xTaskCreate(backgroundBoot, "bootBg", 8192, nullptr, 1, nullptr);
 }
 
 void loop() {
+    PendingRequests::instance().tick(millis());
+    connPolicy.tick(millis());
+    auditLog.tick(millis());
+    MemoryBudget::instance().tick(millis());
+    MemoryBudget::instance().pollSerial();
+    if (ota.rebootDue(millis()))
+        ESP.restart();
+    if (!backgroundReady) {
+        delay(10);
+        return;
+    }
     wifiManager.loop();
-    static unsigned long lastTempCheck = 0;
-    if (millis() - lastTempCheck >= 10000) {
-        float temperature = TemperatureMonitor::getTemperature();
-
-        char temperatureStr[10];
-        dtostrf(temperature, 6, 2, temperatureStr);
-
-        logColor(LColor::Green, F("CPU Temperature: %s °C"), temperatureStr);
+}
 
-        lastTempCheck = millis();
-    }
+void scanWiFi (const std::function<void(const std::vector<netListItem> &found)> &progress)
+{
+    std::vector<netListItem> items;
+    wifiManager.scanWiFi([&](const std::vector<WiFiManager::ScanHit> &found) {
+        items.clear();
+        for (auto &hit : found)
+            items.push_back(netListItem{hit.ssid, hit.rssi, hit.channel, hit.isProtected});
+        progress(items);
+    });
 }
 
-void scanWiFi ()
+size_t replyWriteLimit (const std::string &address)
 {
-    wifiManager.scanWiFi();
+    return FrameTransport::instance().writeLimit(address);
 }
 
 void SetWiFiPass (String ssid, String pass)
@@ -147,4 +683,9 @@ void SetWiFiPass (String ssid, String pass)
 bool isWiFiConnected ()
 {
     return wifiManager.getIsConnected();
+}
+
+bool setApiToken (const std::string &token)
+{
+    return wifiManager.setApiToken(token);
 }
\ No newline at end of file
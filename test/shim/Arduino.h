@@ -0,0 +1,76 @@
+#ifndef SHIM_ARDUINO_H
+#define SHIM_ARDUINO_H
+
+// Host stand-in for the Arduino calls the portable headers make. Time is
+// the steady clock plus whatever a test skipped ahead with hostAdvanceMs().
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <freertos/FreeRTOS.h>
+
+#define F(text) text
+#define PROGMEM
+
+inline uint64_t &hostSkewUs()
+{
+    static uint64_t skew = 0;
+    return skew;
+}
+
+inline void hostAdvanceMs(uint32_t ms)
+{
+    hostSkewUs() += (uint64_t)ms * 1000;
+}
+
+inline uint64_t hostMicros64()
+{
+    using namespace std::chrono;
+    static const auto start = steady_clock::now();
+    return duration_cast<microseconds>(steady_clock::now() - start).count() + hostSkewUs();
+}
+
+inline unsigned long micros() { return (unsigned long)(uint32_t)hostMicros64(); }
+inline unsigned long millis() { return (unsigned long)(uint32_t)(hostMicros64() / 1000); }
+inline void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+inline uint32_t esp_random()
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+class String : public std::string {
+public:
+    String() {}
+    String(const char *s) : std::string(s ? s : "") {}
+    String(const std::string &s) : std::string(s) {}
+    unsigned length() const { return size(); }
+    bool isEmpty() const { return empty(); }
+    int toInt() const { return atoi(c_str()); }
+};
+
+struct HostSerial {
+    int printf(const char *format, ...)
+    {
+        if (!verbose)
+            return 0;
+        va_list args;
+        va_start(args, format);
+        int n = vprintf(format, args);
+        va_end(args);
+        return n;
+    }
+    void println(const char *text) { printf("%s\n", text); }
+    int available() { return 0; }
+    int read() { return -1; }
+    bool verbose = false;
+};
+
+inline HostSerial Serial;
+
+#endif
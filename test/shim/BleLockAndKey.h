@@ -0,0 +1,74 @@
+#ifndef SHIM_BLELOCKANDKEY_H
+#define SHIM_BLELOCKANDKEY_H
+
+// The few BleLockAndKey declarations the portable headers use: colored
+// logging, the hex helpers of SecureConnection, and the access list and
+// reply path of BleLockServer.
+
+#include <Arduino.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "MessageBase.h"
+
+enum class LColor { Reset, Red, Green, Yellow, Blue, Magenta, Cyan, White };
+
+inline void logColor(LColor, const char *format, ...)
+{
+    if (!Serial.verbose)
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+struct SecureConnection {
+    static std::string vector2hex(const std::vector<uint8_t> &data)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(data.size() * 2);
+        for (uint8_t b : data) {
+            hex += digits[b >> 4];
+            hex += digits[b & 0x0f];
+        }
+        return hex;
+    }
+
+    static std::vector<uint8_t> hex2vector(const std::string &hex)
+    {
+        std::vector<uint8_t> data;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2)
+            data.push_back((uint8_t)strtoul(hex.substr(i, 2).c_str(), nullptr, 16));
+        return data;
+    }
+};
+
+class BleLockServer {
+public:
+    BleLockServer() : mutex(xSemaphoreCreateMutex()) {}
+
+    static void saveConfirmedDevices() { saves++; }
+
+    // takes the message like the library does and, with no timeout, waits
+    // for no answer; host only: keeps the bytes
+    MessageBase *request(MessageBase *message, const std::string &address, int)
+    {
+        std::lock_guard<std::mutex> lock(sentMutex);
+        sent.push_back(address + " " + message->serialize());
+        delete message;
+        return nullptr;
+    }
+
+    SemaphoreHandle_t mutex;
+    static inline std::map<std::string, bool> confirmedDevices;
+    // host only: how often the list was written
+    static inline uint32_t saves = 0;
+    std::mutex sentMutex;
+    std::vector<std::string> sent;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef SHIM_MESSAGEBASE_H
+#define SHIM_MESSAGEBASE_H
+
+// Host stand-in for the lock library's message base: the common fields
+// first, then whatever the message adds, dumped as one json object.
+
+#include <functional>
+#include <map>
+#include <string>
+#include <json.hpp>
+
+using json = nlohmann::json;
+typedef int MessageType;
+
+class MessageBase {
+public:
+    MessageType type{};
+    std::string sourceAddress;
+    std::string destinationAddress;
+    std::string requestUUID;
+
+    virtual ~MessageBase() = default;
+
+    std::string serialize()
+    {
+        json doc;
+        doc["type"] = type;
+        doc["sourceAddress"] = sourceAddress;
+        doc["destinationAddress"] = destinationAddress;
+        doc["requestUUID"] = requestUUID;
+        serializeExtraFields(doc);
+        return doc.dump();
+    }
+
+    virtual MessageBase *processRequest(void *) { return nullptr; }
+
+    static void registerConstructor(MessageType type, std::function<MessageBase *()> make)
+    {
+        constructors()[type] = make;
+    }
+
+    // nullptr for bytes that are not json or a type nobody registered
+    static MessageBase *createInstance(const std::string &bytes)
+    {
+        json doc = json::parse(bytes, nullptr, false);
+        if (doc.is_discarded() || !doc.contains("type"))
+            return nullptr;
+        auto it = constructors().find(doc["type"].get<MessageType>());
+        if (it == constructors().end())
+            return nullptr;
+        MessageBase *msg = it->second();
+        msg->type = it->first;
+        msg->sourceAddress = doc.value("sourceAddress", "");
+        msg->destinationAddress = doc.value("destinationAddress", "");
+        msg->requestUUID = doc.value("requestUUID", "");
+        msg->deserializeExtraFields(doc);
+        return msg;
+    }
+
+protected:
+    virtual void serializeExtraFields(json &doc) = 0;
+    virtual void deserializeExtraFields(const json &doc) = 0;
+
+private:
+    static std::map<MessageType, std::function<MessageBase *()>> &constructors()
+    {
+        static std::map<MessageType, std::function<MessageBase *()>> map;
+        return map;
+    }
+};
+
+#endif
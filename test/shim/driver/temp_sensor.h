@@ -0,0 +1,15 @@
+#ifndef SHIM_TEMP_SENSOR_H
+#define SHIM_TEMP_SENSOR_H
+
+// The die sensor reads room temperature on the host; tests drive
+// ThermalMonitor through setSource instead.
+
+inline int temp_sensor_start() { return 0; }
+
+inline int temp_sensor_read_celsius(float *celsius)
+{
+    *celsius = 25.0f;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,4 @@
+#ifndef SHIM_ESP_ADC_CAL_H
+#define SHIM_ESP_ADC_CAL_H
+
+#endif
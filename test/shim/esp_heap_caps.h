@@ -0,0 +1,30 @@
+#ifndef SHIM_ESP_HEAP_CAPS_H
+#define SHIM_ESP_HEAP_CAPS_H
+
+// Host stand-in for the heap queries MemoryBudget makes; tests set the
+// numbers the "chip" reports through hostHeap()
+
+#include <cstddef>
+#include <cstdint>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+struct HostHeap {
+    size_t total = 320 * 1024;
+    size_t free = 200 * 1024;
+    size_t minFree = 180 * 1024;
+    size_t largestBlock = 96 * 1024;
+};
+
+inline HostHeap &hostHeap()
+{
+    static HostHeap heap;
+    return heap;
+}
+
+inline size_t heap_caps_get_total_size(uint32_t) { return hostHeap().total; }
+inline size_t heap_caps_get_free_size(uint32_t) { return hostHeap().free; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t) { return hostHeap().minFree; }
+inline size_t heap_caps_get_largest_free_block(uint32_t) { return hostHeap().largestBlock; }
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef SHIM_FREERTOS_H
+#define SHIM_FREERTOS_H
+
+// Host stand-in for the few FreeRTOS calls the portable headers make:
+// mutexes map onto std::timed_mutex, a task is a thread, a queue a deque
+// of fixed-size items behind a condition variable. Priorities and stack
+// sizes are ignored.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef void *SemaphoreHandle_t;
+typedef void *TaskHandle_t;
+typedef void *QueueHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffffu
+#define pdMS_TO_TICKS(ms) (ms)
+
+// from the C heap like FreeRTOS, so a test replacing operator new does
+// not see its own bookkeeping's mutex
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new (malloc(sizeof(std::timed_mutex))) std::timed_mutex;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t ticks)
+{
+    auto mutex = static_cast<std::timed_mutex *>(m);
+    if (ticks == portMAX_DELAY) {
+        mutex->lock();
+        return pdTRUE;
+    }
+    return mutex->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t m)
+{
+    static_cast<std::timed_mutex *>(m)->unlock();
+    return pdTRUE;
+}
+
+inline void vSemaphoreDelete(SemaphoreHandle_t m)
+{
+    static_cast<std::timed_mutex *>(m)->~timed_mutex();
+    free(m);
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    static thread_local char task;
+    return &task;
+}
+
+inline std::string &hostTaskName()
+{
+    static thread_local std::string name = "main";
+    return name;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t, void *param, UBaseType_t, TaskHandle_t *handle)
+{
+    std::promise<TaskHandle_t> started;
+    auto task = started.get_future();
+    std::string taskName = name;
+    std::thread([fn, param, taskName, &started]() {
+        hostTaskName() = taskName;
+        started.set_value(xTaskGetCurrentTaskHandle());
+        fn(param);
+    }).detach();
+    TaskHandle_t created = task.get();
+    if (handle)
+        *handle = created;
+    return pdTRUE;
+}
+
+inline const char *pcTaskGetName(TaskHandle_t task)
+{
+    return task == xTaskGetCurrentTaskHandle() ? hostTaskName().c_str() : "task";
+}
+
+inline void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+struct HostQueue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> items;
+    size_t depth;
+    size_t itemSize;
+};
+
+inline QueueHandle_t xQueueCreate(UBaseType_t depth, UBaseType_t itemSize)
+{
+    auto q = new (malloc(sizeof(HostQueue))) HostQueue;
+    q->depth = depth;
+    q->itemSize = itemSize;
+    return q;
+}
+
+// waits up to `ticks` ms for `ready`, with the queue's mutex held
+template<typename Ready>
+inline bool hostQueueWait(HostQueue *q, std::unique_lock<std::mutex> &lock, TickType_t ticks, Ready ready)
+{
+    if (ticks == portMAX_DELAY) {
+        q->changed.wait(lock, ready);
+        return true;
+    }
+    return q->changed.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t ticks)
+{
+    auto q = static_cast<HostQueue *>(handle);
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!hostQueueWait(q, lock, ticks, [q]() { return q->items.size() < q->depth; }))
+        return pdFALSE;
+    auto bytes = static_cast<const uint8_t *>(item);
+    q->items.emplace_back(bytes, bytes + q->itemSize);
+    q->changed.notify_all();
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t ticks)
+{
+    auto q = static_cast<HostQueue *>(handle);
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!hostQueueWait(q, lock, ticks, [q]() { return !q->items.empty(); }))
+        return pdFALSE;
+    memcpy(item, q->items.front().data(), q->itemSize);
+    q->items.pop_front();
+    q->changed.notify_all();
+    return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle)
+{
+    auto q = static_cast<HostQueue *>(handle);
+    std::lock_guard<std::mutex> lock(q->mutex);
+    return q->items.size();
+}
+
+// stack bytes a task never touched, as tests set them; 4 KB otherwise
+inline std::map<TaskHandle_t, uint32_t> &hostStackFree()
+{
+    static std::map<TaskHandle_t, uint32_t> free;
+    return free;
+}
+
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    auto it = hostStackFree().find(task);
+    return it == hostStackFree().end() ? 4096 : it->second;
+}
+
+#endif
@@ -0,0 +1,2 @@
+// Host builds: the firmware includes nlohmann json as <json.hpp>
+#include <nlohmann/json.hpp>
@@ -0,0 +1,185 @@
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "AdminAuth.h"
+#include "DeviceAccess.h"
+
+static BleLockServer server;
+
+static std::string address(int n)
+{
+    char text[18];
+    snprintf(text, sizeof(text), "10:20:30:40:%02x:%02x", (n >> 8) & 0xff, n & 0xff);
+    return text;
+}
+
+void setUp()
+{
+    BleLockServer::confirmedDevices.clear();
+    BleLockServer::saves = 0;
+    DeviceAccess::instance().begin(&server);
+}
+
+void tearDown() {}
+
+void test_bulk_apply_saves_once()
+{
+    auto &access = DeviceAccess::instance();
+    std::vector<DeviceAccess::Entry> entries;
+    for (int i = 0; i < 500; i++) {
+        BleLockServer::confirmedDevices[address(i)] = false;
+        entries.emplace_back(address(i), i % 3 != 0);
+    }
+    TEST_ASSERT_EQUAL(333, access.apply(entries));
+    TEST_ASSERT_EQUAL(1, BleLockServer::saves);
+    TEST_ASSERT_EQUAL(500, access.snapshot().size());
+    TEST_ASSERT_TRUE(access.isConfirmed(address(1)));
+    TEST_ASSERT_FALSE(access.isConfirmed(address(3)));
+
+    // the same list again changes nothing and writes nothing
+    TEST_ASSERT_EQUAL(0, access.apply(entries));
+    TEST_ASSERT_EQUAL(1, BleLockServer::saves);
+}
+
+void test_hash_form_names_the_mac()
+{
+    auto &access = DeviceAccess::instance();
+    BleLockServer::confirmedDevices[address(7)] = false;
+    std::string listed = address(7) + " " + DeviceAccess::keyHash({1, 2, 3});
+    TEST_ASSERT_EQUAL(1, access.apply({{listed, true}}));
+    TEST_ASSERT_TRUE(access.isConfirmed(address(7)));
+    TEST_ASSERT_EQUAL(1, BleLockServer::confirmedDevices.size());
+}
+
+void test_unknown_macs_are_not_added()
+{
+    auto &access = DeviceAccess::instance();
+    BleLockServer::confirmedDevices[address(1)] = false;
+    size_t unknown = 0;
+    TEST_ASSERT_EQUAL(1, access.apply({{address(1), true}, {address(2), true}, {address(3) + " 000000000001", true}}, &unknown));
+    TEST_ASSERT_EQUAL(2, unknown);
+    TEST_ASSERT_EQUAL(1, BleLockServer::confirmedDevices.size());
+    TEST_ASSERT_FALSE(access.isConfirmed(address(2)));
+
+    // nothing known, nothing written
+    TEST_ASSERT_EQUAL(0, access.apply({{address(4), true}}, &unknown));
+    TEST_ASSERT_EQUAL(1, unknown);
+    TEST_ASSERT_EQUAL(1, BleLockServer::saves);
+}
+
+void test_key_hash_is_the_low_bits_of_the_byte_sum()
+{
+    TEST_ASSERT_EQUAL_STRING("000000000000", DeviceAccess::keyHash({}).c_str());
+    // 6: bits 1 and 2, least significant first
+    TEST_ASSERT_EQUAL_STRING("011000000000", DeviceAccess::keyHash({1, 2, 3}).c_str());
+    // 258 x 255 = 65790 wraps to 254
+    std::vector<uint8_t> big(258, 0xff);
+    TEST_ASSERT_EQUAL_STRING("011111110000", DeviceAccess::keyHash(big).c_str());
+}
+
+static std::string sessionKey()
+{
+    return std::string("\x00\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb\xcc\xdd\xee\xff", 16);
+}
+
+void test_admin_mac_needs_the_session_key()
+{
+    const int type = 27;
+    std::string peer = address(9);
+    std::string uuid = "5b0e7c1a-93d2-4f6e-8a41-2c7d9e0b3f58";
+    std::string fields = "1048576|9f86d081884c7d65";
+    auto &nonces = OpenNonces::instance();
+
+    // no session on this connection: nothing can be right
+    nonces.issue(peer, "n1", "", 0);
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "n1", fields, "00", 0));
+
+    KeyStore::instance().publishSessionKey(peer, sessionKey());
+    SessionCipher phone(sessionKey());
+    std::string auth = phone.proof(AdminAuth::text(type, uuid, "n1", fields));
+    TEST_ASSERT_TRUE(AdminAuth::check(peer, type, uuid, "n1", fields, auth, 0));
+
+    // bound to the type, the request, the nonce and every field
+    auto fails = [&](int t, const std::string &u, const std::string &f, const std::string &a) {
+        nonces.issue(peer, "n2", "", 0);
+        return !AdminAuth::check(peer, t, u, "n2", f, a, 0);
+    };
+    auth = phone.proof(AdminAuth::text(type, uuid, "n2", fields));
+    TEST_ASSERT_TRUE(fails(type + 1, uuid, fields, auth));
+    TEST_ASSERT_TRUE(fails(type, "other", fields, auth));
+    TEST_ASSERT_TRUE(fails(type, uuid, "1048577|9f86d081884c7d65", auth));
+    TEST_ASSERT_TRUE(fails(type, uuid, fields, ""));
+    TEST_ASSERT_TRUE(fails(type, uuid, fields, phone.proof(AdminAuth::text(type, uuid, "n1", fields))));
+    // and to the peer's own key
+    nonces.issue(address(10), "n2", "", 0);
+    TEST_ASSERT_FALSE(AdminAuth::check(address(10), type, uuid, "n2", fields, auth, 0));
+
+    KeyStore::instance().dropSession(peer);
+    nonces.issue(peer, "n2", "", 0);
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "n2", fields, auth, 0));
+    TEST_ASSERT_EQUAL(1, AdminAuth::stats().accepted.load());
+}
+
+void test_admin_frame_does_not_replay()
+{
+    const int type = 27;
+    std::string peer = address(11);
+    std::string uuid = "0f6b2a9e-41c7-4d8a-b3e5-7c2d1a9f4e60";
+    std::string fields = "0|50";
+    auto &nonces = OpenNonces::instance();
+    KeyStore::instance().publishSessionKey(peer, sessionKey());
+    SessionCipher phone(sessionKey());
+    uint32_t badNonce = AdminAuth::stats().badNonce.load();
+
+    nonces.issue(peer, "r1", "", 1000);
+    std::string auth = phone.proof(AdminAuth::text(type, uuid, "r1", fields));
+    TEST_ASSERT_TRUE(AdminAuth::check(peer, type, uuid, "r1", fields, auth, 1000));
+    // the same frame again, before and after the next nonce went out
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "r1", fields, auth, 1001));
+    nonces.issue(peer, "r2", "", 1002);
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "r1", fields, auth, 1003));
+    // a bad MAC spends the nonce too, and an old one is refused
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "r2", fields, "00", 1004));
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "r2", fields, phone.proof(AdminAuth::text(type, uuid, "r2", fields)), 1005));
+    nonces.issue(peer, "r3", "", 1006);
+    TEST_ASSERT_FALSE(AdminAuth::check(peer, type, uuid, "r3", fields, phone.proof(AdminAuth::text(type, uuid, "r3", fields)),
+                                       1006 + OpenNonceTtlMs + 1));
+    TEST_ASSERT_EQUAL(badNonce + 4, AdminAuth::stats().badNonce.load());
+}
+
+void test_secret_field_round_trips()
+{
+    const int type = 26;
+    std::string peer = address(12);
+    std::string uuid = "c4e1a7d2-5b3f-4e9a-8d60-1f2b7c9e3a45";
+    KeyStore::instance().publishSessionKey(peer, sessionKey());
+    SessionCipher phone(sessionKey());
+
+    std::string token = "a LAN token longer than one AES block";
+    std::string sealed = token;
+    phone.crypt(AdminAuth::text(type, uuid, "s1", "token"), sealed);
+    std::string hex = SessionCipher::toHex(sealed);
+    TEST_ASSERT_TRUE(hex.find("4c414e") == std::string::npos);
+
+    std::string plain;
+    TEST_ASSERT_TRUE(AdminAuth::reveal(peer, type, uuid, "s1", "token", hex, plain));
+    TEST_ASSERT_EQUAL_STRING(token.c_str(), plain.c_str());
+    // another nonce gives another key stream
+    TEST_ASSERT_TRUE(AdminAuth::reveal(peer, type, uuid, "s2", "token", hex, plain));
+    TEST_ASSERT_TRUE(plain != token);
+    TEST_ASSERT_FALSE(AdminAuth::reveal(peer, type, uuid, "s1", "token", hex + "0", plain));
+    TEST_ASSERT_FALSE(AdminAuth::reveal(address(13), type, uuid, "s1", "token", hex, plain));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bulk_apply_saves_once);
+    RUN_TEST(test_hash_form_names_the_mac);
+    RUN_TEST(test_unknown_macs_are_not_added);
+    RUN_TEST(test_key_hash_is_the_low_bits_of_the_byte_sum);
+    RUN_TEST(test_admin_mac_needs_the_session_key);
+    RUN_TEST(test_admin_frame_does_not_replay);
+    RUN_TEST(test_secret_field_round_trips);
+    return UNITY_END();
+}
@@ -0,0 +1,112 @@
+#include <unity.h>
+#include <string>
+#include "Admission.h"
+
+using Verdict = AdmissionControl::Verdict;
+
+static const char *Phone = "5c:3a:91:0e:7f:21";
+static const char *Other = "11:22:33:44:55:66";
+
+void setUp() {}
+void tearDown() {}
+
+void test_normal_requests_are_never_throttled()
+{
+    AdmissionControl ac;
+    for (int i = 0; i < 100; i++)
+        TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Normal, false, 99, 0));
+    TEST_ASSERT_EQUAL(100, ac.stats().admitted);
+}
+
+void test_bucket_per_source_refills()
+{
+    AdmissionControl ac;
+    for (int i = 0; i < AdmissionBucketSize; i++)
+        TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, 0));
+    TEST_ASSERT_EQUAL((int)Verdict::RejectSource, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, 0));
+    // another phone has a bucket of its own
+    TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Other, AdmissionCost::Expensive, false, 0, 0));
+
+    TEST_ASSERT_EQUAL((int)Verdict::RejectSource, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, AdmissionRefillMs - 1));
+    TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, AdmissionRefillMs));
+    TEST_ASSERT_EQUAL((int)Verdict::RejectSource, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, AdmissionRefillMs));
+    TEST_ASSERT_EQUAL(3, ac.stats().rejectedSource);
+}
+
+void test_opens_of_keyed_devices_are_reserved()
+{
+    AdmissionControl ac;
+    for (int i = 0; i < 10; i++)
+        TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Open, true, AdmissionMaxExpensiveQueued, 0));
+    TEST_ASSERT_EQUAL(10, ac.stats().reservedOpens);
+
+    // unknown devices pay from the bucket, but not for queue or cpu
+    ac.charge(AdmissionWindowMs * 1000, 0);
+    for (int i = 0; i < AdmissionBucketSize; i++)
+        TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Other, AdmissionCost::Open, false, AdmissionMaxExpensiveQueued, 0));
+    TEST_ASSERT_EQUAL((int)Verdict::RejectSource, (int)ac.admit(Other, AdmissionCost::Open, false, 0, 0));
+}
+
+void test_expensive_queue_is_bounded()
+{
+    AdmissionControl ac;
+    TEST_ASSERT_EQUAL((int)Verdict::RejectQueue, (int)ac.admit(Phone, AdmissionCost::Expensive, false, AdmissionMaxExpensiveQueued, 0));
+    TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Expensive, false, AdmissionMaxExpensiveQueued - 1, 0));
+    TEST_ASSERT_EQUAL(1, ac.stats().rejectedQueue);
+}
+
+// Expensive handlers may use AdmissionCpuBudgetPercent of a window; what
+// they used in the previous window fades out as the current one goes on
+void test_cpu_budget_over_a_sliding_window()
+{
+    AdmissionControl ac;
+    uint32_t budgetMs = AdmissionWindowMs * AdmissionCpuBudgetPercent / 100;
+    ac.charge((budgetMs - 1) * 1000, 1000);
+    TEST_ASSERT_EQUAL(budgetMs - 1, ac.cpuUsedMs(1000));
+    TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, 1000));
+    ac.charge(1000, 1000);
+    TEST_ASSERT_EQUAL((int)Verdict::RejectCpu, (int)ac.admit(Other, AdmissionCost::Expensive, false, 0, 1000));
+
+    // half way into the next window half of it still counts
+    uint32_t half = AdmissionWindowMs + AdmissionWindowMs / 2;
+    TEST_ASSERT_EQUAL(budgetMs / 2, ac.cpuUsedMs(half));
+    TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Other, AdmissionCost::Expensive, false, 0, half));
+    // two windows later nothing is left
+    TEST_ASSERT_EQUAL(0, ac.cpuUsedMs(3 * AdmissionWindowMs));
+    TEST_ASSERT_EQUAL(1, ac.stats().rejectedCpu);
+}
+
+// The table of buckets is bounded; a new source pushes out the one used
+// longest ago, which starts over with a full bucket when it comes back
+void test_idlest_source_is_evicted()
+{
+    AdmissionControl ac;
+    for (int i = 0; i < AdmissionBucketSize; i++)
+        ac.admit(Phone, AdmissionCost::Expensive, false, 0, 0);
+    for (int i = 0; i < AdmissionMaxSources - 1; i++)
+        ac.admit("peer" + std::to_string(i), AdmissionCost::Expensive, false, 0, 1 + i);
+    TEST_ASSERT_EQUAL((int)Verdict::RejectSource, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, 100));
+
+    // Phone was just used, so peer0 goes
+    ac.admit("late", AdmissionCost::Expensive, false, 0, 101);
+    TEST_ASSERT_EQUAL((int)Verdict::RejectSource, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, 102));
+
+    // now Phone is the idlest after everyone else moved on
+    for (int i = 1; i < AdmissionMaxSources - 1; i++)
+        ac.admit("peer" + std::to_string(i), AdmissionCost::Expensive, false, 0, 200 + i);
+    ac.admit("late", AdmissionCost::Expensive, false, 0, 250);
+    ac.admit("later", AdmissionCost::Expensive, false, 0, 300);
+    TEST_ASSERT_EQUAL((int)Verdict::Admit, (int)ac.admit(Phone, AdmissionCost::Expensive, false, 0, 301));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_normal_requests_are_never_throttled);
+    RUN_TEST(test_bucket_per_source_refills);
+    RUN_TEST(test_opens_of_keyed_devices_are_reserved);
+    RUN_TEST(test_expensive_queue_is_bounded);
+    RUN_TEST(test_cpu_budget_over_a_sliding_window);
+    RUN_TEST(test_idlest_source_is_evicted);
+    return UNITY_END();
+}
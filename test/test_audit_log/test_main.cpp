@@ -0,0 +1,178 @@
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "AuditLog.h"
+
+// Erased flash in RAM, counting the writes that reach it
+class RamFlash : public AuditFlash {
+public:
+    explicit RamFlash(size_t records) : bytes(records * sizeof(AuditRecord), 0xff) {}
+
+    size_t size() override { return bytes.size(); }
+
+    bool read(size_t offset, void *buf, size_t len) override
+    {
+        if (offset + len > bytes.size())
+            return false;
+        memcpy(buf, &bytes[offset], len);
+        return true;
+    }
+
+    bool write(size_t offset, const void *buf, size_t len) override
+    {
+        if (offset + len > bytes.size())
+            return false;
+        memcpy(&bytes[offset], buf, len);
+        writes++;
+        return true;
+    }
+
+    std::vector<uint8_t> bytes;
+    uint32_t writes = 0;
+};
+
+static const char *Phone = "5C:3A:91:0E:7F:21";
+
+void setUp() {}
+void tearDown() {}
+
+void test_appends_are_batched()
+{
+    RamFlash flash(64);
+    AuditLog log(flash);
+    log.begin();
+    for (int i = 0; i < AuditBufferRecords - 1; i++)
+        log.append(Phone, AuditResult::Opened, 40, 1700000000 + i, true, 1000);
+    log.tick(1000);
+    TEST_ASSERT_EQUAL(0, flash.writes);
+
+    log.append(Phone, AuditResult::Denied, 55, 1700000100, true, 1000);
+    log.tick(1000);
+    TEST_ASSERT_EQUAL(1, flash.writes);
+    TEST_ASSERT_EQUAL(0, log.buffered());
+
+    // a partly filled buffer waits AuditFlushMs
+    log.append(Phone, AuditResult::Opened, 40, 1700000200, true, 2000);
+    log.tick(2000 + AuditFlushMs - 1);
+    TEST_ASSERT_EQUAL(1, flash.writes);
+    log.tick(2000 + AuditFlushMs);
+    TEST_ASSERT_EQUAL(2, flash.writes);
+}
+
+void test_pages_cover_flash_and_buffer()
+{
+    RamFlash flash(64);
+    AuditLog log(flash);
+    log.begin();
+    for (int i = 0; i < 30; i++)
+        log.append(Phone, i % 2 ? AuditResult::Opened : AuditResult::Denied, i, 1700000000 + i, true, 0);
+    log.flush();
+    for (int i = 30; i < 35; i++)
+        log.append(Phone, AuditResult::Opened, i, 1700000000 + i, true, 0);
+
+    std::vector<uint32_t> seen;
+    uint32_t cursor = 0;
+    for (int pages = 0; pages < 10; pages++) {
+        nlohmann::json j;
+        log.page(cursor, AuditPageMax, j);
+        if (j["entries"].empty())
+            break;
+        for (auto &e : j["entries"])
+            seen.push_back(e[0].get<uint32_t>());
+        cursor = j["next"];
+    }
+    TEST_ASSERT_EQUAL(35, seen.size());
+    for (size_t i = 0; i < seen.size(); i++)
+        TEST_ASSERT_EQUAL(i + 1, seen[i]);
+
+    nlohmann::json j;
+    log.page(35, 1, j);
+    TEST_ASSERT_EQUAL_STRING("5c:3a:91:0e:7f:21", j["entries"][0][2].get<std::string>().c_str());
+    TEST_ASSERT_EQUAL(35, j["last"].get<uint32_t>());
+}
+
+void test_wraps_and_survives_reboot()
+{
+    RamFlash flash(32);
+    {
+        AuditLog log(flash);
+        log.begin();
+        for (int i = 0; i < 100; i++) {
+            log.append(Phone, AuditResult::Opened, 10, 1700000000 + i, true, 0);
+            log.tick(0);
+        }
+        log.flush();
+    }
+    AuditLog log(flash);
+    log.begin();
+    TEST_ASSERT_EQUAL(100, log.lastSeq());
+    TEST_ASSERT_EQUAL(101, log.append(Phone, AuditResult::Opened, 10, 0, false, 0));
+
+    // only the newest capacity() records are left; a stale cursor skips ahead
+    std::vector<AuditRecord> out;
+    uint32_t next;
+    log.read(1, AuditPageMax, out, next);
+    TEST_ASSERT_EQUAL(100 - 32 + 1, out.front().seq);
+}
+
+void test_corrupt_slot_is_skipped()
+{
+    RamFlash flash(32);
+    AuditLog log(flash);
+    log.begin();
+    for (int i = 0; i < 5; i++)
+        log.append(Phone, AuditResult::Opened, 10, 1700000000 + i, true, 0);
+    log.flush();
+    flash.bytes[3 * sizeof(AuditRecord) + 4] ^= 0x40;   // time of seq 3
+
+    std::vector<AuditRecord> out;
+    uint32_t next;
+    log.read(1, AuditPageMax, out, next);
+    TEST_ASSERT_EQUAL(4, out.size());
+    TEST_ASSERT_EQUAL(4, out[2].seq);
+}
+
+// Opens before the background boot mounted the file system wait in RAM and
+// continue the numbering found in flash
+void test_appends_before_begin_follow_flash()
+{
+    RamFlash flash(32);
+    {
+        AuditLog log(flash);
+        log.begin();
+        for (int i = 0; i < 10; i++)
+            log.append(Phone, AuditResult::Opened, 10, 1700000000 + i, true, 0);
+        log.flush();
+    }
+    AuditLog log(flash);
+    log.append(Phone, AuditResult::Denied, 20, 1700000100, true, 0);
+    log.append(Phone, AuditResult::Opened, 30, 1700000101, true, 0);
+    log.tick(AuditFlushMs);
+    log.flush();
+    TEST_ASSERT_EQUAL(2, log.buffered());
+
+    log.begin();
+    TEST_ASSERT_EQUAL(12, log.lastSeq());
+    log.flush();
+    TEST_ASSERT_EQUAL(0, log.buffered());
+
+    std::vector<AuditRecord> out;
+    uint32_t next;
+    log.read(9, AuditPageMax, out, next);
+    TEST_ASSERT_EQUAL(4, out.size());
+    TEST_ASSERT_EQUAL(11, out[2].seq);
+    TEST_ASSERT_EQUAL((uint8_t)AuditResult::Denied, out[2].result);
+    TEST_ASSERT_EQUAL(12, out[3].seq);
+    TEST_ASSERT_EQUAL(13, next);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_appends_are_batched);
+    RUN_TEST(test_pages_cover_flash_and_buffer);
+    RUN_TEST(test_wraps_and_survives_reboot);
+    RUN_TEST(test_corrupt_slot_is_skipped);
+    RUN_TEST(test_appends_before_begin_follow_flash);
+    return UNITY_END();
+}
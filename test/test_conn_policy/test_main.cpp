@@ -0,0 +1,176 @@
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "ConnPolicy.h"
+
+// Stand-in link layer: a settable connection list and a record of every
+// parameter update asked for
+class FakeLink : public LinkDriver {
+public:
+    struct Update {
+        uint16_t handle;
+        ConnParams params;
+    };
+
+    std::vector<LinkPeer> peers;
+    std::vector<Update> updates;
+
+    void connected(std::vector<LinkPeer> &out) override { out = peers; }
+
+    bool update(uint16_t handle, const ConnParams &params) override
+    {
+        updates.push_back(Update{handle, params});
+        return true;
+    }
+};
+
+static std::vector<std::string> gone;
+
+static void onGone(const std::string &address)
+{
+    gone.push_back(address);
+}
+
+static const int Open = 2;
+static const int List = 8;
+static const int Other = 20;
+
+static void configure(ConnPolicy &policy)
+{
+    policy.setProfile(Open, LinkProfile::Interactive);
+    policy.setProfile(List, LinkProfile::Bulk);
+    policy.setDisconnectHook(onGone);
+}
+
+static bool sameParams(const ConnParams &a, const ConnParams &b)
+{
+    return a.minInterval == b.minInterval && a.maxInterval == b.maxInterval && a.latency == b.latency &&
+           a.timeout == b.timeout;
+}
+
+void setUp()
+{
+    gone.clear();
+}
+
+void tearDown() {}
+
+void test_open_raises_then_relaxes()
+{
+    FakeLink link;
+    ConnPolicy policy(link);
+    configure(policy);
+    link.peers = {{1, "aa:bb:cc:dd:ee:01"}};
+    policy.tick(1000);
+
+    policy.onMessage("aa:bb:cc:dd:ee:01", Open, 1000);
+    TEST_ASSERT_EQUAL(1, link.updates.size());
+    TEST_ASSERT_EQUAL(1, link.updates[0].handle);
+    TEST_ASSERT_TRUE(sameParams(link.updates[0].params, ConnPolicy::paramsFor(LinkProfile::Interactive)));
+    TEST_ASSERT_TRUE(policy.profileOf("aa:bb:cc:dd:ee:01") == LinkProfile::Interactive);
+
+    // a bulk message while interactive changes nothing
+    policy.onMessage("aa:bb:cc:dd:ee:01", List, 1500);
+    TEST_ASSERT_EQUAL(1, link.updates.size());
+
+    policy.tick(1000 + ConnInteractiveHoldMs - 1);
+    TEST_ASSERT_EQUAL(1, link.updates.size());
+    policy.tick(1000 + ConnInteractiveHoldMs);
+    TEST_ASSERT_EQUAL(2, link.updates.size());
+    TEST_ASSERT_TRUE(sameParams(link.updates[1].params, ConnPolicy::paramsFor(LinkProfile::Idle)));
+    TEST_ASSERT_EQUAL(0, policy.fastLinks());
+
+    // relaxed once, not again on every tick
+    policy.tick(1000 + ConnInteractiveHoldMs + 5000);
+    TEST_ASSERT_EQUAL(2, link.updates.size());
+}
+
+void test_never_raised_link_is_relaxed()
+{
+    FakeLink link;
+    ConnPolicy policy(link);
+    configure(policy);
+    link.peers = {{4, "aa:bb:cc:dd:ee:04"}};
+    policy.tick(300);
+    policy.onMessage("aa:bb:cc:dd:ee:04", Other, 400);
+    TEST_ASSERT_EQUAL(0, link.updates.size());
+
+    policy.tick(300 + ConnSettleMs);
+    TEST_ASSERT_EQUAL(1, link.updates.size());
+    TEST_ASSERT_EQUAL(4, link.updates[0].handle);
+    TEST_ASSERT_TRUE(sameParams(link.updates[0].params, ConnPolicy::paramsFor(LinkProfile::Idle)));
+    TEST_ASSERT_EQUAL(1, policy.stats().relaxed);
+}
+
+void test_claimed_address_must_be_connected()
+{
+    FakeLink link;
+    ConnPolicy policy(link);
+    configure(policy);
+    link.peers = {{1, "aa:bb:cc:dd:ee:01"}};
+    policy.tick(1000);
+
+    // a message naming a peer that has no connection tunes nothing
+    policy.onMessage("11:22:33:44:55:66", Open, 1000);
+    TEST_ASSERT_EQUAL(0, link.updates.size());
+    TEST_ASSERT_EQUAL(1, policy.stats().unresolved);
+
+    // the controller's spelling and the message's may differ in case
+    policy.onMessage("AA:BB:CC:DD:EE:01", Open, 1000);
+    TEST_ASSERT_EQUAL(1, link.updates.size());
+    TEST_ASSERT_EQUAL(1, link.updates[0].handle);
+}
+
+void test_disconnect_forgets_and_reports()
+{
+    FakeLink link;
+    ConnPolicy policy(link);
+    configure(policy);
+    link.peers = {{1, "aa:bb:cc:dd:ee:01"}, {2, "aa:bb:cc:dd:ee:02"}};
+    policy.tick(1000);
+    policy.onMessage("AA:BB:CC:DD:EE:01", Open, 1000);
+    TEST_ASSERT_EQUAL(2, policy.linkCount());
+
+    link.peers = {{2, "aa:bb:cc:dd:ee:02"}};
+    policy.tick(1000 + ConnLinkPollMs);
+    TEST_ASSERT_EQUAL(1, policy.linkCount());
+    TEST_ASSERT_EQUAL(2, gone.size());
+    TEST_ASSERT_EQUAL_STRING("AA:BB:CC:DD:EE:01", gone[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("aa:bb:cc:dd:ee:01", gone[1].c_str());
+    TEST_ASSERT_EQUAL(1, policy.stats().disconnects);
+    TEST_ASSERT_EQUAL(0, policy.fastLinks());
+
+    // the raised link is gone, so its hold running out relaxes nothing
+    size_t before = link.updates.size();
+    policy.tick(1000 + ConnInteractiveHoldMs);
+    TEST_ASSERT_EQUAL(before, link.updates.size());
+}
+
+void test_reused_handle_is_a_new_link()
+{
+    FakeLink link;
+    ConnPolicy policy(link);
+    configure(policy);
+    link.peers = {{1, "aa:bb:cc:dd:ee:01"}};
+    policy.tick(1000);
+    policy.onMessage("aa:bb:cc:dd:ee:01", Open, 1000);
+
+    link.peers = {{1, "aa:bb:cc:dd:ee:09"}};
+    policy.tick(1000 + ConnLinkPollMs);
+    TEST_ASSERT_EQUAL(1, gone.size());
+    TEST_ASSERT_EQUAL_STRING("aa:bb:cc:dd:ee:01", gone[0].c_str());
+    TEST_ASSERT_TRUE(policy.profileOf("aa:bb:cc:dd:ee:09") == LinkProfile::Idle);
+    TEST_ASSERT_TRUE(policy.profileOf("aa:bb:cc:dd:ee:01") == LinkProfile::Idle);
+    TEST_ASSERT_EQUAL(2, policy.stats().connects);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_open_raises_then_relaxes);
+    RUN_TEST(test_never_raised_link_is_relaxed);
+    RUN_TEST(test_claimed_address_must_be_connected);
+    RUN_TEST(test_disconnect_forgets_and_reports);
+    RUN_TEST(test_reused_handle_is_a_new_link);
+    return UNITY_END();
+}
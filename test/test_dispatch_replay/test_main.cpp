@@ -0,0 +1,84 @@
+#include <unity.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "DispatchReplay.h"
+
+static const uint8_t Open = 0, Admin = 2;
+
+// A download holding `records` as captured
+static std::vector<uint8_t> download(const std::vector<TraceRecord> &records)
+{
+    TraceHeader header{TraceMagic, TraceVersion, sizeof(TraceRecord), (uint32_t)records.size(), 0, 0, 64};
+    std::vector<uint8_t> body(reinterpret_cast<uint8_t *>(&header), reinterpret_cast<uint8_t *>(&header + 1));
+    body.insert(body.end(), reinterpret_cast<const uint8_t *>(records.data()),
+                reinterpret_cast<const uint8_t *>(records.data() + records.size()));
+    return body;
+}
+
+static TraceRecord handled(uint8_t type, uint8_t cls, uint32_t at, uint32_t run, uint16_t bytes = 120)
+{
+    return TraceRecord{at, 0, run, bytes, type, cls};
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Three Admin requests 1 ms apart that ran 5 ms each and never waited in
+// the field: replayed on the one Admin worker, the Dispatcher measures the
+// second and third waiting behind the first
+void test_replay_is_measured_on_the_dispatcher()
+{
+    auto body = download({handled(5, Admin, 1000, 5000), handled(5, Admin, 2000, 5000), handled(5, Admin, 3000, 5000)});
+    TraceReplay trace;
+    std::string error;
+    TEST_ASSERT_TRUE(trace.load(body.data(), body.size(), error));
+
+    DispatchReplay replay(trace);
+    nlohmann::json report;
+    replay.run(report);
+    TEST_ASSERT_EQUAL(0, report["unfinished"].get<int>());
+    TEST_ASSERT_EQUAL(3, report["replies"].get<int>());
+    auto &admin = report["replayed"]["5"];
+    TEST_ASSERT_EQUAL(3, admin["count"].get<int>());
+    TEST_ASSERT_TRUE(admin["avgHandleUs"].get<int>() >= 5000);
+    TEST_ASSERT_TRUE(admin["maxWaitUs"].get<int>() >= 7000);
+    // the request the worker got was padded to its captured size
+    TEST_ASSERT_EQUAL(120, admin["avgBytes"].get<int>());
+    TEST_ASSERT_EQUAL(0, report["captured"]["5"]["maxWaitUs"].get<int>());
+    TEST_ASSERT_EQUAL(1, Dispatcher::instance().poolOf(DispatchClass::Admin));
+}
+
+// An installed handler replaces the captured time and runs on a worker of
+// the record's class
+void test_installed_handler_runs_on_the_class_worker()
+{
+    auto body = download({handled(6, Open, 0, 20000), handled(6, Open, 100, 20000)});
+    TraceReplay trace;
+    std::string error;
+    TEST_ASSERT_TRUE(trace.load(body.data(), body.size(), error));
+
+    std::mutex mutex;
+    std::vector<std::string> tasks;
+    DispatchReplay replay(trace);
+    replay.setHandler(6, [&](const TraceRecord &rec) {
+        std::lock_guard<std::mutex> guard(mutex);
+        tasks.push_back(hostTaskName());
+    });
+    nlohmann::json report;
+    replay.run(report);
+    TEST_ASSERT_EQUAL(2, tasks.size());
+    for (auto &task : tasks)
+        TEST_ASSERT_EQUAL_STRING("dispOpen", task.substr(0, 8).c_str());
+    TEST_ASSERT_EQUAL(2, report["replayed"]["6"]["count"].get<int>());
+    TEST_ASSERT_TRUE(report["replayed"]["6"]["avgHandleUs"].get<int>() < 20000);
+    TEST_ASSERT_EQUAL(20000, report["captured"]["6"]["avgHandleUs"].get<int>());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_replay_is_measured_on_the_dispatcher);
+    RUN_TEST(test_installed_handler_runs_on_the_class_worker);
+    return UNITY_END();
+}
@@ -0,0 +1,676 @@
+#include <unity.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Dispatcher.h"
+
+static const MessageType OkType = 1, OpenType = 2, AdminType = 3, BatchType = 4, ScanType = 5, HandshakeType = 6,
+                         HelloType = 7, KeyedOpenType = 8;
+
+// Same shape as ResOk in ReqRes.h, carrying the seq of the request answered
+class Ok : public MessageBase {
+public:
+    int seq = 0;
+
+    Ok() { type = OkType; }
+
+protected:
+    void serializeExtraFields(json &doc) override { doc["seq"] = seq; }
+    void deserializeExtraFields(const json &doc) override { seq = doc["seq"]; }
+};
+
+// Where and in which order requests ran
+struct Ran {
+    int seq;
+    std::string address;
+    TaskHandle_t task;
+    std::string taskName;
+};
+
+static std::mutex mutex;
+static std::condition_variable changed;
+static std::vector<Ran> ran;
+static std::vector<int> replies;
+static std::vector<DispatchTrace> traces;
+
+// A request that takes `sleepMs` on whatever task runs it
+class Probe : public Detachable<Probe> {
+public:
+    int seq = 0;
+    int sleepMs = 0;
+
+    explicit Probe(MessageType t = AdminType) { type = t; }
+
+    MessageBase *handleRequest(void *) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ran.push_back(Ran{seq, sourceAddress, xTaskGetCurrentTaskHandle(), hostTaskName()});
+        }
+        if (sleepMs)
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
+        auto res = new Ok;
+        res->seq = seq;
+        res->destinationAddress = sourceAddress;
+        return res;
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override
+    {
+        doc["seq"] = seq;
+        doc["sleep"] = sleepMs;
+    }
+    void deserializeExtraFields(const json &doc) override
+    {
+        seq = doc["seq"];
+        sleepMs = doc["sleep"];
+    }
+};
+
+// Charged like a WiFi scan or an RSA key
+class CostlyProbe : public Detachable<CostlyProbe, Probe> {
+public:
+    CostlyProbe() { type = ScanType; }
+    AdmissionCost cost() const override { return AdmissionCost::Expensive; }
+};
+
+// A HelloRequest that makes the lock generate RSA keys
+class HelloProbe : public Detachable<HelloProbe, Probe> {
+public:
+    HelloProbe() { type = HelloType; }
+    AdmissionCost cost() const override { return AdmissionCost::Expensive; }
+};
+
+// OpenRequest, charged as an open
+class OpenProbe : public Detachable<OpenProbe, Probe> {
+public:
+    OpenProbe() { type = KeyedOpenType; }
+    AdmissionCost cost() const override { return AdmissionCost::Open; }
+};
+
+// A request with a payload worth moving; counts how often it is serialized
+class BulkyProbe : public Detachable<BulkyProbe, Probe> {
+public:
+    std::vector<std::string> payload;
+    static inline int serialized = 0;
+    static inline size_t handledPayload = 0;
+
+    MessageBase *handleRequest(void *context) override
+    {
+        handledPayload = payload.size();
+        return Probe::handleRequest(context);
+    }
+
+protected:
+    void serializeExtraFields(json &doc) override
+    {
+        serialized++;
+        Probe::serializeExtraFields(doc);
+        doc["payload"] = payload;
+    }
+};
+
+// BatchMaxItems in ReqRes.h
+#define BatchLimit 16
+
+// Same loop as BatchMessage::handleRequest in ReqRes.h: every item goes
+// through processRequest while the batch runs on a worker, and a batch
+// over the limit is refused whole
+class Batch : public Detachable<Batch> {
+public:
+    std::vector<std::string> items;
+    std::vector<int> results;
+
+    Batch() { type = BatchType; }
+
+    MessageBase *handleRequest(void *context) override
+    {
+        auto res = new Ok;
+        res->destinationAddress = sourceAddress;
+        if (items.size() > BatchLimit) {
+            res->seq = -1;
+            return res;
+        }
+        for (auto &raw : items) {
+            MessageBase *item = MessageBase::createInstance(raw);
+            item->sourceAddress = sourceAddress;
+            MessageBase *itemRes = item->processRequest(context);
+            results.push_back(itemRes ? static_cast<Ok *>(itemRes)->seq : -1);
+            delete itemRes;
+            delete item;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        batchResults = results;
+        return res;
+    }
+
+    static inline std::vector<int> batchResults;
+
+protected:
+    void serializeExtraFields(json &doc) override { doc["items"] = items; }
+    void deserializeExtraFields(const json &doc) override { items = doc["items"].get<std::vector<std::string>>(); }
+};
+
+static BleLockServer lock;
+static auto &dispatcher = Dispatcher::instance();
+
+static MessageBase *dispatch(MessageType type, int seq, const char *from = "11:22:33:44:55:66", int sleepMs = 0)
+{
+    Probe req(type);
+    req.seq = seq;
+    req.sleepMs = sleepMs;
+    req.sourceAddress = from;
+    return req.processRequest(&lock);
+}
+
+static bool waitReplies(size_t n, int ms = 2000)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    return changed.wait_for(guard, std::chrono::milliseconds(ms), [n]() { return replies.size() >= n; });
+}
+
+static bool waitReply(int seq, int ms = 2000)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    return changed.wait_for(guard, std::chrono::milliseconds(ms),
+                            [seq]() { return std::find(replies.begin(), replies.end(), seq) != replies.end(); });
+}
+
+void setUp()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    ran.clear();
+    replies.clear();
+    traces.clear();
+}
+
+void tearDown() {}
+
+void test_runs_in_place_before_begin()
+{
+    std::unique_ptr<MessageBase> res(dispatch(AdminType, 1));
+    TEST_ASSERT_NOT_NULL(res.get());
+    TEST_ASSERT_EQUAL(1, static_cast<Ok &>(*res).seq);
+    TEST_ASSERT_EQUAL(1, ran.size());
+    TEST_ASSERT_TRUE(ran[0].task == xTaskGetCurrentTaskHandle());
+    TEST_ASSERT_EQUAL(1, traces.size());
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::InPlace, (int)traces[0].outcome);
+}
+
+void test_requests_run_on_their_class_worker()
+{
+    dispatcher.begin(&lock);
+    TEST_ASSERT_NULL(dispatch(OpenType, 1));
+    TEST_ASSERT_NULL(dispatch(AdminType, 2));
+    TEST_ASSERT_TRUE(waitReplies(2));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    for (auto &r : ran) {
+        TEST_ASSERT_TRUE(r.task != xTaskGetCurrentTaskHandle());
+        TEST_ASSERT_EQUAL_STRING(r.seq == 1 ? "dispOpen" : "dispAdmin0", r.taskName.substr(0, r.seq == 1 ? 8 : 10));
+    }
+    TEST_ASSERT_EQUAL(1, dispatcher.stats(DispatchClass::Open).handled);
+    TEST_ASSERT_EQUAL(1, dispatcher.stats(DispatchClass::Admin).handled);
+    TEST_ASSERT_EQUAL(0, dispatcher.stats(DispatchClass::Handshake).handled);
+    TEST_ASSERT_EQUAL(2, traces.size());
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::Handled, (int)traces[0].outcome);
+}
+
+// One Admin worker busy, DispatchQueueDepth waiting: the next request is
+// rejected after the backpressure wait instead of blocking the BLE task
+void test_full_queue_rejects()
+{
+    uint32_t dropped = dispatcher.stats(DispatchClass::Admin).dropped;
+    TEST_ASSERT_NULL(dispatch(AdminType, 0, "11:22:33:44:55:66", 300));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (int i = 1; i <= DispatchQueueDepth; i++)
+        TEST_ASSERT_NULL(dispatch(AdminType, i));
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<MessageBase> rejected(dispatch(AdminType, 99));
+    auto waited = std::chrono::steady_clock::now() - start;
+    TEST_ASSERT_NOT_NULL(rejected.get());
+    TEST_ASSERT_EQUAL(-99, static_cast<Ok &>(*rejected).seq);
+    TEST_ASSERT_TRUE(waited >= std::chrono::milliseconds(DispatchBackpressureMs));
+    TEST_ASSERT_EQUAL(dropped + 1, dispatcher.stats(DispatchClass::Admin).dropped);
+
+    TEST_ASSERT_TRUE(waitReplies(DispatchQueueDepth + 1));
+    std::lock_guard<std::mutex> guard(mutex);
+    for (int i = 0; i <= DispatchQueueDepth; i++)
+        TEST_ASSERT_EQUAL(i, replies[i]);
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::Dropped, (int)traces[0].outcome);
+}
+
+// Items of a batch run on the batch's worker, in order, and answer into
+// the batch instead of each sending a reply of its own
+void test_batch_items_run_in_place_on_the_worker()
+{
+    Batch batch;
+    batch.sourceAddress = "11:22:33:44:55:66";
+    for (int i = 1; i <= 3; i++) {
+        Probe item(i == 2 ? OpenType : AdminType);
+        item.seq = i;
+        batch.items.push_back(item.serialize());
+    }
+    TEST_ASSERT_NULL(batch.processRequest(&lock));
+    TEST_ASSERT_TRUE(waitReplies(1));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    TEST_ASSERT_EQUAL(1, replies.size());
+    TEST_ASSERT_EQUAL(3, Batch::batchResults.size());
+    TEST_ASSERT_EQUAL(3, ran.size());
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(i + 1, Batch::batchResults[i]);
+        TEST_ASSERT_EQUAL(i + 1, ran[i].seq);
+        // the Open item too stays on the Admin worker running the batch
+        TEST_ASSERT_TRUE(ran[i].task == ran[0].task);
+        TEST_ASSERT_EQUAL_STRING("dispAdmin0", ran[i].taskName);
+    }
+    TEST_ASSERT_EQUAL(4, traces.size());
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::InPlace, (int)traces[0].outcome);
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::Handled, (int)traces[3].outcome);
+}
+
+// The worker gets the request's fields moved into an instance of its own:
+// nothing is serialized and parsed again on the way, and the caller keeps
+// an empty shell to delete like the library does
+void test_queued_request_is_moved_not_copied()
+{
+    auto req = new BulkyProbe;
+    req->seq = 7;
+    req->sourceAddress = "11:22:33:44:55:66";
+    req->payload.assign(100, std::string(40, 'p'));
+    BulkyProbe::serialized = 0;
+    TEST_ASSERT_NULL(req->processRequest(&lock));
+    TEST_ASSERT_TRUE(req->payload.empty());
+    delete req;
+    TEST_ASSERT_TRUE(waitReplies(1));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    TEST_ASSERT_EQUAL(7, replies[0]);
+    TEST_ASSERT_EQUAL(100, BulkyProbe::handledPayload);
+    TEST_ASSERT_EQUAL(0, BulkyProbe::serialized);
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::Handled, (int)traces[0].outcome);
+}
+
+// sendRaw says whether the reply could be handed to the lock at all
+void test_send_raw_reports_what_could_not_be_sent()
+{
+    auto res = new Ok;
+    res->destinationAddress = "11:22:33:44:55:66";
+    TEST_ASSERT_TRUE(Dispatcher::sendRaw(&lock, res));
+    TEST_ASSERT_EQUAL_STRING("11:22:33:44:55:66", lock.sent.back().substr(0, 17).c_str());
+
+    size_t sent = lock.sent.size();
+    TEST_ASSERT_FALSE(Dispatcher::sendRaw(&lock, new Ok));
+    auto orphan = new Ok;
+    orphan->destinationAddress = "11:22:33:44:55:66";
+    TEST_ASSERT_FALSE(Dispatcher::sendRaw(nullptr, orphan));
+    TEST_ASSERT_EQUAL(sent, lock.sent.size());
+}
+
+static std::string probeItem(int seq)
+{
+    Probe item(AdminType);
+    item.seq = seq;
+    return item.serialize();
+}
+
+void test_oversized_batch_runs_nothing()
+{
+    Batch batch;
+    batch.sourceAddress = "11:22:33:44:55:66";
+    for (int i = 0; i <= BatchLimit; i++)
+        batch.items.push_back(probeItem(i));
+    TEST_ASSERT_NULL(batch.processRequest(&lock));
+    TEST_ASSERT_TRUE(waitReplies(1));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    TEST_ASSERT_EQUAL(-1, replies[0]);
+    TEST_ASSERT_EQUAL(0, ran.size());
+}
+
+// BatchLimit requests one round trip at a time against one batch of them.
+// On the host this is only what the extra queue hops cost; over BLE every
+// round trip adds at least a connection interval (LinkIntervalMs) on top.
+#define LinkIntervalMs 30
+
+void test_batching_against_single_requests()
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BatchLimit; i++) {
+        TEST_ASSERT_NULL(dispatch(AdminType, 500 + i));
+        TEST_ASSERT_TRUE(waitReply(500 + i));
+    }
+    auto single = std::chrono::steady_clock::now() - start;
+
+    Batch batch;
+    batch.sourceAddress = "11:22:33:44:55:66";
+    for (int i = 0; i < BatchLimit; i++)
+        batch.items.push_back(probeItem(600 + i));
+    start = std::chrono::steady_clock::now();
+    TEST_ASSERT_NULL(batch.processRequest(&lock));
+    TEST_ASSERT_TRUE(waitReplies(BatchLimit + 1));
+    auto batched = std::chrono::steady_clock::now() - start;
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        // one reply for the whole batch
+        TEST_ASSERT_EQUAL(BatchLimit + 1, replies.size());
+        TEST_ASSERT_EQUAL(BatchLimit, Batch::batchResults.size());
+        TEST_ASSERT_EQUAL(600, Batch::batchResults[0]);
+    }
+
+    using us = std::chrono::microseconds;
+    long long singleUs = std::chrono::duration_cast<us>(single).count();
+    long long batchedUs = std::chrono::duration_cast<us>(batched).count();
+    char line[160];
+    snprintf(line, sizeof(line), "%d requests: %lld us in %d round trips, %lld us in one batch; at %d ms a round trip %lld ms vs %lld ms",
+             BatchLimit, singleUs, BatchLimit, batchedUs, LinkIntervalMs,
+             singleUs / 1000 + BatchLimit * LinkIntervalMs, batchedUs / 1000 + LinkIntervalMs);
+    TEST_MESSAGE(line);
+}
+
+// an address the pool of `cls` pins to `worker`
+static std::string addressOn(size_t worker, DispatchClass cls = DispatchClass::Open)
+{
+    for (int i = 0;; i++) {
+        std::string address = "aa:bb:cc:dd:ee:" + std::to_string(10 + i);
+        if (std::hash<std::string>()(address) % dispatcher.poolOf(cls) == worker)
+            return address;
+    }
+}
+
+// Phones on different workers of a pool are served at the same time
+void test_phones_are_served_concurrently()
+{
+    TEST_ASSERT_EQUAL(3, dispatcher.poolOf(DispatchClass::Open));
+    TEST_ASSERT_EQUAL(2, dispatcher.poolOf(DispatchClass::Handshake));
+    TEST_ASSERT_EQUAL(1, dispatcher.poolOf(DispatchClass::Admin));
+
+    std::string first = addressOn(0), second = addressOn(1);
+    auto start = std::chrono::steady_clock::now();
+    TEST_ASSERT_NULL(dispatch(OpenType, 1, first.c_str(), 200));
+    TEST_ASSERT_NULL(dispatch(OpenType, 2, second.c_str(), 200));
+    TEST_ASSERT_TRUE(waitReplies(2));
+    auto took = std::chrono::steady_clock::now() - start;
+    TEST_ASSERT_TRUE(took < std::chrono::milliseconds(380));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    TEST_ASSERT_TRUE(ran[0].task != ran[1].task);
+}
+
+// One phone is pinned to one worker, so its requests keep their order
+void test_one_phone_stays_in_order()
+{
+    std::string phone = addressOn(2);
+    for (int i = 1; i <= 5; i++)
+        TEST_ASSERT_NULL(dispatch(OpenType, i, phone.c_str(), i == 1 ? 50 : 0));
+    TEST_ASSERT_TRUE(waitReplies(5));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL(i + 1, replies[i]);
+        TEST_ASSERT_TRUE(ran[i].task == ran[0].task);
+    }
+}
+
+// Admission runs on the calling task: an expensive request over its
+// source's bucket is answered by the rejecter and never queued
+void test_admission_refuses_before_queueing()
+{
+    const char *phone = "aa:bb:cc:00:00:01";
+    auto before = dispatcher.admissionStats();
+    for (int i = 1; i <= AdmissionBucketSize; i++) {
+        CostlyProbe req;
+        req.seq = i;
+        req.sourceAddress = phone;
+        TEST_ASSERT_NULL(req.processRequest(&lock));
+        TEST_ASSERT_TRUE(waitReplies(i));
+    }
+    CostlyProbe req;
+    req.seq = 9;
+    req.sourceAddress = phone;
+    std::unique_ptr<MessageBase> refused(req.processRequest(&lock));
+    TEST_ASSERT_NOT_NULL(refused.get());
+    TEST_ASSERT_EQUAL(-9, static_cast<Ok &>(*refused).seq);
+
+    std::lock_guard<std::mutex> guard(mutex);
+    TEST_ASSERT_EQUAL(AdmissionBucketSize, ran.size());
+    TEST_ASSERT_EQUAL((int)DispatchOutcome::Refused, (int)traces.back().outcome);
+    auto after = dispatcher.admissionStats();
+    TEST_ASSERT_EQUAL(before.rejectedSource + 1, after.rejectedSource);
+}
+
+// Every Admin and Handshake worker busy with 150 ms requests and more
+// queued behind them: opens from phones on each Open worker still start
+// within OpenLatencyBoundMs of being queued
+#define OpenLatencyBoundMs 20
+
+void test_open_latency_with_admin_and_handshake_saturated()
+{
+    int seq = 100;
+    for (int i = 0; i < 4; i++)
+        TEST_ASSERT_NULL(dispatch(AdminType, seq++, "11:22:33:44:55:66", 150));
+    for (size_t w = 0; w < dispatcher.poolOf(DispatchClass::Handshake); w++) {
+        std::string phone = addressOn(w, DispatchClass::Handshake);
+        for (int i = 0; i < 4; i++)
+            TEST_ASSERT_NULL(dispatch(HandshakeType, seq++, phone.c_str(), 150));
+    }
+    int background = seq - 100;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    for (int round = 0; round < 3; round++) {
+        for (size_t w = 0; w < dispatcher.poolOf(DispatchClass::Open); w++)
+            TEST_ASSERT_NULL(dispatch(OpenType, seq++, addressOn(w).c_str()));
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+    int opens = seq - 100 - background;
+    TEST_ASSERT_TRUE(waitReplies(background + opens, 3000));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    uint32_t maxOpenWaitUs = 0;
+    int openCount = 0;
+    size_t lastOpen = 0, firstQueuedBehind = traces.size();
+    for (size_t i = 0; i < traces.size(); i++) {
+        auto &t = traces[i];
+        if (t.type == OpenType) {
+            maxOpenWaitUs = std::max(maxOpenWaitUs, t.startUs - t.enqueuedUs);
+            openCount++;
+            lastOpen = i;
+        } else if (t.startUs - t.enqueuedUs > 100000 && firstQueuedBehind == traces.size()) {
+            firstQueuedBehind = i;
+        }
+    }
+    TEST_ASSERT_EQUAL(opens, openCount);
+    TEST_ASSERT_TRUE(maxOpenWaitUs < OpenLatencyBoundMs * 1000);
+    // the background was still queued when the last open was done
+    TEST_ASSERT_TRUE(firstQueuedBehind > lastOpen);
+
+    char line[120];
+    snprintf(line, sizeof(line), "%d opens behind %d queued admin/handshake requests: max queue-to-start %u us",
+             opens, background, (unsigned)maxOpenWaitUs);
+    TEST_MESSAGE(line);
+}
+
+struct Scaling {
+    double perSecond;
+    double avgLatencyMs;
+};
+
+// `clients` phones, each on its own std::thread, each sending a chain of
+// ScalingRequests requests of ScalingWorkMs and waiting for every reply
+// before the next
+#define ScalingRequests 8
+#define ScalingWorkMs 4
+// the most one worker can serve of them in a second
+#define ScalingWorkerCapacity (1000.0 / ScalingWorkMs)
+
+static Scaling runClients(MessageType type, int clients)
+{
+    std::vector<std::thread> threads;
+    std::vector<double> latencyMs(clients);
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < clients; c++) {
+        threads.emplace_back([&, c]() {
+            std::string phone = addressOn(c % dispatcher.poolOf(DispatchClass::Open));
+            for (int i = 0; i < ScalingRequests; i++) {
+                int seq = 10000 + c * 100 + i;
+                auto sent = std::chrono::steady_clock::now();
+                delete dispatch(type, seq, phone.c_str(), ScalingWorkMs);
+                waitReply(seq);
+                latencyMs[c] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double total = 0;
+    for (auto ms : latencyMs)
+        total += ms;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        replies.clear();
+    }
+    return Scaling{clients * ScalingRequests / seconds, total / (clients * ScalingRequests)};
+}
+
+// The same request chains served by the Open pool and, as the baseline, by
+// the single Admin worker: the baseline stays under what one worker can
+// serve however many clients there are, the pool goes well past it
+void test_throughput_scales_with_clients()
+{
+    Scaling single[9], pooled[9];
+    for (int clients : {1, 2, 4, 8}) {
+        single[clients] = runClients(AdminType, clients);
+        pooled[clients] = runClients(OpenType, clients);
+        char line[140];
+        snprintf(line, sizeof(line), "%d clients: %.0f req/s, %.1f ms avg on the pool; %.0f req/s, %.1f ms on one worker",
+                 clients, pooled[clients].perSecond, pooled[clients].avgLatencyMs, single[clients].perSecond,
+                 single[clients].avgLatencyMs);
+        TEST_MESSAGE(line);
+    }
+    for (int clients : {1, 2, 4, 8})
+        TEST_ASSERT_TRUE(single[clients].perSecond <= ScalingWorkerCapacity);
+    TEST_ASSERT_TRUE(pooled[4].perSecond > ScalingWorkerCapacity * 1.5);
+    TEST_ASSERT_TRUE(pooled[8].perSecond > ScalingWorkerCapacity * 1.5);
+    TEST_ASSERT_TRUE(pooled[8].avgLatencyMs < single[8].avgLatencyMs);
+}
+
+// Phones on FloodSources addresses send 30 ms HelloRequests as fast as
+// their replies come back while a keyed phone opens every 20 ms: every
+// open is admitted and starts within OpenLatencyBoundMs, the flood is cut
+// down by admission control
+#define FloodSources 40
+
+void test_keyed_open_is_admitted_under_a_handshake_flood()
+{
+    std::string keyed = addressOn(0);
+    KeyStore::instance().publishSessionKey(keyed, std::string(16, 'k'));
+    auto before = dispatcher.admissionStats();
+
+    std::atomic<bool> flooding{true};
+    std::atomic<int> floodSent{0}, floodRefused{0};
+    std::thread flood([&]() {
+        for (int n = 0; flooding; n++) {
+            HelloProbe hello;
+            hello.seq = 20000 + n;
+            hello.sleepMs = 30;
+            hello.sourceAddress = "f1:00:00:00:00:" + std::to_string(n % FloodSources);
+            std::unique_ptr<MessageBase> res(hello.processRequest(&lock));
+            floodSent++;
+            if (res)
+                floodRefused++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    const int opens = 15;
+    for (int i = 0; i < opens; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        OpenProbe open;
+        open.seq = 30000 + i;
+        open.sourceAddress = keyed;
+        TEST_ASSERT_NULL(open.processRequest(&lock));
+    }
+    TEST_ASSERT_TRUE(waitReply(30000 + opens - 1));
+    flooding = false;
+    flood.join();
+    KeyStore::instance().dropSession(keyed);
+    TEST_ASSERT_TRUE(waitReplies(opens + floodSent - floodRefused, 3000));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    uint32_t maxOpenWaitUs = 0;
+    int admitted = 0;
+    for (auto &t : traces) {
+        if (t.type != KeyedOpenType)
+            continue;
+        TEST_ASSERT_EQUAL((int)DispatchOutcome::Handled, (int)t.outcome);
+        maxOpenWaitUs = std::max(maxOpenWaitUs, t.startUs - t.enqueuedUs);
+        admitted++;
+    }
+    TEST_ASSERT_EQUAL(opens, admitted);
+    TEST_ASSERT_TRUE(maxOpenWaitUs < OpenLatencyBoundMs * 1000);
+    auto after = dispatcher.admissionStats();
+    TEST_ASSERT_EQUAL(before.reservedOpens + opens, after.reservedOpens);
+    TEST_ASSERT_TRUE(floodRefused > floodSent / 2);
+
+    char line[140];
+    snprintf(line, sizeof(line), "%d HelloRequests from %d sources, %d refused: %d opens, max queue-to-start %u us",
+             floodSent.load(), FloodSources, floodRefused.load(), opens, (unsigned)maxOpenWaitUs);
+    TEST_MESSAGE(line);
+}
+
+int main()
+{
+    MessageBase::registerConstructor(OpenType, []() -> MessageBase * { return new Probe(OpenType); });
+    MessageBase::registerConstructor(AdminType, []() -> MessageBase * { return new Probe(AdminType); });
+    MessageBase::registerConstructor(HandshakeType, []() -> MessageBase * { return new Probe(HandshakeType); });
+    MessageBase::registerConstructor(HelloType, []() -> MessageBase * { return new HelloProbe; });
+    MessageBase::registerConstructor(KeyedOpenType, []() -> MessageBase * { return new OpenProbe; });
+    MessageBase::registerConstructor(ScanType, []() -> MessageBase * { return new CostlyProbe; });
+    MessageBase::registerConstructor(BatchType, []() -> MessageBase * { return new Batch; });
+    dispatcher.setClass(OpenType, DispatchClass::Open);
+    dispatcher.setClass(AdminType, DispatchClass::Admin);
+    dispatcher.setClass(HandshakeType, DispatchClass::Handshake);
+    dispatcher.setClass(HelloType, DispatchClass::Handshake);
+    dispatcher.setClass(KeyedOpenType, DispatchClass::Open);
+    Dispatcher::setSender([](void *, MessageBase *response) {
+        std::lock_guard<std::mutex> guard(mutex);
+        replies.push_back(static_cast<Ok *>(response)->seq);
+        delete response;
+        changed.notify_all();
+    });
+    Dispatcher::setRejecter([](MessageBase *request) -> MessageBase * {
+        auto res = new Ok;
+        res->seq = -static_cast<Probe *>(request)->seq;
+        return res;
+    });
+    Dispatcher::setTracer([](const DispatchTrace &t) {
+        std::lock_guard<std::mutex> guard(mutex);
+        traces.push_back(t);
+    });
+
+    UNITY_BEGIN();
+    RUN_TEST(test_runs_in_place_before_begin);
+    RUN_TEST(test_requests_run_on_their_class_worker);
+    RUN_TEST(test_full_queue_rejects);
+    RUN_TEST(test_batch_items_run_in_place_on_the_worker);
+    RUN_TEST(test_oversized_batch_runs_nothing);
+    RUN_TEST(test_batching_against_single_requests);
+    RUN_TEST(test_queued_request_is_moved_not_copied);
+    RUN_TEST(test_send_raw_reports_what_could_not_be_sent);
+    RUN_TEST(test_phones_are_served_concurrently);
+    RUN_TEST(test_one_phone_stays_in_order);
+    RUN_TEST(test_admission_refuses_before_queueing);
+    RUN_TEST(test_open_latency_with_admin_and_handshake_saturated);
+    RUN_TEST(test_throughput_scales_with_clients);
+    RUN_TEST(test_keyed_open_is_admitted_under_a_handshake_flood);
+    return UNITY_END();
+}
@@ -0,0 +1,234 @@
+#include <unity.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <json.hpp>
+#include "FrameCodec.h"
+
+using json = nlohmann::json;
+
+static const char *Phone = "5c:3a:91:0e:7f:21";
+static const char *Lock = "a4:cf:12:6b:90:3e";
+
+// A Fragment as it goes on air, keys in the order the firmware writes them
+static std::string fragment(uint16_t id, uint16_t seq, uint16_t total, const std::string &data)
+{
+    json doc;
+    doc["type"] = 31;
+    doc["sourceAddress"] = Lock;
+    doc["destinationAddress"] = Phone;
+    doc["requestUUID"] = "f" + std::to_string(id);
+    doc["id"] = id;
+    doc["seq"] = seq;
+    doc["total"] = total;
+    doc["data"] = data;
+    return doc.dump();
+}
+
+// what FrameTransport::negotiate leaves for data
+static size_t budgetFor(uint16_t mtu)
+{
+    size_t envelope = fragment(0xffff, 0xffff, 0xffff, "").size();
+    return mtu > 3 + envelope ? mtu - 3 - envelope : 0;
+}
+
+// a reply with everything that escapes: quotes, backslashes, control
+// characters and multi-byte UTF-8
+static std::string awkwardReply()
+{
+    json doc;
+    doc["type"] = 12;
+    auto list = json::array();
+    for (int i = 0; i < 40; i++) {
+        list.push_back({{"ssid", "Caf\xc3\xa9 \"" + std::to_string(i) + "\" \\ \xe2\x98\x95 \xf0\x9f\x94\x92"},
+                        {"note", std::string("tab\there\nnew line \x01\x02")},
+                        {"rssi", -40 - i}});
+    }
+    doc["list"] = list;
+    return doc.dump();
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_escaped_size_matches_json()
+{
+    for (int c = 1; c < 0x80; c++) {
+        std::string one(1, (char)c);
+        TEST_ASSERT_EQUAL(json(one).dump().size() - 2, FrameCodec::escapedSize(c));
+    }
+}
+
+void test_every_fragment_fits_the_mtu()
+{
+    std::string reply = awkwardReply();
+    const uint16_t mtus[] = {185, 247, 256, 512};
+    for (uint16_t mtu : mtus) {
+        size_t budget = budgetFor(mtu);
+        TEST_ASSERT_GREATER_THAN(FrameMinPayload - 1, budget);
+        std::vector<uint32_t> offsets;
+        TEST_ASSERT_TRUE(FrameCodec::plan(reply, budget, offsets));
+        uint16_t total = offsets.size() - 1;
+        std::string joined;
+        for (uint16_t seq = 0; seq < total; seq++) {
+            std::string data = reply.substr(offsets[seq], offsets[seq + 1] - offsets[seq]);
+            // throws on a split UTF-8 sequence
+            std::string wire = fragment(7, seq, total, data);
+            TEST_ASSERT_LESS_OR_EQUAL(mtu - 3, wire.size());
+            joined += json::parse(wire)["data"].get<std::string>();
+        }
+        TEST_ASSERT_TRUE(joined == reply);
+    }
+}
+
+void test_default_mtu_leaves_room()
+{
+    // iOS negotiates 185
+    TEST_ASSERT_GREATER_THAN(FrameMinPayload - 1, budgetFor(185));
+    // the BLE minimum MTU cannot carry a fragment
+    TEST_ASSERT_EQUAL(0, budgetFor(23));
+}
+
+void test_reassembly_rejects_bad_totals_before_sizing()
+{
+    FrameReassembler rx;
+    std::string joined;
+    uint16_t ack;
+    bool sendAck;
+    TEST_ASSERT_FALSE(rx.accept(Phone, 1, 0, 0, "x", 4, joined, ack, sendAck));
+    TEST_ASSERT_FALSE(rx.accept(Phone, 2, 0, FrameMaxFragments + 1, "x", 4, joined, ack, sendAck));
+    TEST_ASSERT_FALSE(rx.accept(Phone, 3, 0, 0xffff, "x", 4, joined, ack, sendAck));
+    TEST_ASSERT_FALSE(rx.accept(Phone, 4, 9, 9, "x", 4, joined, ack, sendAck));
+    TEST_ASSERT_EQUAL(0, rx.pending(Phone));
+    TEST_ASSERT_EQUAL(4, rx.stats().drops);
+
+    TEST_ASSERT_TRUE(rx.accept(Phone, 5, 0, FrameMaxFragments, "x", 4, joined, ack, sendAck));
+    TEST_ASSERT_EQUAL(1, rx.pending(Phone));
+}
+
+void test_reassembly_bounds_bytes_and_transfers()
+{
+    FrameReassembler rx;
+    std::string joined;
+    uint16_t ack;
+    bool sendAck;
+    std::string big(FrameMaxReassemblyBytes / 2 + 1, 'a');
+    TEST_ASSERT_TRUE(rx.accept(Phone, 1, 0, 3, big, 4, joined, ack, sendAck));
+    TEST_ASSERT_FALSE(rx.accept(Phone, 1, 1, 3, big, 4, joined, ack, sendAck));
+    TEST_ASSERT_EQUAL(0, rx.pending(Phone));
+
+    TEST_ASSERT_TRUE(rx.accept(Phone, 2, 0, 2, "a", 4, joined, ack, sendAck));
+    TEST_ASSERT_TRUE(rx.accept(Phone, 3, 0, 2, "a", 4, joined, ack, sendAck));
+    TEST_ASSERT_TRUE(rx.accept(Phone, 4, 0, 2, "a", 4, joined, ack, sendAck));
+    TEST_ASSERT_EQUAL(FrameMaxTransfersPerPeer, rx.pending(Phone));
+
+    rx.forget(Phone);
+    TEST_ASSERT_EQUAL(0, rx.pending(Phone));
+}
+
+// xorshift, so every run loses the same frames
+struct Lossy {
+    uint32_t state;
+    unsigned percent;
+    bool lose()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % 100 < percent;
+    }
+};
+
+struct Outcome {
+    bool delivered = false;
+    bool aborted = false;
+    uint32_t sent = 0;
+};
+
+// One transfer over a channel that drops `percent` of fragments and of acks.
+// Each round the sender fills its window; a round in which no ack moved the
+// window is a timeout.
+static Outcome simulate(const std::string &reply, uint16_t mtu, uint8_t window, unsigned percent, uint32_t seed)
+{
+    Outcome out;
+    Lossy channel{seed, percent};
+    FrameWindow tx;
+    FrameReassembler rx;
+    if (!tx.plan(reply, budgetFor(mtu), window)) {
+        out.aborted = true;
+        return out;
+    }
+    std::string joined;
+    for (int round = 0; round < 1000 && !tx.done(); round++) {
+        bool moved = false;
+        uint16_t seq;
+        size_t offset, length;
+        while (tx.next(seq, offset, length)) {
+            out.sent++;
+            if (channel.lose())
+                continue;
+            uint16_t ack;
+            bool sendAck;
+            std::string part = reply.substr(offset, length);
+            rx.accept(Phone, 1, seq, tx.total(), part, window, joined, ack, sendAck);
+            if (sendAck && !channel.lose())
+                moved |= tx.ack(ack);
+        }
+        if (!moved && !tx.done()) {
+            uint16_t resent;
+            if (!tx.timeout(resent)) {
+                out.aborted = true;
+                break;
+            }
+        }
+    }
+    out.delivered = joined == reply;
+    return out;
+}
+
+void test_lossless_channel_sends_each_fragment_once()
+{
+    std::string reply = awkwardReply();
+    FrameWindow plan;
+    TEST_ASSERT_TRUE(plan.plan(reply, budgetFor(185), 4));
+    Outcome out = simulate(reply, 185, 4, 0, 1);
+    TEST_ASSERT_TRUE(out.delivered);
+    TEST_ASSERT_EQUAL(plan.total(), out.sent);
+}
+
+void test_lossy_channel_delivers_intact_or_aborts()
+{
+    std::string reply = awkwardReply();
+    const unsigned losses[] = {5, 10, 20};
+    for (unsigned percent : losses) {
+        unsigned delivered = 0, aborted = 0;
+        uint32_t sent = 0;
+        for (uint32_t seed = 1; seed <= 200; seed++) {
+            Outcome out = simulate(reply, 185, 4, percent, seed * 2654435761u);
+            // never a corrupted or half-joined reply
+            TEST_ASSERT_TRUE(out.delivered || out.aborted);
+            delivered += out.delivered;
+            aborted += out.aborted;
+            sent += out.sent;
+        }
+        char line[96];
+        snprintf(line, sizeof(line), "loss %u%%: %u/200 delivered, %u aborted, %u fragments sent",
+                 percent, delivered, aborted, (unsigned)sent);
+        TEST_MESSAGE(line);
+        if (percent <= 10)
+            TEST_ASSERT_GREATER_THAN(190, delivered);
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_escaped_size_matches_json);
+    RUN_TEST(test_every_fragment_fits_the_mtu);
+    RUN_TEST(test_default_mtu_leaves_room);
+    RUN_TEST(test_reassembly_rejects_bad_totals_before_sizing);
+    RUN_TEST(test_reassembly_bounds_bytes_and_transfers);
+    RUN_TEST(test_lossless_channel_sends_each_fragment_once);
+    RUN_TEST(test_lossy_channel_delivers_intact_or_aborts);
+    return UNITY_END();
+}
@@ -0,0 +1,110 @@
+#include <unity.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "KeyStore.h"
+
+static std::string address(int n)
+{
+    char text[18];
+    snprintf(text, sizeof(text), "aa:bb:cc:dd:%02x:%02x", (n >> 8) & 0xff, n & 0xff);
+    return text;
+}
+
+static std::string sessionKey(int n)
+{
+    std::string key(SessionKeyBytes, 0);
+    for (size_t i = 0; i < key.size(); i++)
+        key[i] = (char)(n * 31 + i);
+    return key;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_snapshot_is_immutable()
+{
+    auto &keys = KeyStore::instance();
+    keys.publishPublicKey(address(1), {1, 2, 3});
+    auto before = keys.snapshot();
+    keys.publishPublicKey(address(2), {4, 5, 6});
+    TEST_ASSERT_EQUAL(0, before->count(address(2)));
+    TEST_ASSERT_TRUE(keys.hasPublicKey(address(2)));
+
+    std::string wire;
+    bool isBase64 = true;
+    TEST_ASSERT_TRUE(keys.encodedPublicKey(address(2), wire, isBase64));
+    TEST_ASSERT_FALSE(isBase64);
+    TEST_ASSERT_EQUAL_STRING("040506", wire.c_str());
+    keys.setCaps(address(2), CapKeyBase64);
+    TEST_ASSERT_TRUE(keys.encodedPublicKey(address(2), wire, isBase64));
+    TEST_ASSERT_TRUE(isBase64);
+    TEST_ASSERT_EQUAL_STRING("BAUG", wire.c_str());
+}
+
+void test_session_publish_and_drop()
+{
+    auto &keys = KeyStore::instance();
+    keys.publishSessionKey(address(3), sessionKey(3));
+    TEST_ASSERT_TRUE(keys.hasSession(address(3)));
+    TEST_ASSERT_NOT_NULL(keys.sessionCipher(address(3)).get());
+
+    // held by a handler across the drop: still usable, no longer published
+    auto held = keys.sessionCipher(address(3));
+    keys.dropSession(address(3));
+    TEST_ASSERT_FALSE(keys.hasSession(address(3)));
+    TEST_ASSERT_NULL(keys.sessionCipher(address(3)).get());
+    TEST_ASSERT_TRUE(held->valid());
+}
+
+void test_concurrent_readers_see_whole_entries()
+{
+    auto &keys = KeyStore::instance();
+    const int writers = 2, perWriter = 150;
+    std::atomic<bool> stop{false};
+    std::atomic<uint32_t> torn{0}, reads{0};
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; r++) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                auto snap = keys.snapshot();
+                for (auto &it : *snap) {
+                    // an entry is published whole or not at all
+                    if (it.second.hasSession && it.second.sessionKey.size() != SessionKeyBytes)
+                        torn++;
+                }
+                reads++;
+            }
+        });
+    }
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([&, w] {
+            for (int i = 0; i < perWriter; i++) {
+                int n = 1000 + w * perWriter + i;
+                keys.publishSessionKey(address(n), sessionKey(n));
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    stop = true;
+    for (auto &t : readers)
+        t.join();
+
+    TEST_ASSERT_EQUAL(0, torn.load());
+    TEST_ASSERT_GREATER_THAN(0, reads.load());
+    for (int n = 1000; n < 1000 + writers * perWriter; n++)
+        TEST_ASSERT_TRUE(keys.hasSession(address(n)));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_snapshot_is_immutable);
+    RUN_TEST(test_session_publish_and_drop);
+    RUN_TEST(test_concurrent_readers_see_whole_entries);
+    return UNITY_END();
+}
@@ -0,0 +1,178 @@
+// Site accounting needs the allocator replaced, as a profiling build does
+#define MemSiteTracking 1
+
+#include <unity.h>
+#include <new>
+#include <string>
+#include <vector>
+#include "MemoryBudget.h"
+#include "AuditLog.h"
+
+void *operator new(size_t size)
+{
+    void *p = MemoryBudget::allocate(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { MemoryBudget::release(p); }
+void operator delete(void *p, size_t) noexcept { MemoryBudget::release(p); }
+
+class RamFlash : public AuditFlash {
+public:
+    explicit RamFlash(size_t records) : bytes(records * sizeof(AuditRecord), 0xff) {}
+    size_t size() override { return bytes.size(); }
+    bool read(size_t offset, void *buf, size_t len) override
+    {
+        memcpy(buf, &bytes[offset], len);
+        return true;
+    }
+    bool write(size_t offset, const void *buf, size_t len) override
+    {
+        memcpy(&bytes[offset], buf, len);
+        return true;
+    }
+    std::vector<uint8_t> bytes;
+};
+
+// Straight calls: new expressions whose result goes unused may be elided
+static void *grab(size_t size) { return ::operator new(size); }
+static void drop(void *p) { ::operator delete(p); }
+
+static nlohmann::json siteReport(const char *name)
+{
+    nlohmann::json j;
+    MemoryBudget::instance().report(j);
+    for (auto &site : j["sites"])
+        if (site["name"] == name)
+            return site;
+    return nlohmann::json();
+}
+
+void setUp()
+{
+    hostHeap() = HostHeap();
+    hostStackFree().clear();
+}
+
+void tearDown() {}
+
+void test_scope_counts_until_the_delete()
+{
+    auto &budget = MemoryBudget::instance();
+    uint8_t site = budget.site("scoped");
+    void *kept, *other;
+    {
+        MemScope scope(site);
+        kept = grab(1000);
+        drop(grab(24));
+    }
+    other = grab(100);  // outside any scope: site 0
+    auto j = siteReport("scoped");
+    TEST_ASSERT_EQUAL(2, j["allocs"].get<int>());
+    TEST_ASSERT_EQUAL(1, j["frees"].get<int>());
+    TEST_ASSERT_EQUAL(1000, j["live"].get<int>());
+    drop(other);
+
+    // freed on another scope, still charged to the one that allocated
+    {
+        MemScope other(budget.site("other scope"));
+        drop(kept);
+    }
+    j = siteReport("scoped");
+    TEST_ASSERT_EQUAL(2, j["frees"].get<int>());
+    TEST_ASSERT_EQUAL(0, j["live"].get<int>());
+    TEST_ASSERT_EQUAL(1024, j["peak"].get<int>());
+}
+
+void test_inner_scope_wins_and_restores()
+{
+    auto &budget = MemoryBudget::instance();
+    uint8_t outer = budget.site("outer"), inner = budget.site("inner");
+    {
+        MemScope a(outer);
+        drop(grab(4));
+        {
+            MemScope b(inner);
+            drop(grab(4));
+            drop(grab(4));
+        }
+        drop(grab(4));
+    }
+    TEST_ASSERT_EQUAL(2, siteReport("outer")["allocs"].get<int>());
+    TEST_ASSERT_EQUAL(2, siteReport("inner")["allocs"].get<int>());
+}
+
+// A full audit page rendered as json is one of the bigger replies the lock
+// builds; it has to fit the per-site budget with room to spare
+void test_audit_page_fits_the_site_budget()
+{
+    RamFlash flash(256);
+    AuditLog log(flash);
+    log.begin();
+    for (int i = 0; i < 200; i++)
+        log.append("5c:3a:91:0e:7f:21", AuditResult::Opened, 40, 1700000000 + i, true, 0);
+    log.flush();
+
+    auto &budget = MemoryBudget::instance();
+    {
+        MemScope scope(budget.site("auditPage"));
+        nlohmann::json j;
+        log.page(1, AuditPageMax, j);
+        std::string reply = j.dump();
+        TEST_ASSERT_TRUE(reply.size() > 0);
+    }
+    auto site = siteReport("auditPage");
+    TEST_ASSERT_EQUAL(0, site["live"].get<int>());
+    TEST_ASSERT_TRUE(site["ok"].get<bool>());
+    TEST_ASSERT_TRUE(site["peak"].get<int>() < MemSiteBudgetBytes / 2);
+    TEST_ASSERT_TRUE(budget.withinBudget());
+}
+
+void test_stack_and_heap_budgets()
+{
+    auto &budget = MemoryBudget::instance();
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    budget.watchTask("test", task, 8192);
+    budget.tick(MemSampleMs);
+    TEST_ASSERT_TRUE(budget.withinBudget());
+
+    hostStackFree()[task] = MemStackReserveBytes - 1;
+    budget.tick(2 * MemSampleMs);
+    TEST_ASSERT_FALSE(budget.withinBudget());
+    nlohmann::json j;
+    budget.report(j);
+    TEST_ASSERT_FALSE(j["ok"].get<bool>());
+    TEST_ASSERT_FALSE(j["tasks"][0]["ok"].get<bool>());
+}
+
+// Last: a breach is remembered (minimums and peaks never recover)
+void test_site_over_budget_fails_the_check()
+{
+    auto &budget = MemoryBudget::instance();
+    {
+        MemScope scope(budget.site("hog"));
+        drop(grab(MemSiteBudgetBytes + 1));
+    }
+    auto site = siteReport("hog");
+    TEST_ASSERT_FALSE(site["ok"].get<bool>());
+    TEST_ASSERT_FALSE(budget.withinBudget());
+
+    hostHeap().largestBlock = MemHeapBlockBudget - 1;
+    budget.tick(3 * MemSampleMs);
+    nlohmann::json j;
+    budget.report(j);
+    TEST_ASSERT_FALSE(j["heap"]["ok"].get<bool>());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_scope_counts_until_the_delete);
+    RUN_TEST(test_inner_scope_wins_and_restores);
+    RUN_TEST(test_audit_page_fits_the_site_budget);
+    RUN_TEST(test_stack_and_heap_budgets);
+    RUN_TEST(test_site_over_budget_fails_the_check);
+    return UNITY_END();
+}
@@ -0,0 +1,198 @@
+#include <unity.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "TraceReplay.h"
+
+static const uint8_t Open = 0, Admin = 2;
+static const uint8_t Handled = 0, Refused = 2;
+
+static MessageTrace trace;
+
+// A record of `type` enqueued at `at` that waited `wait` and ran `run` us
+static void record(uint8_t type, uint8_t cls, uint32_t at, uint32_t wait, uint32_t run, uint8_t outcome = Handled)
+{
+    trace.record(type, cls, outcome, at, at + wait, at + wait + run, 40);
+}
+
+// What GET /trace sends: the header, then header.count records however
+// much capture goes on between the chunks
+static std::vector<uint8_t> download(const std::function<void()> &between = nullptr)
+{
+    uint32_t epoch;
+    TraceHeader header = trace.header(&epoch);
+    std::vector<uint8_t> body(reinterpret_cast<uint8_t *>(&header), reinterpret_cast<uint8_t *>(&header + 1));
+    TraceRecord chunk[TraceReadChunk];
+    uint32_t seq = header.firstSeq;
+    for (uint32_t left = header.count; left;) {
+        size_t n = left < TraceReadChunk ? left : TraceReadChunk;
+        trace.readExact(epoch, seq, chunk, n);
+        body.insert(body.end(), reinterpret_cast<uint8_t *>(chunk), reinterpret_cast<uint8_t *>(chunk + n));
+        seq += n;
+        left -= n;
+        if (between)
+            between();
+    }
+    return body;
+}
+
+void setUp() { trace.clear(); }
+void tearDown() {}
+
+void test_off_until_started()
+{
+    record(1, Open, 0, 0, 10);
+    TEST_ASSERT_EQUAL(0, trace.recorded());
+    trace.start(8);
+    record(1, Open, 0, 0, 10);
+    TEST_ASSERT_EQUAL(1, trace.recorded());
+}
+
+void test_wrapped_ring_keeps_the_newest()
+{
+    trace.start(8);
+    for (uint32_t i = 0; i < 20; i++)
+        record(1, Open, i * 100, 0, i);
+    TraceHeader h = trace.header();
+    TEST_ASSERT_EQUAL(8, h.count);
+    TEST_ASSERT_EQUAL(12, h.firstSeq);
+    TEST_ASSERT_EQUAL(12, h.lost);
+    auto body = download();
+    auto rec = reinterpret_cast<const TraceRecord *>(body.data() + sizeof(TraceHeader));
+    TEST_ASSERT_EQUAL(12, rec[0].handleUs);
+    TEST_ASSERT_EQUAL(19, rec[7].handleUs);
+}
+
+void test_download_length_holds_while_capture_wraps()
+{
+    trace.start(TraceReadChunk * 3);
+    for (uint32_t i = 0; i < TraceReadChunk * 3; i++)
+        record(1, Open, i, 0, 5);
+    // a full ring written over after every chunk sent
+    auto body = download([]() {
+        for (uint32_t i = 0; i < TraceReadChunk * 3; i++)
+            record(2, Open, i, 0, 5);
+    });
+    TEST_ASSERT_EQUAL(sizeof(TraceHeader) + TraceReadChunk * 3 * sizeof(TraceRecord), body.size());
+
+    TraceReplay replay;
+    std::string error;
+    TEST_ASSERT_TRUE(replay.load(body.data(), body.size(), error));
+    TEST_ASSERT_EQUAL(TraceReadChunk * 2, replay.lost());
+}
+
+void test_restart_during_download_sends_fillers()
+{
+    trace.start(16);
+    for (uint32_t i = 0; i < 16; i++)
+        record(1, Open, i, 0, 5);
+    uint32_t epoch;
+    TraceHeader h = trace.header(&epoch);
+    trace.start(16);
+    for (uint32_t i = 0; i < 16; i++)
+        record(9, Open, i, 0, 5);
+    TraceRecord out[16];
+    TEST_ASSERT_EQUAL(16, trace.readExact(epoch, h.firstSeq, out, h.count));
+    for (auto &rec : out)
+        TEST_ASSERT_EQUAL(TraceFlagLost, rec.flags);
+}
+
+void test_summary_skips_fillers_and_counts_refusals()
+{
+    trace.start(8);
+    record(1, Open, 0, 10, 100);
+    record(1, Open, 0, 30, 300);
+    record(1, Open, 0, 0, 0, Refused);
+    nlohmann::json j;
+    trace.summary(j);
+    TEST_ASSERT_EQUAL(2, j["1"]["count"].get<int>());
+    TEST_ASSERT_EQUAL(1, j["1"]["refused"].get<int>());
+    TEST_ASSERT_EQUAL(200, j["1"]["avgHandleUs"].get<int>());
+
+    MessageTrace::TypeSummary sum;
+    TraceRecord filler{};
+    filler.flags = TraceFlagLost;
+    MessageTrace::add(sum, filler);
+    TEST_ASSERT_EQUAL(0, sum.count);
+}
+
+void test_load_rejects_a_short_body()
+{
+    trace.start(8);
+    record(1, Open, 0, 0, 5);
+    record(1, Open, 0, 0, 5);
+    auto body = download();
+    TraceReplay replay;
+    std::string error;
+    TEST_ASSERT_FALSE(replay.load(body.data(), body.size() - 1, error));
+    TEST_ASSERT_FALSE(error.empty());
+    body[0] ^= 0xff;
+    TEST_ASSERT_FALSE(replay.load(body.data(), body.size(), error));
+}
+
+// Three Admin requests 100 us apart, 250 us each, on the single Admin
+// worker: they queue 0, 150 and 300 us. With two workers only the third
+// waits, 50 us for the first to be done.
+void test_replay_queues_on_the_class_pool()
+{
+    trace.start(8);
+    record(5, Admin, 1000, 0, 250);
+    record(5, Admin, 1100, 0, 250);
+    record(5, Admin, 1200, 0, 250);
+    auto body = download();
+    TraceReplay replay;
+    std::string error;
+    TEST_ASSERT_TRUE(replay.load(body.data(), body.size(), error));
+
+    nlohmann::json report;
+    replay.run(report);
+    TEST_ASSERT_EQUAL(3, report["replayed"]["5"]["count"].get<int>());
+    TEST_ASSERT_EQUAL(150, report["replayed"]["5"]["avgWaitUs"].get<int>());
+    TEST_ASSERT_EQUAL(300, report["replayed"]["5"]["maxWaitUs"].get<int>());
+    TEST_ASSERT_EQUAL(0, report["captured"]["5"]["maxWaitUs"].get<int>());
+
+    replay.setPool(Admin, 2);
+    replay.run(report);
+    TEST_ASSERT_EQUAL(50, report["replayed"]["5"]["maxWaitUs"].get<int>());
+
+    // twice the arrival rate on one worker again
+    replay.setPool(Admin, 1);
+    replay.setSpeed(2);
+    replay.run(report);
+    TEST_ASSERT_EQUAL(200, report["replayed"]["5"]["avgWaitUs"].get<int>());
+}
+
+void test_replay_runs_installed_handlers()
+{
+    trace.start(8);
+    record(5, Admin, 0, 0, 250);
+    record(6, Admin, 10, 0, 250);
+    auto body = download();
+    TraceReplay replay;
+    std::string error;
+    TEST_ASSERT_TRUE(replay.load(body.data(), body.size(), error));
+    int calls = 0;
+    replay.setHandler(6, [&](const TraceRecord &rec) {
+        TEST_ASSERT_EQUAL(6, rec.type);
+        calls++;
+    });
+    nlohmann::json report;
+    replay.run(report);
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_EQUAL(250, report["replayed"]["5"]["avgHandleUs"].get<int>());
+    TEST_ASSERT_TRUE(report["replayed"]["6"]["avgHandleUs"].get<int>() < 250);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_off_until_started);
+    RUN_TEST(test_wrapped_ring_keeps_the_newest);
+    RUN_TEST(test_download_length_holds_while_capture_wraps);
+    RUN_TEST(test_restart_during_download_sends_fillers);
+    RUN_TEST(test_summary_skips_fillers_and_counts_refusals);
+    RUN_TEST(test_load_rejects_a_short_body);
+    RUN_TEST(test_replay_queues_on_the_class_pool);
+    RUN_TEST(test_replay_runs_installed_handlers);
+    return UNITY_END();
+}
@@ -0,0 +1,154 @@
+#include <unity.h>
+#include <string>
+#include "KeyStore.h"
+#include "OpenNonces.h"
+
+static auto &nonces = OpenNonces::instance();
+
+// OpenNonces is a singleton; every test uses addresses and nonces of its
+// own and starts from an empty table
+static std::string peer(int test, int n)
+{
+    return "aa:bb:cc:dd:" + std::to_string(test) + ":" + std::to_string(n);
+}
+
+static std::string nonce(int test, int n)
+{
+    return "nonce-" + std::to_string(test) + "-" + std::to_string(n);
+}
+
+void setUp() {}
+
+void tearDown()
+{
+    for (int t = 0; t < 10; t++)
+        for (int n = 0; n < OpenNonceEntries + 2; n++)
+            nonces.drop(peer(t, n));
+}
+
+void test_nonce_opens_once()
+{
+    nonces.issue(peer(1, 0), nonce(1, 0), "proof", 1000);
+    std::string proof;
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Valid, (int)nonces.consume(peer(1, 0), nonce(1, 0), 2000, &proof));
+    TEST_ASSERT_EQUAL_STRING("proof", proof);
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Replayed, (int)nonces.consume(peer(1, 0), nonce(1, 0), 2000));
+    TEST_ASSERT_EQUAL(0, nonces.size());
+}
+
+void test_nonce_of_another_phone_is_unknown()
+{
+    nonces.issue(peer(2, 0), nonce(2, 0), "", 0);
+    auto unknown = nonces.stats().unknown;
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Unknown, (int)nonces.consume(peer(2, 1), nonce(2, 0), 0));
+    TEST_ASSERT_EQUAL(unknown + 1, nonces.stats().unknown);
+    // the owner can still use it
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Valid, (int)nonces.consume(peer(2, 0), nonce(2, 0), 0));
+}
+
+void test_stale_nonce_is_expired_and_spent()
+{
+    nonces.issue(peer(3, 0), nonce(3, 0), "", 0);
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Expired, (int)nonces.consume(peer(3, 0), nonce(3, 0), OpenNonceTtlMs + 1));
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Replayed, (int)nonces.consume(peer(3, 0), nonce(3, 0), OpenNonceTtlMs + 2));
+
+    nonces.issue(peer(3, 1), nonce(3, 1), "", 0);
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Valid, (int)nonces.consume(peer(3, 1), nonce(3, 1), OpenNonceTtlMs));
+}
+
+void test_new_nonce_replaces_the_live_one()
+{
+    nonces.issue(peer(4, 0), nonce(4, 0), "", 0);
+    nonces.issue(peer(4, 0), nonce(4, 1), "", 10);
+    TEST_ASSERT_EQUAL(1, nonces.size());
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Unknown, (int)nonces.consume(peer(4, 0), nonce(4, 0), 20));
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Valid, (int)nonces.consume(peer(4, 0), nonce(4, 1), 20));
+}
+
+void test_drop_forgets_the_peer()
+{
+    nonces.issue(peer(5, 0), nonce(5, 0), "", 0);
+    nonces.drop(peer(5, 0));
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Unknown, (int)nonces.consume(peer(5, 0), nonce(5, 0), 0));
+}
+
+void test_table_is_bounded_oldest_evicted()
+{
+    auto evicted = nonces.stats().evicted;
+    for (int n = 0; n <= OpenNonceEntries; n++)
+        nonces.issue(peer(6, n), nonce(6, n), "", 100 + n);
+    TEST_ASSERT_EQUAL(OpenNonceEntries, nonces.size());
+    TEST_ASSERT_EQUAL(evicted + 1, nonces.stats().evicted);
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Unknown, (int)nonces.consume(peer(6, 0), nonce(6, 0), 200));
+    TEST_ASSERT_EQUAL((int)OpenNonces::Result::Valid, (int)nonces.consume(peer(6, OpenNonceEntries), nonce(6, OpenNonceEntries), 200));
+}
+
+static std::string sessionKey(char fill)
+{
+    return std::string(16, fill);
+}
+
+// OpenNonceMessage::offer: the proof is computed when the nonce goes out
+static void offer(const std::string &address, const std::string &nonce, unsigned long nowMs)
+{
+    auto cipher = KeyStore::instance().sessionCipher(address);
+    nonces.issue(address, nonce, cipher ? cipher->proof(nonce) : std::string(), nowMs);
+}
+
+// The fast path of OpenRequest::handleRequest: one message from the phone
+// and the lock knows the answer without touching AES
+static bool openInOneMessage(const std::string &address, const std::string &nonce, const std::string &proof, unsigned long nowMs)
+{
+    std::string expected;
+    if (nonces.consume(address, nonce, nowMs, &expected) != OpenNonces::Result::Valid)
+        return false;
+    return !expected.empty() && SessionCipher::sameProof(proof, expected);
+}
+
+void test_one_round_trip_open()
+{
+    std::string address = peer(7, 0);
+    KeyStore::instance().publishSessionKey(address, sessionKey('k'));
+    SessionCipher phone(sessionKey('k'));
+    uint32_t ops = SessionCipher::stats().ops.load();
+
+    offer(address, nonce(7, 0), 0);
+    TEST_ASSERT_EQUAL(ops + 1, SessionCipher::stats().ops.load());
+    TEST_ASSERT_TRUE(openInOneMessage(address, nonce(7, 0), phone.proof(nonce(7, 0)), 100));
+    // the phone's proof was all the AES there was; the lock only compared
+    TEST_ASSERT_EQUAL(ops + 2, SessionCipher::stats().ops.load());
+
+    // the same frame again opens nothing, the nonce pushed with the reply does
+    TEST_ASSERT_FALSE(openInOneMessage(address, nonce(7, 0), phone.proof(nonce(7, 0)), 200));
+    offer(address, nonce(7, 1), 200);
+    TEST_ASSERT_TRUE(openInOneMessage(address, nonce(7, 1), phone.proof(nonce(7, 1)), 300));
+}
+
+void test_one_round_trip_open_needs_the_session_key()
+{
+    std::string address = peer(8, 0);
+    KeyStore::instance().publishSessionKey(address, sessionKey('k'));
+    SessionCipher stranger(sessionKey('s'));
+    offer(address, nonce(8, 0), 0);
+    TEST_ASSERT_FALSE(openInOneMessage(address, nonce(8, 0), stranger.proof(nonce(8, 0)), 100));
+
+    // no session when the nonce went out: nothing to compare, no fast open
+    KeyStore::instance().dropSession(address);
+    offer(address, nonce(8, 1), 100);
+    SessionCipher phone(sessionKey('k'));
+    TEST_ASSERT_FALSE(openInOneMessage(address, nonce(8, 1), phone.proof(nonce(8, 1)), 200));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_nonce_opens_once);
+    RUN_TEST(test_nonce_of_another_phone_is_unknown);
+    RUN_TEST(test_stale_nonce_is_expired_and_spent);
+    RUN_TEST(test_new_nonce_replaces_the_live_one);
+    RUN_TEST(test_drop_forgets_the_peer);
+    RUN_TEST(test_table_is_bounded_oldest_evicted);
+    RUN_TEST(test_one_round_trip_open);
+    RUN_TEST(test_one_round_trip_open_needs_the_session_key);
+    return UNITY_END();
+}
@@ -0,0 +1,508 @@
+#include <unity.h>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "OtaUpdate.h"
+
+// Flash slot in RAM; erase is per sector like the real one
+class RamPartition : public OtaPartition {
+public:
+    explicit RamPartition(size_t size) : bytes(size, 0xff) {}
+
+    bool open() override { return true; }
+    size_t size() override { return bytes.size(); }
+
+    bool erase(size_t offset, size_t len) override
+    {
+        if (offset % OtaSectorBytes || offset + len > bytes.size())
+            return false;
+        std::fill(bytes.begin() + offset, bytes.begin() + offset + len, 0xff);
+        return true;
+    }
+
+    bool write(size_t offset, const uint8_t *data, size_t len) override
+    {
+        if (offset + len > bytes.size())
+            return false;
+        for (size_t i = 0; i < len; i++)
+            bytes[offset + i] &= data[i];
+        written += len;
+        return true;
+    }
+
+    bool read(size_t offset, uint8_t *data, size_t len) override
+    {
+        if (offset + len > bytes.size())
+            return false;
+        memcpy(data, &bytes[offset], len);
+        return true;
+    }
+
+    bool activate() override
+    {
+        activations++;
+        return true;
+    }
+
+    std::vector<uint8_t> bytes;
+    size_t written = 0;
+    int activations = 0;
+};
+
+// FIPS 180-4 SHA-256, enough to check what the updater hashes
+class Sha256 : public OtaHash {
+public:
+    void reset() override
+    {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(h, init, sizeof(h));
+        used = 0;
+        length = 0;
+    }
+
+    void update(const uint8_t *data, size_t len) override
+    {
+        length += len;
+        while (len--) {
+            block[used++] = *data++;
+            if (used == 64) {
+                compress();
+                used = 0;
+            }
+        }
+    }
+
+    std::string hex() override
+    {
+        uint64_t bits = length * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56)
+            update(&pad, 1);
+        for (int i = 7; i >= 0; i--) {
+            uint8_t b = bits >> (i * 8);
+            update(&b, 1);
+        }
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (uint32_t word : h) {
+            for (int i = 28; i >= 0; i -= 4)
+                out += digits[(word >> i) & 0xf];
+        }
+        return out;
+    }
+
+    static std::string of(const std::vector<uint8_t> &data)
+    {
+        Sha256 sha;
+        sha.reset();
+        sha.update(data.data(), data.size());
+        return sha.hex();
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress()
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    uint32_t h[8];
+    uint8_t block[64];
+    size_t used = 0;
+    uint64_t length = 0;
+};
+
+// NVS in RAM; survives the SettingsStore (and updater) built on top of it
+class RamSettings : public SettingsBackend {
+public:
+    bool open(const char *) override { return true; }
+
+    bool read(const std::string &key, SettingType, std::string &value) override
+    {
+        auto it = committed.find(key);
+        if (it == committed.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+
+    bool write(const std::string &key, SettingType, const std::string &value) override
+    {
+        staged[key] = value;
+        return true;
+    }
+
+    bool erase(const std::string &key) override
+    {
+        staged[key] = Erased;
+        return true;
+    }
+
+    bool commit() override
+    {
+        for (auto &it : staged) {
+            if (it.second == Erased)
+                committed.erase(it.first);
+            else
+                committed[it.first] = it.second;
+        }
+        staged.clear();
+        return true;
+    }
+
+    static constexpr const char *Erased = "\x01erased";
+    std::map<std::string, std::string> staged;
+    std::map<std::string, std::string> committed;
+};
+
+// Takes the digest itself as its "signature"
+class DigestSignature : public OtaSignature {
+public:
+    bool verify(const uint8_t digest[32], const std::vector<uint8_t> &signature) override
+    {
+        return signature == std::vector<uint8_t>(digest, digest + 32);
+    }
+
+    static std::vector<uint8_t> sign(const std::string &hex)
+    {
+        std::vector<uint8_t> out;
+        for (size_t i = 0; i < hex.size(); i += 2)
+            out.push_back(std::stoi(hex.substr(i, 2), nullptr, 16));
+        return out;
+    }
+};
+
+static const size_t SlotBytes = 512 * 1024;
+static const std::vector<uint8_t> NoSignature;
+
+static std::vector<uint8_t> image(size_t len, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> out(len);
+    for (auto &b : out)
+        b = rng();
+    return out;
+}
+
+// Sends `img` from `from` in `chunk` pieces until done or `stopAt` bytes
+static OtaUpdater::Result send(OtaUpdater &ota, const std::vector<uint8_t> &img, uint32_t from, size_t chunk,
+                               size_t stopAt = ~0u)
+{
+    auto result = OtaUpdater::Result::Ok;
+    uint32_t next = from;
+    while (next < img.size() && next < stopAt && result == OtaUpdater::Result::Ok) {
+        size_t len = std::min(chunk, img.size() - next);
+        result = ota.write(next, img.data() + next, len, 0, next);
+    }
+    return result;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_sha256_matches_known_digest()
+{
+    std::vector<uint8_t> abc = {'a', 'b', 'c'};
+    TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+                             Sha256::of(abc).c_str());
+}
+
+void test_whole_image_activates()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    auto img = image(150000, 1);
+
+    uint32_t offset = 1;
+    TEST_ASSERT_TRUE(ota.begin(img.size(), Sha256::of(img), NoSignature, offset) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(0, offset);
+    TEST_ASSERT_TRUE(send(ota, img, 0, 4096) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_TRUE(ota.getState() == OtaUpdater::State::Done);
+    TEST_ASSERT_EQUAL(1, slot.activations);
+    TEST_ASSERT_TRUE(std::equal(img.begin(), img.end(), slot.bytes.begin()));
+    // the checkpoint is gone once the image is in
+    TEST_ASSERT_EQUAL(0, nvs.committed.size());
+    TEST_ASSERT_FALSE(ota.rebootDue(OtaRebootDelayMs - 1));
+    TEST_ASSERT_TRUE(ota.rebootDue(OtaRebootDelayMs));
+}
+
+void test_out_of_order_and_resent_chunks()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    auto img = image(10000, 2);
+    uint32_t next;
+
+    TEST_ASSERT_TRUE(ota.write(0, img.data(), 100, 0, next) == OtaUpdater::Result::NotStarted);
+    uint32_t offset;
+    ota.begin(img.size(), Sha256::of(img), NoSignature, offset);
+    ota.write(0, img.data(), 1000, 0, next);
+    TEST_ASSERT_TRUE(ota.write(2000, img.data() + 2000, 1000, 0, next) == OtaUpdater::Result::BadOffset);
+    TEST_ASSERT_EQUAL(1000, next);
+    // a full resend is a duplicate, an overlapping one only adds its tail
+    TEST_ASSERT_TRUE(ota.write(0, img.data(), 1000, 0, next) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(1, ota.stats().duplicates);
+    ota.write(500, img.data() + 500, 1000, 0, next);
+    TEST_ASSERT_EQUAL(1500, next);
+    TEST_ASSERT_TRUE(send(ota, img, next, 3000) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_TRUE(ota.getState() == OtaUpdater::State::Done);
+    TEST_ASSERT_EQUAL(img.size(), slot.written);
+}
+
+void test_hash_mismatch_does_not_activate()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    auto img = image(20000, 3);
+    auto claimed = Sha256::of(image(20000, 4));
+
+    uint32_t offset;
+    ota.begin(img.size(), claimed, NoSignature, offset);
+    TEST_ASSERT_TRUE(send(ota, img, 0, 4096) == OtaUpdater::Result::HashMismatch);
+    TEST_ASSERT_TRUE(ota.getState() == OtaUpdater::State::Failed);
+    TEST_ASSERT_EQUAL(0, slot.activations);
+}
+
+void test_bad_requests()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    uint32_t offset;
+
+    TEST_ASSERT_TRUE(ota.begin(100, "abc", NoSignature, offset) == OtaUpdater::Result::BadRequest);
+    TEST_ASSERT_TRUE(ota.begin(100, std::string(64, 'g'), NoSignature, offset) == OtaUpdater::Result::BadRequest);
+    TEST_ASSERT_TRUE(ota.begin(0, std::string(64, 'a'), NoSignature, offset) == OtaUpdater::Result::TooLarge);
+    TEST_ASSERT_TRUE(ota.begin(SlotBytes + 1, std::string(64, 'a'), NoSignature, offset) ==
+                     OtaUpdater::Result::TooLarge);
+    // upper case digests are the same image
+    TEST_ASSERT_TRUE(ota.begin(100, std::string(64, 'A'), NoSignature, offset) == OtaUpdater::Result::Ok);
+}
+
+void test_signature_required()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    DigestSignature verifier;
+    ota.requireSignature(verifier);
+    auto img = image(30000, 5);
+    auto digest = Sha256::of(img);
+    uint32_t offset;
+
+    TEST_ASSERT_TRUE(ota.begin(img.size(), digest, NoSignature, offset) == OtaUpdater::Result::BadSignature);
+    auto forged = DigestSignature::sign(Sha256::of(image(30000, 6)));
+    TEST_ASSERT_TRUE(ota.begin(img.size(), digest, forged, offset) == OtaUpdater::Result::BadSignature);
+    TEST_ASSERT_EQUAL(2, ota.stats().badSignatures);
+    TEST_ASSERT_TRUE(ota.getState() == OtaUpdater::State::Idle);
+    uint32_t next;
+    TEST_ASSERT_TRUE(ota.write(0, img.data(), 100, 0, next) == OtaUpdater::Result::NotStarted);
+    TEST_ASSERT_EQUAL(0, slot.written);
+
+    auto sig = DigestSignature::sign(digest);
+    TEST_ASSERT_TRUE(ota.begin(img.size(), digest, sig, offset) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_TRUE(send(ota, img, 0, 4096) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(1, slot.activations);
+    TEST_ASSERT_EQUAL_STRING("badSignature", OtaUpdater::name(OtaUpdater::Result::BadSignature));
+}
+
+void test_resume_after_link_loss()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    auto img = image(100000, 7);
+    auto digest = Sha256::of(img);
+
+    uint32_t offset;
+    ota.begin(img.size(), digest, NoSignature, offset);
+    send(ota, img, 0, 4096, 40000);
+    uint32_t reached = ota.offset();
+
+    // the client comes back, asks where to go on and does not start over
+    TEST_ASSERT_TRUE(ota.begin(img.size(), digest, NoSignature, offset) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(reached, offset);
+    TEST_ASSERT_EQUAL(1, ota.stats().resumed);
+    TEST_ASSERT_EQUAL(1, ota.stats().sessions);
+    TEST_ASSERT_TRUE(send(ota, img, offset, 4096) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(img.size(), slot.written);
+    TEST_ASSERT_EQUAL(1, slot.activations);
+}
+
+void test_resume_after_reboot_from_checkpoint()
+{
+    RamPartition slot(SlotBytes);
+    RamSettings nvs;
+    auto img = image(300000, 8);
+    auto digest = Sha256::of(img);
+    uint32_t offset;
+    {
+        Sha256 sha;
+        SettingsStore settings(nvs);
+        OtaUpdater ota(slot, sha, settings);
+        ota.begin(img.size(), digest, NoSignature, offset);
+        send(ota, img, 0, 4096, 3 * OtaCheckpointBytes + 10000);
+        TEST_ASSERT_EQUAL(3, ota.stats().checkpoints);
+    }
+
+    // power cut: only what reached NVS and flash is left
+    Sha256 sha;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    TEST_ASSERT_TRUE(ota.begin(img.size(), digest, NoSignature, offset) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(3 * OtaCheckpointBytes, offset);
+    TEST_ASSERT_EQUAL(3 * OtaCheckpointBytes, ota.stats().rehashedBytes);
+    TEST_ASSERT_TRUE(send(ota, img, offset, 4096) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_TRUE(ota.getState() == OtaUpdater::State::Done);
+    TEST_ASSERT_TRUE(std::equal(img.begin(), img.end(), slot.bytes.begin()));
+}
+
+void test_new_image_starts_over()
+{
+    RamPartition slot(SlotBytes);
+    Sha256 sha;
+    RamSettings nvs;
+    SettingsStore settings(nvs);
+    OtaUpdater ota(slot, sha, settings);
+    auto first = image(80000, 9);
+    auto second = image(70000, 10);
+    uint32_t offset;
+
+    ota.begin(first.size(), Sha256::of(first), NoSignature, offset);
+    send(ota, first, 0, 4096, 70000);
+    ota.begin(second.size(), Sha256::of(second), NoSignature, offset);
+    TEST_ASSERT_EQUAL(0, offset);
+    TEST_ASSERT_TRUE(send(ota, second, 0, 4096) == OtaUpdater::Result::Ok);
+    TEST_ASSERT_EQUAL(1, slot.activations);
+    TEST_ASSERT_TRUE(std::equal(second.begin(), second.end(), slot.bytes.begin()));
+}
+
+// A flaky link: every chunk may be lost on the way, its reply may be lost on
+// the way back, and now and then the link drops and the client reconnects
+// (sometimes across a reboot of the lock). The image must still land intact
+// and the bytes resent stay a small share of it.
+void test_flaky_link_simulation()
+{
+    RamPartition slot(SlotBytes);
+    RamSettings nvs;
+    auto img = image(400000, 11);
+    auto digest = Sha256::of(img);
+    std::mt19937 rng(12);
+    const size_t chunk = 512;
+
+    auto *sha = new Sha256;
+    auto *settings = new SettingsStore(nvs);
+    auto *ota = new OtaUpdater(slot, *sha, *settings);
+    uint32_t offset;
+    ota->begin(img.size(), digest, NoSignature, offset);
+
+    uint32_t clientAt = offset;
+    size_t sent = 0;
+    int reconnects = 0, reboots = 0;
+    while (ota->getState() != OtaUpdater::State::Done) {
+        uint32_t roll = rng() % 1000;
+        if (roll < 20) {
+            if (rng() % 3 == 0) {
+                delete ota;
+                delete settings;
+                delete sha;
+                sha = new Sha256;
+                settings = new SettingsStore(nvs);
+                ota = new OtaUpdater(slot, *sha, *settings);
+                reboots++;
+            }
+            TEST_ASSERT_TRUE(ota->begin(img.size(), digest, NoSignature, offset) == OtaUpdater::Result::Ok);
+            clientAt = offset;
+            reconnects++;
+            continue;
+        }
+        size_t len = std::min(chunk, img.size() - clientAt);
+        sent += len;
+        if (roll < 70)
+            continue; // chunk lost: the client resends after its reply timeout
+        uint32_t next;
+        auto result = ota->write(clientAt, img.data() + clientAt, len, 0, next);
+        TEST_ASSERT_TRUE(result == OtaUpdater::Result::Ok);
+        if (roll < 120)
+            continue; // reply lost: same chunk again, the updater skips it
+        clientAt = next;
+    }
+
+    TEST_ASSERT_EQUAL(1, slot.activations);
+    TEST_ASSERT_TRUE(std::equal(img.begin(), img.end(), slot.bytes.begin()));
+    TEST_ASSERT_TRUE(reconnects > 0);
+    TEST_ASSERT_TRUE(reboots > 0);
+    printf("flaky link: %zu bytes sent for %zu, %d reconnects, %d reboots, %u rehashed\n", sent, img.size(),
+           reconnects, reboots, ota->stats().rehashedBytes);
+    TEST_ASSERT_TRUE(sent < img.size() * 2);
+    delete ota;
+    delete settings;
+    delete sha;
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_sha256_matches_known_digest);
+    RUN_TEST(test_whole_image_activates);
+    RUN_TEST(test_out_of_order_and_resent_chunks);
+    RUN_TEST(test_hash_mismatch_does_not_activate);
+    RUN_TEST(test_bad_requests);
+    RUN_TEST(test_signature_required);
+    RUN_TEST(test_resume_after_link_loss);
+    RUN_TEST(test_resume_after_reboot_from_checkpoint);
+    RUN_TEST(test_new_image_starts_over);
+    RUN_TEST(test_flaky_link_simulation);
+    return UNITY_END();
+}
@@ -0,0 +1,128 @@
+#include <unity.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "PendingRequests.h"
+
+// What a parked request carries until it is answered or times out
+class Parked : public MessageBase {
+public:
+    explicit Parked(std::string note) : note(std::move(note)) {}
+    std::string note;
+
+protected:
+    void serializeExtraFields(json &) override {}
+    void deserializeExtraFields(const json &) override {}
+};
+
+static const char *Phone = "5c:3a:91:0e:7f:21";
+static const char *Other = "11:22:33:44:55:66";
+static const MessageType Check = 3;
+
+static std::vector<std::string> expired;
+
+static void onExpire(const std::string &uuid, std::unique_ptr<MessageBase> payload)
+{
+    expired.push_back(uuid + "=" + (payload ? static_cast<Parked &>(*payload).note : "none"));
+}
+
+// PendingRequests is a singleton; every test starts from an empty table and
+// its own clock
+static unsigned long now = 0;
+
+static void drain()
+{
+    auto &pending = PendingRequests::instance();
+    pending.cancelAddress(Phone);
+    pending.cancelAddress(Other);
+}
+
+void setUp()
+{
+    drain();
+    expired.clear();
+    now += 100000;
+    PendingRequests::instance().tick(now);
+    PendingRequests::instance().setTimeout(Check, 500);
+}
+
+void tearDown() {}
+
+void test_complete_returns_the_payload()
+{
+    auto &pending = PendingRequests::instance();
+    uint32_t before = pending.completedTotal();
+    TEST_ASSERT_TRUE(pending.add("u1", Phone, Check, std::unique_ptr<MessageBase>(new Parked("open")), onExpire));
+    TEST_ASSERT_FALSE(pending.add("u1", Phone, Check));
+    auto payload = pending.complete("u1", Phone);
+    TEST_ASSERT_TRUE(payload != nullptr);
+    TEST_ASSERT_EQUAL_STRING("open", static_cast<Parked &>(*payload).note.c_str());
+    TEST_ASSERT_EQUAL(before + 1, pending.completedTotal());
+    TEST_ASSERT_TRUE(pending.complete("u1", Phone) == nullptr);
+    TEST_ASSERT_EQUAL(0, pending.outstanding());
+}
+
+void test_only_the_asked_peer_completes()
+{
+    auto &pending = PendingRequests::instance();
+    uint32_t before = pending.mismatchedTotal();
+    pending.add("u2", Phone, Check, std::unique_ptr<MessageBase>(new Parked("open")), onExpire);
+    TEST_ASSERT_TRUE(pending.complete("u2", Other) == nullptr);
+    TEST_ASSERT_EQUAL(before + 1, pending.mismatchedTotal());
+    TEST_ASSERT_EQUAL(1, pending.outstanding());
+    TEST_ASSERT_TRUE(pending.complete("u2", Phone) != nullptr);
+}
+
+void test_timeout_hands_the_payload_to_the_handler()
+{
+    auto &pending = PendingRequests::instance();
+    uint32_t before = pending.timeoutsTotal();
+    pending.add("u3", Phone, Check, std::unique_ptr<MessageBase>(new Parked("open")), onExpire);
+    pending.tick(now + 400);
+    TEST_ASSERT_EQUAL(0, expired.size());
+    pending.tick(now + 600);
+    TEST_ASSERT_EQUAL(1, expired.size());
+    TEST_ASSERT_EQUAL_STRING("u3=open", expired[0].c_str());
+    TEST_ASSERT_EQUAL(before + 1, pending.timeoutsTotal());
+    // answered too late
+    TEST_ASSERT_TRUE(pending.complete("u3", Phone) == nullptr);
+}
+
+void test_long_timeouts_wrap_the_wheel()
+{
+    auto &pending = PendingRequests::instance();
+    const uint32_t ms = PendingWheelSlots * PendingTickMs * 2 + 300;
+    pending.setTimeout(Check + 1, ms);
+    pending.add("u4", Phone, Check + 1, nullptr, onExpire);
+    pending.tick(now + ms - PendingTickMs);
+    TEST_ASSERT_EQUAL(0, expired.size());
+    pending.tick(now + ms);
+    TEST_ASSERT_EQUAL(1, expired.size());
+    TEST_ASSERT_EQUAL_STRING("u4=none", expired[0].c_str());
+}
+
+void test_disconnect_cancels_without_handlers()
+{
+    auto &pending = PendingRequests::instance();
+    uint32_t before = pending.cancelledTotal();
+    pending.add("u5", Phone, Check, std::unique_ptr<MessageBase>(new Parked("a")), onExpire);
+    pending.add("u6", Phone, Check, std::unique_ptr<MessageBase>(new Parked("b")), onExpire);
+    pending.add("u7", Other, Check, std::unique_ptr<MessageBase>(new Parked("c")), onExpire);
+    TEST_ASSERT_EQUAL(2, pending.cancelAddress(Phone));
+    TEST_ASSERT_EQUAL(before + 2, pending.cancelledTotal());
+    TEST_ASSERT_EQUAL(1, pending.outstanding());
+    pending.tick(now + 1000);
+    TEST_ASSERT_EQUAL(1, expired.size());
+    TEST_ASSERT_EQUAL_STRING("u7=c", expired[0].c_str());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_complete_returns_the_payload);
+    RUN_TEST(test_only_the_asked_peer_completes);
+    RUN_TEST(test_timeout_hands_the_payload_to_the_handler);
+    RUN_TEST(test_long_timeouts_wrap_the_wheel);
+    RUN_TEST(test_disconnect_cancels_without_handlers);
+    return UNITY_END();
+}
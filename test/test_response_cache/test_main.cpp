@@ -0,0 +1,130 @@
+#include <unity.h>
+#include <memory>
+#include <string>
+#include "ResponseCache.h"
+
+// Same shape as ResOk in ReqRes.h
+class Ok : public MessageBase {
+public:
+    bool status = false;
+
+protected:
+    void serializeExtraFields(json &doc) override { doc["status"] = status; }
+    void deserializeExtraFields(const json &doc) override { status = doc["status"]; }
+};
+
+static const MessageType OkType = 7;
+static const char *Lock = "aa:bb:cc:dd:ee:ff";
+static const char *Phone = "11:22:33:44:55:66";
+static const char *Other = "5c:3a:91:0e:7f:21";
+
+static Ok request(const char *from, const char *uuid)
+{
+    Ok req;
+    req.type = 1;
+    req.sourceAddress = from;
+    req.destinationAddress = Lock;
+    req.requestUUID = uuid;
+    return req;
+}
+
+// Runs `req` through the cache with a handler that counts its calls
+static int handled = 0;
+
+static void serve(Ok &req)
+{
+    delete ResponseCache::instance().serve(&req, [&]() -> MessageBase * {
+        handled++;
+        auto res = new Ok;
+        res->type = OkType;
+        res->sourceAddress = req.destinationAddress;
+        res->destinationAddress = req.sourceAddress;
+        res->requestUUID = req.requestUUID;
+        res->status = true;
+        return res;
+    });
+}
+
+void setUp()
+{
+    MessageBase::registerConstructor(OkType, []() -> MessageBase * { return new Ok; });
+    ResponseCache::instance().invalidate(Phone);
+    ResponseCache::instance().invalidate(Other);
+    handled = 0;
+}
+
+void tearDown() {}
+
+void test_retry_is_replayed_without_the_handler()
+{
+    auto req = request(Phone, "u1");
+    TEST_ASSERT_NULL(ResponseCache::instance().replay(&req));
+    serve(req);
+    TEST_ASSERT_EQUAL(1, handled);
+
+    std::unique_ptr<MessageBase> again(ResponseCache::instance().replay(&req));
+    TEST_ASSERT_NOT_NULL(again.get());
+    TEST_ASSERT_EQUAL(OkType, again->type);
+    TEST_ASSERT_EQUAL_STRING(Phone, again->destinationAddress.c_str());
+    TEST_ASSERT_EQUAL_STRING("u1", again->requestUUID.c_str());
+    TEST_ASSERT_TRUE(static_cast<Ok &>(*again).status);
+    TEST_ASSERT_EQUAL(1, handled);
+}
+
+void test_key_is_address_and_uuid()
+{
+    auto mine = request(Phone, "u1");
+    serve(mine);
+    auto theirs = request(Other, "u1");
+    TEST_ASSERT_NULL(ResponseCache::instance().replay(&theirs));
+    auto next = request(Phone, "u2");
+    TEST_ASSERT_NULL(ResponseCache::instance().replay(&next));
+}
+
+void test_no_uuid_is_never_cached()
+{
+    auto req = request(Phone, "");
+    serve(req);
+    TEST_ASSERT_NULL(ResponseCache::instance().replay(&req));
+    TEST_ASSERT_EQUAL(0, ResponseCache::instance().size());
+}
+
+void test_invalidate_drops_only_that_peer()
+{
+    auto mine = request(Phone, "u1");
+    auto theirs = request(Other, "u1");
+    serve(mine);
+    serve(theirs);
+    ResponseCache::instance().invalidate(Phone);
+    TEST_ASSERT_NULL(ResponseCache::instance().replay(&mine));
+    std::unique_ptr<MessageBase> kept(ResponseCache::instance().replay(&theirs));
+    TEST_ASSERT_NOT_NULL(kept.get());
+    TEST_ASSERT_EQUAL(1, ResponseCache::instance().size());
+}
+
+void test_oldest_entry_goes_first()
+{
+    char uuid[8];
+    for (int i = 0; i <= ResponseCacheEntries; i++) {
+        snprintf(uuid, sizeof(uuid), "u%d", i);
+        auto req = request(Phone, uuid);
+        serve(req);
+    }
+    TEST_ASSERT_EQUAL(ResponseCacheEntries, ResponseCache::instance().size());
+    auto first = request(Phone, "u0");
+    TEST_ASSERT_NULL(ResponseCache::instance().replay(&first));
+    auto last = request(Phone, uuid);
+    std::unique_ptr<MessageBase> kept(ResponseCache::instance().replay(&last));
+    TEST_ASSERT_NOT_NULL(kept.get());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_retry_is_replayed_without_the_handler);
+    RUN_TEST(test_key_is_address_and_uuid);
+    RUN_TEST(test_no_uuid_is_never_cached);
+    RUN_TEST(test_invalidate_drops_only_that_peer);
+    RUN_TEST(test_oldest_entry_goes_first);
+    return UNITY_END();
+}
@@ -0,0 +1,113 @@
+#include <unity.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "ResponseTemplate.h"
+
+// Same shape as ResOk in ReqRes.h
+class Ok : public MessageBase {
+public:
+    bool status;
+
+    explicit Ok(bool status) : status(status) {}
+
+protected:
+    void serializeExtraFields(json &doc) override { doc["status"] = status; }
+    void deserializeExtraFields(const json &doc) override { status = doc["status"]; }
+};
+
+static const char *Lock = "aa:bb:cc:dd:ee:ff";
+static const char *Phone = "11:22:33:44:55:66";
+static const char *Uuid = "3f2b8c1e-7d4a-4e9b-a1c6-5d8e2f7b9a04";
+
+static ResponseTemplate built(bool status)
+{
+    ResponseTemplate t;
+    Ok prototype(status);
+    t.build(prototype);
+    return t;
+}
+
+static std::string viaJson(bool status, const std::string &src, const std::string &dst, const std::string &uuid)
+{
+    Ok reply(status);
+    reply.sourceAddress = src;
+    reply.destinationAddress = dst;
+    reply.requestUUID = uuid;
+    return reply.serialize();
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_render_matches_json()
+{
+    for (bool status : {false, true}) {
+        auto t = built(status);
+        TEST_ASSERT_TRUE(t.isBuilt());
+        std::string out;
+        t.render(Lock, Phone, Uuid, out);
+        TEST_ASSERT_EQUAL_STRING(viaJson(status, Lock, Phone, Uuid).c_str(), out.c_str());
+        TEST_ASSERT_EQUAL(out.size(), t.size(Lock, Phone, Uuid));
+    }
+}
+
+void test_spliced_fields_are_escaped()
+{
+    auto t = built(true);
+    std::string out;
+    std::string odd = "a\"b\\c\nd";
+    t.render(odd, Phone, "", out);
+    TEST_ASSERT_EQUAL_STRING(viaJson(true, odd, Phone, "").c_str(), out.c_str());
+    TEST_ASSERT_TRUE(json::parse(out)["sourceAddress"] == odd);
+}
+
+void test_render_reuses_the_buffer()
+{
+    auto t = built(true);
+    std::string out;
+    t.render(Lock, Phone, Uuid, out);
+    const char *data = out.data();
+    size_t capacity = out.capacity();
+    for (int i = 0; i < 100; i++)
+        t.render(Lock, Phone, Uuid, out);
+    TEST_ASSERT_EQUAL(capacity, out.capacity());
+    TEST_ASSERT_TRUE(data == out.data());
+}
+
+void test_benchmark_template_against_json()
+{
+    const int iterations = 20000;
+    auto t = built(true);
+    using clock = std::chrono::steady_clock;
+
+    size_t sink = 0;
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++)
+        sink += viaJson(true, Lock, Phone, Uuid).size();
+    double jsonNs = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+
+    std::string out;
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        t.render(Lock, Phone, Uuid, out);
+        sink += out.size();
+    }
+    double templateNs = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+
+    char line[96];
+    snprintf(line, sizeof(line), "ResOk reply: %.0f ns through json, %.0f ns from the template", jsonNs, templateNs);
+    TEST_MESSAGE(line);
+    TEST_ASSERT_GREATER_THAN(0, sink);
+    TEST_ASSERT_TRUE(templateNs < jsonNs);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_render_matches_json);
+    RUN_TEST(test_spliced_fields_are_escaped);
+    RUN_TEST(test_render_reuses_the_buffer);
+    RUN_TEST(test_benchmark_template_against_json);
+    return UNITY_END();
+}
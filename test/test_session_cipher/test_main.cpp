@@ -0,0 +1,91 @@
+#include <unity.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "SessionCipher.h"
+
+static std::string fromHex(const char *hex)
+{
+    std::string out;
+    for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+        char byte[3] = {hex[i], hex[i + 1], 0};
+        out += (char)strtoul(byte, nullptr, 16);
+    }
+    return out;
+}
+
+static const char *RfcKey = "2b7e151628aed2a6abf7158809cf4f3c";
+static const char *RfcMessage =
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+
+void setUp() {}
+void tearDown() {}
+
+void test_rfc4493_vectors()
+{
+    SessionCipher cipher(fromHex(RfcKey));
+    TEST_ASSERT_TRUE(cipher.valid());
+    std::string message = fromHex(RfcMessage);
+    TEST_ASSERT_EQUAL_STRING("bb1d6929e95937287fa37d129b756746", cipher.proof("").c_str());
+    TEST_ASSERT_EQUAL_STRING("070a16b46b4d4144f79bdd9dd04a287c", cipher.proof(message.substr(0, 16)).c_str());
+    TEST_ASSERT_EQUAL_STRING("dfa66747de9ae63030ca32611497c827", cipher.proof(message.substr(0, 40)).c_str());
+    TEST_ASSERT_EQUAL_STRING("51f0bebf7e3b9d92fc49741779363cfe", cipher.proof(message).c_str());
+}
+
+void test_key_must_be_raw_aes_key()
+{
+    // no guessing: hex text of the key, a short or a long key are all refused
+    TEST_ASSERT_FALSE(SessionCipher(RfcKey).valid());
+    TEST_ASSERT_FALSE(SessionCipher(fromHex(RfcKey).substr(0, 15)).valid());
+    TEST_ASSERT_FALSE(SessionCipher(fromHex(RfcKey) + "x").valid());
+    TEST_ASSERT_FALSE(SessionCipher("").valid());
+}
+
+void test_same_proof()
+{
+    TEST_ASSERT_TRUE(SessionCipher::sameProof("070A16b4", "070a16B4"));
+    TEST_ASSERT_FALSE(SessionCipher::sameProof("070a16b4", "070a16b5"));
+    TEST_ASSERT_FALSE(SessionCipher::sameProof("070a16b4", "070a16b"));
+}
+
+// What caching the schedule buys on the nonce proof path: expanding the key
+// for every message against reusing the session's context
+void test_benchmark_cached_schedule()
+{
+    const int iterations = 20000;
+    std::string key = fromHex(RfcKey);
+    std::string nonce = "9f2c4e1a7b3d5f60a8c2e4b6d8f0a1c3";
+    using clock = std::chrono::steady_clock;
+
+    size_t sink = 0;
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        SessionCipher perMessage(key);
+        sink += perMessage.proof(nonce)[0];
+    }
+    double expandNs = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+
+    SessionCipher cached(key);
+    start = clock::now();
+    for (int i = 0; i < iterations; i++)
+        sink += cached.proof(nonce)[0];
+    double cachedNs = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+
+    char line[96];
+    snprintf(line, sizeof(line), "proof of a 32 byte nonce: %.0f ns expanding per message, %.0f ns cached",
+             expandNs, cachedNs);
+    TEST_MESSAGE(line);
+    TEST_ASSERT_GREATER_THAN(0, sink);
+    TEST_ASSERT_TRUE(cachedNs < expandNs);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_rfc4493_vectors);
+    RUN_TEST(test_key_must_be_raw_aes_key);
+    RUN_TEST(test_same_proof);
+    RUN_TEST(test_benchmark_cached_schedule);
+    return UNITY_END();
+}
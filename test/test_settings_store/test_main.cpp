@@ -0,0 +1,179 @@
+#include <unity.h>
+#include <map>
+#include <string>
+#include "SettingsStore.h"
+
+// NVS in RAM that remembers each key's type and counts what reaches it
+class RamBackend : public SettingsBackend {
+public:
+    struct Stored {
+        SettingType type;
+        std::string value;
+    };
+
+    bool open(const char *) override { return true; }
+
+    bool read(const std::string &key, SettingType type, std::string &value) override
+    {
+        reads++;
+        auto it = keys.find(key);
+        // like nvs_get_*: a key of another type is not found
+        if (it == keys.end() || it->second.type != type)
+            return false;
+        value = it->second.value;
+        return true;
+    }
+
+    bool write(const std::string &key, SettingType type, const std::string &value) override
+    {
+        writes++;
+        keys[key] = Stored{type, value};
+        return true;
+    }
+
+    bool erase(const std::string &key) override
+    {
+        erases++;
+        return keys.erase(key) > 0;
+    }
+
+    bool commit() override
+    {
+        commits++;
+        return true;
+    }
+
+    std::map<std::string, Stored> keys;
+    int reads = 0;
+    int writes = 0;
+    int erases = 0;
+    int commits = 0;
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_puts_stay_in_ram_until_flush()
+{
+    RamBackend nvs;
+    SettingsStore store(nvs);
+    for (uint32_t i = 0; i < 100; i++)
+        store.putUInt("acked", i);
+    store.putString("image", "abc");
+    TEST_ASSERT_EQUAL(0, nvs.writes);
+    TEST_ASSERT_TRUE(store.isDirty());
+    TEST_ASSERT_EQUAL(99, store.getUInt("acked"));
+
+    TEST_ASSERT_TRUE(store.flush());
+    TEST_ASSERT_EQUAL(2, nvs.writes);
+    TEST_ASSERT_EQUAL(1, nvs.commits);
+    TEST_ASSERT_FALSE(store.isDirty());
+    // nothing changed since: no writes, no commit
+    store.flush();
+    TEST_ASSERT_EQUAL(1, nvs.commits);
+}
+
+void test_unchanged_values_are_skipped()
+{
+    RamBackend nvs;
+    nvs.keys["count"] = RamBackend::Stored{SettingType::U32, std::string("\x07\x00\x00\x00", 4)};
+    SettingsStore store(nvs);
+    store.putUInt("count", 7);
+    TEST_ASSERT_FALSE(store.isDirty());
+    TEST_ASSERT_EQUAL(1, store.stats().skippedWrites);
+    store.flush();
+    TEST_ASSERT_EQUAL(0, nvs.writes);
+}
+
+void test_put_of_unread_key_records_its_type()
+{
+    // the first touch of a key being a put must not leave it typed as a
+    // string: a U32 equal to what is stored is a skip, and a read of the
+    // same key afterwards is a hit of the right type
+    RamBackend nvs;
+    nvs.keys["total"] = RamBackend::Stored{SettingType::U32, std::string("\x10\x00\x00\x00", 4)};
+    SettingsStore store(nvs);
+    store.putUInt("total", 16);
+    TEST_ASSERT_EQUAL(1, store.stats().skippedWrites);
+    TEST_ASSERT_EQUAL(16, store.getUInt("total"));
+    TEST_ASSERT_EQUAL(1, nvs.reads);
+
+    store.putUInt("fresh", 5);
+    TEST_ASSERT_EQUAL(5, store.getUInt("fresh"));
+    store.flush();
+    TEST_ASSERT_TRUE(nvs.keys["fresh"].type == SettingType::U32);
+}
+
+void test_type_mismatch_reads_default()
+{
+    RamBackend nvs;
+    SettingsStore store(nvs);
+    store.putString("name", "lock");
+    TEST_ASSERT_EQUAL(42, store.getUInt("name", 42));
+    TEST_ASSERT_EQUAL_STRING("lock", store.getString("name").c_str());
+}
+
+void test_reads_hit_flash_once()
+{
+    RamBackend nvs;
+    nvs.keys["name"] = RamBackend::Stored{SettingType::Str, "front door"};
+    SettingsStore store(nvs);
+    for (int i = 0; i < 10; i++)
+        TEST_ASSERT_EQUAL_STRING("front door", store.getString("name").c_str());
+    TEST_ASSERT_EQUAL(1, nvs.reads);
+    TEST_ASSERT_EQUAL(1, store.stats().misses);
+    TEST_ASSERT_EQUAL(9, store.stats().hits);
+    // a missing key is remembered as missing too
+    store.getString("absent");
+    store.getString("absent");
+    TEST_ASSERT_EQUAL(2, nvs.reads);
+}
+
+void test_remove_is_batched()
+{
+    RamBackend nvs;
+    nvs.keys["image"] = RamBackend::Stored{SettingType::Str, "abc"};
+    SettingsStore store(nvs);
+    store.remove("image");
+    TEST_ASSERT_EQUAL_STRING("", store.getString("image").c_str());
+    TEST_ASSERT_EQUAL(0, nvs.erases);
+    store.flush();
+    TEST_ASSERT_EQUAL(1, nvs.erases);
+    TEST_ASSERT_EQUAL(0, nvs.keys.size());
+    // removing what is already gone is not another flash operation
+    store.remove("image");
+    TEST_ASSERT_FALSE(store.isDirty());
+}
+
+void test_blobs_and_numbers_round_trip()
+{
+    RamBackend nvs;
+    {
+        SettingsStore store(nvs);
+        uint8_t blob[5] = {1, 2, 3, 0, 5};
+        store.putBytes("blob", blob, sizeof(blob));
+        store.putInt("neg", -12);
+        store.putBool("on", true);
+        store.flush();
+    }
+    SettingsStore store(nvs);
+    uint8_t out[8] = {};
+    TEST_ASSERT_EQUAL(5, store.getBytes("blob", out, sizeof(out)));
+    TEST_ASSERT_EQUAL(5, out[4]);
+    TEST_ASSERT_EQUAL(0, store.getBytes("blob", out, 4));
+    TEST_ASSERT_EQUAL(-12, store.getInt("neg"));
+    TEST_ASSERT_TRUE(store.getBool("on"));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_puts_stay_in_ram_until_flush);
+    RUN_TEST(test_unchanged_values_are_skipped);
+    RUN_TEST(test_put_of_unread_key_records_its_type);
+    RUN_TEST(test_type_mismatch_reads_default);
+    RUN_TEST(test_reads_hit_flash_once);
+    RUN_TEST(test_remove_is_batched);
+    RUN_TEST(test_blobs_and_numbers_round_trip);
+    return UNITY_END();
+}
@@ -0,0 +1,149 @@
+#include <unity.h>
+#include <atomic>
+#include <future>
+#include "ThermalMonitor.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_hysteresis_between_hot_and_cool()
+{
+    ThermalPolicy policy;
+    TEST_ASSERT_FALSE(policy.update(ThermalHotC - 0.1f));
+    TEST_ASSERT_TRUE(policy.update(ThermalHotC));
+    // in the band between the thresholds it stays where it was
+    TEST_ASSERT_TRUE(policy.update(ThermalCoolC + 0.1f));
+    TEST_ASSERT_FALSE(policy.update(ThermalCoolC));
+    TEST_ASSERT_FALSE(policy.update(ThermalHotC - 0.1f));
+    TEST_ASSERT_EQUAL(2, policy.changes());
+}
+
+void test_noise_around_one_value_does_not_toggle()
+{
+    ThermalPolicy policy;
+    policy.update(ThermalHotC + 1);
+    for (int i = 0; i < 100; i++)
+        policy.update(i % 2 ? ThermalHotC + 0.5f : ThermalHotC - 0.5f);
+    TEST_ASSERT_TRUE(policy.isHot());
+    TEST_ASSERT_EQUAL(1, policy.changes());
+}
+
+void test_history_buckets_min_max_avg()
+{
+    ThermalHistory history;
+    for (int i = 0; i < ThermalBucketSamples; i++)
+        history.add(40.0f + i % 3);     // 40, 41, 42, ...
+    TEST_ASSERT_EQUAL(1, history.size());
+    TEST_ASSERT_EQUAL(0, history.current().count);
+    auto &b = history.at(0);
+    TEST_ASSERT_EQUAL(ThermalBucketSamples, b.count);
+    TEST_ASSERT_TRUE(b.min == 40.0f);
+    TEST_ASSERT_TRUE(b.max == 42.0f);
+    TEST_ASSERT_TRUE(b.avg > 40.99f && b.avg < 41.01f);
+
+    history.add(55.0f);
+    TEST_ASSERT_EQUAL(1, history.current().count);
+    TEST_ASSERT_TRUE(history.last() == 55.0f);
+}
+
+void test_history_drops_the_oldest_bucket()
+{
+    ThermalHistory history;
+    for (int b = 0; b < ThermalBuckets + 5; b++)
+        for (int i = 0; i < ThermalBucketSamples; i++)
+            history.add((float)b);
+    TEST_ASSERT_EQUAL(ThermalBuckets, history.size());
+    TEST_ASSERT_TRUE(history.at(0).avg == 5.0f);
+    TEST_ASSERT_TRUE(history.at(ThermalBuckets - 1).avg == (float)(ThermalBuckets + 4));
+}
+
+// A synthetic heat-up and cool-down, as the sampler task would see it
+static float temperature;
+
+void test_sampler_follows_a_synthetic_source()
+{
+    ThermalSampler sampler([]() { return temperature; });
+    int hotSamples = 0;
+    for (int i = 0; i < 200; i++) {
+        temperature = i < 100 ? 50.0f + i * 0.3f : 80.0f - (i - 100) * 0.3f;
+        if (sampler.sample())
+            hotSamples++;
+    }
+    // hot from 70.1 C on the way up (i = 67) until 62 C on the way down
+    // (i = 160): 33 samples rising, 60 falling
+    TEST_ASSERT_EQUAL(2, sampler.changes());
+    TEST_ASSERT_FALSE(sampler.isHot());
+    TEST_ASSERT_EQUAL(33 + 60, hotSamples);
+    TEST_ASSERT_EQUAL(200 / ThermalBucketSamples, sampler.samples().size());
+}
+
+static std::atomic<float> dieCelsius{25.0f};
+
+static float syntheticDie()
+{
+    return dieCelsius;
+}
+
+// Sampling runs every ThermalSampleMs; wait for the sampler to see the die
+static bool waitForHot(bool hot)
+{
+    for (int i = 0; i < 3 * ThermalSampleMs / 50; i++) {
+        if (ThermalMonitor::instance().isHot() == hot)
+            return true;
+        delay(50);
+    }
+    return false;
+}
+
+// What a WiFi scan does first: it waits while hot and goes ahead once the
+// die is back under ThermalCoolC
+void test_scan_waits_while_hot()
+{
+    auto &monitor = ThermalMonitor::instance();
+    monitor.setSource(syntheticDie);
+    monitor.begin();
+    TEST_ASSERT_TRUE(waitForHot(false));
+    TEST_ASSERT_EQUAL(0, monitor.waitUntilCool());
+
+    dieCelsius = ThermalHotC + 5;
+    TEST_ASSERT_TRUE(waitForHot(true));
+    auto scan = std::async(std::launch::async, [&]() { return monitor.waitUntilCool(); });
+    TEST_ASSERT_TRUE(scan.wait_for(std::chrono::milliseconds(ThermalSampleMs / 2)) == std::future_status::timeout);
+    dieCelsius = ThermalCoolC - 5;
+    TEST_ASSERT_TRUE(scan.wait_for(std::chrono::milliseconds(3 * ThermalSampleMs)) == std::future_status::ready);
+    TEST_ASSERT_TRUE(scan.get() >= ThermalSampleMs / 2);
+
+    nlohmann::json j;
+    monitor.toJson(j, 0);
+    TEST_ASSERT_EQUAL(1, j["deferrals"].get<int>());
+    TEST_ASSERT_EQUAL(0, j["forced"].get<int>());
+}
+
+// A chip that stays hot holds a scan back for at most maxMs
+void test_scan_runs_anyway_after_the_cap()
+{
+    auto &monitor = ThermalMonitor::instance();
+    dieCelsius = ThermalHotC + 5;
+    TEST_ASSERT_TRUE(waitForHot(true));
+    uint32_t waited = monitor.waitUntilCool(2 * ThermalDeferPollMs);
+    TEST_ASSERT_TRUE(waited >= 2 * ThermalDeferPollMs && waited < 4 * ThermalDeferPollMs);
+
+    nlohmann::json j;
+    monitor.toJson(j, 0);
+    TEST_ASSERT_EQUAL(1, j["forced"].get<int>());
+    dieCelsius = 25.0f;
+    TEST_ASSERT_TRUE(waitForHot(false));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_hysteresis_between_hot_and_cool);
+    RUN_TEST(test_noise_around_one_value_does_not_toggle);
+    RUN_TEST(test_history_buckets_min_max_avg);
+    RUN_TEST(test_history_drops_the_oldest_bucket);
+    RUN_TEST(test_sampler_follows_a_synthetic_source);
+    RUN_TEST(test_scan_waits_while_hot);
+    RUN_TEST(test_scan_runs_anyway_after_the_cap);
+    return UNITY_END();
+}
@@ -0,0 +1,156 @@
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "WiFiConnector.h"
+
+// Radio that associates `connectAfterMs` after a begin() of the right kind
+class FakeDriver : public WiFiDriver {
+public:
+    void begin(const WiFiLink &link, bool targeted) override
+    {
+        calls.push_back(targeted ? "fast" : "full");
+        beganMs = now;
+        lastTargeted = targeted;
+        ssid = link.ssid;
+    }
+
+    void disconnect() override { calls.push_back("disconnect"); }
+
+    bool isConnected() override
+    {
+        bool works = lastTargeted ? fastWorks : fullWorks;
+        return works && now - beganMs >= connectAfterMs;
+    }
+
+    void current(WiFiLink &link) override
+    {
+        memcpy(link.bssid, apBssid, 6);
+        link.channel = apChannel;
+    }
+
+    uint32_t now = 0;
+    uint32_t beganMs = 0;
+    uint32_t connectAfterMs = 400;
+    bool fastWorks = true;
+    bool fullWorks = true;
+    bool lastTargeted = false;
+    std::string ssid;
+    std::vector<std::string> calls;
+    uint8_t apBssid[6] = {0x02, 0x11, 0x22, 0x33, 0x44, 0x55};
+    int32_t apChannel = 6;
+};
+
+static WiFiLink saved(bool withBssid)
+{
+    WiFiLink link;
+    link.ssid = "home";
+    link.password = "secret";
+    if (withBssid) {
+        uint8_t bssid[6] = {0x02, 0x11, 0x22, 0x33, 0x44, 0x55};
+        memcpy(link.bssid, bssid, 6);
+        link.channel = 6;
+        link.hasBssid = true;
+    }
+    return link;
+}
+
+// advance the fake clock in 100 ms polls until the connector is done
+static void run(WiFiConnector &connector, FakeDriver &radio, uint32_t limitMs = 60000)
+{
+    while (!connector.poll(radio.now) && radio.now < limitMs)
+        radio.now += 100;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_known_ap_connects_targeted()
+{
+    FakeDriver radio;
+    WiFiConnector connector(radio);
+    connector.start(saved(true), 0);
+    run(connector, radio);
+    TEST_ASSERT_EQUAL((int)WiFiConnector::State::Connected, (int)connector.getState());
+    TEST_ASSERT_EQUAL(1, radio.calls.size());
+    TEST_ASSERT_EQUAL_STRING("fast", radio.calls[0]);
+    auto &t = connector.getTimings();
+    TEST_ASSERT_TRUE(t.usedFast);
+    TEST_ASSERT_FALSE(t.fastFailed);
+    TEST_ASSERT_EQUAL(400, t.fastMs);
+    TEST_ASSERT_EQUAL(400, t.totalMs);
+}
+
+void test_first_connect_is_full_and_remembers_the_ap()
+{
+    FakeDriver radio;
+    radio.apChannel = 11;
+    WiFiConnector connector(radio);
+    connector.start(saved(false), 0);
+    run(connector, radio);
+    TEST_ASSERT_EQUAL((int)WiFiConnector::State::Connected, (int)connector.getState());
+    TEST_ASSERT_EQUAL_STRING("full", radio.calls[0]);
+    TEST_ASSERT_FALSE(connector.getTimings().usedFast);
+
+    // what gets saved lets the next boot connect targeted
+    const WiFiLink &next = connector.result();
+    TEST_ASSERT_TRUE(next.hasBssid);
+    TEST_ASSERT_EQUAL(11, next.channel);
+    TEST_ASSERT_EQUAL(0x55, next.bssid[5]);
+    TEST_ASSERT_EQUAL_STRING("home", next.ssid);
+}
+
+// The AP moved channel: the targeted attempt gives up after its timeout
+// and a full connect finds it
+void test_stale_bssid_falls_back_to_full()
+{
+    FakeDriver radio;
+    radio.fastWorks = false;
+    WiFiConnector connector(radio);
+    connector.start(saved(true), 1000);
+    radio.now = 1000;
+    run(connector, radio);
+    TEST_ASSERT_EQUAL((int)WiFiConnector::State::Connected, (int)connector.getState());
+    TEST_ASSERT_EQUAL(3, radio.calls.size());
+    TEST_ASSERT_EQUAL_STRING("fast", radio.calls[0]);
+    TEST_ASSERT_EQUAL_STRING("disconnect", radio.calls[1]);
+    TEST_ASSERT_EQUAL_STRING("full", radio.calls[2]);
+    auto &t = connector.getTimings();
+    TEST_ASSERT_TRUE(t.fastFailed);
+    TEST_ASSERT_EQUAL(WiFiFastConnectTimeoutMs, t.fastMs);
+    TEST_ASSERT_EQUAL(400, t.fullMs);
+    TEST_ASSERT_EQUAL(WiFiFastConnectTimeoutMs + 400, t.totalMs);
+}
+
+void test_gives_up_after_both_timeouts()
+{
+    FakeDriver radio;
+    radio.fastWorks = radio.fullWorks = false;
+    WiFiConnector connector(radio);
+    connector.start(saved(true), 0);
+    run(connector, radio);
+    TEST_ASSERT_EQUAL((int)WiFiConnector::State::Failed, (int)connector.getState());
+    TEST_ASSERT_EQUAL(WiFiFastConnectTimeoutMs + WiFiFullConnectTimeoutMs, connector.getTimings().totalMs);
+    // final states stay final
+    TEST_ASSERT_TRUE(connector.poll(radio.now + 100000));
+}
+
+void test_no_ssid_fails_without_touching_the_radio()
+{
+    FakeDriver radio;
+    WiFiConnector connector(radio);
+    connector.start(WiFiLink(), 0);
+    TEST_ASSERT_EQUAL((int)WiFiConnector::State::Failed, (int)connector.getState());
+    TEST_ASSERT_TRUE(connector.poll(0));
+    TEST_ASSERT_EQUAL(0, radio.calls.size());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_known_ap_connects_targeted);
+    RUN_TEST(test_first_connect_is_full_and_remembers_the_ap);
+    RUN_TEST(test_stale_bssid_falls_back_to_full);
+    RUN_TEST(test_gives_up_after_both_timeouts);
+    RUN_TEST(test_no_ssid_fails_without_touching_the_radio);
+    return UNITY_END();
+}
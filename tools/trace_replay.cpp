@@ -0,0 +1,86 @@
+// Replays a message trace downloaded from GET /trace and prints the
+// per-type latency of the replay next to that of the capture.
+//
+//   curl -H "Authorization: Bearer $TOKEN" http://<lock>/trace -o field.trace
+//   g++ -std=gnu++2a -pthread -Iinclude -Itest/shim -I$AES tools/trace_replay.cpp $AES/aes.c -o trace_replay
+//   ./trace_replay field.trace [--speed 2] [--peers 4]
+//   ./trace_replay field.trace --model [--speed 2] [--pool 3,2,1]
+//
+// with $AES a tiny-AES-c checkout (KeyStore, which the Dispatcher asks
+// about sessions, links it).
+//
+// By default every record is sent through MessageBase::createInstance and
+// Dispatcher::dispatch at its captured arrival time, against the host
+// stand-ins for the lock and the transport, and the report holds the wait
+// and handle times the Dispatcher measured (DispatchReplay). --model skips
+// the Dispatcher and queues the records on a model of its worker pools,
+// which is deterministic and takes --pool to try other pool sizes.
+// Benchmarks of changed handlers install them with setHandler (see
+// test/test_dispatch_replay).
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include "DispatchReplay.h"
+
+static int usage()
+{
+    fprintf(stderr, "usage: trace_replay <trace file> [--speed <factor>] [--peers <count>]\n"
+                    "       trace_replay <trace file> --model [--speed <factor>] [--pool <open>,<handshake>,<admin>]\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        return usage();
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    TraceReplay replay;
+    std::string error;
+    if (!replay.load(bytes.data(), bytes.size(), error)) {
+        fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+        return 1;
+    }
+    DispatchReplay driven(replay);
+    bool model = false;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--model") {
+            model = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return usage();
+        if (arg == "--speed") {
+            double speed = atof(argv[++i]);
+            replay.setSpeed(speed);
+            driven.setSpeed(speed);
+        } else if (arg == "--peers") {
+            driven.setPeers(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--pool") {
+            unsigned pool[ReplayClasses];
+            if (sscanf(argv[++i], "%u,%u,%u", &pool[0], &pool[1], &pool[2]) != ReplayClasses)
+                return usage();
+            for (int c = 0; c < ReplayClasses; c++)
+                replay.setPool(c, pool[c]);
+        } else {
+            return usage();
+        }
+    }
+
+    nlohmann::json report;
+    if (model)
+        replay.run(report);
+    else
+        driven.run(report);
+    report["lostBeforeDownload"] = replay.header().lost;
+    printf("%s\n", report.dump(2).c_str());
+    return 0;
+}